@@ -15,9 +15,9 @@ function go()
 	return;
  if (preg_match('/^[a-zA-Z0-9]*$/', $a) === false)
 	return;
- $sta = "../pool/users/$a";
- if (file_exists($sta))
-	echo file_get_contents($sta);
+ $sta = statsrecord("../pool/users.dat", $a);
+ if ($sta !== null)
+	echo $sta;
 }
 go();
 ?>
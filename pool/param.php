@@ -35,4 +35,30 @@ function getparam($name, $both)
  return substr($a, 0, 1024);
 }
 #
+// Return the json line for $name from a ckpool stats store,
+//  which holds a space padded line of json per user or worker
+//  including its "name", or null if it isn't there
+function statsrecord($file, $name)
+{
+ $fp = @fopen($file, 'r');
+ if ($fp === false)
+	return null;
+
+ $rec = null;
+ $key = '"name": "'.$name.'"';
+ while (($line = fgets($fp)) !== false)
+ {
+	if (strpos($line, $key) === false)
+		continue;
+	$val = json_decode($line, true);
+	if (is_array($val) and isset($val['name']) and $val['name'] === $name)
+	{
+		$rec = rtrim($line);
+		break;
+	}
+ }
+ fclose($fp);
+ return $rec;
+}
+#
 ?>
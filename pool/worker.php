@@ -13,9 +13,9 @@ function go()
 	return;
  if (preg_match('/^[a-zA-Z0-9]{24,}[\._]?[a-zA-Z0-9\._]*$/', $a) === false)
 	return;
- $sta = "../pool/workers/$a";
- if (file_exists($sta))
-	echo file_get_contents($sta);
+ $sta = statsrecord("../pool/workers.dat", $a);
+ if ($sta !== null)
+	echo $sta;
 }
 go();
 ?>
@@ -14,6 +14,7 @@
 #include "ckpool.h"
 #include "libckpool.h"
 #include "bitcoin.h"
+#include "uthash.h"
 
 static const char *b58chars = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
@@ -79,97 +80,284 @@ out:
 	return ret;
 }
 
+/* Transactions are kept in binary across templates, keyed by their hash, so
+ * only those new to a template need decoding */
+struct txn_entry {
+	UT_hash_handle hh;
+	char hash[68];
+	uchar hashbin[32]; /* Byte swapped for the merkle tree */
+	uchar *data;
+	int len;
+	int64_t generation; /* Template this was last seen in */
+};
+
+typedef struct txn_entry txn_entry_t;
+
+#define MERKLE_LEVELS 17
+
+struct txnstore {
+	txn_entry_t *txns;
+	int64_t generation;
+
+	/* Each level of the last merkle tree, with entry 0 the coinbase
+	 * placeholder, so unchanged subtrees aren't hashed again */
+	uchar *level[MERKLE_LEVELS];
+	int levelcount[MERKLE_LEVELS];
+};
+
+/* Build the merkle branch of the coinbase from the count leaves of a tree,
+ * reusing any of the last tree's hashes whose children are unchanged. leaves
+ * must have room for one more entry and becomes the store's first level. */
+static void gbt_merkles(gbtbase_t *gbt, txnstore_t *store, uchar *leaves, int count)
+{
+	int level, hashed = 0, reused = 0;
+	uchar *cur = leaves;
+
+	for (level = 0; count > 1 && level < MERKLE_LEVELS - 1; level++) {
+		uchar *old = store->level[level], *oldnext = store->level[level + 1];
+		int i, oldcount = store->levelcount[level];
+		int oldnextcount = store->levelcount[level + 1];
+		uchar *next;
+
+		memcpy(&gbt->merklebin[gbt->merkles][0], cur + 32, 32);
+		__bin2hex(&gbt->merklehash[gbt->merkles][0], cur + 32, 32);
+		LOGDEBUG("MH%d %s", gbt->merkles, &gbt->merklehash[gbt->merkles][0]);
+		gbt->merkles++;
+		if (count % 2) {
+			memcpy(cur + count * 32, cur + (count - 1) * 32, 32);
+			count++;
+		}
+		count /= 2;
+		next = ckzalloc(count * 32 + 32);
+		for (i = 1; i < count; i++) {
+			if (i < oldnextcount && i * 2 + 2 <= oldcount &&
+			    !memcmp(cur + i * 64, old + i * 64, 64)) {
+				memcpy(next + i * 32, oldnext + i * 32, 32);
+				reused++;
+			} else {
+				gen_hash(cur + i * 64, next + i * 32, 64);
+				hashed++;
+			}
+		}
+		free(old);
+		store->level[level] = cur;
+		store->levelcount[level] = count * 2;
+		cur = next;
+	}
+	free(store->level[level]);
+	store->level[level] = cur;
+	store->levelcount[level] = count;
+	/* Drop any deeper levels left from a larger tree */
+	for (level++; level < MERKLE_LEVELS; level++) {
+		dealloc(store->level[level]);
+		store->levelcount[level] = 0;
+	}
+	LOGDEBUG("Merkle tree hashed %d and reused %d nodes", hashed, reused);
+}
+
 /* Distill down a set of transactions into an efficient tree arrangement for
  * stratum messages and fast work assembly. */
 static bool gbt_merkle_bins(gbtbase_t *gbt, json_t *transaction_arr)
 {
-	int i, j, binleft, binlen;
-	json_t *arr_val;
-	uchar *hashbin;
-
-	dealloc(gbt->txn_data);
+	txnstore_t *store = gbt->store;
+	txn_entry_t *txn, *tmp, **order;
+	int i, added = 0, dropped = 0;
+	uchar *leaves, *ofs;
+	char *hashes = NULL;
+	int64_t gen;
+
+	dealloc(gbt->txn_bin);
 	dealloc(gbt->txn_hashes);
-	gbt->transactions = 0;
+	gbt->txn_binlen = 0;
 	gbt->merkles = 0;
 	gbt->transactions = json_array_size(transaction_arr);
-	binlen = gbt->transactions * 32 + 32;
-	hashbin = alloca(binlen + 32);
-	memset(hashbin, 0, 32);
-	binleft = binlen / 32;
-	if (gbt->transactions) {
-		int len = 1, ofs = 0;
-		const char *txn;
-
-		for (i = 0; i < gbt->transactions; i++) {
-			arr_val = json_array_get(transaction_arr, i);
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			if (!txn) {
-				LOGWARNING("json_string_value fail - cannot find transaction data");
-				return false;
-			}
-			len += strlen(txn);
+	if (!store)
+		store = gbt->store = ckzalloc(sizeof(txnstore_t));
+	gen = ++store->generation;
+	leaves = ckzalloc(gbt->transactions * 32 + 64);
+	order = ckalloc(gbt->transactions * sizeof(txn_entry_t *) + 1);
+
+	if (gbt->transactions)
+		gbt->txn_hashes = hashes = ckalloc(gbt->transactions * 65 + 1);
+	for (i = 0; i < gbt->transactions; i++) {
+		json_t *arr_val = json_array_get(transaction_arr, i);
+		const char *hash, *data;
+
+		hash = json_string_value(json_object_get(arr_val, "hash"));
+		if (unlikely(!hash || strlen(hash) != 64)) {
+			LOGWARNING("Invalid transaction hash in gbt_merkle_bins");
+			goto out_fail;
 		}
-
-		gbt->txn_data = ckzalloc(len + 1);
-		gbt->txn_hashes = ckzalloc(gbt->transactions * 65 + 1);
-		memset(gbt->txn_hashes, 0x20, gbt->transactions * 65); // Spaces
-
-		for (i = 0; i < gbt->transactions; i++) {
+		HASH_FIND(hh, store->txns, hash, 64, txn);
+		if (!txn) {
 			char binswap[32];
-			const char *hash;
-
-			arr_val = json_array_get(transaction_arr, i);
-			hash = json_string_value(json_object_get(arr_val, "hash"));
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			len = strlen(txn);
-			memcpy(gbt->txn_data + ofs, txn, len);
-			ofs += len;
-#if 0
-			/* In case we ever want to be a gbt poolproxy */
-			if (!hash) {
-				char *txn_bin;
-				int txn_len;
-
-				txn_len = len / 2;
-				txn_bin = ckalloc(txn_len);
-				hex2bin(txn_bin, txn, txn_len);
-				/* This is needed for pooled mining since only
-				 * transaction data and not hashes are sent */
-				gen_hash(txn_bin, hashbin + 32 + 32 * i, txn_len);
-				continue;
+			int len;
+
+			data = json_string_value(json_object_get(arr_val, "data"));
+			if (unlikely(!data)) {
+				LOGWARNING("json_string_value fail - cannot find transaction data");
+				goto out_fail;
 			}
-#endif
-			if (!hex2bin(binswap, hash, 32)) {
+			len = strlen(data) / 2;
+			if (unlikely(!hex2bin(binswap, hash, 32))) {
 				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
-				return false;
+				goto out_fail;
 			}
-			memcpy(gbt->txn_hashes + i * 65, hash, 64);
-			bswap_256(hashbin + 32 + 32 * i, binswap);
+			txn = ckzalloc(sizeof(txn_entry_t));
+			memcpy(txn->hash, hash, 64);
+			bswap_256(txn->hashbin, binswap);
+			txn->data = ckalloc(len);
+			if (unlikely(!len || !hex2bin(txn->data, data, len))) {
+				LOGERR("Failed to hex2bin transaction data in gbt_merkle_bins");
+				free(txn->data);
+				free(txn);
+				goto out_fail;
+			}
+			txn->len = len;
+			HASH_ADD(hh, store->txns, hash, 64, txn);
+			added++;
 		}
+		txn->generation = gen;
+		order[i] = txn;
+		gbt->txn_binlen += txn->len;
+		memcpy(leaves + 32 + 32 * i, txn->hashbin, 32);
+		memcpy(hashes + i * 65, txn->hash, 64);
+		hashes[i * 65 + 64] = ' ';
 	}
-	if (binleft > 1) {
-		while (42) {
-			uchar merklebin[32];
+	if (gbt->transactions)
+		hashes[gbt->transactions * 65] = '\0';
 
-			if (binleft == 1)
-				break;
-			memcpy(merklebin, hashbin + 32, 32);
-			__bin2hex(&gbt->merklehash[gbt->merkles][0], merklebin, 32);
-			LOGDEBUG("MH%d %s",gbt->merkles, &gbt->merklehash[gbt->merkles][0]);
-			gbt->merkles++;
-			if (binleft % 2) {
-				memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
-				binlen += 32;
-				binleft++;
-			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
-				gen_hash(hashbin + j, hashbin + i, 64);
-			binleft /= 2;
-			binlen = binleft * 32;
+	/* Assemble the binary transactions in template order, dropping any that
+	 * have left the template */
+	if (gbt->txn_binlen) {
+		ofs = gbt->txn_bin = ckalloc(gbt->txn_binlen);
+		for (i = 0; i < gbt->transactions; i++) {
+			memcpy(ofs, order[i]->data, order[i]->len);
+			ofs += order[i]->len;
+		}
+	}
+	HASH_ITER(hh, store->txns, txn, tmp) {
+		if (txn->generation != gen) {
+			HASH_DEL(store->txns, txn);
+			free(txn->data);
+			free(txn);
+			dropped++;
 		}
 	}
-	LOGINFO("Stored %d transactions", gbt->transactions);
+
+	free(order);
+	gbt_merkles(gbt, store, leaves, gbt->transactions + 1);
+	LOGINFO("Stored %d transactions, %d new and %d dropped", gbt->transactions,
+		added, dropped);
 	return true;
+
+out_fail:
+	free(order);
+	free(leaves);
+	return false;
+}
+
+/* Free the transactions and merkle tree kept across templates */
+void clear_gbtstore(gbtbase_t *gbt)
+{
+	txnstore_t *store = gbt->store;
+	txn_entry_t *txn, *tmp;
+	int i;
+
+	if (!store)
+		return;
+	HASH_ITER(hh, store->txns, txn, tmp) {
+		HASH_DEL(store->txns, txn);
+		free(txn->data);
+		free(txn);
+	}
+	for (i = 0; i < MERKLE_LEVELS; i++)
+		free(store->level[i]);
+	dealloc(gbt->store);
+}
+
+/* Build the gbtbin_t image of a complete gbtbase once so every consumer can
+ * have it without any further serialisation */
+static void gbt_binary(gbtbase_t *gbt)
+{
+	uint32_t flagslen, hasheslen;
+	gbtbin_t *bin;
+	char *ofs;
+
+	flagslen = strlen(gbt->flags) + 1;
+	hasheslen = gbt->txn_hashes ? strlen(gbt->txn_hashes) + 1 : 0;
+	gbt->binlen = sizeof(gbtbin_t) + flagslen + gbt->txn_binlen + hasheslen;
+	dealloc(gbt->bin);
+	gbt->bin = ckzalloc(gbt->binlen);
+	bin = (gbtbin_t *)gbt->bin;
+
+	bin->magic = GBTBIN_MAGIC;
+	bin->len = gbt->binlen;
+	memcpy(bin->target, gbt->target, sizeof(bin->target));
+	bin->diff = gbt->diff;
+	bin->version = gbt->version;
+	bin->curtime = gbt->curtime;
+	memcpy(bin->prevhash, gbt->prevhash, sizeof(bin->prevhash));
+	memcpy(bin->ntime, gbt->ntime, sizeof(bin->ntime));
+	memcpy(bin->bbversion, gbt->bbversion, sizeof(bin->bbversion));
+	memcpy(bin->nbit, gbt->nbit, sizeof(bin->nbit));
+	bin->coinbasevalue = gbt->coinbasevalue;
+	bin->height = gbt->height;
+	bin->transactions = gbt->transactions;
+	bin->merkles = gbt->merkles;
+	bin->flagslen = flagslen;
+	bin->txn_binlen = gbt->txn_binlen;
+	bin->txn_hasheslen = hasheslen;
+	memcpy(bin->merklehash, gbt->merklehash, 68 * gbt->merkles);
+	memcpy(bin->merklebin, gbt->merklebin, 32 * gbt->merkles);
+
+	ofs = gbt->bin + sizeof(gbtbin_t);
+	memcpy(ofs, gbt->flags, flagslen);
+	ofs += flagslen;
+	if (gbt->txn_binlen)
+		memcpy(ofs, gbt->txn_bin, gbt->txn_binlen);
+	ofs += gbt->txn_binlen;
+	if (hasheslen)
+		memcpy(ofs, gbt->txn_hashes, hasheslen);
+}
+
+/* The json form of a gbtbase for anything other than the stratifier asking
+ * for a getbase, as it was sent before the binary form */
+char *gbtbase_json(const gbtbase_t *gbt)
+{
+	json_t *val = json_object(), *array;
+	char *buf;
+	int i;
+
+	json_set_string(val, "target", gbt->target);
+	json_set_double(val, "diff", gbt->diff);
+	json_set_uint32(val, "version", gbt->version);
+	json_set_uint32(val, "curtime", gbt->curtime);
+	json_set_string(val, "prevhash", gbt->prevhash);
+	json_set_string(val, "ntime", gbt->ntime);
+	json_set_string(val, "bbversion", gbt->bbversion);
+	json_set_string(val, "nbit", gbt->nbit);
+	json_set_int64(val, "coinbasevalue", gbt->coinbasevalue);
+	json_set_int(val, "height", gbt->height);
+	json_set_string(val, "flags", gbt->flags);
+	json_set_int(val, "transactions", gbt->transactions);
+	if (gbt->transactions) {
+		char *txn_data = bin2hex(gbt->txn_bin, gbt->txn_binlen);
+
+		json_set_string(val, "txn_data", txn_data);
+		json_set_string(val, "txn_hashes", gbt->txn_hashes);
+		free(txn_data);
+	}
+	json_set_int(val, "merkles", gbt->merkles);
+	if (gbt->merkles) {
+		array = json_array();
+		for (i = 0; i < gbt->merkles; i++)
+			json_array_append_new(array, json_string_nocheck(gbt->merklehash[i]));
+		json_set_object(val, "merklehash", array);
+	}
+	buf = json_dumps(val, JSON_NO_UTF8);
+	json_decref(val);
+	return buf;
 }
 
 static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"]}]}\n";
@@ -179,7 +367,7 @@ static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\
  * required to assemble a mining template, storing it in a gbtbase_t structure */
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 {
-	json_t *transaction_arr, *coinbase_aux, *res_val, *val, *array;
+	json_t *transaction_arr, *coinbase_aux, *res_val, *val;
 	const char *previousblockhash;
 	char hash_swap[32], tmp[32];
 	uint64_t coinbasevalue;
@@ -189,7 +377,6 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	int version;
 	int curtime;
 	int height;
-	int i;
 	bool ret = false;
 
 	val = json_rpc_call(cs, gbt_req);
@@ -219,58 +406,28 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 		goto out;
 	}
 
-	gbt->json = json_object();
-
 	hex2bin(hash_swap, previousblockhash, 32);
 	swap_256(tmp, hash_swap);
 	__bin2hex(gbt->prevhash, tmp, 32);
-	json_object_set_new_nocheck(gbt->json, "prevhash", json_string_nocheck(gbt->prevhash));
 
 	strncpy(gbt->target, target, 65);
-	json_object_set_new_nocheck(gbt->json, "target", json_string_nocheck(gbt->target));
 
 	hex2bin(hash_swap, target, 32);
 	bswap_256(tmp, hash_swap);
 	gbt->diff = diff_from_target((uchar *)tmp);
-	json_object_set_new_nocheck(gbt->json, "diff", json_real(gbt->diff));
 
 	gbt->version = version;
-	json_object_set_new_nocheck(gbt->json, "version", json_integer(version));
-
 	gbt->curtime = curtime;
-	json_object_set_new_nocheck(gbt->json, "curtime", json_integer(curtime));
-
 	snprintf(gbt->ntime, 9, "%08x", curtime);
-	json_object_set_new_nocheck(gbt->json, "ntime", json_string_nocheck(gbt->ntime));
-
 	snprintf(gbt->bbversion, 9, "%08x", version);
-	json_object_set_new_nocheck(gbt->json, "bbversion", json_string_nocheck(gbt->bbversion));
-
 	snprintf(gbt->nbit, 9, "%s", bits);
-	json_object_set_new_nocheck(gbt->json, "nbit", json_string_nocheck(gbt->nbit));
-
 	gbt->coinbasevalue = coinbasevalue;
-	json_object_set_new_nocheck(gbt->json, "coinbasevalue", json_integer(coinbasevalue));
-
 	gbt->height = height;
-	json_object_set_new_nocheck(gbt->json, "height", json_integer(height));
-
 	gbt->flags = strdup(flags);
-	json_object_set_new_nocheck(gbt->json, "flags", json_string_nocheck(gbt->flags));
 
-	gbt_merkle_bins(gbt, transaction_arr);
-	json_object_set_new_nocheck(gbt->json, "transactions", json_integer(gbt->transactions));
-	if (gbt->transactions) {
-		json_object_set_new_nocheck(gbt->json, "txn_data", json_string_nocheck(gbt->txn_data));
-		json_object_set_new_nocheck(gbt->json, "txn_hashes", json_string_nocheck(gbt->txn_hashes));
-	}
-	json_object_set_new_nocheck(gbt->json, "merkles", json_integer(gbt->merkles));
-	if (gbt->merkles) {
-		array = json_array();
-		for (i = 0; i < gbt->merkles; i++)
-			json_array_append_new(array, json_string_nocheck(&gbt->merklehash[i][0]));
-		json_object_set_new_nocheck(gbt->json, "merklehash", array);
-	}
+	if (unlikely(!gbt_merkle_bins(gbt, transaction_arr)))
+		goto out;
+	gbt_binary(gbt);
 	ret = true;
 
 out:
@@ -278,14 +435,17 @@ out:
 	return ret;
 }
 
+/* Clear the template, keeping the transaction store for the next one */
 void clear_gbtbase(gbtbase_t *gbt)
 {
+	txnstore_t *store = gbt->store;
+
 	dealloc(gbt->flags);
-	dealloc(gbt->txn_data);
+	dealloc(gbt->txn_bin);
 	dealloc(gbt->txn_hashes);
-	json_decref(gbt->json);
-	gbt->json = NULL;
+	dealloc(gbt->bin);
 	memset(gbt, 0, sizeof(gbtbase_t));
+	gbt->store = store;
 }
 
 static const char *blockcount_req = "{\"method\": \"getblockcount\"}\n";
@@ -376,7 +536,7 @@ out:
 	return ret;
 }
 
-bool submit_block(connsock_t *cs, char *params)
+bool submit_block(connsock_t *cs, const char *params)
 {
 	json_t *val, *res_val;
 	int len, retries = 0;
@@ -10,6 +10,8 @@
 #ifndef BITCOIN_H
 #define BITCOIN_H
 
+typedef struct txnstore txnstore_t;
+
 struct gbtbase {
 	char target[68];
 	double diff;
@@ -23,21 +25,58 @@ struct gbtbase {
 	int height;
 	char *flags;
 	int transactions;
-	char *txn_data;
+	uchar *txn_bin; /* Binary transactions in template order */
+	uint32_t txn_binlen;
 	char *txn_hashes;
 	int merkles;
 	char merklehash[16][68];
-	json_t *json;
+	uchar merklebin[16][32];
+	char *bin; /* gbtbin_t image of the above */
+	uint32_t binlen;
+	txnstore_t *store; /* Kept across templates */
 };
 
 typedef struct gbtbase gbtbase_t;
 
+/* Binary image of a gbtbase handed from the generator to the stratifier,
+ * followed by the flags string, the binary transactions and the txn_hashes
+ * string in that order, the strings including their terminating null. Both
+ * ends always come from the same build so native layout and byte order are
+ * used. */
+#define GBTBIN_MAGIC 0x4e494247 /* "GBIN" */
+
+struct gbtbin {
+	uint32_t magic;
+	uint32_t len; /* Total length including the trailing strings */
+	char target[68];
+	double diff;
+	uint32_t version;
+	uint32_t curtime;
+	char prevhash[68];
+	char ntime[12];
+	char bbversion[12];
+	char nbit[12];
+	uint64_t coinbasevalue;
+	int height;
+	int transactions;
+	int merkles;
+	uint32_t flagslen;
+	uint32_t txn_binlen;
+	uint32_t txn_hasheslen;
+	char merklehash[16][68];
+	uchar merklebin[16][32];
+};
+
+typedef struct gbtbin gbtbin_t;
+
 bool validate_address(connsock_t *cs, const char *address);
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt);
 void clear_gbtbase(gbtbase_t *gbt);
+char *gbtbase_json(const gbtbase_t *gbt);
+void clear_gbtstore(gbtbase_t *gbt);
 int get_blockcount(connsock_t *cs);
 bool get_blockhash(connsock_t *cs, int height, char *hash);
 bool get_bestblockhash(connsock_t *cs, char *hash);
-bool submit_block(connsock_t *cs, char *params);
+bool submit_block(connsock_t *cs, const char *params);
 
 #endif /* BITCOIN_H */
@@ -0,0 +1,377 @@
+/*
+ * Copyright 2014-2016 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Micro benchmarks of the pool's hot paths, linked against the pool's own
+ * code. Each benchmark is repeated with doubling iterations until it runs for
+ * long enough to time reliably, and the results are written to stdout as
+ * json for comparing between machines, sha256 kernels and builds. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ckpool.h"
+#include "libckpool.h"
+#include "sha2.h"
+#include "stratifier.h"
+#include "ktree.h"
+
+/* Referenced by klist but normally defined by ckdb */
+const char *nullstr = "(null)";
+
+static const char *submit_line = "{\"params\": [\"ckpool.worker1\", \"5a2b3c4d00000001\", "
+	"\"0000000000000001\", \"5a000000\", \"1a2b3c4d\"], \"id\": 1234, \"method\": \"mining.submit\"}";
+
+struct bench_data {
+	ckpool_t *ckp;
+	void *wb;
+	uchar enonce1bin[16];
+	uchar buf[128];
+	char hex[65];
+	char hexout[65];
+	int64_t counter;
+
+	K_LIST *list;
+	K_TREE *tree;
+	K_TREE_CTX ctx[1];
+	int treesize;
+};
+
+typedef struct bench_data bench_t;
+
+typedef void (*bench_func_t)(bench_t *, int64_t);
+
+/* Results are folded into here to stop the compiler optimising work away */
+static volatile uint64_t sink;
+
+static int64_t target_ns = 500000000;
+static const char *filter;
+static json_t *results;
+
+static void time_gen_hash(bench_t *bench, int64_t iterations)
+{
+	uchar hash[32];
+
+	while (iterations--) {
+		bench->buf[0]++;
+		gen_hash(bench->buf, hash, 80);
+		sink += hash[31];
+	}
+}
+
+static void time_share_diff(bench_t *bench, int64_t iterations)
+{
+	char nonce2[20], nonce[12];
+	uchar hash[32];
+
+	while (iterations--) {
+		sprintf(nonce2, "%016"PRIx64, bench->counter++);
+		sprintf(nonce, "%08x", (uint32_t)bench->counter);
+		sink += bench_share_diff(bench->wb, bench->enonce1bin, nonce2, nonce, hash);
+	}
+}
+
+static void time_hex2bin(bench_t *bench, int64_t iterations)
+{
+	while (iterations--) {
+		hex2bin(bench->buf, bench->hex, 32);
+		sink += bench->buf[0];
+	}
+}
+
+static void time_bin2hex(bench_t *bench, int64_t iterations)
+{
+	while (iterations--) {
+		bench->buf[0]++;
+		__bin2hex(bench->hexout, bench->buf, 32);
+		sink += bench->hexout[0];
+	}
+}
+
+static void time_diff_from_target(bench_t *bench, int64_t iterations)
+{
+	while (iterations--) {
+		bench->buf[31]++;
+		sink += diff_from_target(bench->buf);
+	}
+}
+
+/* Every share is new, the common case the pool optimises for */
+static void time_new_share(bench_t *bench, int64_t iterations)
+{
+	uchar hash[32];
+
+	memset(hash, 0, 32);
+	while (iterations--) {
+		int64_t counter = bench->counter++;
+
+		memcpy(hash, &counter, sizeof(counter));
+		memcpy(hash + 8, &counter, sizeof(counter));
+		sink += bench_new_share(bench->ckp, hash, 1);
+	}
+}
+
+static void time_json_loads(bench_t __maybe_unused *bench, int64_t iterations)
+{
+	json_t *val;
+
+	while (iterations--) {
+		val = json_loads(submit_line, 0, NULL);
+		sink += json_object_size(val);
+		json_decref(val);
+	}
+}
+
+/* Stand in for ckdb's keyed records, ordered by id then create time */
+struct bench_item {
+	int64_t id;
+	tv_t createdate;
+};
+
+static cmp_t cmp_bench_item(K_ITEM *a, K_ITEM *b)
+{
+	struct bench_item *ia = a->data, *ib = b->data;
+	cmp_t c = CMP_BIGINT(ia->id, ib->id);
+
+	if (c == 0)
+		c = CMP_TV(ia->createdate, ib->createdate);
+	return c;
+}
+
+/* Spread keys over the tree in a fixed pseudo random order */
+static int64_t bench_key(const int64_t n)
+{
+	return (n * 2654435761ll) % 4294967291ll;
+}
+
+static void time_find_in_ktree(bench_t *bench, int64_t iterations)
+{
+	struct bench_item look;
+	K_TREE_CTX ctx[1];
+	K_ITEM item;
+	int64_t n;
+
+	memset(&look, 0, sizeof(look));
+	item.data = &look;
+	while (iterations--) {
+		/* Find the items in a different order to how they were added,
+		 *  since that's also the order they are in memory */
+		n = bench->counter++ * 7919 % bench->treesize;
+		look.id = bench_key(n);
+		look.createdate.tv_sec = n;
+		K_RLOCK(bench->list);
+		sink += !!find_in_ktree(bench->tree, &item, ctx);
+		K_RUNLOCK(bench->list);
+	}
+}
+
+/* Walk the tree in order, starting again from the first item at the end */
+static void time_next_in_ktree(bench_t *bench, int64_t iterations)
+{
+	K_ITEM *item;
+
+	K_RLOCK(bench->list);
+	item = first_in_ktree(bench->tree, bench->ctx);
+	while (iterations--) {
+		item = next_in_ktree(bench->ctx);
+		if (!item)
+			item = first_in_ktree(bench->tree, bench->ctx);
+		sink += ((struct bench_item *)(item->data))->id;
+	}
+	K_RUNLOCK(bench->list);
+}
+
+static void add_result(const char *name, const char *impl, const int64_t iterations,
+		       const int64_t ns)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{ss,ss,sI,sf,sf}", "name", name, "impl", impl ? impl : "",
+		   "iterations", iterations, "ns_per_op", (double)ns / iterations,
+		   "ops_per_sec", (double)iterations * 1000000000 / ns);
+	json_array_append_new(results, val);
+	LOGWARNING("%-18s %-8s %12.1f ns/op", name, impl ? impl : "", (double)ns / iterations);
+}
+
+static void run_bench(const char *name, const char *impl, bench_func_t func, bench_t *bench)
+{
+	int64_t iterations = 1, start, ns;
+
+	if (filter && !strstr(name, filter))
+		return;
+	/* Warm caches and allocators up first */
+	func(bench, 16);
+	do {
+		iterations *= 2;
+		start = monotonic_ns();
+		func(bench, iterations);
+		ns = monotonic_ns() - start;
+	} while (ns < target_ns / 4);
+	/* Scale the final run to the target time */
+	iterations = iterations * target_ns / ns + 1;
+	start = monotonic_ns();
+	func(bench, iterations);
+	ns = monotonic_ns() - start;
+	add_result(name, impl, iterations, ns);
+}
+
+/* Build a ckdb sized tree, timing the inserts as the add_to_ktree result */
+static void build_ktree(bench_t *bench, const char *impl)
+{
+	struct bench_item *data;
+	int64_t start, ns;
+	K_ITEM *item;
+	int i;
+
+	if (!bench->list)
+		bench->list = k_new_list("BenchItems", sizeof(struct bench_item), 65536, 0, true);
+	if (strcmp(impl, "btree") == 0)
+		bench->tree = new_ktree_btree("BenchTree", cmp_bench_item, bench->list);
+	else
+		bench->tree = new_ktree("BenchTree", cmp_bench_item, bench->list);
+	start = monotonic_ns();
+	K_WLOCK(bench->list);
+	for (i = 0; i < bench->treesize; i++) {
+		item = k_unlink_head(bench->list);
+		data = item->data;
+		data->id = bench_key(i);
+		data->createdate.tv_sec = i;
+		data->createdate.tv_usec = 0;
+		add_to_ktree(bench->tree, item);
+	}
+	K_WUNLOCK(bench->list);
+	ns = monotonic_ns() - start;
+	add_result("add_to_ktree", impl, bench->treesize, ns);
+}
+
+// Return the tree's items to the list for the next tree
+static void free_bench_ktree(bench_t *bench)
+{
+	K_ITEM *item;
+
+	K_WLOCK(bench->list);
+	while ((item = first_in_ktree(bench->tree, bench->ctx))) {
+		remove_from_ktree(bench->tree, item);
+		k_add_head(bench->list, item);
+	}
+	free_ktree(bench->tree, NULL);
+	K_WUNLOCK(bench->list);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -f filter      Only run benchmarks whose name contains filter\n"
+		"  -k kernels     Comma separated sha256 kernels to compare (default all supported)\n"
+		"  -m merkles     Merkle branches in the share_diff workbase (default 12)\n"
+		"  -n size        Items in the ktree benchmarks (default 1000000)\n"
+		"  -t ms          Milliseconds to run each benchmark for (default 500)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *kernels = NULL, *impl, *saveptr = NULL;
+	const char *defimpl;
+	int c, i, merkles = 12;
+	ckpool_t ckp;
+	json_t *val;
+	bench_t bench;
+	char *buf;
+
+	memset(&ckp, 0, sizeof(ckp));
+	memset(&bench, 0, sizeof(bench));
+	bench.treesize = 1000000;
+	while ((c = getopt(argc, argv, "f:hk:m:n:t:")) != -1) {
+		switch(c) {
+			case 'f':
+				filter = optarg;
+				break;
+			case 'k':
+				kernels = strdup(optarg);
+				break;
+			case 'm':
+				merkles = atoi(optarg);
+				if (merkles < 0 || merkles > 16)
+					usage(argv[0]);
+				break;
+			case 'n':
+				bench.treesize = atoi(optarg);
+				if (bench.treesize < 1)
+					usage(argv[0]);
+				break;
+			case 't':
+				target_ns = (int64_t)atoi(optarg) * 1000000;
+				if (target_ns < 1)
+					usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	global_ckp = &ckp;
+	ckp.loglevel = LOG_WARNING;
+	ckp.btcaddress = "14BMjogz69qe8hk9thyzbmR5pg34mVKB1e";
+	ckp.nonce1length = 4;
+	ckp.nonce2length = 8;
+	json_slab_init();
+	FIRST_LOCK_INIT("ckbench");
+	srandom(42);
+
+	bench.ckp = &ckp;
+	bench.wb = bench_workbase(&ckp, merkles);
+	for (i = 0; i < (int)sizeof(bench.buf); i++)
+		bench.buf[i] = random();
+	__bin2hex(bench.hex, bench.buf, 32);
+	results = json_array();
+
+	/* The sha256 dependent benchmarks for each kernel, restoring the
+	 * automatically chosen one afterwards */
+	defimpl = sha256_impl();
+	if (!kernels)
+		kernels = strdup("generic,sse4,avx1,avx2,shani");
+	for (impl = strtok_r(kernels, ",", &saveptr); impl; impl = strtok_r(NULL, ",", &saveptr)) {
+		if (!sha256_set_impl(impl)) {
+			LOGWARNING("Skipping unsupported sha256 kernel %s", impl);
+			continue;
+		}
+		run_bench("gen_hash", impl, time_gen_hash, &bench);
+		run_bench("share_diff", impl, time_share_diff, &bench);
+	}
+	sha256_set_impl(defimpl);
+
+	run_bench("hex2bin", NULL, time_hex2bin, &bench);
+	run_bench("bin2hex", NULL, time_bin2hex, &bench);
+	run_bench("diff_from_target", NULL, time_diff_from_target, &bench);
+	run_bench("new_share", NULL, time_new_share, &bench);
+	run_bench("json_loads", NULL, time_json_loads, &bench);
+	if (!filter || strstr("add_to_ktree find_in_ktree next_in_ktree", filter)) {
+		const char *trees[] = { "rbtree", "btree" };
+
+		for (i = 0; i < 2; i++) {
+			build_ktree(&bench, trees[i]);
+			run_bench("find_in_ktree", trees[i], time_find_in_ktree, &bench);
+			run_bench("next_in_ktree", trees[i], time_next_in_ktree, &bench);
+			free_bench_ktree(&bench);
+		}
+	}
+
+	JSON_CPACK(val, "{ss,ss,si,si,so}", "sha256", defimpl, "sha256_multi", sha256_multi_impl(),
+		   "merkles", merkles, "treesize", bench.treesize, "results", results);
+	buf = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	printf("%s\n", buf);
+	free(buf);
+	free(kernels);
+	return 0;
+}
@@ -291,6 +291,24 @@ char *btc_auth;
 int btc_timeout = 5;
 cklock_t btc_lock;
 
+// argv -B - rows per COPY send, 0 = don't use COPY
+int copy_batch = 1000;
+
+// argv -W - threads processing shares, 1 = only the plistener
+int pool_workers = 1;
+
+// argv -j - threads summarising a shift into markersummaries
+int marker_workers = 1;
+
+struct CMDTIME *cmd_times;
+// 10us, 100us, 1ms, 10ms, 100ms, 1s, 10s then slower
+const int64_t cmdtime_bucket_us[CMDTIME_BUCKETS-1] = {
+	10, 100, 1000, 10000, 100000, 1000000, 10000000
+};
+
+// argv -K - markersummary checkpoint file
+char *checkpoint_file = NULL;
+
 char *by_default = "code";
 char *inet_default = "127.0.0.1";
 char *id_default = "42";
@@ -311,10 +329,23 @@ K_STORE *btc_workqueue_store;
 mutex_t wq_waitlock;
 pthread_cond_t wq_waitcond;
 
+// PLWORKER
+static PLWORKER *plworkers;
+static mutex_t plworkers_lock;
+static pthread_cond_t plworkers_idle;
+// Items queued to, or being processed by, the plworkers
+static int plworkers_busy;
+static int plworkers_using_data;
+
 // HEARTBEATQUEUE
 K_LIST *heartbeatqueue_free;
 K_STORE *heartbeatqueue_store;
 
+// CMDCACHE
+K_LIST *cmdcache_free;
+K_STORE *cmdcache_store;
+K_TREE *cmdcache_root;
+
 // TRANSFER
 K_LIST *transfer_free;
 
@@ -411,6 +442,11 @@ K_STORE *shareerrors_store;
 K_TREE *shareerrors_early_root;
 K_STORE *shareerrors_early_store;
 
+// INTERN
+K_TREE *intern_root;
+K_LIST *intern_free;
+K_STORE *intern_store;
+
 // SHARESUMMARY
 K_TREE *sharesummary_root;
 K_TREE *sharesummary_workinfoid_root;
@@ -746,12 +782,15 @@ PGconn *dbconnect()
 			conn = PQconnectdb(conninfo);
 			if (PQstatus(conn) == CONNECTION_OK) {
 				LOGWARNING("%s(): Connected on attempt %d", __func__, i+2);
+				CKPQconnected(conn);
 				return conn;
 			}
 		}
 		quithere(1, "ERR: Failed to connect %d times to db '%s'",
 			 retry+1, pqerrmsg(conn));
 	}
+	// It has none of the prepared statements yet
+	CKPQconnected(conn);
 	return conn;
 }
 
@@ -832,6 +871,7 @@ sukamudai:
 }
 
 static bool reload_from(tv_t *start);
+static void plworkers_start();
 
 static bool reload()
 {
@@ -980,6 +1020,11 @@ static void alloc_storage()
 				 ALLOC_SEQSET, LIMIT_SEQSET, true);
 	seqset_store = k_new_store(seqset_free);
 
+	for (seq = 0; ckdb_cmds[seq].cmd_val != CMD_END; seq++);
+	cmd_times = calloc(seq, sizeof(*cmd_times));
+	if (!cmd_times)
+		quithere(1, "calloc (%d) OOM", seq);
+
 	// Map the SEQ_NNN values to their cmd names
 	seqnam[0] = strdup(SEQALL);
 	for (seq = 0; ckdb_cmds[seq].cmd_val != CMD_END; seq++) {
@@ -1011,6 +1056,7 @@ static void alloc_storage()
 
 	msgline_free = k_new_list("MsgLine", sizeof(MSGLINE),
 					ALLOC_MSGLINE, LIMIT_MSGLINE, true);
+	k_magazine(msgline_free, MAGAZINE_MSGLINE);
 	msgline_store = k_new_store(msgline_free);
 
 	workqueue_free = k_new_list("WorkQueue", sizeof(WORKQUEUE),
@@ -1025,9 +1071,15 @@ static void alloc_storage()
 					 LIMIT_HEARTBEATQUEUE, true);
 	heartbeatqueue_store = k_new_store(heartbeatqueue_free);
 
+	cmdcache_free = k_new_list("CmdCache", sizeof(CMDCACHE),
+					ALLOC_CMDCACHE, LIMIT_CMDCACHE, true);
+	cmdcache_store = k_new_store(cmdcache_free);
+	cmdcache_root = new_ktree(NULL, cmp_cmdcache, cmdcache_free);
+
 	transfer_free = k_new_list(Transfer, sizeof(TRANSFER),
 					ALLOC_TRANSFER, LIMIT_TRANSFER, true);
 	transfer_free->dsp_func = dsp_transfer;
+	k_magazine(transfer_free, MAGAZINE_TRANSFER);
 
 	users_free = k_new_list("Users", sizeof(USERS),
 					ALLOC_USERS, LIMIT_USERS, true);
@@ -1083,7 +1135,7 @@ static void alloc_storage()
 	workinfo_free = k_new_list("WorkInfo", sizeof(WORKINFO),
 					ALLOC_WORKINFO, LIMIT_WORKINFO, true);
 	workinfo_store = k_new_store(workinfo_free);
-	workinfo_root = new_ktree(NULL, cmp_workinfo, workinfo_free);
+	workinfo_root = new_ktree_btree(NULL, cmp_workinfo, workinfo_free);
 	if (!confirm_sharesummary) {
 		workinfo_height_root = new_ktree("WorkInfoHeight",
 						 cmp_workinfo_height,
@@ -1092,9 +1144,10 @@ static void alloc_storage()
 
 	shares_free = k_new_list("Shares", sizeof(SHARES),
 					ALLOC_SHARES, LIMIT_SHARES, true);
+	k_magazine(shares_free, MAGAZINE_SHARES);
 	shares_store = k_new_store(shares_free);
 	shares_early_store = k_new_store(shares_free);
-	shares_root = new_ktree(NULL, cmp_shares, shares_free);
+	shares_root = new_ktree_btree(NULL, cmp_shares, shares_free);
 	shares_early_root = new_ktree("SharesEarly", cmp_shares, shares_free);
 
 	shareerrors_free = k_new_list("ShareErrors", sizeof(SHAREERRORS),
@@ -1106,12 +1159,17 @@ static void alloc_storage()
 	shareerrors_early_root = new_ktree("ShareErrorsEarly", cmp_shareerrors,
 					   shareerrors_free);
 
+	intern_free = k_new_list("Intern", sizeof(INTERN),
+					ALLOC_INTERN, LIMIT_INTERN, true);
+	intern_store = k_new_store(intern_free);
+	intern_root = new_ktree(NULL, cmp_intern, intern_free);
+
 	sharesummary_free = k_new_list("ShareSummary", sizeof(SHARESUMMARY),
 					ALLOC_SHARESUMMARY, LIMIT_SHARESUMMARY,
 					true);
 	sharesummary_store = k_new_store(sharesummary_free);
-	sharesummary_root = new_ktree(NULL, cmp_sharesummary,
-					sharesummary_free);
+	sharesummary_root = new_ktree_btree(NULL, cmp_sharesummary,
+					    sharesummary_free);
 	sharesummary_workinfoid_root = new_ktree("ShareSummaryWId",
 						 cmp_sharesummary_workinfoid,
 						 sharesummary_free);
@@ -1168,8 +1226,8 @@ static void alloc_storage()
 					ALLOC_MARKERSUMMARY, LIMIT_MARKERSUMMARY,
 					true);
 	markersummary_store = k_new_store(markersummary_free);
-	markersummary_root = new_ktree(NULL, cmp_markersummary,
-					markersummary_free);
+	markersummary_root = new_ktree_btree(NULL, cmp_markersummary,
+					     markersummary_free);
 	markersummary_userid_root = new_ktree("MarkerSummaryUserId",
 					      cmp_markersummary_userid,
 					      markersummary_free);
@@ -1244,6 +1302,8 @@ static void alloc_storage()
 	DLPRIO(idcontrol, PRIO_TERMINAL);
 	DLPRIO(optioncontrol, PRIO_TERMINAL);
 	DLPRIO(paymentaddresses, PRIO_TERMINAL);
+	DLPRIO(cmdcache, PRIO_TERMINAL);
+	DLPRIO(intern, PRIO_TERMINAL);
 
 	DLPCHECK();
 
@@ -1528,6 +1588,15 @@ static void dealloc_storage()
 
 	LOGWARNING("%s() transfer/heartbeatqueue/workqueue ...", __func__);
 
+	FREE_TREE(cmdcache);
+	FREE_STORE_DATA(cmdcache);
+	FREE_LISTS(cmdcache);
+
+	// After everything that uses the names
+	FREE_TREE(intern);
+	FREE_STORE_DATA(intern);
+	FREE_LISTS(intern);
+
 	FREE_LIST(transfer);
 	FREE_LISTS(heartbeatqueue);
 	FREE_STORE(pool_workqueue);
@@ -1578,6 +1647,8 @@ static bool setup_data()
 
 	alloc_storage();
 
+	plworkers_start();
+
 	setnow(&db_stt);
 
 	if (!getdata1() || everyone_die)
@@ -2649,9 +2720,7 @@ static enum cmd_values breakdown(K_ITEM **ml_item, char *buf, tv_t *now,
 	bool noid = false;
 	size_t siz;
 
-	K_WLOCK(msgline_free);
-	*ml_item = k_unlink_head_zero(msgline_free);
-	K_WUNLOCK(msgline_free);
+	*ml_item = k_mag_unlink_head_zero(msgline_free);
 	DATA_MSGLINE(msgline, *ml_item);
 	msgline->which_cmds = CMD_UNSET;
 	copy_tv(&(msgline->now), now);
@@ -2752,9 +2821,7 @@ static enum cmd_values breakdown(K_ITEM **ml_item, char *buf, tv_t *now,
 				goto nogood;
 			}
 			*(end++) = '\0';
-			K_WLOCK(transfer_free);
-			t_item = k_unlink_head(transfer_free);
-			K_WUNLOCK(transfer_free);
+			t_item = k_mag_unlink_head(transfer_free);
 			DATA_TRANSFER(transfer, t_item);
 			STRNCPY(transfer->name, next);
 			was = next = end;
@@ -2891,9 +2958,7 @@ static enum cmd_values breakdown(K_ITEM **ml_item, char *buf, tv_t *now,
 			else
 				*(eq++) = '\0';
 
-			K_WLOCK(transfer_free);
-			t_item = k_unlink_head(transfer_free);
-			K_WUNLOCK(transfer_free);
+			t_item = k_mag_unlink_head(transfer_free);
 			DATA_TRANSFER(transfer, t_item);
 			STRNCPY(transfer->name, data);
 			STRNCPY(transfer->svalue, eq);
@@ -2903,9 +2968,7 @@ static enum cmd_values breakdown(K_ITEM **ml_item, char *buf, tv_t *now,
 			if (find_in_ktree_nolock(msgline->trf_root, t_item, ctx)) {
 				if (transfer->mvalue != transfer->svalue)
 					FREENULL(transfer->mvalue);
-				K_WLOCK(transfer_free);
-				k_add_head(transfer_free, t_item);
-				K_WUNLOCK(transfer_free);
+				k_mag_add_head(transfer_free, t_item);
 			} else {
 				add_to_ktree_nolock(msgline->trf_root, t_item);
 				k_add_head_nolock(msgline->trf_store, t_item);
@@ -2961,11 +3024,8 @@ static enum cmd_values breakdown(K_ITEM **ml_item, char *buf, tv_t *now,
 	free(cmdptr);
 	return ckdb_cmds[msgline->which_cmds].cmd_val;
 nogood:
-	if (t_item) {
-		K_WLOCK(transfer_free);
-		k_add_head(transfer_free, t_item);
-		K_WUNLOCK(transfer_free);
-	}
+	if (t_item)
+		k_mag_add_head(transfer_free, t_item);
 	free(cmdptr);
 	return CMD_REPLY;
 }
@@ -3796,6 +3856,8 @@ static void make_a_workmarker()
 
 static void *marker(__maybe_unused void *arg)
 {
+	int checkpoint_up = -1, checkpoint_count = -1, up, count;
+	time_t checkpoint_t = 0;
 	int i;
 
 	pthread_detach(pthread_self());
@@ -3856,6 +3918,22 @@ static void *marker(__maybe_unused void *arg)
 			if (markersummary_auto)
 				make_markersummaries(false, NULL, NULL, NULL, NULL, NULL);
 		}
+
+		// Only write a checkpoint when markersummary has changed
+		if (checkpoint_file && !everyone_die &&
+		    (time(NULL) - checkpoint_t) >= CHECKPOINT_S) {
+			K_RLOCK(markersummary_free);
+			up = markersummary_store->count_up;
+			count = markersummary_store->count;
+			K_RUNLOCK(markersummary_free);
+			if (up != checkpoint_up || count != checkpoint_count) {
+				if (markersummary_checkpoint(checkpoint_file)) {
+					checkpoint_up = up;
+					checkpoint_count = count;
+				}
+			}
+			checkpoint_t = time(NULL);
+		}
 	}
 
 	marker_using_data = false;
@@ -3950,9 +4028,61 @@ static void *logger(__maybe_unused void *arg)
 	return NULL;
 }
 
+static int cmdtime_bucket(int64_t ns)
+{
+	int i;
+
+	for (i = 0; i < CMDTIME_BUCKETS-1; i++) {
+		if (ns <= cmdtime_bucket_us[i] * 1000)
+			break;
+	}
+	return i;
+}
+
+// Run msgline's cmd, adding how long it took to its cmd_times[]
+static char *run_cmd(PGconn *conn, MSGLINE *msgline, char *by, char *code,
+		     char *inet)
+{
+	struct CMDTIME *ct = &(cmd_times[msgline->which_cmds]);
+	int64_t start, db_start, wait, run, db, max;
+	tv_t now;
+	char *ans;
+
+	setnow(&now);
+	wait = (int64_t)(us_tvdiff(&now, &(msgline->now)) * 1000.0);
+	if (wait < 0)
+		wait = 0;
+
+	db_start = cmd_db_ns;
+	start = monotonic_ns();
+	ans = ckdb_cmds[msgline->which_cmds].func(conn, msgline->cmd,
+						  msgline->id,
+						  &(msgline->now), by, code,
+						  inet, &(msgline->cd),
+						  msgline->trf_root);
+	run = monotonic_ns() - start;
+	db = cmd_db_ns - db_start;
+
+	__atomic_add_fetch(&(ct->count), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(ct->wait_ns), wait, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(ct->run_ns), run, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(ct->db_ns), db, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(ct->wait_hist[cmdtime_bucket(wait)]), 1,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(ct->run_hist[cmdtime_bucket(run)]), 1,
+			   __ATOMIC_RELAXED);
+	max = __atomic_load_n(&(ct->max_run_ns), __ATOMIC_RELAXED);
+	while ((uint64_t)run > (uint64_t)max &&
+	       !__atomic_compare_exchange_n(&(ct->max_run_ns), &max, run,
+					    true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+	return ans;
+}
+
 static void process_sockd(PGconn *conn, K_ITEM *wq_item)
 {
 	WORKQUEUE *workqueue;
+	CMDCACHE_KEY cck;
 	MSGLINE *msgline;
 	K_ITEM *ml_item;
 	char *ans, *rep;
@@ -3962,15 +4092,13 @@ static void process_sockd(PGconn *conn, K_ITEM *wq_item)
 	ml_item = workqueue->msgline_item;
 	DATA_MSGLINE(msgline, ml_item);
 
-	ans = ckdb_cmds[msgline->which_cmds].func(conn,
-						  msgline->cmd,
-						  msgline->id,
-						  &(msgline->now),
-						  workqueue->by,
-						  workqueue->code,
-						  workqueue->inet,
-						  &(msgline->cd),
-						  msgline->trf_root);
+	ans = cmdcache_find(msgline, &cck);
+	if (!ans) {
+		ans = run_cmd(conn, msgline, workqueue->by,
+			      workqueue->code, workqueue->inet);
+		cmdcache_add(&cck, ans);
+	}
+	FREENULL(cck.key);
 	siz = strlen(ans) + strlen(msgline->id) + 32;
 	rep = malloc(siz);
 	snprintf(rep, siz, "%s.%ld.%s",
@@ -3982,9 +4110,7 @@ static void process_sockd(PGconn *conn, K_ITEM *wq_item)
 	FREENULL(rep);
 
 	free_msgline_data(ml_item, true, true);
-	K_WLOCK(msgline_free);
-	k_add_head(msgline_free, ml_item);
-	K_WUNLOCK(msgline_free);
+	k_mag_add_head(msgline_free, ml_item);
 
 	K_WLOCK(workqueue_free);
 	k_add_head(workqueue_free, wq_item);
@@ -4076,6 +4202,147 @@ static void *blistener(__maybe_unused void *arg)
 	return NULL;
 }
 
+// Remember the first message from the pool
+static void first_pool_msg(bool *want_first, char *buf)
+{
+	if (*want_first) {
+		*want_first = false;
+		ck_wlock(&fpm_lock);
+		first_pool_message = strdup(buf);
+		ck_wunlock(&fpm_lock);
+	}
+}
+
+// Queue a pool message for the pool workqueue processing
+static void queue_pool_msg(K_ITEM *ml_item)
+{
+	WORKQUEUE *workqueue;
+	K_ITEM *wq_item;
+
+	K_WLOCK(workqueue_free);
+	wq_item = k_unlink_head(workqueue_free);
+	DATA_WORKQUEUE(workqueue, wq_item);
+	workqueue->msgline_item = ml_item;
+	workqueue->by = by_default;
+	workqueue->code =  (char *)__func__;
+	workqueue->inet = inet_default;
+	k_add_tail(pool_workqueue_store, wq_item);
+	/* Stop the reload queue from growing too big
+	 * Use a size that should be big enough */
+	if (reloading && pool_workqueue_store->count > 250000) {
+		K_ITEM *wq2_item = k_unlink_head(pool_workqueue_store);
+		K_WUNLOCK(workqueue_free);
+		WORKQUEUE *wq;
+		DATA_WORKQUEUE(wq, wq2_item);
+		K_ITEM *ml2_item = wq->msgline_item;
+		free_msgline_data(ml2_item, true, false);
+		k_mag_add_head(msgline_free, ml2_item);
+		K_WLOCK(workqueue_free);
+		k_add_head(workqueue_free, wq2_item);
+	}
+	K_WUNLOCK(workqueue_free);
+	mutex_lock(&wq_waitlock);
+	pthread_cond_signal(&wq_waitcond);
+	mutex_unlock(&wq_waitlock);
+}
+
+/* Process one message from a batch exactly as if it had been sent on its
+ * own, returning the reply. Only the pool messages that are processed
+ * immediately or queued can be batched since the reply must be immediate */
+static char *batch_msg(char *buf, tv_t *now, int seqentryflags, bool *want_first)
+{
+	enum cmd_values cmdnum;
+	K_ITEM *ml_item = NULL;
+	MSGLINE *msgline;
+	char *ans, *rep;
+	size_t siz;
+
+	cmdnum = breakdown(&ml_item, buf, now, seqentryflags);
+	DATA_MSGLINE(msgline, ml_item);
+	switch (cmdnum) {
+		case CMD_AUTH:
+		case CMD_ADDRAUTH:
+		case CMD_HEARTBEAT:
+			first_pool_msg(want_first, buf);
+			ans = run_cmd(NULL, msgline, by_default,
+				      (char *)__func__, inet_default);
+			siz = strlen(ans) + strlen(msgline->id) + 32;
+			rep = malloc(siz);
+			snprintf(rep, siz, "%s.%ld.%s",
+				 msgline->id, now->tv_sec, ans);
+			FREENULL(ans);
+			queue_pool_msg(ml_item);
+			break;
+		case CMD_SHARELOG:
+		case CMD_POOLSTAT:
+		case CMD_USERSTAT:
+		case CMD_WORKERSTAT:
+		case CMD_BLOCK:
+			first_pool_msg(want_first, buf);
+			siz = strlen(msgline->id) + 32;
+			rep = malloc(siz);
+			snprintf(rep, siz, "%s.%ld.ok.queued",
+				 msgline->id, now->tv_sec);
+			queue_pool_msg(ml_item);
+			break;
+		default:
+			if (cmdnum != CMD_REPLY) {
+				LOGERR("%s() unbatchable message %d %.32s...",
+					__func__, cmdnum, buf);
+			}
+			siz = strlen(msgline->id) + 32;
+			rep = malloc(siz);
+			snprintf(rep, siz, "%s.%ld.%s",
+				 msgline->id, now->tv_sec,
+				 cmdnum == CMD_REPLY ? "?." : "failed.batch");
+			free_msgline_data(ml_item, true, true);
+			k_mag_add_head(msgline_free, ml_item);
+			break;
+	}
+	return rep;
+}
+
+/* A batch is the header line BATCH_CMD"count." followed by count pool
+ * messages, one per line, that are each processed in order.
+ * The reply is the reply to each message, one per line, in the same order */
+static void process_batch(int sockd, char *buf, tv_t *now, int seqentryflags,
+			  bool *want_first)
+{
+	char *line, *next, *ans, *rep = NULL;
+	size_t len = 0, off = 0, siz;
+	int count = 0;
+
+	next = strchr(buf, '\n');
+	while (next) {
+		line = next + 1;
+		next = strchr(line, '\n');
+		if (next)
+			*next = '\0';
+		if (!*line)
+			continue;
+		ans = batch_msg(line, now, seqentryflags, want_first);
+		siz = strlen(ans);
+		if (off + siz + 2 > len) {
+			len = (off + siz + 2) * 2;
+			rep = realloc(rep, len);
+			if (!rep)
+				quithere(1, "realloc (%d) OOM", (int)len);
+		}
+		if (off)
+			rep[off++] = '\n';
+		memcpy(rep + off, ans, siz + 1);
+		off += siz;
+		free(ans);
+		count++;
+	}
+	LOGDEBUG("%s() processed %d batched messages", __func__, count);
+	if (rep) {
+		send_unix_msg(sockd, rep);
+		free(rep);
+	} else
+		LOGWARNING("%s() Empty batch", __func__);
+}
+
 static void *socketer(__maybe_unused void *arg)
 {
 	proc_instance_t *pi = (proc_instance_t *)arg;
@@ -4137,6 +4404,9 @@ static void *socketer(__maybe_unused void *arg)
 				LOGWARNING("%s() Failed to get message", __func__);
 			else
 				LOGWARNING("%s() Empty message", __func__);
+		} else if (strncmp(buf, BATCH_CMD, BATCH_CMD_LEN) == 0) {
+			process_batch(sockd, buf, &now, reload_queue_complete ?
+				      SE_SOCKET : SE_EARLYSOCK, &want_first);
 		} else {
 			int seqentryflags = SE_SOCKET;
 			if (!reload_queue_complete)
@@ -4258,6 +4528,7 @@ static void *socketer(__maybe_unused void *arg)
 				case CMD_SHSTA:
 				case CMD_USERINFO:
 				case CMD_LOCKS:
+				case CMD_CMDTIMES:
 					msgline->sockd = sockd;
 					sockd = -1;
 					K_WLOCK(workqueue_free);
@@ -4319,22 +4590,11 @@ static void *socketer(__maybe_unused void *arg)
 				case CMD_ADDRAUTH:
 				case CMD_HEARTBEAT:
 					// First message from the pool
-					if (want_first) {
-						want_first = false;
-						ck_wlock(&fpm_lock);
-						first_pool_message = strdup(buf);
-						ck_wunlock(&fpm_lock);
-					}
+					first_pool_msg(&want_first, buf);
 					DATA_MSGLINE(msgline, ml_item);
-					ans = ckdb_cmds[msgline->which_cmds].func(NULL,
-							msgline->cmd,
-							msgline->id,
-							&(msgline->now),
-							by_default,
-							(char *)__func__,
-							inet_default,
-							&(msgline->cd),
-							msgline->trf_root);
+					ans = run_cmd(NULL, msgline, by_default,
+						      (char *)__func__,
+						      inet_default);
 					siz = strlen(ans) + strlen(msgline->id) + 32;
 					rep = malloc(siz);
 					snprintf(rep, siz, "%s.%ld.%s",
@@ -4351,12 +4611,7 @@ static void *socketer(__maybe_unused void *arg)
 				case CMD_BLOCK:
 					if (!replied) {
 						// First message from the pool
-						if (want_first) {
-							want_first = false;
-							ck_wlock(&fpm_lock);
-							first_pool_message = strdup(buf);
-							ck_wunlock(&fpm_lock);
-						}
+						first_pool_msg(&want_first, buf);
 						snprintf(reply, sizeof(reply),
 							 "%s.%ld.ok.queued",
 							 msgline->id,
@@ -4364,34 +4619,8 @@ static void *socketer(__maybe_unused void *arg)
 						send_unix_msg(sockd, reply);
 					}
 
-					K_WLOCK(workqueue_free);
-					wq_item = k_unlink_head(workqueue_free);
-					DATA_WORKQUEUE(workqueue, wq_item);
-					workqueue->msgline_item = ml_item;
-					workqueue->by = by_default;
-					workqueue->code =  (char *)__func__;
-					workqueue->inet = inet_default;
-					k_add_tail(pool_workqueue_store, wq_item);
-					/* Stop the reload queue from growing too big
-					 * Use a size that should be big enough */
-					if (reloading && pool_workqueue_store->count > 250000) {
-						K_ITEM *wq2_item = k_unlink_head(pool_workqueue_store);
-						K_WUNLOCK(workqueue_free);
-						WORKQUEUE *wq;
-						DATA_WORKQUEUE(wq, wq2_item);
-						K_ITEM *ml_item = wq->msgline_item;
-						free_msgline_data(ml_item, true, false);
-						K_WLOCK(msgline_free);
-						k_add_head(msgline_free, ml_item);
-						K_WUNLOCK(msgline_free);
-						K_WLOCK(workqueue_free);
-						k_add_head(workqueue_free, wq2_item);
-					}
-					K_WUNLOCK(workqueue_free);
-					wq_item = ml_item = NULL;
-					mutex_lock(&wq_waitlock);
-					pthread_cond_signal(&wq_waitcond);
-					mutex_unlock(&wq_waitlock);
+					queue_pool_msg(ml_item);
+					ml_item = NULL;
 					break;
 				// Code error
 				default:
@@ -4411,9 +4640,7 @@ static void *socketer(__maybe_unused void *arg)
 
 		if (ml_item) {
 			free_msgline_data(ml_item, true, true);
-			K_WLOCK(msgline_free);
-			k_add_head(msgline_free, ml_item);
-			K_WUNLOCK(msgline_free);
+			k_mag_add_head(msgline_free, ml_item);
 			ml_item = NULL;
 		}
 
@@ -4429,12 +4656,239 @@ static void *socketer(__maybe_unused void *arg)
 	return NULL;
 }
 
+// Wait until the plworkers have processed everything queued to them
+static void plworkers_wait()
+{
+	mutex_lock(&plworkers_lock);
+	while (plworkers_busy > 0 && !everyone_die)
+		cond_wait(&plworkers_idle, &plworkers_lock);
+	mutex_unlock(&plworkers_lock);
+}
+
+/* Run the command of a queued message that has already had its seq number
+ *  checked, then free it
+ * All commands except shares and shareerrors expect everything before them
+ *  to have been processed so, when barrier is set, they wait for the
+ *  plworkers to finish first */
+static void process_queued_cmd(PGconn *conn, K_ITEM *wq_item,
+				enum cmd_values cmdnum, bool barrier)
+{
+	WORKQUEUE *workqueue;
+	MSGLINE *msgline;
+	K_ITEM *ml_item;
+	char *ans;
+
+	DATA_WORKQUEUE(workqueue, wq_item);
+	ml_item = workqueue->msgline_item;
+	DATA_MSGLINE(msgline, ml_item);
+
+	switch (cmdnum) {
+		case CMD_DUPSEQ:
+		// Already replied
+		case CMD_AUTH:
+		case CMD_ADDRAUTH:
+		case CMD_HEARTBEAT:
+			break;
+		default:
+			if (barrier)
+				plworkers_wait();
+			ans = run_cmd(conn, msgline, workqueue->by,
+				      workqueue->code, workqueue->inet);
+			FREENULL(ans);
+			break;
+	}
+
+	free_msgline_data(ml_item, true, true);
+	k_mag_add_head(msgline_free, ml_item);
+
+	K_WLOCK(workqueue_free);
+	k_add_head(workqueue_free, wq_item);
+	if (workqueue_free->count == workqueue_free->total &&
+	    workqueue_free->total >= ALLOC_WORKQUEUE * CULL_WORKQUEUE)
+		k_cull_list(workqueue_free);
+	K_WUNLOCK(workqueue_free);
+}
+
+/* Shares and shareerrors for different workinfoids only share data that is
+ *  updated under a lock, so they can be processed in parallel as long as
+ *  all those for one workinfoid go, in order, to the same plworker
+ * Returns the plworker for msgline, or NULL if it must be processed in
+ *  order by the caller */
+static PLWORKER *plworker_for(MSGLINE *msgline, enum cmd_values cmdnum)
+{
+	K_ITEM *i_workinfoid;
+	int64_t workinfoid;
+	enum seq_num seq;
+
+	if (!plworkers || cmdnum != CMD_SHARELOG)
+		return NULL;
+
+	seq = ckdb_cmds[msgline->which_cmds].seq;
+	if (seq != SEQ_SHARES && seq != SEQ_SHAREERRORS)
+		return NULL;
+
+	/* Any share can procure an early share of a different workinfoid
+	 *  so process them all in order until there are none
+	 * Checked outside lock, since new early shares can only happen
+	 *  for a workinfoid that doesn't exist yet and the workinfo itself
+	 *  will wait for all the plworkers before it's added */
+	if (shares_early_store->count || shareerrors_early_store->count)
+		return NULL;
+
+	i_workinfoid = find_transfer(msgline->trf_root, "workinfoid");
+	if (!i_workinfoid)
+		return NULL;
+	workinfoid = atoll(transfer_data(i_workinfoid));
+	if (workinfoid < 0)
+		workinfoid = -workinfoid;
+
+	return &(plworkers[workinfoid % pool_workers]);
+}
+
+static void plworker_add(PLWORKER *plworker, K_ITEM *wq_item)
+{
+	int count;
+
+	mutex_lock(&plworkers_lock);
+	plworkers_busy++;
+	mutex_unlock(&plworkers_lock);
+
+	mutex_lock(&(plworker->lock));
+	K_WLOCK(workqueue_free);
+	k_add_tail(plworker->store, wq_item);
+	count = plworker->store->count;
+	K_WUNLOCK(workqueue_free);
+	pthread_cond_signal(&(plworker->cond));
+	mutex_unlock(&(plworker->lock));
+
+	// Checked outside lock since it only needs to be roughly right
+	while (count > LIMIT_PLWORKER_QUEUE && !everyone_die) {
+		cksleep_ms(1);
+		count = plworker->store->count;
+	}
+}
+
+static void *plworker(void *arg)
+{
+	PLWORKER *plworker = (PLWORKER *)arg;
+	PGconn *conn = NULL;
+	K_ITEM *wq_item;
+	char buf[32];
+	time_t now;
+
+	pthread_detach(pthread_self());
+
+	snprintf(buf, sizeof(buf), "db_plworker%d", plworker->n);
+	LOCK_INIT(buf);
+	rename_proc(buf);
+
+	mutex_lock(&plworkers_lock);
+	plworkers_using_data++;
+	mutex_unlock(&plworkers_lock);
+
+	conn = dbconnect();
+	now = time(NULL);
+
+	while (!everyone_die) {
+		mutex_lock(&(plworker->lock));
+		K_WLOCK(workqueue_free);
+		wq_item = k_unlink_head(plworker->store);
+		K_WUNLOCK(workqueue_free);
+		if (!wq_item) {
+			const ts_t tsdiff = {0, 420000000};
+			tv_t now;
+			ts_t abs;
+
+			tv_time(&now);
+			tv_to_ts(&abs, &now);
+			timeraddspec(&abs, &tsdiff);
+			cond_timedwait(&(plworker->cond), &(plworker->lock), &abs);
+		}
+		mutex_unlock(&(plworker->lock));
+
+		// Don't keep a connection for more than ~10s
+		if ((time(NULL) - now) > 10) {
+			PQfinish(conn);
+			conn = dbconnect();
+			now = time(NULL);
+		}
+
+		if (wq_item) {
+			process_queued_cmd(conn, wq_item, CMD_SHARELOG, false);
+			plworker->processed++;
+
+			mutex_lock(&plworkers_lock);
+			if (--plworkers_busy == 0)
+				pthread_cond_broadcast(&plworkers_idle);
+			mutex_unlock(&plworkers_lock);
+		}
+	}
+
+	k_mags_flush();
+
+	// Release anyone waiting for the plworkers
+	mutex_lock(&plworkers_lock);
+	pthread_cond_broadcast(&plworkers_idle);
+	plworkers_using_data--;
+	mutex_unlock(&plworkers_lock);
+
+	if (conn)
+		PQfinish(conn);
+
+	return NULL;
+}
+
+static void plworkers_start()
+{
+	int i;
+
+	if (pool_workers < 2)
+		return;
+
+	plworkers = calloc(pool_workers, sizeof(*plworkers));
+	if (!plworkers)
+		quithere(1, "calloc (%d) OOM", pool_workers);
+	for (i = 0; i < pool_workers; i++) {
+		plworkers[i].n = i;
+		mutex_init(&(plworkers[i].lock));
+		cond_init(&(plworkers[i].cond));
+		plworkers[i].store = k_new_store(workqueue_free);
+		create_pthread(&(plworkers[i].pt), plworker, &(plworkers[i]));
+	}
+	LOGWARNING("%s(): %d plworkers processing shares", __func__,
+		   pool_workers);
+}
+
+static void process_queued(PGconn *conn, K_ITEM *wq_item)
+{
+	enum cmd_values cmdnum;
+	WORKQUEUE *workqueue;
+	MSGLINE *msgline;
+	PLWORKER *plworker;
+
+	DATA_WORKQUEUE(workqueue, wq_item);
+	DATA_MSGLINE(msgline, workqueue->msgline_item);
+
+	/* Queued messages haven't had their seq number check yet
+	 * This will return the entries cmdnum or DUP
+	 * The seq numbers are always checked here in the order they
+	 *  were queued, even when a plworker processes the message */
+	cmdnum = process_seq(msgline);
+	plworker = plworker_for(msgline, cmdnum);
+	if (plworker)
+		plworker_add(plworker, wq_item);
+	else
+		process_queued_cmd(conn, wq_item, cmdnum, true);
+}
+
 static void reload_line(PGconn *conn, char *filename, uint64_t count, char *buf)
 {
 	enum cmd_values cmdnum;
 	char *end, *ans, *st = NULL;
+	WORKQUEUE *workqueue;
+	PLWORKER *plworker;
 	MSGLINE *msgline;
-	K_ITEM *ml_item;
+	K_ITEM *ml_item, *wq_item;
 	tv_t now;
 	bool matched;
 
@@ -4515,6 +4969,7 @@ static void reload_line(PGconn *conn, char *filename, uint64_t count, char *buf)
 			case CMD_BTCSET:
 			case CMD_QUERY:
 			case CMD_LOCKS:
+			case CMD_CMDTIMES:
 				LOGERR("%s() INVALID message line %"PRIu64
 					" ignored '%.42s...",
 					__func__, count,
@@ -4534,15 +4989,24 @@ static void reload_line(PGconn *conn, char *filename, uint64_t count, char *buf)
 				// This will return the same cmdnum or DUP
 				cmdnum = process_seq(msgline);
 				if (cmdnum != CMD_DUPSEQ) {
-					ans = ckdb_cmds[msgline->which_cmds].func(conn,
-							msgline->cmd,
-							msgline->id,
-							&(msgline->now),
-							by_default,
-							(char *)__func__,
-							inet_default,
-							&(msgline->cd),
-							msgline->trf_root);
+					plworker = plworker_for(msgline, cmdnum);
+					if (plworker) {
+						K_WLOCK(workqueue_free);
+						wq_item = k_unlink_head(workqueue_free);
+						K_WUNLOCK(workqueue_free);
+						DATA_WORKQUEUE(workqueue, wq_item);
+						workqueue->msgline_item = ml_item;
+						workqueue->by = by_default;
+						workqueue->code = (char *)__func__;
+						workqueue->inet = inet_default;
+						plworker_add(plworker, wq_item);
+						ml_item = NULL;
+						break;
+					}
+					plworkers_wait();
+					ans = run_cmd(conn, msgline, by_default,
+						      (char *)__func__,
+						      inet_default);
 					FREENULL(ans);
 				}
 				break;
@@ -4559,9 +5023,7 @@ static void reload_line(PGconn *conn, char *filename, uint64_t count, char *buf)
 
 		if (ml_item) {
 			free_msgline_data(ml_item, true, true);
-			K_WLOCK(msgline_free);
-			k_add_head(msgline_free, ml_item);
-			K_WUNLOCK(msgline_free);
+			k_mag_add_head(msgline_free, ml_item);
 			ml_item = NULL;
 		}
 	}
@@ -4640,6 +5102,129 @@ static bool logopen(char **filename, FILE **fp, bool *apipe)
 	return false;
 }
 
+/* Each reload file is read a batch of lines ahead of reload_from() in a
+ *  reader thread, so reading the file overlaps processing the lines, the
+ *  same as any decompressor already does in its own process */
+#define RELOAD_AHEAD_LINES 4096
+#define RELOAD_BATCH 64
+
+struct reload_ahead {
+	FILE *fp;
+	char *filename;
+	mutex_t lock;
+	pthread_cond_t cond;
+	char *line[RELOAD_AHEAD_LINES];
+	int head;
+	int count;
+	bool eof;
+	bool stop;
+};
+
+static void *reload_reader(void *arg)
+{
+	struct reload_ahead *ra = (struct reload_ahead *)arg;
+	char *batch[RELOAD_BATCH], *buf;
+	bool eof = false;
+	int n = 0, i;
+
+	buf = malloc(MAX_READ);
+	if (!buf)
+		quithere(1, "(%d) OOM", MAX_READ);
+
+	while (!eof) {
+		if (everyone_die || !logline(buf, MAX_READ, ra->fp, ra->filename))
+			eof = true;
+		else {
+			batch[n] = strdup(buf);
+			if (!batch[n])
+				quithere(1, "(%d) OOM", (int)strlen(buf));
+			n++;
+		}
+		if (n < RELOAD_BATCH && !eof)
+			continue;
+
+		mutex_lock(&(ra->lock));
+		while (!ra->stop && (ra->count + n) > RELOAD_AHEAD_LINES)
+			cond_wait(&(ra->cond), &(ra->lock));
+		if (ra->stop) {
+			mutex_unlock(&(ra->lock));
+			for (i = 0; i < n; i++)
+				free(batch[i]);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			ra->line[(ra->head + ra->count) % RELOAD_AHEAD_LINES] = batch[i];
+			ra->count++;
+		}
+		ra->eof = eof;
+		pthread_cond_broadcast(&(ra->cond));
+		mutex_unlock(&(ra->lock));
+		n = 0;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+// Process all of fp and return the line count
+static uint64_t reload_file(PGconn *conn, char *filename, FILE *fp)
+{
+	struct reload_ahead *ra;
+	char *batch[RELOAD_BATCH];
+	uint64_t count = 0;
+	pthread_t pt;
+	int n, i;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		quithere(1, "(%d) OOM", (int)sizeof(*ra));
+	ra->fp = fp;
+	ra->filename = filename;
+	mutex_init(&(ra->lock));
+	cond_init(&(ra->cond));
+	create_pthread(&pt, reload_reader, ra);
+
+	while (!everyone_die) {
+		mutex_lock(&(ra->lock));
+		while (ra->count == 0 && !ra->eof)
+			cond_wait(&(ra->cond), &(ra->lock));
+		for (n = 0; n < RELOAD_BATCH && ra->count > 0; n++) {
+			batch[n] = ra->line[ra->head];
+			ra->head = (ra->head + 1) % RELOAD_AHEAD_LINES;
+			ra->count--;
+		}
+		pthread_cond_broadcast(&(ra->cond));
+		mutex_unlock(&(ra->lock));
+
+		// Only empty at the end of the file
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			if (!everyone_die)
+				reload_line(conn, filename, ++count, batch[i]);
+			free(batch[i]);
+		}
+	}
+
+	mutex_lock(&(ra->lock));
+	ra->stop = true;
+	pthread_cond_broadcast(&(ra->cond));
+	mutex_unlock(&(ra->lock));
+	join_pthread(pt);
+
+	while (ra->count > 0) {
+		free(ra->line[ra->head]);
+		ra->head = (ra->head + 1) % RELOAD_AHEAD_LINES;
+		ra->count--;
+	}
+	mutex_destroy(&(ra->lock));
+	pthread_cond_destroy(&(ra->cond));
+	free(ra);
+
+	return count;
+}
+
 // How many files need to be processed before flagging reloaded_N_files
 #define RELOAD_N_FILES 2
 // optioncontrol name to override the above value
@@ -4702,17 +5287,13 @@ static bool reload_from(tv_t *start)
 	while (!everyone_die && !finished) {
 		LOGWARNING("%s(): processing %s", __func__, filename);
 		processing++;
-		count = 0;
 
 		/* Don't abort when matched since breakdown() will remove
 		 *  the matching message sequence numbers queued from ckpool
 		 * Also since ckpool messages are not in order, we could be
 		 *  aborting early and not get the few slightly later out of
 		 *  order messages in the log file */
-		while (!everyone_die && 
-			logline(reload_buf, MAX_READ, fp, filename)) {
-				reload_line(conn, filename, ++count, reload_buf);
-		}
+		count = reload_file(conn, filename, fp);
 
 		LOGWARNING("%s(): %sread %"PRIu64" line%s from %s",
 			   __func__,
@@ -4786,6 +5367,10 @@ static bool reload_from(tv_t *start)
 		}
 	}
 
+	plworkers_wait();
+	// Give back the items this thread kept, so they can be culled
+	k_mags_flush();
+
 	PQfinish(conn);
 
 	setnow(&now);
@@ -4820,55 +5405,6 @@ static bool reload_from(tv_t *start)
 	return ret;
 }
 
-static void process_queued(PGconn *conn, K_ITEM *wq_item)
-{
-	enum cmd_values cmdnum;
-	WORKQUEUE *workqueue;
-	MSGLINE *msgline;
-	K_ITEM *ml_item;
-	char *ans;
-
-	DATA_WORKQUEUE(workqueue, wq_item);
-	ml_item = workqueue->msgline_item;
-	DATA_MSGLINE(msgline, ml_item);
-
-	/* Queued messages haven't had their seq number check yet
-	 * This will return the entries cmdnum or DUP */
-	cmdnum = process_seq(msgline);
-	switch (cmdnum) {
-		case CMD_DUPSEQ:
-		// Already replied
-		case CMD_AUTH:
-		case CMD_ADDRAUTH:
-		case CMD_HEARTBEAT:
-			break;
-		default:
-			ans = ckdb_cmds[msgline->which_cmds].func(conn,
-					msgline->cmd,
-					msgline->id,
-					&(msgline->now),
-					workqueue->by,
-					workqueue->code,
-					workqueue->inet,
-					&(msgline->cd),
-					msgline->trf_root);
-			FREENULL(ans);
-			break;
-	}
-
-	free_msgline_data(ml_item, true, true);
-	K_WLOCK(msgline_free);
-	k_add_head(msgline_free, ml_item);
-	K_WUNLOCK(msgline_free);
-
-	K_WLOCK(workqueue_free);
-	k_add_head(workqueue_free, wq_item);
-	if (workqueue_free->count == workqueue_free->total &&
-	    workqueue_free->total >= ALLOC_WORKQUEUE * CULL_WORKQUEUE)
-		k_cull_list(workqueue_free);
-	K_WUNLOCK(workqueue_free);
-}
-
 static void free_lost(SEQDATA *seqdata)
 {
 	if (seqdata->reload_lost) {
@@ -4968,9 +5504,6 @@ static void *listener(void *arg)
 		left = pool_workqueue_store->count;
 		K_WUNLOCK(workqueue_free);
 
-		if (left == 0 && wq_stt.tv_sec != 0L)
-			setnow(&wq_fin);
-
 		/* Don't keep a connection for more than ~10s or ~10000 items
 		 *  but always have a connection open */
 		if ((time(NULL) - now) > 10 || wqgot > 10000) {
@@ -4987,6 +5520,8 @@ static void *listener(void *arg)
 		}
 
 		if (left == 0 && wq_stt.tv_sec != 0L) {
+			plworkers_wait();
+			setnow(&wq_fin);
 			sec = tvdiff(&wq_fin, &wq_stt);
 			min = floor(sec / 60.0);
 			sec -= min * 60.0;
@@ -5624,12 +6159,15 @@ static void check_restore_dir(char *name)
 
 static struct option long_options[] = {
 	{ "config",		required_argument,	0,	'c' },
+	{ "copy-batch",		required_argument,	0,	'B' },
 	{ "dbname",		required_argument,	0,	'd' },
 	{ "free",		required_argument,	0,	'f' },
 	// generate = enable payout pplns auto generation
 	{ "generate",		no_argument,		0,	'g' },
 	{ "help",		no_argument,		0,	'h' },
+	{ "marker-workers",	required_argument,	0,	'j' },
 	{ "killold",		no_argument,		0,	'k' },
+	{ "checkpoint",		required_argument,	0,	'K' },
 	{ "loglevel",		required_argument,	0,	'l' },
 	// marker = enable mark/workmarker/markersummary auto generation
 	{ "marker",		no_argument,		0,	'm' },
@@ -5646,6 +6184,7 @@ static struct option long_options[] = {
 	{ "btc-user",		required_argument,	0,	'U' },
 	{ "version",		no_argument,		0,	'v' },
 	{ "workinfoid",		required_argument,	0,	'w' },
+	{ "pool-workers",	required_argument,	0,	'W' },
 	{ "confirm",		no_argument,		0,	'y' },
 	{ "confirmrange",	required_argument,	0,	'Y' },
 	{ 0, 0, 0, 0 }
@@ -5678,8 +6217,13 @@ int main(int argc, char **argv)
 	memset(&ckp, 0, sizeof(ckp));
 	ckp.loglevel = LOG_NOTICE;
 
-	while ((c = getopt_long(argc, argv, "c:d:ghkl:mM:n:p:P:r:R:s:S:t:u:U:vw:yY:", long_options, &i)) != -1) {
+	while ((c = getopt_long(argc, argv, "B:c:d:ghj:kK:l:mM:n:p:P:r:R:s:S:t:u:U:vw:W:yY:", long_options, &i)) != -1) {
 		switch(c) {
+			case 'B':
+				copy_batch = atoi(optarg);
+				if (copy_batch < 0)
+					quit(1, "Invalid copy-batch %d", copy_batch);
+				break;
 			case 'c':
 				ckp.config = strdup(optarg);
 				break;
@@ -5727,6 +6271,9 @@ int main(int argc, char **argv)
 			case 'k':
 				ckp.killold = true;
 				break;
+			case 'K':
+				checkpoint_file = strdup(optarg);
+				break;
 			case 'l':
 				ckp.loglevel = atoi(optarg);
 				if (ckp.loglevel < LOG_EMERG || ckp.loglevel > LOG_DEBUG) {
@@ -5808,6 +6355,23 @@ int main(int argc, char **argv)
 					dbload_workinfoid_start = start;
 				}
 				break;
+			case 'j':
+				marker_workers = atoi(optarg);
+				if (marker_workers < 1 ||
+				    marker_workers > MAX_MARKER_WORKERS) {
+					quit(1, "Invalid marker-workers %d - must"
+					     " be 1 to %d", marker_workers,
+					     MAX_MARKER_WORKERS);
+				}
+				break;
+			case 'W':
+				pool_workers = atoi(optarg);
+				if (pool_workers < 1 || pool_workers > MAX_POOL_WORKERS) {
+					quit(1, "Invalid pool-workers %d - must be"
+					     " 1 to %d", pool_workers,
+					     MAX_POOL_WORKERS);
+				}
+				break;
 			case 'y':
 				confirm_sharesummary = true;
 				break;
@@ -5893,6 +6457,10 @@ int main(int argc, char **argv)
 
 	cklock_init(&last_lock);
 	cklock_init(&btc_lock);
+	mutex_init(&ckpq_lock);
+	mutex_init(&plworkers_lock);
+	mutex_init(&pplns_index_lock);
+	cond_init(&plworkers_idle);
 
 	// Emulate a list for lock checking
 	process_pplns_free = k_lock_only_list("ProcessPPLNS");
@@ -5931,7 +6499,7 @@ int main(int argc, char **argv)
 	while (socketer_using_data || summariser_using_data ||
 		logger_using_data || plistener_using_data ||
 		clistener_using_data || blistener_using_data ||
-		marker_using_data) {
+		marker_using_data || plworkers_using_data) {
 		msg = NULL;
 		curr = time(NULL);
 		if (curr - start > 4) {
@@ -5943,7 +6511,7 @@ int main(int argc, char **argv)
 		}
 		if (msg) {
 			trigger = curr;
-			printf("%s %ds due to%s%s%s%s%s%s%s\n",
+			printf("%s %ds due to%s%s%s%s%s%s%s%s\n",
 				msg, (int)(curr - start),
 				socketer_using_data ? " socketer" : EMPTY,
 				summariser_using_data ? " summariser" : EMPTY,
@@ -5951,7 +6519,8 @@ int main(int argc, char **argv)
 				plistener_using_data ? " plistener" : EMPTY,
 				clistener_using_data ? " clistener" : EMPTY,
 				blistener_using_data ? " blistener" : EMPTY,
-				marker_using_data ? " marker" : EMPTY);
+				marker_using_data ? " marker" : EMPTY,
+				plworkers_using_data ? " plworkers" : EMPTY);
 			fflush(stdout);
 		}
 		sleep(1);
@@ -51,7 +51,7 @@
 
 #define DB_VLOCK "1"
 #define DB_VERSION "1.0.4"
-#define CKDB_VERSION DB_VERSION"-1.914"
+#define CKDB_VERSION DB_VERSION"-1.915"
 
 #define WHERE_FFL " - from %s %s() line %d"
 #define WHERE_FFL_HERE __FILE__, __func__, __LINE__
@@ -337,6 +337,9 @@ extern cklock_t last_lock;
 
 #define JSON_TRANSFER "json="
 #define JSON_TRANSFER_LEN (sizeof(JSON_TRANSFER)-1)
+// A header line followed by multiple pool messages, one per line
+#define BATCH_CMD "batch."
+#define BATCH_CMD_LEN (sizeof(BATCH_CMD)-1)
 #define JSON_BEGIN '{'
 // Arrays have limited support in breakdown()
 #define JSON_ARRAY '['
@@ -427,6 +430,7 @@ enum cmd_values {
 	CMD_BTCSET,
 	CMD_QUERY,
 	CMD_LOCKS,
+	CMD_CMDTIMES,
 	CMD_END
 };
 
@@ -766,6 +770,7 @@ typedef struct msgline {
 
 #define ALLOC_MSGLINE 8192
 #define LIMIT_MSGLINE 0
+#define MAGAZINE_MSGLINE K_MAGAZINE_MAX
 #define CULL_MSGLINE 16
 #define INIT_MSGLINE(_item) INIT_GENERIC(_item, msgline)
 #define DATA_MSGLINE(_var, _item) DATA_GENERIC(_var, _item, msgline, true)
@@ -795,6 +800,28 @@ extern K_STORE *btc_workqueue_store;
 extern mutex_t wq_waitlock;
 extern pthread_cond_t wq_waitcond;
 
+/* PLWORKER - shares and shareerrors are processed in parallel, each
+ *  plworker getting all of the shares for the workinfoids it owns, so
+ *  that the sharesummaries for a workinfoid only ever have one writer */
+typedef struct plworker {
+	int n;
+	pthread_t pt;
+	mutex_t lock;
+	pthread_cond_t cond;
+	K_STORE *store;
+	uint64_t processed;
+} PLWORKER;
+
+#define MAX_POOL_WORKERS 64
+// Stop the reload filling ram faster than a plworker can empty it
+#define LIMIT_PLWORKER_QUEUE 10000
+
+extern int pool_workers;
+
+#define MAX_MARKER_WORKERS 64
+
+extern int marker_workers;
+
 // HEARTBEATQUEUE
 typedef struct heartbeatqueue {
 	char workername[TXT_BIG+1];
@@ -810,6 +837,26 @@ typedef struct heartbeatqueue {
 extern K_LIST *heartbeatqueue_free;
 extern K_STORE *heartbeatqueue_store;
 
+/* CMDCACHE - replies to the busy web commands, reused until they expire
+ *  or one of the stores they read has changed */
+typedef struct cmdcache {
+	char *key;
+	char *ans;
+	time_t expires;
+	int64_t version_up;
+	int64_t version_count;
+} CMDCACHE;
+
+#define ALLOC_CMDCACHE 64
+#define LIMIT_CMDCACHE 4096
+#define INIT_CMDCACHE(_item) INIT_GENERIC(_item, cmdcache)
+#define DATA_CMDCACHE(_var, _item) DATA_GENERIC(_var, _item, cmdcache, true)
+#define DATA_CMDCACHE_NULL(_var, _item) DATA_GENERIC(_var, _item, cmdcache, false)
+
+extern K_LIST *cmdcache_free;
+extern K_STORE *cmdcache_store;
+extern K_TREE *cmdcache_root;
+
 // TRANSFER
 #define NAME_SIZE 63
 #define VALUE_SIZE 1023
@@ -822,6 +869,7 @@ typedef struct transfer {
 // Suggest malloc use MMAP - 1913 = largest under 2MB
 #define ALLOC_TRANSFER 1913
 #define LIMIT_TRANSFER 0
+#define MAGAZINE_TRANSFER K_MAGAZINE_MAX
 #define CULL_TRANSFER 64
 #define INIT_TRANSFER(_item) INIT_GENERIC(_item, transfer)
 #define DATA_TRANSFER(_var, _item) DATA_GENERIC(_var, _item, transfer, true)
@@ -1406,6 +1454,7 @@ typedef struct shares {
 
 #define ALLOC_SHARES 10000
 #define LIMIT_SHARES 0
+#define MAGAZINE_SHARES K_MAGAZINE_MAX
 #define INIT_SHARES(_item) INIT_GENERIC(_item, shares)
 #define DATA_SHARES(_var, _item) DATA_GENERIC(_var, _item, shares, true)
 
@@ -1457,10 +1506,27 @@ extern K_STORE *shareerrors_store;
 extern K_TREE *shareerrors_early_root;
 extern K_STORE *shareerrors_early_store;
 
+/* INTERN - the one shared copy of each workername that's in the
+ *  sharesummaries and markersummaries, so the millions of them don't each
+ *  have their own copy and comparing the same name is a pointer compare
+ * They are never freed, since there is only one of each name ever seen */
+typedef struct intern {
+	char *name;
+} INTERN;
+
+#define ALLOC_INTERN 1024
+#define LIMIT_INTERN 0
+#define INIT_INTERN(_item) INIT_GENERIC(_item, intern)
+#define DATA_INTERN(_var, _item) DATA_GENERIC(_var, _item, intern, true)
+
+extern K_TREE *intern_root;
+extern K_LIST *intern_free;
+extern K_STORE *intern_store;
+
 // SHARESUMMARY
 typedef struct sharesummary {
 	int64_t userid;
-	char *workername;
+	char *workername; // interned
 	int64_t workinfoid;
 	double diffacc;
 	double diffsta;
@@ -1927,7 +1993,7 @@ extern K_STORE *workerstatus_store;
 typedef struct markersummary {
 	int64_t markerid;
 	int64_t userid;
-	char *workername;
+	char *workername; // interned
 	double diffacc;
 	double diffsta;
 	double diffdup;
@@ -1965,6 +2031,27 @@ extern K_STORE *markersummary_pool_store;
 // The markerid load start for markersummary
 extern char *mark_start;
 
+/* The header of a markersummary checkpoint file, followed by rows records
+ *  of a MARKERSUMMARY then its 7 strings, each as a uint32_t length then
+ *  the characters
+ * It's only valid for the same ckdb version and markerid load start, and
+ *  only while the DB still has the same markersummaries up to markerid */
+#define MS_CHECKPOINT_MAGIC "CKDBMSC1"
+typedef struct ms_checkpoint {
+	char magic[8];
+	char version[16];
+	int32_t rowsiz;
+	int64_t markstart;
+	int64_t markerid;
+	int64_t rows;
+	tv_t newest_createdate;
+} MS_CHECKPOINT;
+
+// argv -K - markersummary checkpoint file, NULL = none
+extern char *checkpoint_file;
+// How often to write the checkpoint, if markersummary changed
+#define CHECKPOINT_S 3600
+
 // WORKMARKERS
 typedef struct workmarkers {
 	int64_t markerid;
@@ -2170,6 +2257,8 @@ extern void free_optioncontrol_data(K_ITEM *item);
 extern void free_markersummary_data(K_ITEM *item);
 extern void free_workmarkers_data(K_ITEM *item);
 extern void free_marks_data(K_ITEM *item);
+extern void free_cmdcache_data(K_ITEM *item);
+extern void free_intern_data(K_ITEM *item);
 #define free_seqset_data(_item) _free_seqset_data(_item)
 extern void _free_seqset_data(K_ITEM *item);
 
@@ -2246,6 +2335,10 @@ extern char *_btu64_to_buf(uint64_t *data, char *buf, size_t siz, WHERE_FFL_ARGS
 extern char *_transfer_data(K_ITEM *item, WHERE_FFL_ARGS);
 extern void dsp_transfer(K_ITEM *item, FILE *stream);
 extern cmp_t cmp_transfer(K_ITEM *a, K_ITEM *b);
+extern cmp_t cmp_cmdcache(K_ITEM *a, K_ITEM *b);
+extern cmp_t cmp_intern(K_ITEM *a, K_ITEM *b);
+extern char *intern_name(char *name);
+extern void *snapshot_ktree(K_TREE *tree, K_STORE *store, int *count);
 extern K_ITEM *find_transfer(K_TREE *trf_root, char *name);
 #define optional_name(_root, _name, _len, _patt, _reply, _siz) \
 		_optional_name(_root, _name, _len, _patt, _reply, _siz, \
@@ -2361,7 +2454,7 @@ extern void zero_sharesummary(SHARESUMMARY *row);
 	_find_sharesummary(KANO, EMPTY, _workinfoid, true)
 #define POOL_SS(_row) do { \
 		(_row)->userid = KANO; \
-		(_row)->workername = strdup(EMPTY); \
+		(_row)->workername = EMPTY; \
 	} while (0)
 extern K_ITEM *_find_sharesummary(int64_t userid, char *workername,
 				  int64_t workinfoid, bool pool);
@@ -2394,6 +2487,13 @@ extern K_ITEM *first_miningpayouts(int64_t payoutid, K_TREE_CTX *ctx);
 extern cmp_t cmp_mu(K_ITEM *a, K_ITEM *b);
 extern void upd_add_mu(K_TREE *mu_root, K_STORE *mu_store, int64_t userid,
 			double diffacc);
+extern mutex_t pplns_index_lock;
+extern void pplns_index_add(K_TREE *mu_root, K_STORE *mu_store,
+			    int64_t before_workinfoid, bool countbacklimit,
+			    double diff_want, double *total_diff,
+			    int64_t *total_share_count, int64_t *acc_share_count,
+			    int64_t *begin_workinfoid, int64_t *end_workinfoid,
+			    tv_t *end_tv, int64_t *wm_count, int64_t *ms_count);
 extern cmp_t cmp_payouts(K_ITEM *a, K_ITEM *b);
 extern cmp_t cmp_payouts_id(K_ITEM *a, K_ITEM *b);
 extern cmp_t cmp_payouts_wid(K_ITEM *a, K_ITEM *b);
@@ -2483,9 +2583,39 @@ extern PGresult *_CKPQexecParams(PGconn *conn, const char *qry,
 				 int resultFormat,
 				 bool isread, WHERE_FFL_ARGS);
 
+/* Named prepared statements for the frequent queries
+ * Each is prepared on a connection the first time that connection runs it,
+ *  so a new connection from dbconnect() always prepares them again */
+typedef struct ckpqstmt {
+	const char *name;
+	int id; // -1 until first run
+	int64_t runs;
+	int64_t prepares;
+	int64_t total_ns;
+	int64_t max_ns;
+	struct ckpqstmt *next;
+} CKPQSTMT;
+
+#define CKPQSTMT_INIT(_name) { _name, -1, 0, 0, 0, 0, NULL }
+// Statements beyond this just use PQexecParams
+#define CKPQ_MAXSTMTS 64
+
+extern mutex_t ckpq_lock;
+extern CKPQSTMT *ckpq_stmts;
+
+#define CKPQexecStmt(_conn, _stmt, _qry, _par, _params, _isread) \
+			_CKPQexecStmt(_conn, _stmt, _qry, _par, _params, \
+			_isread, WHERE_FFL_HERE)
+extern PGresult *_CKPQexecStmt(PGconn *conn, CKPQSTMT *stmt, const char *qry,
+				int nParams, const char *const * paramValues,
+				bool isread, WHERE_FFL_ARGS);
+extern void CKPQconnected(PGconn *conn);
+extern void CKPQfinish(PGconn *conn);
+
 // Force use CKPQ... for PQ functions in use
 #define PQexec CKPQexec
 #define PQexecParams CKPQexecParams
+#define PQfinish CKPQfinish
 
 #define PGLOG(__LOG, __str, __rescode, __conn) do { \
 		char *__buf = pqerrmsg(__conn); \
@@ -2505,6 +2635,34 @@ extern bool _CKPQBegin(PGconn *conn, WHERE_FFL_ARGS);
 extern void _CKPQEnd(PGconn *conn, bool commit, WHERE_FFL_ARGS);
 #define CKPQEnd(_conn, _commit) _CKPQEnd(_conn, _commit, WHERE_FFL_HERE)
 
+/* Bulk inserts with COPY ... FROM STDIN in binary format
+ * Rows are built up in buf and sent to the db every copy_batch rows */
+typedef struct ckcopy {
+	PGconn *conn;
+	const char *table;
+	int fields;
+	char *buf;
+	size_t len, siz;
+	int rows;
+	int64_t total;
+	bool failed;
+} CKCOPY;
+
+/* Rows per COPY send, 0 means use individual inserts instead of COPY
+ * The high volume tables use COPY when adding more than one row */
+extern int copy_batch;
+
+extern bool _ckcopy_begin(CKCOPY *copy, PGconn *conn, const char *table,
+			  const char *columns, int fields, WHERE_FFL_ARGS);
+#define ckcopy_begin(_copy, _conn, _table, _columns, _fields) \
+		_ckcopy_begin(_copy, _conn, _table, _columns, _fields, WHERE_FFL_HERE)
+extern void ckcopy_row(CKCOPY *copy);
+extern void ckcopy_bigint(CKCOPY *copy, int64_t val);
+extern void ckcopy_double(CKCOPY *copy, double val);
+extern void ckcopy_str(CKCOPY *copy, const char *str);
+extern void ckcopy_tv(CKCOPY *copy, const tv_t *tv);
+extern bool ckcopy_end(CKCOPY *copy);
+
 extern int64_t nextid(PGconn *conn, char *idname, int64_t increment,
 			tv_t *cd, char *by, char *code, char *inet);
 extern bool users_update(PGconn *conn, K_ITEM *u_item, char *oldhash,
@@ -2602,6 +2760,9 @@ extern bool miningpayouts_add(PGconn *conn, bool add, K_ITEM *mp_item,
 				K_ITEM **old_mp_item, char *by, char *code,
 				char *inet, tv_t *cd, K_TREE *trf_root,
 				bool already);
+extern bool miningpayouts_copy(PGconn *conn, K_TREE *mu_root, char *by,
+				char *code, char *inet, tv_t *cd,
+				K_TREE *trf_root);
 extern bool miningpayouts_fill(PGconn *conn);
 extern void payouts_add_ram(bool ok, K_ITEM *p_item, K_ITEM *old_p_item,
 			    tv_t *cd);
@@ -2637,7 +2798,11 @@ extern bool workerstats_add(char *poolinstance, char *elapsed, char *username,
 extern bool userstats_fill(PGconn *conn);
 extern bool markersummary_add(PGconn *conn, K_ITEM *ms_item, char *by, char *code,
 				char *inet, tv_t *cd, K_TREE *trf_root);
+extern bool markersummary_copy(PGconn *conn, K_STORE *ms_store, char *by,
+				char *code, char *inet, tv_t *cd,
+				K_TREE *trf_root);
 extern bool markersummary_fill(PGconn *conn);
+extern bool markersummary_checkpoint(char *filename);
 #define workmarkers_process(_conn, _already, _add, _markerid, _poolinstance, \
 			    _workinfoidend, _workinfoidstart, _description, \
 			    _status, _by, _code, _inet, _cd, _trf_root) \
@@ -2690,6 +2855,54 @@ struct CMDS {
 
 extern struct CMDS ckdb_cmds[];
 
+/* How long each ckdb_cmds[] entry takes, indexed the same as ckdb_cmds[]
+ * wait is from when the message was received until it was processed, db is
+ *  the time in PQexec* and run is the total processing time including db
+ * They are updated with __atomic adds, without a lock, by the threads that
+ *  run the cmds, so a reader may see one cmd's fields part way updated
+ * Histogram bucket i counts those <= cmdtime_bucket_us[i] and the last
+ *  bucket is all those larger */
+#define CMDTIME_BUCKETS 8
+
+struct CMDTIME {
+	uint64_t count;
+	uint64_t wait_ns;
+	uint64_t run_ns;
+	uint64_t db_ns;
+	uint64_t max_run_ns;
+	uint64_t wait_hist[CMDTIME_BUCKETS];
+	uint64_t run_hist[CMDTIME_BUCKETS];
+};
+
+extern struct CMDTIME *cmd_times;
+extern const int64_t cmdtime_bucket_us[CMDTIME_BUCKETS-1];
+extern __thread int64_t cmd_db_ns;
+
+#define CMDCACHE_STORES 3
+
+// Which web commands have their reply cached, and for how long
+struct CMDCACHEDEF {
+	enum cmd_values cmd_val;
+	int ttl; // seconds
+	K_STORE **stores[CMDCACHE_STORES];
+	int64_t hits;
+	int64_t misses;
+	int64_t expired;
+};
+
+extern struct CMDCACHEDEF cmdcache_defs[];
+
+// What cmdcache_find() looked for, to pass to cmdcache_add()
+typedef struct cmdcache_key {
+	struct CMDCACHEDEF *def;
+	char *key;
+	int64_t version_up;
+	int64_t version_count;
+} CMDCACHE_KEY;
+
+extern char *cmdcache_find(MSGLINE *msgline, CMDCACHE_KEY *cck);
+extern void cmdcache_add(CMDCACHE_KEY *cck, char *ans);
+
 // ***
 // *** ckdb_btc.c
 // ***
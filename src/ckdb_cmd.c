@@ -1182,15 +1182,13 @@ static char *cmd_blocklist(__maybe_unused PGconn *conn, char *cmd, char *id,
 			   __maybe_unused tv_t *notcd,
 			   __maybe_unused K_TREE *trf_root)
 {
-	K_TREE_CTX ctx[1];
-	K_ITEM *b_item;
-	BLOCKS *blocks;
+	BLOCKS *snap, *blocks;
 	char reply[1024] = "";
 	char tmp[1024];
 	char *buf, *desc, desc_buf[64];
 	size_t len, off;
 	tv_t stats_tv = {0,0}, stats_tv2 = {0,0};
-	int rows, srows, tot, seq;
+	int rows, srows, tot, seq, count, i;
 	int64_t maxrows;
 	bool has_stats;
 
@@ -1205,22 +1203,29 @@ redo:
 	has_stats = check_update_blocks_stats(&stats_tv);
 
 	srows = rows = 0;
+	/* Build the page from a copy of the blocks so the lock isn't held
+	 *  while formatting it
+	 * Any code that modifies the blocks table must have it under write
+	 *  lock and will flag the stats as needing to be recalculated, so
+	 *  the stats time taken with the copy is still used for the redo */
 	K_RLOCK(blocks_free);
-	b_item = first_in_ktree(blocks_root, ctx);
+	snap = snapshot_ktree(blocks_root, blocks_store, &count);
+	copy_tv(&stats_tv2, &blocks_stats_time);
+	K_RUNLOCK(blocks_free);
+
 	tot = 0;
-	while (b_item) {
-		DATA_BLOCKS(blocks, b_item);
+	for (i = 0; i < count; i++) {
+		blocks = &(snap[i]);
 		if (CURRENT(&(blocks->expirydate))) {
 			if (blocks->confirmed[0] != BLOCKS_ORPHAN &&
 			    blocks->confirmed[0] != BLOCKS_REJECT)
 				tot++;
 		}
-		b_item = next_in_ktree(ctx);
 	}
 	seq = tot;
-	b_item = last_in_ktree(blocks_root, ctx);
-	while (b_item && rows < (int)maxrows) {
-		DATA_BLOCKS(blocks, b_item);
+	i = count;
+	while (i > 0 && rows < (int)maxrows) {
+		blocks = &(snap[--i]);
 		if (CURRENT(&(blocks->expirydate))) {
 			if (blocks->confirmed[0] == BLOCKS_ORPHAN ||
 			    blocks->confirmed[0] == BLOCKS_REJECT) {
@@ -1331,13 +1336,12 @@ redo:
 
 			rows++;
 		}
-		b_item = prev_in_ktree(ctx);
 	}
 	if (has_stats) {
 		seq = tot;
-		b_item = last_in_ktree(blocks_root, ctx);
-		while (b_item) {
-			DATA_BLOCKS(blocks, b_item);
+		i = count;
+		while (i > 0) {
+			blocks = &(snap[--i]);
 			if (CURRENT(&(blocks->expirydate)) &&
 			    blocks->confirmed[0] != BLOCKS_ORPHAN &&
 			    blocks->confirmed[0] != BLOCKS_REJECT) {
@@ -1384,11 +1388,9 @@ redo:
 				}
 				seq--;
 			}
-			b_item = prev_in_ktree(ctx);
 		}
-		copy_tv(&stats_tv2, &blocks_stats_time);
 	}
-	K_RUNLOCK(blocks_free);
+	free(snap);
 
 	// Only check for a redo if we used the stats values
 	if (has_stats) {
@@ -4077,11 +4079,8 @@ static char *cmd_pplns(__maybe_unused PGconn *conn, char *cmd, char *id,
 	size_t siz = sizeof(reply);
 	K_ITEM *i_height, *i_difftimes, *i_diffadd, *i_allowaged;
 	K_ITEM b_look, ss_look, *b_item, *w_item, *ss_item;
-	K_ITEM wm_look, *wm_item, ms_look, *ms_item;
 	K_ITEM *mu_item, *wb_item, *u_item;
 	SHARESUMMARY looksharesummary, *sharesummary;
-	WORKMARKERS lookworkmarkers, *workmarkers;
-	MARKERSUMMARY lookmarkersummary, *markersummary;
 	MININGPAYOUTS *miningpayouts;
 	WORKINFO *workinfo;
 	TRANSFER *transfer;
@@ -4091,12 +4090,12 @@ static char *cmd_pplns(__maybe_unused PGconn *conn, char *cmd, char *id,
 	USERS *users;
 	int32_t height;
 	int64_t block_workinfoid, end_workinfoid;
-	int64_t begin_workinfoid;
+	int64_t begin_workinfoid, before_workinfoid;
 	int64_t total_share_count, acc_share_count;
 	int64_t ss_count, wm_count, ms_count;
 	char tv_buf[DATE_BUFSIZ];
 	tv_t cd, begin_tv, block_tv, end_tv;
-	K_TREE_CTX ctx[1], wm_ctx[1], ms_ctx[1], pay_ctx[1];
+	K_TREE_CTX ctx[1], pay_ctx[1];
 	double ndiff, total_diff, elapsed;
 	double diff_times = 1.0;
 	double diff_add = 0.0;
@@ -4288,53 +4287,17 @@ static char *cmd_pplns(__maybe_unused PGconn *conn, char *cmd, char *id,
 	/* If we haven't met or exceeded the required N,
 	 * move on to the markersummaries */
 	if (total_diff < diff_want) {
-		lookworkmarkers.expirydate.tv_sec = default_expiry.tv_sec;
-		lookworkmarkers.expirydate.tv_usec = default_expiry.tv_usec;
 		if (begin_workinfoid != 0)
-			lookworkmarkers.workinfoidend = begin_workinfoid;
+			before_workinfoid = begin_workinfoid;
 		else
-			lookworkmarkers.workinfoidend = block_workinfoid + 1;
-		INIT_WORKMARKERS(&wm_look);
-		wm_look.data = (void *)(&lookworkmarkers);
-		wm_item = find_before_in_ktree(workmarkers_workinfoid_root,
-						&wm_look, wm_ctx);
-		DATA_WORKMARKERS_NULL(workmarkers, wm_item);
-		LOGDEBUG("%s(): workmarkers < %"PRId64, __func__, lookworkmarkers.workinfoidend);
-		while (total_diff < diff_want && wm_item && CURRENT(&(workmarkers->expirydate))) {
-			if (WMPROCESSED(workmarkers->status)) {
-				// Stop before FIVExWID if necessary
-				if (countbacklimit && workmarkers->workinfoidstart <= FIVExWID)
-					break;
-
-				wm_count++;
-				lookmarkersummary.markerid = workmarkers->markerid;
-				lookmarkersummary.userid = MAXID;
-				lookmarkersummary.workername = EMPTY;
-				INIT_MARKERSUMMARY(&ms_look);
-				ms_look.data = (void *)(&lookmarkersummary);
-				ms_item = find_before_in_ktree(markersummary_root,
-								&ms_look, ms_ctx);
-				DATA_MARKERSUMMARY_NULL(markersummary, ms_item);
-				// add the whole markerid
-				while (ms_item && markersummary->markerid == workmarkers->markerid) {
-					if (end_workinfoid == 0)
-						end_workinfoid = workmarkers->workinfoidend;
-					ms_count++;
-					total_share_count += markersummary->sharecount;
-					acc_share_count += markersummary->shareacc;
-					total_diff += (int64_t)(markersummary->diffacc);
-					begin_workinfoid = workmarkers->workinfoidstart;
-					if (tv_newer(&end_tv, &(markersummary->lastshareacc)))
-						copy_tv(&end_tv, &(markersummary->lastshareacc));
-					upd_add_mu(mu_root, mu_store, markersummary->userid,
-						   (int64_t)(markersummary->diffacc));
-					ms_item = prev_in_ktree(ms_ctx);
-					DATA_MARKERSUMMARY_NULL(markersummary, ms_item);
-				}
-			}
-			wm_item = prev_in_ktree(wm_ctx);
-			DATA_WORKMARKERS_NULL(workmarkers, wm_item);
-		}
+			before_workinfoid = block_workinfoid + 1;
+		LOGDEBUG("%s(): workmarkers < %"PRId64, __func__, before_workinfoid);
+		// add whole workmarkers until >= diff_want
+		pplns_index_add(mu_root, mu_store, before_workinfoid,
+				countbacklimit, diff_want, &total_diff,
+				&total_share_count, &acc_share_count,
+				&begin_workinfoid, &end_workinfoid, &end_tv,
+				&wm_count, &ms_count);
 		LOGDEBUG("%s(): wm %"PRId64" ms %"PRId64" total %.0f want %.0f",
 			 __func__, wm_count, ms_count, total_diff, diff_want);
 	}
@@ -5064,17 +5027,18 @@ static char *cmd_mpayouts(__maybe_unused PGconn *conn, char *cmd, char *id,
 			  __maybe_unused tv_t *notcd,
 			  __maybe_unused K_TREE *trf_root)
 {
-	K_ITEM *i_username, *u_item, *mp_item, *po_item;
-	K_TREE_CTX ctx[1];
+	K_ITEM *i_username, *u_item, *mp_item;
 	MININGPAYOUTS *mp;
-	PAYOUTS *payouts;
+	PAYOUTS *snap, *payouts;
+	int64_t mp_amount = 0;
+	double mp_diffacc = 0.0;
 	USERS *users;
 	char reply[1024] = "";
 	char tmp[1024];
 	size_t siz = sizeof(reply);
 	char *buf;
 	size_t len, off;
-	int rows;
+	int rows, count, i;
 
 	LOGDEBUG("%s(): cmd '%s'", __func__, cmd);
 
@@ -5092,12 +5056,15 @@ static char *cmd_mpayouts(__maybe_unused PGconn *conn, char *cmd, char *id,
 	APPEND_REALLOC_INIT(buf, off, len);
 	APPEND_REALLOC(buf, off, len, "ok.");
 	rows = 0;
+	// Format the reply from a copy, without holding payouts_free
 	K_RLOCK(payouts_free);
-	po_item = last_in_ktree(payouts_root, ctx);
-	DATA_PAYOUTS_NULL(payouts, po_item);
+	snap = snapshot_ktree(payouts_root, payouts_store, &count);
+	K_RUNLOCK(payouts_free);
 	/* TODO: allow to see details of a single payoutid
 	 *	 if it has multiple items (percent payout user) */
-	while (po_item) {
+	i = count;
+	while (i > 0) {
+		payouts = &(snap[--i]);
 		if (CURRENT(&(payouts->expirydate)) &&
 		    PAYGENERATED(payouts->status)) {
 			K_RLOCK(miningpayouts_free);
@@ -5105,7 +5072,11 @@ static char *cmd_mpayouts(__maybe_unused PGconn *conn, char *cmd, char *id,
 						     users->userid);
 			if (mp_item) {
 				DATA_MININGPAYOUTS(mp, mp_item);
-
+				mp_amount = mp->amount;
+				mp_diffacc = mp->diffacc;
+			}
+			K_RUNLOCK(miningpayouts_free);
+			if (mp_item) {
 				bigint_to_buf(payouts->payoutid, reply,
 					      sizeof(reply));
 				snprintf(tmp, sizeof(tmp), "payoutid:%d=%s%c",
@@ -5129,12 +5100,12 @@ static char *cmd_mpayouts(__maybe_unused PGconn *conn, char *cmd, char *id,
 							   rows, reply, FLDSEP);
 				APPEND_REALLOC(buf, off, len, tmp);
 
-				bigint_to_buf(mp->amount, reply, sizeof(reply));
+				bigint_to_buf(mp_amount, reply, sizeof(reply));
 				snprintf(tmp, sizeof(tmp), "amount:%d=%s%c",
 							   rows, reply, FLDSEP);
 				APPEND_REALLOC(buf, off, len, tmp);
 
-				double_to_buf(mp->diffacc, reply, sizeof(reply));
+				double_to_buf(mp_diffacc, reply, sizeof(reply));
 				snprintf(tmp, sizeof(tmp), "diffacc:%d=%s%c",
 							   rows, reply, FLDSEP);
 				APPEND_REALLOC(buf, off, len, tmp);
@@ -5159,12 +5130,9 @@ static char *cmd_mpayouts(__maybe_unused PGconn *conn, char *cmd, char *id,
 
 				rows++;
 			}
-			K_RUNLOCK(miningpayouts_free);
 		}
-		po_item = prev_in_ktree(ctx);
-		DATA_PAYOUTS_NULL(payouts, po_item);
 	}
-	K_RUNLOCK(payouts_free);
+	free(snap);
 
 	snprintf(tmp, sizeof(tmp), "rows=%d%cflds=%s%c",
 		 rows, FLDSEP,
@@ -5657,7 +5625,9 @@ static char *cmd_stats(__maybe_unused PGconn *conn, char *cmd, char *id,
 	uint64_t ram, ram2, tot = 0;
 	K_LIST *klist;
 	K_LISTS *klists;
-	int rows = 0;
+	CKPQSTMT *stmt;
+	struct CMDCACHEDEF *def;
+	int rows = 0, prows = 0, crows = 0, i, j;
 	bool istree;
 
 	LOGDEBUG("%s(): cmd '%s'", __func__, cmd);
@@ -5721,13 +5691,71 @@ static char *cmd_stats(__maybe_unused PGconn *conn, char *cmd, char *id,
 	snprintf(tmp, sizeof(tmp), "totalram=%"PRIu64"%c", tot, FLDSEP);
 	APPEND_REALLOC(buf, off, len, tmp);
 
+	// The prepared statements, times are microseconds
+	mutex_lock(&ckpq_lock);
+	stmt = ckpq_stmts;
+	while (stmt) {
+		snprintf(tmp, sizeof(tmp),
+			 "p_name:%d=%s%cp_runs:%d=%"PRId64"%c"
+			 "p_prepares:%d=%"PRId64"%cp_avg:%d=%.1f%c"
+			 "p_max:%d=%.1f%c",
+			 prows, stmt->name, FLDSEP,
+			 prows, stmt->runs, FLDSEP,
+			 prows, stmt->prepares, FLDSEP,
+			 prows, stmt->runs ? (double)(stmt->total_ns) /
+				(double)(stmt->runs) / 1000.0 : 0.0, FLDSEP,
+			 prows, (double)(stmt->max_ns) / 1000.0, FLDSEP);
+		APPEND_REALLOC(buf, off, len, tmp);
+		prows++;
+		stmt = stmt->next;
+	}
+	mutex_unlock(&ckpq_lock);
+
+	snprintf(tmp, sizeof(tmp),
+		 "p_rows=%d%cp_flds=%s%c",
+		 prows, FLDSEP,
+		 "p_name,p_runs,p_prepares,p_avg,p_max", FLDSEP);
+	APPEND_REALLOC(buf, off, len, tmp);
+
+	// The web reply cache
+	K_RLOCK(cmdcache_free);
+	for (i = 0; cmdcache_defs[i].cmd_val != CMD_END; i++) {
+		def = &(cmdcache_defs[i]);
+		for (j = 0; ckdb_cmds[j].cmd_val != CMD_END; j++) {
+			if (ckdb_cmds[j].cmd_val == def->cmd_val)
+				break;
+		}
+		snprintf(tmp, sizeof(tmp),
+			 "c_name:%d=%s%cc_ttl:%d=%d%c"
+			 "c_hits:%d=%"PRId64"%cc_misses:%d=%"PRId64"%c"
+			 "c_expired:%d=%"PRId64"%c",
+			 crows, ckdb_cmds[j].cmd_str ? ckdb_cmds[j].cmd_str : EMPTY, FLDSEP,
+			 crows, def->ttl, FLDSEP,
+			 crows, def->hits, FLDSEP,
+			 crows, def->misses, FLDSEP,
+			 crows, def->expired, FLDSEP);
+		APPEND_REALLOC(buf, off, len, tmp);
+		crows++;
+	}
+	snprintf(tmp, sizeof(tmp), "c_entries=%d%c", cmdcache_store->count,
+		 FLDSEP);
+	K_RUNLOCK(cmdcache_free);
+	APPEND_REALLOC(buf, off, len, tmp);
+
+	snprintf(tmp, sizeof(tmp),
+		 "c_rows=%d%cc_flds=%s%c",
+		 crows, FLDSEP,
+		 "c_name,c_ttl,c_hits,c_misses,c_expired", FLDSEP);
+	APPEND_REALLOC(buf, off, len, tmp);
+
 	snprintf(tmp, sizeof(tmp),
 		 "rows=%d%cflds=%s%c",
 		 rows, FLDSEP,
 		 "name,initial,allocated,instore,ram,cull", FLDSEP);
 	APPEND_REALLOC(buf, off, len, tmp);
 
-	snprintf(tmp, sizeof(tmp), "arn=%s%carp=%s", "Stats", FLDSEP, "");
+	snprintf(tmp, sizeof(tmp), "arn=%s%carp=%s", "Stats,Statements,Cache",
+		 FLDSEP, ",p,c");
 	APPEND_REALLOC(buf, off, len, tmp);
 
 	LOGDEBUG("%s.ok.%s...", id, cmd);
@@ -7341,6 +7369,204 @@ static char *cmd_locks(__maybe_unused PGconn *conn, char *cmd, char *id,
 	return strdup(reply);
 }
 
+// A queue's current and highest length
+#define CMDTIMES_QUEUE(_buf, _off, _len, _tmp, _prom, _rows, _name, \
+			_free, _store) do { \
+		int __count, __hi; \
+		K_RLOCK(_free); \
+		__count = (_store)->count; \
+		__hi = (_store)->count_hi; \
+		K_RUNLOCK(_free); \
+		if (_prom) { \
+			snprintf(_tmp, sizeof(_tmp), \
+				 "ckdb_queue_length{queue=\"%s\"} %d\n" \
+				 "ckdb_queue_length_max{queue=\"%s\"} %d\n", \
+				 _name, __count, _name, __hi); \
+		} else { \
+			snprintf(_tmp, sizeof(_tmp), \
+				 "q_name:%d=%s%cq_count:%d=%d%c" \
+				 "q_hi:%d=%d%c", \
+				 _rows, _name, FLDSEP, _rows, __count, FLDSEP, \
+				 _rows, __hi, FLDSEP); \
+		} \
+		APPEND_REALLOC(_buf, _off, _len, _tmp); \
+		_rows++; \
+	} while (0)
+
+/* Add one cmd's histogram
+ * Prometheus buckets are cumulative, the others are per bucket */
+static void cmdtimes_hist(char **buf, size_t *off, size_t *len, bool prom,
+			  const char *cmd, const char *name, uint64_t *hist,
+			  uint64_t sum_ns, int rows)
+{
+	uint64_t count, cum = 0;
+	char tmp[1024];
+	int i;
+
+	if (!prom) {
+		snprintf(tmp, sizeof(tmp), "%s_hist:%d=", name, rows);
+		APPEND_REALLOC(*buf, *off, *len, tmp);
+	}
+	for (i = 0; i < CMDTIME_BUCKETS; i++) {
+		count = __atomic_load_n(&(hist[i]), __ATOMIC_RELAXED);
+		cum += count;
+		if (!prom) {
+			snprintf(tmp, sizeof(tmp), "%s%"PRIu64,
+				 i ? "," : EMPTY, count);
+		} else if (i < CMDTIME_BUCKETS-1) {
+			snprintf(tmp, sizeof(tmp),
+				 "ckdb_cmd_%s_seconds_bucket{cmd=\"%s\","
+				 "le=\"%g\"} %"PRIu64"\n",
+				 name, cmd,
+				 (double)(cmdtime_bucket_us[i]) / 1000000.0,
+				 cum);
+		} else {
+			snprintf(tmp, sizeof(tmp),
+				 "ckdb_cmd_%s_seconds_bucket{cmd=\"%s\","
+				 "le=\"+Inf\"} %"PRIu64"\n"
+				 "ckdb_cmd_%s_seconds_sum{cmd=\"%s\"} %.6f\n"
+				 "ckdb_cmd_%s_seconds_count{cmd=\"%s\"} %"PRIu64"\n",
+				 name, cmd, cum,
+				 name, cmd, (double)sum_ns / 1000000000.0,
+				 name, cmd, cum);
+		}
+		APPEND_REALLOC(*buf, *off, *len, tmp);
+	}
+	if (!prom) {
+		snprintf(tmp, sizeof(tmp), "%c", FLDSEP);
+		APPEND_REALLOC(*buf, *off, *len, tmp);
+	}
+}
+
+/* How long each cmd has taken, from cmd_times[], and the queue lengths
+ * Times are microseconds, averaged over count, and the histogram buckets
+ *  are listed in buckets= with the last bucket being all larger times
+ * format=prometheus replies with "ok." then the Prometheus text format
+ *  for a scraper that can strip the "ok." */
+static char *cmd_cmdtimes(__maybe_unused PGconn *conn, char *cmd, char *id,
+			  __maybe_unused tv_t *now, __maybe_unused char *by,
+			  __maybe_unused char *code, __maybe_unused char *inet,
+			  __maybe_unused tv_t *notcd, K_TREE *trf_root)
+{
+	uint64_t count, wait_ns, run_ns, db_ns, max_ns;
+	struct CMDTIME *ct;
+	K_ITEM *i_format;
+	char reply[1024] = "";
+	char tmp[1024], *buf;
+	size_t siz = sizeof(reply);
+	size_t len, off;
+	int rows = 0, qrows = 0, i;
+	bool prom = false;
+
+	LOGDEBUG("%s(): cmd '%s'", __func__, cmd);
+
+	i_format = optional_name(trf_root, "format", 1, NULL, reply, siz);
+	if (i_format && strcasecmp(transfer_data(i_format), "prometheus") == 0)
+		prom = true;
+
+	APPEND_REALLOC_INIT(buf, off, len);
+	APPEND_REALLOC(buf, off, len, "ok.");
+
+	if (prom) {
+		APPEND_REALLOC(buf, off, len,
+			"# TYPE ckdb_cmd_total counter\n"
+			"# TYPE ckdb_cmd_part_seconds_total counter\n"
+			"# TYPE ckdb_cmd_max_run_seconds gauge\n"
+			"# TYPE ckdb_cmd_wait_seconds histogram\n"
+			"# TYPE ckdb_cmd_run_seconds histogram\n"
+			"# TYPE ckdb_queue_length gauge\n"
+			"# TYPE ckdb_queue_length_max gauge\n");
+	}
+
+	// Only those that have been used
+	for (i = 0; ckdb_cmds[i].cmd_val != CMD_END; i++) {
+		ct = &(cmd_times[i]);
+		count = __atomic_load_n(&(ct->count), __ATOMIC_RELAXED);
+		if (count == 0)
+			continue;
+		wait_ns = __atomic_load_n(&(ct->wait_ns), __ATOMIC_RELAXED);
+		run_ns = __atomic_load_n(&(ct->run_ns), __ATOMIC_RELAXED);
+		db_ns = __atomic_load_n(&(ct->db_ns), __ATOMIC_RELAXED);
+		max_ns = __atomic_load_n(&(ct->max_run_ns), __ATOMIC_RELAXED);
+		// A part way update could make db look larger
+		if (db_ns > run_ns)
+			db_ns = run_ns;
+		if (prom) {
+			snprintf(tmp, sizeof(tmp),
+				 "ckdb_cmd_total{cmd=\"%s\"} %"PRIu64"\n"
+				 "ckdb_cmd_part_seconds_total{cmd=\"%s\",part=\"wait\"} %.6f\n"
+				 "ckdb_cmd_part_seconds_total{cmd=\"%s\",part=\"db\"} %.6f\n"
+				 "ckdb_cmd_part_seconds_total{cmd=\"%s\",part=\"proc\"} %.6f\n"
+				 "ckdb_cmd_max_run_seconds{cmd=\"%s\"} %.6f\n",
+				 ckdb_cmds[i].cmd_str, count,
+				 ckdb_cmds[i].cmd_str, (double)wait_ns / 1000000000.0,
+				 ckdb_cmds[i].cmd_str, (double)db_ns / 1000000000.0,
+				 ckdb_cmds[i].cmd_str,
+				 (double)(run_ns - db_ns) / 1000000000.0,
+				 ckdb_cmds[i].cmd_str, (double)max_ns / 1000000000.0);
+		} else {
+			snprintf(tmp, sizeof(tmp),
+				 "name:%d=%s%ccount:%d=%"PRIu64"%c"
+				 "wait:%d=%.1f%cdb:%d=%.1f%cproc:%d=%.1f%c"
+				 "max:%d=%.1f%c",
+				 rows, ckdb_cmds[i].cmd_str, FLDSEP,
+				 rows, count, FLDSEP,
+				 rows, (double)wait_ns / (double)count / 1000.0, FLDSEP,
+				 rows, (double)db_ns / (double)count / 1000.0, FLDSEP,
+				 rows, (double)(run_ns - db_ns) / (double)count / 1000.0,
+				 FLDSEP,
+				 rows, (double)max_ns / 1000.0, FLDSEP);
+		}
+		APPEND_REALLOC(buf, off, len, tmp);
+		cmdtimes_hist(&buf, &off, &len, prom, ckdb_cmds[i].cmd_str,
+			      "wait", ct->wait_hist, wait_ns, rows);
+		cmdtimes_hist(&buf, &off, &len, prom, ckdb_cmds[i].cmd_str,
+			      "run", ct->run_hist, run_ns, rows);
+		rows++;
+	}
+
+	CMDTIMES_QUEUE(buf, off, len, tmp, prom, qrows, "pool",
+			workqueue_free, pool_workqueue_store);
+	CMDTIMES_QUEUE(buf, off, len, tmp, prom, qrows, "cmd",
+			workqueue_free, cmd_workqueue_store);
+	CMDTIMES_QUEUE(buf, off, len, tmp, prom, qrows, "btc",
+			workqueue_free, btc_workqueue_store);
+	CMDTIMES_QUEUE(buf, off, len, tmp, prom, qrows, "log",
+			logqueue_free, logqueue_store);
+	CMDTIMES_QUEUE(buf, off, len, tmp, prom, qrows, "heartbeat",
+			heartbeatqueue_free, heartbeatqueue_store);
+
+	if (!prom) {
+		APPEND_REALLOC(buf, off, len, "buckets=");
+		for (i = 0; i < CMDTIME_BUCKETS-1; i++) {
+			snprintf(tmp, sizeof(tmp), "%s%"PRId64, i ? "," : EMPTY,
+				 cmdtime_bucket_us[i]);
+			APPEND_REALLOC(buf, off, len, tmp);
+		}
+		snprintf(tmp, sizeof(tmp), "%c", FLDSEP);
+		APPEND_REALLOC(buf, off, len, tmp);
+
+		snprintf(tmp, sizeof(tmp),
+			 "q_rows=%d%cq_flds=%s%c",
+			 qrows, FLDSEP, "q_name,q_count,q_hi", FLDSEP);
+		APPEND_REALLOC(buf, off, len, tmp);
+
+		snprintf(tmp, sizeof(tmp),
+			 "rows=%d%cflds=%s%c",
+			 rows, FLDSEP,
+			 "name,count,wait,db,proc,max,wait_hist,run_hist",
+			 FLDSEP);
+		APPEND_REALLOC(buf, off, len, tmp);
+
+		snprintf(tmp, sizeof(tmp), "arn=%s%carp=%s", "CmdTimes,Queues",
+			 FLDSEP, ",q");
+		APPEND_REALLOC(buf, off, len, tmp);
+	}
+
+	LOGDEBUG("%s.ok.%d_cmds", id, rows);
+	return buf;
+}
+
 /* The socket command format is as follows:
  *  Basic structure:
  *    cmd.ID.fld1=value1 FLDSEP fld2=value2 FLDSEP fld3=...
@@ -7451,5 +7677,193 @@ struct CMDS ckdb_cmds[] = {
 	{ CMD_BTCSET,	"btcset",	false,	false,	cmd_btcset,	SEQ_NONE,	ACCESS_SYSTEM },
 	{ CMD_QUERY,	"query",	false,	false,	cmd_query,	SEQ_NONE,	ACCESS_SYSTEM },
 	{ CMD_LOCKS,	"locks",	false,	false,	cmd_locks,	SEQ_NONE,	ACCESS_SYSTEM },
+	{ CMD_CMDTIMES,	"cmdtimes",	false,	false,	cmd_cmdtimes,	SEQ_NONE,	ACCESS_SYSTEM },
 	{ CMD_END,	NULL,		false,	false,	NULL,		SEQ_NONE,	0 }
 };
+
+/* The web pages keep asking for the same replies, so they are cached
+ * A reply is reused for no more than ttl seconds, and not at all once an
+ *  item has been added to, or removed from, any of the stores that it was
+ *  generated from - which covers the data that's only ever replaced
+ * The others, e.g. workerstatus and userstats, are updated in place so
+ *  replies that use them only depend on the ttl */
+struct CMDCACHEDEF cmdcache_defs[] = {
+	{ CMD_HOMEPAGE,	5,	{ NULL },					0, 0, 0 },
+	{ CMD_BLOCKLIST,60,	{ &blocks_store, NULL },			0, 0, 0 },
+	{ CMD_WORKERS,	5,	{ &workers_store, NULL },			0, 0, 0 },
+	{ CMD_ALLUSERS,	30,	{ &users_store, NULL },				0, 0, 0 },
+	{ CMD_SHIFTS,	30,	{ &workmarkers_store, &markersummary_store,
+				  &payouts_store },				0, 0, 0 },
+	{ CMD_END,	0,	{ NULL },					0, 0, 0 }
+};
+
+/* The fields that are different for every web request but don't change
+ *  the reply, so aren't part of the key */
+static const char *cmdcache_ignore[] = {
+	"createby", "createcode", "createinet", "createdate", "webtime", NULL
+};
+
+/* Unlocked reads of the counters, since a change that's missed
+ *  will only be seen on the next request */
+static void cmdcache_versions(struct CMDCACHEDEF *def, int64_t *up,
+				int64_t *count)
+{
+	K_STORE *store;
+	int i;
+
+	*up = *count = 0;
+	for (i = 0; i < CMDCACHE_STORES && def->stores[i]; i++) {
+		store = *(def->stores[i]);
+		*up += store->count_up;
+		*count += store->count;
+	}
+}
+
+/* Return a copy of the cached reply for msgline, if there is one
+ * cck is set up for cmdcache_add() to cache the reply if there isn't,
+ *  and the caller must free cck->key */
+char *cmdcache_find(MSGLINE *msgline, CMDCACHE_KEY *cck)
+{
+	CMDCACHE lookcmdcache, *cmdcache;
+	K_ITEM look, *cc_item, *t_item;
+	K_TREE_CTX ctx[1];
+	TRANSFER *transfer;
+	char tmp[64], *ans = NULL;
+	size_t len, off;
+	int i, j;
+
+	cck->def = NULL;
+	cck->key = NULL;
+	if (!msgline->trf_root)
+		return NULL;
+
+	for (i = 0; cmdcache_defs[i].cmd_val != CMD_END; i++) {
+		if (cmdcache_defs[i].cmd_val ==
+		    ckdb_cmds[msgline->which_cmds].cmd_val)
+			break;
+	}
+	if (cmdcache_defs[i].cmd_val == CMD_END || cmdcache_defs[i].ttl <= 0)
+		return NULL;
+	cck->def = &(cmdcache_defs[i]);
+
+	/* The key is the cmd then each name and value, all with their
+	 *  length so that no two different requests can have the same key
+	 * The trf_root is in name order */
+	APPEND_REALLOC_INIT(cck->key, off, len);
+	APPEND_REALLOC(cck->key, off, len, msgline->cmd);
+	t_item = first_in_ktree_nolock(msgline->trf_root, ctx);
+	while (t_item) {
+		DATA_TRANSFER(transfer, t_item);
+		for (j = 0; cmdcache_ignore[j]; j++) {
+			if (strcmp(transfer->name, cmdcache_ignore[j]) == 0)
+				break;
+		}
+		if (!cmdcache_ignore[j]) {
+			snprintf(tmp, sizeof(tmp), "%c%d:",
+				 FLDSEP, (int)strlen(transfer->name));
+			APPEND_REALLOC(cck->key, off, len, tmp);
+			APPEND_REALLOC(cck->key, off, len, transfer->name);
+			snprintf(tmp, sizeof(tmp), "%c%d:",
+				 FLDSEP, (int)strlen(transfer_data(t_item)));
+			APPEND_REALLOC(cck->key, off, len, tmp);
+			APPEND_REALLOC(cck->key, off, len, transfer_data(t_item));
+		}
+		t_item = next_in_ktree_nolock(ctx);
+	}
+
+	// Before the command runs, so changes while it's running aren't missed
+	cmdcache_versions(cck->def, &(cck->version_up), &(cck->version_count));
+
+	lookcmdcache.key = cck->key;
+	INIT_CMDCACHE(&look);
+	look.data = (void *)(&lookcmdcache);
+	K_WLOCK(cmdcache_free);
+	cc_item = find_in_ktree(cmdcache_root, &look, ctx);
+	if (cc_item) {
+		DATA_CMDCACHE(cmdcache, cc_item);
+		if (cmdcache->expires <= time(NULL) ||
+		    cmdcache->version_up != cck->version_up ||
+		    cmdcache->version_count != cck->version_count) {
+			remove_from_ktree(cmdcache_root, cc_item);
+			k_unlink_item(cmdcache_store, cc_item);
+			free_cmdcache_data(cc_item);
+			k_add_head(cmdcache_free, cc_item);
+			cck->def->expired++;
+			cc_item = NULL;
+		} else {
+			ans = strdup(cmdcache->ans);
+			if (!ans)
+				quithere(1, "strdup OOM");
+			cck->def->hits++;
+		}
+	}
+	if (!cc_item)
+		cck->def->misses++;
+	K_WUNLOCK(cmdcache_free);
+	return ans;
+}
+
+// Requires K_WLOCK(cmdcache_free)
+static void cmdcache_expire(time_t now)
+{
+	CMDCACHE *cmdcache;
+	K_ITEM *cc_item, *next;
+
+	cc_item = STORE_HEAD_NOLOCK(cmdcache_store);
+	while (cc_item) {
+		next = cc_item->next;
+		DATA_CMDCACHE(cmdcache, cc_item);
+		if (cmdcache->expires <= now) {
+			remove_from_ktree(cmdcache_root, cc_item);
+			k_unlink_item(cmdcache_store, cc_item);
+			free_cmdcache_data(cc_item);
+			k_add_head(cmdcache_free, cc_item);
+		}
+		cc_item = next;
+	}
+}
+
+// Cache ans if cmdcache_find() was looking for it, and it's not an error
+void cmdcache_add(CMDCACHE_KEY *cck, char *ans)
+{
+	CMDCACHE *cmdcache;
+	K_ITEM *cc_item, *old_item;
+	K_TREE_CTX ctx[1];
+	time_t now;
+
+	if (!cck->def || !cck->key || !ans || strncmp(ans, "ok.", 3) != 0)
+		return;
+
+	now = time(NULL);
+	K_WLOCK(cmdcache_free);
+	cc_item = k_unlink_head(cmdcache_free);
+	if (!cc_item) {
+		// Only clear out the expired ones when it's full
+		cmdcache_expire(now);
+		cc_item = k_unlink_head(cmdcache_free);
+	}
+	if (cc_item) {
+		DATA_CMDCACHE(cmdcache, cc_item);
+		cmdcache->key = cck->key;
+		cck->key = NULL;
+		LIST_MEM_ADD(cmdcache_free, cmdcache->key);
+		cmdcache->ans = strdup(ans);
+		if (!cmdcache->ans)
+			quithere(1, "strdup OOM");
+		LIST_MEM_ADD(cmdcache_free, cmdcache->ans);
+		cmdcache->expires = now + cck->def->ttl;
+		cmdcache->version_up = cck->version_up;
+		cmdcache->version_count = cck->version_count;
+		// Another request may have already replaced it
+		old_item = find_in_ktree(cmdcache_root, cc_item, ctx);
+		if (old_item) {
+			remove_from_ktree(cmdcache_root, old_item);
+			k_unlink_item(cmdcache_store, old_item);
+			free_cmdcache_data(old_item);
+			k_add_head(cmdcache_free, old_item);
+		}
+		add_to_ktree(cmdcache_root, cc_item);
+		k_add_head(cmdcache_store, cc_item);
+	}
+	K_WUNLOCK(cmdcache_free);
+}
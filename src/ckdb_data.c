@@ -32,10 +32,16 @@ void free_msgline_data(K_ITEM *item, bool t_lock, bool t_cull)
 		if (t_lock)
 			K_WLOCK(transfer_free);
 		k_list_transfer_to_head(msgline->trf_store, transfer_free);
-		if (t_cull) {
-			if (transfer_free->count == transfer_free->total &&
-			    transfer_free->total >= ALLOC_TRANSFER * CULL_TRANSFER)
+		if (t_cull && transfer_free->total >= ALLOC_TRANSFER * CULL_TRANSFER) {
+			if (transfer_free->count == transfer_free->total)
 				k_cull_list(transfer_free);
+			/* All free but some are in the thread magazines,
+			 *  so have them returned to allow the cull */
+			else if (transfer_free->count +
+				 __atomic_load_n(&(transfer_free->mag_count),
+						 __ATOMIC_RELAXED) ==
+				 transfer_free->total)
+				transfer_free->mag_drain = true;
 		}
 		if (t_lock)
 			K_WUNLOCK(transfer_free);
@@ -78,8 +84,8 @@ void free_sharesummary_data(K_ITEM *item)
 	SHARESUMMARY *sharesummary;
 
 	DATA_SHARESUMMARY(sharesummary, item);
-	LIST_MEM_SUB(sharesummary_free, sharesummary->workername);
-	FREENULL(sharesummary->workername);
+	// Interned
+	sharesummary->workername = NULL;
 	SET_CREATEBY(sharesummary_free, sharesummary->createby, EMPTY);
 	SET_CREATECODE(sharesummary_free, sharesummary->createcode, EMPTY);
 	SET_CREATEINET(sharesummary_free, sharesummary->createinet, EMPTY);
@@ -102,8 +108,8 @@ void free_markersummary_data(K_ITEM *item)
 	MARKERSUMMARY *markersummary;
 
 	DATA_MARKERSUMMARY(markersummary, item);
-	LIST_MEM_SUB(markersummary_free, markersummary->workername);
-	FREENULL(markersummary->workername);
+	// Interned
+	markersummary->workername = NULL;
 	SET_CREATEBY(markersummary_free, markersummary->createby, EMPTY);
 	SET_CREATECODE(markersummary_free, markersummary->createcode, EMPTY);
 	SET_CREATEINET(markersummary_free, markersummary->createinet, EMPTY);
@@ -136,6 +142,26 @@ void free_marks_data(K_ITEM *item)
 	FREENULL(marks->extra);
 }
 
+void free_cmdcache_data(K_ITEM *item)
+{
+	CMDCACHE *cmdcache;
+
+	DATA_CMDCACHE(cmdcache, item);
+	LIST_MEM_SUB(cmdcache_free, cmdcache->key);
+	FREENULL(cmdcache->key);
+	LIST_MEM_SUB(cmdcache_free, cmdcache->ans);
+	FREENULL(cmdcache->ans);
+}
+
+void free_intern_data(K_ITEM *item)
+{
+	INTERN *intern;
+
+	DATA_INTERN(intern, item);
+	LIST_MEM_SUB(intern_free, intern->name);
+	FREENULL(intern->name);
+}
+
 void _free_seqset_data(K_ITEM *item)
 {
 	K_STORE *reload_lost;
@@ -680,6 +706,95 @@ cmp_t cmp_transfer(K_ITEM *a, K_ITEM *b)
 	return CMP_STR(ta->name, tb->name);
 }
 
+// order by key asc
+cmp_t cmp_cmdcache(K_ITEM *a, K_ITEM *b)
+{
+	CMDCACHE *ca, *cb;
+	DATA_CMDCACHE(ca, a);
+	DATA_CMDCACHE(cb, b);
+	return CMP_STR(ca->key, cb->key);
+}
+
+// order by name asc
+cmp_t cmp_intern(K_ITEM *a, K_ITEM *b)
+{
+	INTERN *ia, *ib;
+	DATA_INTERN(ia, a);
+	DATA_INTERN(ib, b);
+	return CMP_STR(ia->name, ib->name);
+}
+
+/* Return the shared copy of name, adding it if it's new
+ * EMPTY is returned for an empty name, the same as DUP_POINTER() */
+char *intern_name(char *name)
+{
+	INTERN lookintern, *intern;
+	K_ITEM look, *i_item;
+	K_TREE_CTX ctx[1];
+
+	if (!name || !*name)
+		return EMPTY;
+
+	lookintern.name = name;
+	INIT_INTERN(&look);
+	look.data = (void *)(&lookintern);
+	K_RLOCK(intern_free);
+	i_item = find_in_ktree(intern_root, &look, ctx);
+	K_RUNLOCK(intern_free);
+	if (!i_item) {
+		K_WLOCK(intern_free);
+		// It may have been added since the RLOCK
+		i_item = find_in_ktree(intern_root, &look, ctx);
+		if (!i_item) {
+			i_item = k_unlink_head(intern_free);
+			DATA_INTERN(intern, i_item);
+			intern->name = strdup(name);
+			if (!intern->name)
+				quithere(1, "strdup OOM");
+			LIST_MEM_ADD(intern_free, intern->name);
+			add_to_ktree(intern_root, i_item);
+			k_add_head(intern_store, i_item);
+		}
+		K_WUNLOCK(intern_free);
+	}
+	// Items are never removed, so it's safe without the lock
+	DATA_INTERN(intern, i_item);
+	return intern->name;
+}
+
+/* Copy the data of every item in tree, in tree order, into one malloc'd
+ *  array so that a long reply can be built from the copy after the list
+ *  lock is released, rather than holding up the writers while formatting
+ *  e.g. cmd_blocklist used to hold blocks_free for the whole page
+ * The caller must hold the tree's list lock and free() the result
+ * store is the tree items' store and bounds the count
+ * Any pointers in the copies still belong to the items in the tree, so
+ *  only the fixed size fields can be used from the copy */
+void *snapshot_ktree(K_TREE *tree, K_STORE *store, int *count)
+{
+	K_TREE_CTX ctx[1];
+	K_ITEM *item;
+	size_t siz;
+	char *snap;
+	int n;
+
+	siz = tree->master->siz;
+	*count = 0;
+	if (store->count < 1)
+		return NULL;
+	snap = malloc(siz * store->count);
+	if (!snap)
+		quithere(1, "malloc (%d*%d) OOM", store->count, (int)siz);
+	n = 0;
+	item = first_in_ktree(tree, ctx);
+	while (item && n < store->count) {
+		memcpy(snap + siz * n++, item->data, siz);
+		item = next_in_ktree(ctx);
+	}
+	*count = n;
+	return (void *)snap;
+}
+
 K_ITEM *find_transfer(K_TREE *trf_root, char *name)
 {
 	TRANSFER transfer;
@@ -1025,6 +1140,8 @@ void _workerstatus_update(AUTHS *auths, SHARES *shares,
 	}
 
 	if (startup_complete && shares) {
+		// Every plworker updates the pool totals
+		K_WLOCK(workerstatus_free);
 		if (shares->errn == SE_NONE) {
 			pool.diffacc += shares->diff;
 			pool.shareacc++;
@@ -1032,6 +1149,7 @@ void _workerstatus_update(AUTHS *auths, SHARES *shares,
 			pool.diffinv += shares->diff;
 			pool.shareinv++;
 		}
+		K_WUNLOCK(workerstatus_free);
 		item = find_create_workerstatus(false, true, shares->userid,
 						shares->workername, false,
 						file, func, line);
@@ -2352,7 +2470,7 @@ cmp_t cmp_sharesummary(K_ITEM *a, K_ITEM *b)
 	DATA_SHARESUMMARY(sb, b);
 	cmp_t c = CMP_BIGINT(sa->userid, sb->userid);
 	if (c == 0) {
-		c = CMP_STR(sa->workername, sb->workername);
+		c = CMP_NAME(sa->workername, sb->workername);
 		if (c == 0)
 			c = CMP_BIGINT(sa->workinfoid, sb->workinfoid);
 	}
@@ -2369,7 +2487,7 @@ cmp_t cmp_sharesummary_workinfoid(K_ITEM *a, K_ITEM *b)
 	if (c == 0) {
 		c = CMP_BIGINT(sa->userid, sb->userid);
 		if (c == 0)
-			c = CMP_STR(sa->workername, sb->workername);
+			c = CMP_NAME(sa->workername, sb->workername);
 	}
 	return c;
 }
@@ -3343,6 +3461,351 @@ void upd_add_mu(K_TREE *mu_root, K_STORE *mu_store, int64_t userid,
 	}
 }
 
+/* The PPLNS index for cmd_pplns()
+ * cmd_pplns() used to walk back through every markersummary of every
+ *  workmarker in the window each time it was called, which is most of the
+ *  work for the web pplns pages
+ * Instead keep the CURRENT processed workmarkers in workinfoidend order, with
+ *  running totals of their (int64_t) diffacc, so the start of the window is
+ *  a binary search, and the (int64_t) diffacc of each user in the same order,
+ *  so each user's share of the window is also a binary search
+ * cmd_pplns() truncates each row's diffacc before adding it, so the running
+ *  totals give exactly the same answer as the walk
+ * It's rebuilt when it's first needed after the workmarkers or
+ *  markersummary stores change, which is only when markers are processed
+ *  or expired
+ * process_pplns() still does it's own walk, since that's once per block and
+ *  must add the full double diffacc in the same order as always */
+struct pplns_wm {
+	int64_t markerid;
+	int64_t workinfoidstart;
+	int64_t workinfoidend;
+	int64_t rows;
+	int64_t diffacc;
+	int64_t sharecount;
+	int64_t shareacc;
+	tv_t lastshareacc;
+	// running totals up to and including this workmarker
+	int64_t cum_rows;
+	int64_t cum_diffacc;
+	int64_t cum_sharecount;
+	int64_t cum_shareacc;
+	// the highest workmarker <= this one to stop before, or -1
+	int lastfive;
+};
+
+struct pplns_mu {
+	int64_t userid;
+	int wm;
+	int64_t diffacc;	// running total for the userid
+};
+
+struct pplns_user {
+	int64_t userid;
+	int first;
+	int count;
+	int lastwm;
+};
+
+mutex_t pplns_index_lock;
+
+static struct pplns_wm *pplns_wms;
+static struct pplns_mu *pplns_mus;
+static struct pplns_user *pplns_users;
+static int pplns_wm_count, pplns_mu_count, pplns_user_count;
+static int pplns_wm_siz, pplns_mu_siz, pplns_user_siz;
+static int *pplns_byid;
+static int pplns_byid_siz;
+static int pplns_wm_up = -1, pplns_wm_stored = -1;
+static int pplns_ms_up = -1, pplns_ms_stored = -1;
+
+#define PPLNS_GROW(_ptr, _siz, _need) do { \
+		if ((_need) > (_siz)) { \
+			(_siz) = (_siz) ? (_siz) * 2 : 1024; \
+			if ((_need) > (_siz)) \
+				(_siz) = (_need); \
+			(_ptr) = realloc((_ptr), sizeof(*(_ptr)) * (_siz)); \
+			if (!(_ptr)) \
+				quithere(1, "realloc (%d) OOM", \
+					 (int)(sizeof(*(_ptr)) * (_siz))); \
+		} \
+	} while (0)
+
+static int cmp_pplns_byid(const void *a, const void *b)
+{
+	int64_t ma = pplns_wms[*(const int *)a].markerid;
+	int64_t mb = pplns_wms[*(const int *)b].markerid;
+
+	return (ma > mb) - (ma < mb);
+}
+
+static int cmp_pplns_mu(const void *a, const void *b)
+{
+	const struct pplns_mu *ma = a, *mb = b;
+
+	if (ma->userid != mb->userid)
+		return (ma->userid > mb->userid) - (ma->userid < mb->userid);
+	return ma->wm - mb->wm;
+}
+
+// The pplns_wms index of markerid, or -1 if it's not in the index
+static int pplns_find_markerid(int64_t markerid)
+{
+	int lo = 0, hi = pplns_wm_count - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (pplns_wms[pplns_byid[mid]].markerid == markerid)
+			return pplns_byid[mid];
+		if (pplns_wms[pplns_byid[mid]].markerid < markerid)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+/* Requires K_RLOCK(workmarkers_free), K_RLOCK(markersummary_free)
+ *  and pplns_index_lock */
+static void pplns_index_build()
+{
+	WORKMARKERS lookworkmarkers, *workmarkers;
+	MARKERSUMMARY *markersummary;
+	K_ITEM wm_look, *wm_item, *ms_item;
+	K_TREE_CTX ctx[1];
+	struct pplns_wm *wm, *prev;
+	struct pplns_mu *mu;
+	int64_t lastmarkerid = -1;
+	int i, last = -1;
+	tv_t stt, fin;
+
+	setnow(&stt);
+	pplns_wm_count = pplns_mu_count = pplns_user_count = 0;
+
+	// The CURRENT workmarkers are all at the end of the tree
+	lookworkmarkers.expirydate.tv_sec = default_expiry.tv_sec;
+	lookworkmarkers.expirydate.tv_usec = default_expiry.tv_usec;
+	lookworkmarkers.workinfoidend = -1;
+	INIT_WORKMARKERS(&wm_look);
+	wm_look.data = (void *)(&lookworkmarkers);
+	wm_item = find_after_in_ktree(workmarkers_workinfoid_root, &wm_look, ctx);
+	DATA_WORKMARKERS_NULL(workmarkers, wm_item);
+	while (wm_item && CURRENT(&(workmarkers->expirydate))) {
+		if (WMPROCESSED(workmarkers->status)) {
+			PPLNS_GROW(pplns_wms, pplns_wm_siz, pplns_wm_count + 1);
+			wm = &(pplns_wms[pplns_wm_count++]);
+			bzero(wm, sizeof(*wm));
+			wm->markerid = workmarkers->markerid;
+			wm->workinfoidstart = workmarkers->workinfoidstart;
+			wm->workinfoidend = workmarkers->workinfoidend;
+		}
+		wm_item = next_in_ktree(ctx);
+		DATA_WORKMARKERS_NULL(workmarkers, wm_item);
+	}
+
+	PPLNS_GROW(pplns_byid, pplns_byid_siz, pplns_wm_count);
+	for (i = 0; i < pplns_wm_count; i++)
+		pplns_byid[i] = i;
+	qsort(pplns_byid, pplns_wm_count, sizeof(*pplns_byid), cmp_pplns_byid);
+
+	/* markersummaries are in markerid,userid order so all of a user's
+	 *  rows in a markerid are together */
+	ms_item = first_in_ktree(markersummary_root, ctx);
+	DATA_MARKERSUMMARY_NULL(markersummary, ms_item);
+	while (ms_item) {
+		if (markersummary->markerid != lastmarkerid) {
+			lastmarkerid = markersummary->markerid;
+			last = pplns_find_markerid(lastmarkerid);
+		}
+		if (last >= 0) {
+			wm = &(pplns_wms[last]);
+			wm->rows++;
+			wm->diffacc += (int64_t)(markersummary->diffacc);
+			wm->sharecount += markersummary->sharecount;
+			wm->shareacc += markersummary->shareacc;
+			if (tv_newer(&(wm->lastshareacc), &(markersummary->lastshareacc)))
+				copy_tv(&(wm->lastshareacc), &(markersummary->lastshareacc));
+			if (pplns_mu_count > 0 &&
+			    pplns_mus[pplns_mu_count-1].wm == last &&
+			    pplns_mus[pplns_mu_count-1].userid == markersummary->userid) {
+				pplns_mus[pplns_mu_count-1].diffacc +=
+					(int64_t)(markersummary->diffacc);
+			} else {
+				PPLNS_GROW(pplns_mus, pplns_mu_siz, pplns_mu_count + 1);
+				mu = &(pplns_mus[pplns_mu_count++]);
+				mu->userid = markersummary->userid;
+				mu->wm = last;
+				mu->diffacc = (int64_t)(markersummary->diffacc);
+			}
+		}
+		ms_item = next_in_ktree(ctx);
+		DATA_MARKERSUMMARY_NULL(markersummary, ms_item);
+	}
+
+	prev = NULL;
+	for (i = 0; i < pplns_wm_count; i++) {
+		wm = &(pplns_wms[i]);
+		wm->cum_rows = wm->rows;
+		wm->cum_diffacc = wm->diffacc;
+		wm->cum_sharecount = wm->sharecount;
+		wm->cum_shareacc = wm->shareacc;
+		wm->lastfive = -1;
+		if (prev) {
+			wm->cum_rows += prev->cum_rows;
+			wm->cum_diffacc += prev->cum_diffacc;
+			wm->cum_sharecount += prev->cum_sharecount;
+			wm->cum_shareacc += prev->cum_shareacc;
+			wm->lastfive = prev->lastfive;
+		}
+		if (wm->workinfoidstart <= FIVExWID)
+			wm->lastfive = i;
+		prev = wm;
+	}
+
+	qsort(pplns_mus, pplns_mu_count, sizeof(*pplns_mus), cmp_pplns_mu);
+	for (i = 0; i < pplns_mu_count; i++) {
+		mu = &(pplns_mus[i]);
+		if (pplns_user_count > 0 &&
+		    pplns_users[pplns_user_count-1].userid == mu->userid) {
+			mu->diffacc += pplns_mus[i-1].diffacc;
+			pplns_users[pplns_user_count-1].count++;
+			pplns_users[pplns_user_count-1].lastwm = mu->wm;
+		} else {
+			PPLNS_GROW(pplns_users, pplns_user_siz, pplns_user_count + 1);
+			pplns_users[pplns_user_count].userid = mu->userid;
+			pplns_users[pplns_user_count].first = i;
+			pplns_users[pplns_user_count].count = 1;
+			pplns_users[pplns_user_count].lastwm = mu->wm;
+			pplns_user_count++;
+		}
+	}
+
+	pplns_wm_up = workmarkers_store->count_up;
+	pplns_wm_stored = workmarkers_store->count;
+	pplns_ms_up = markersummary_store->count_up;
+	pplns_ms_stored = markersummary_store->count;
+
+	setnow(&fin);
+	LOGDEBUG("%s() wm %d ms %d users %d in %.3fs",
+		 __func__, pplns_wm_count, pplns_mu_count, pplns_user_count,
+		 tvdiff(&fin, &stt));
+}
+
+// The first of a user's entries with wm >= from
+static int pplns_user_from(struct pplns_user *user, int from)
+{
+	int lo = user->first, hi = user->first + user->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pplns_mus[mid].wm < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Sum of the field over workmarkers [_from,_to]
+#define PPLNS_SUM(_from, _to, _field) (pplns_wms[_to]._field - \
+		((_from) > 0 ? pplns_wms[(_from)-1]._field : 0))
+
+/* Add the CURRENT processed workmarkers before before_workinfoid to the
+ *  pplns totals, newest first, until total_diff reaches diff_want,
+ *  the same as walking back through the markersummaries,
+ *  adding the (int64_t) diffacc of each
+ * begin_workinfoid is set to the start of the oldest workmarker with rows,
+ *  and end_workinfoid the end of the newest if it's zero
+ * Requires K_WLOCK(miningpayouts_free), for upd_add_mu(),
+ *  K_RLOCK(workmarkers_free) and K_RLOCK(markersummary_free) */
+void pplns_index_add(K_TREE *mu_root, K_STORE *mu_store,
+		     int64_t before_workinfoid, bool countbacklimit,
+		     double diff_want, double *total_diff,
+		     int64_t *total_share_count, int64_t *acc_share_count,
+		     int64_t *begin_workinfoid, int64_t *end_workinfoid,
+		     tv_t *end_tv, int64_t *wm_count, int64_t *ms_count)
+{
+	struct pplns_user *user;
+	int lo, hi, mid, low, top, from, to, i, j;
+	int64_t diffacc;
+
+	mutex_lock(&pplns_index_lock);
+	if (pplns_wm_up != workmarkers_store->count_up ||
+	    pplns_wm_stored != workmarkers_store->count ||
+	    pplns_ms_up != markersummary_store->count_up ||
+	    pplns_ms_stored != markersummary_store->count)
+		pplns_index_build();
+
+	// top = the last workmarker with workinfoidend < before_workinfoid
+	lo = 0;
+	hi = pplns_wm_count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pplns_wms[mid].workinfoidend < before_workinfoid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	top = lo - 1;
+	if (top < 0)
+		goto out;
+
+	// Stop before FIVExWID if necessary
+	if (countbacklimit)
+		low = pplns_wms[top].lastfive + 1;
+	else
+		low = 0;
+	if (low > top)
+		goto out;
+
+	/* from = the newest workmarker that reaches diff_want, or low if none
+	 *  do, since the walk stops once it has reached it */
+	lo = low;
+	hi = top;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (*total_diff + PPLNS_SUM(mid, top, cum_diffacc) >= diff_want)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	from = lo;
+	if (*total_diff + PPLNS_SUM(from, top, cum_diffacc) < diff_want)
+		from = low;
+
+	*wm_count += top - from + 1;
+	*ms_count += PPLNS_SUM(from, top, cum_rows);
+	*total_share_count += PPLNS_SUM(from, top, cum_sharecount);
+	*acc_share_count += PPLNS_SUM(from, top, cum_shareacc);
+	*total_diff += PPLNS_SUM(from, top, cum_diffacc);
+
+	for (i = top; i >= from; i--) {
+		if (pplns_wms[i].rows) {
+			if (*end_workinfoid == 0)
+				*end_workinfoid = pplns_wms[i].workinfoidend;
+			*begin_workinfoid = pplns_wms[i].workinfoidstart;
+			if (tv_newer(end_tv, &(pplns_wms[i].lastshareacc)))
+				copy_tv(end_tv, &(pplns_wms[i].lastshareacc));
+		}
+	}
+
+	for (i = 0; i < pplns_user_count; i++) {
+		user = &(pplns_users[i]);
+		if (user->lastwm < from)
+			continue;
+		j = pplns_user_from(user, from);
+		if (pplns_mus[j].wm > top)
+			continue;
+		to = pplns_user_from(user, top + 1) - 1;
+		diffacc = pplns_mus[to].diffacc;
+		if (j > user->first)
+			diffacc -= pplns_mus[j-1].diffacc;
+		upd_add_mu(mu_root, mu_store, user->userid, diffacc);
+	}
+out:
+	mutex_unlock(&pplns_index_lock);
+}
+
 // order by height asc,blockhash asc,expirydate asc
 cmp_t cmp_payouts(K_ITEM *a, K_ITEM *b)
 {
@@ -4132,12 +4595,17 @@ bool process_pplns(int32_t height, char *blockhash, tv_t *addr_cd)
 		else
 			miningpayouts->amount = used;
 
-		ok = miningpayouts_add(conn, true, mu_item,
-					&(miningpayouts->old_item),
-					(char *)by_default, (char *)__func__,
-					(char *)inet_default, &now, NULL, begun);
-		if (!ok)
-			goto shazbot;
+		// With copy_batch they are all copied after the payments
+		if (copy_batch == 0) {
+			ok = miningpayouts_add(conn, true, mu_item,
+						&(miningpayouts->old_item),
+						(char *)by_default,
+						(char *)__func__,
+						(char *)inet_default, &now,
+						NULL, begun);
+			if (!ok)
+				goto shazbot;
+		}
 
 		if (addr_store->count) {
 			K_WLOCK(paymentaddresses_free);
@@ -4149,6 +4617,14 @@ bool process_pplns(int32_t height, char *blockhash, tv_t *addr_cd)
 		mu_item = next_in_ktree_nolock(mu_ctx);
 	}
 
+	if (copy_batch > 0) {
+		ok = miningpayouts_copy(conn, mu_root, (char *)by_default,
+					(char *)__func__, (char *)inet_default,
+					&now, NULL);
+		if (!ok)
+			goto shazbot;
+	}
+
 	// begun is true
 	CKPQEnd(conn, begun);
 
@@ -4377,7 +4853,7 @@ cmp_t cmp_markersummary(K_ITEM *a, K_ITEM *b)
 	if (c == 0) {
 		c = CMP_BIGINT(ma->userid, mb->userid);
 		if (c == 0)
-			c = CMP_STR(ma->workername, mb->workername);
+			c = CMP_NAME(ma->workername, mb->workername);
 	}
 	return c;
 }
@@ -4390,7 +4866,7 @@ cmp_t cmp_markersummary_userid(K_ITEM *a, K_ITEM *b)
 	DATA_MARKERSUMMARY(mb, b);
 	cmp_t c = CMP_BIGINT(ma->userid, mb->userid);
 	if (c == 0) {
-		c = CMP_STR(ma->workername, mb->workername);
+		c = CMP_NAME(ma->workername, mb->workername);
 		if (c == 0)
 			c = CMP_TV(ma->lastshare, mb->lastshare);
 	}
@@ -212,14 +212,24 @@ char *pqerrmsg(PGconn *conn)
 #undef PQexec
 #undef PQexecParams
 
+/* The time this thread has spent waiting for the DB, so that the cmd times
+ *  can be split into the DB and in RAM processing */
+__thread int64_t cmd_db_ns;
+
 // Bug check to ensure no unexpected write txns occur
 PGresult *_CKPQexec(PGconn *conn, const char *qry, bool isread, WHERE_FFL_ARGS)
 {
+	PGresult *res;
+	int64_t start;
+
 	// It would slow it down, but could check qry for insert/update/...
 	if (!isread && confirm_sharesummary)
 		quitfrom(1, file, func, line, "BUG: write txn during confirm");
 
-	return PQexec(conn, qry);
+	start = monotonic_ns();
+	res = PQexec(conn, qry);
+	cmd_db_ns += monotonic_ns() - start;
+	return res;
 }
 
 PGresult *_CKPQexecParams(PGconn *conn, const char *qry,
@@ -231,12 +241,146 @@ PGresult *_CKPQexecParams(PGconn *conn, const char *qry,
 			  int resultFormat,
 			  bool isread, WHERE_FFL_ARGS)
 {
+	PGresult *res;
+	int64_t start;
+
 	// It would slow it down, but could check qry for insert/update/...
 	if (!isread && confirm_sharesummary)
 		quitfrom(1, file, func, line, "BUG: write txn during confirm");
 
-	return PQexecParams(conn, qry, nParams, paramTypes, paramValues, paramLengths,
-			    paramFormats, resultFormat);
+	start = monotonic_ns();
+	res = PQexecParams(conn, qry, nParams, paramTypes, paramValues,
+			   paramLengths, paramFormats, resultFormat);
+	cmd_db_ns += monotonic_ns() - start;
+	return res;
+}
+
+/* The prepared statements each connection has, as a bitmap of their ids
+ *  All connections come from dbconnect() and go via CKPQfinish */
+typedef struct ckpqconn {
+	UT_hash_handle hh;
+	PGconn *conn;
+	uint64_t prepared;
+} CKPQCONN;
+
+mutex_t ckpq_lock;
+CKPQSTMT *ckpq_stmts;
+static CKPQCONN *ckpq_conns;
+static int ckpq_stmt_count;
+
+// Forget anything left by a previous connection that had the same address
+void CKPQconnected(PGconn *conn)
+{
+	CKPQCONN *pc;
+
+	mutex_lock(&ckpq_lock);
+	HASH_FIND_PTR(ckpq_conns, &conn, pc);
+	if (!pc) {
+		pc = calloc(1, sizeof(*pc));
+		if (!pc)
+			quithere(1, "calloc OOM");
+		pc->conn = conn;
+		HASH_ADD_PTR(ckpq_conns, conn, pc);
+	}
+	pc->prepared = 0;
+	mutex_unlock(&ckpq_lock);
+}
+
+#undef PQfinish
+
+void CKPQfinish(PGconn *conn)
+{
+	CKPQCONN *pc;
+
+	if (!conn)
+		return;
+
+	mutex_lock(&ckpq_lock);
+	HASH_FIND_PTR(ckpq_conns, &conn, pc);
+	if (pc)
+		HASH_DEL(ckpq_conns, pc);
+	mutex_unlock(&ckpq_lock);
+	free(pc);
+
+	PQfinish(conn);
+}
+
+#define PQfinish CKPQfinish
+
+PGresult *_CKPQexecStmt(PGconn *conn, CKPQSTMT *stmt, const char *qry,
+			int nParams, const char *const * paramValues,
+			bool isread, WHERE_FFL_ARGS)
+{
+	ExecStatusType rescode;
+	bool prepared = false;
+	int64_t start, ns;
+	CKPQCONN *pc;
+	PGresult *res;
+	uint64_t bit = 0;
+	int id;
+
+	if (!isread && confirm_sharesummary)
+		quitfrom(1, file, func, line, "BUG: write txn during confirm");
+
+	mutex_lock(&ckpq_lock);
+	if (stmt->id < 0 && ckpq_stmt_count < CKPQ_MAXSTMTS) {
+		stmt->id = ckpq_stmt_count++;
+		stmt->next = ckpq_stmts;
+		ckpq_stmts = stmt;
+	}
+	id = stmt->id;
+	if (id >= 0) {
+		bit = (uint64_t)1 << id;
+		HASH_FIND_PTR(ckpq_conns, &conn, pc);
+		if (pc)
+			prepared = (pc->prepared & bit);
+	}
+	mutex_unlock(&ckpq_lock);
+
+	start = monotonic_ns();
+	if (id < 0) {
+		res = PQexecParams(conn, qry, nParams, NULL, paramValues,
+				   NULL, NULL, 0);
+		cmd_db_ns += monotonic_ns() - start;
+		return res;
+	}
+
+	if (!prepared) {
+		res = PQprepare(conn, stmt->name, qry, nParams, NULL);
+		rescode = PQresultStatus(res);
+		PQclear(res);
+		if (!PGOK(rescode)) {
+			char *buf = pqerrmsg(conn);
+			LOGERR("%s(): Prepare %s failed (%d) '%s'" WHERE_FFL,
+				__func__, stmt->name, (int)rescode, buf,
+				WHERE_FFL_PASS);
+			free(buf);
+			// Let the caller see the error
+			res = PQexecParams(conn, qry, nParams, NULL,
+					   paramValues, NULL, NULL, 0);
+			cmd_db_ns += monotonic_ns() - start;
+			return res;
+		}
+		mutex_lock(&ckpq_lock);
+		HASH_FIND_PTR(ckpq_conns, &conn, pc);
+		if (pc)
+			pc->prepared |= bit;
+		stmt->prepares++;
+		mutex_unlock(&ckpq_lock);
+	}
+	res = PQexecPrepared(conn, stmt->name, nParams, paramValues,
+			     NULL, NULL, 0);
+	ns = monotonic_ns() - start;
+	cmd_db_ns += ns;
+
+	mutex_lock(&ckpq_lock);
+	stmt->runs++;
+	stmt->total_ns += ns;
+	if (stmt->max_ns < ns)
+		stmt->max_ns = ns;
+	mutex_unlock(&ckpq_lock);
+
+	return res;
 }
 
 #define PQexec CKPQexec
@@ -306,6 +450,180 @@ void _CKPQEnd(PGconn *conn, bool commit, WHERE_FFL_ARGS)
 	}
 }
 
+#define COPY_SIGNATURE "PGCOPY\n\377\r\n"
+#define COPY_SIGLEN 11
+// Postgres timestamps are microseconds since 2000-01-01 UTC
+#define COPY_EPOCH 946684800L
+
+static void ckcopy_need(CKCOPY *copy, size_t len)
+{
+	if (copy->len + len > copy->siz) {
+		while (copy->len + len > copy->siz)
+			copy->siz = copy->siz ? copy->siz * 2 : 65536;
+		copy->buf = realloc(copy->buf, copy->siz);
+		if (!copy->buf)
+			quithere(1, "realloc (%d) OOM", (int)(copy->siz));
+	}
+}
+
+static void ckcopy_add(CKCOPY *copy, const void *data, size_t len)
+{
+	ckcopy_need(copy, len);
+	memcpy(copy->buf + copy->len, data, len);
+	copy->len += len;
+}
+
+static void ckcopy_int16(CKCOPY *copy, int16_t val)
+{
+	uint16_t be = htobe16((uint16_t)val);
+
+	ckcopy_add(copy, &be, sizeof(be));
+}
+
+static void ckcopy_int32(CKCOPY *copy, int32_t val)
+{
+	uint32_t be = htobe32((uint32_t)val);
+
+	ckcopy_add(copy, &be, sizeof(be));
+}
+
+static void ckcopy_int64(CKCOPY *copy, int64_t val)
+{
+	uint64_t be = htobe64((uint64_t)val);
+
+	ckcopy_add(copy, &be, sizeof(be));
+}
+
+// Send what's buffered so far
+static void ckcopy_flush(CKCOPY *copy)
+{
+	if (copy->failed || copy->len == 0)
+		return;
+
+	if (PQputCopyData(copy->conn, copy->buf, (int)(copy->len)) != 1) {
+		char *buf = pqerrmsg(copy->conn);
+		LOGERR("%s(): copy %s failed after %"PRId64" rows '%s'",
+			__func__, copy->table, copy->total, buf);
+		free(buf);
+		copy->failed = true;
+	}
+	copy->len = 0;
+	copy->rows = 0;
+}
+
+/* The caller must already be in a transaction if it wants the copy
+ *  to be part of one */
+bool _ckcopy_begin(CKCOPY *copy, PGconn *conn, const char *table,
+		   const char *columns, int fields, WHERE_FFL_ARGS)
+{
+	ExecStatusType rescode;
+	PGresult *res;
+	char qry[1024];
+
+	if (confirm_sharesummary)
+		quitfrom(1, file, func, line, "BUG: write txn during confirm");
+
+	bzero(copy, sizeof(*copy));
+	copy->conn = conn;
+	copy->table = table;
+	copy->fields = fields;
+
+	snprintf(qry, sizeof(qry), "copy %s (%s) from stdin with (format binary)",
+		 table, columns);
+	res = PQexec(conn, qry, CKPQ_WRITE);
+	rescode = PQresultStatus(res);
+	PQclear(res);
+	if (rescode != PGRES_COPY_IN) {
+		char *buf = pqerrmsg(conn);
+		LOGERR("%s(): copy %s failed (%d) '%s'" WHERE_FFL,
+			__func__, table, (int)rescode, buf, WHERE_FFL_PASS);
+		free(buf);
+		return false;
+	}
+
+	// Header: signature, flags, header extension length
+	ckcopy_add(copy, COPY_SIGNATURE, COPY_SIGLEN);
+	ckcopy_int32(copy, 0);
+	ckcopy_int32(copy, 0);
+	return true;
+}
+
+void ckcopy_row(CKCOPY *copy)
+{
+	if (copy->rows >= copy_batch)
+		ckcopy_flush(copy);
+	ckcopy_int16(copy, (int16_t)(copy->fields));
+	copy->rows++;
+	copy->total++;
+}
+
+void ckcopy_bigint(CKCOPY *copy, int64_t val)
+{
+	ckcopy_int32(copy, 8);
+	ckcopy_int64(copy, val);
+}
+
+void ckcopy_double(CKCOPY *copy, double val)
+{
+	int64_t i64;
+
+	memcpy(&i64, &val, sizeof(i64));
+	ckcopy_int32(copy, 8);
+	ckcopy_int64(copy, i64);
+}
+
+void ckcopy_str(CKCOPY *copy, const char *str)
+{
+	size_t len = strlen(str);
+
+	ckcopy_int32(copy, (int32_t)len);
+	ckcopy_add(copy, str, len);
+}
+
+void ckcopy_tv(CKCOPY *copy, const tv_t *tv)
+{
+	ckcopy_int32(copy, 8);
+	ckcopy_int64(copy, ((int64_t)(tv->tv_sec) - COPY_EPOCH) * 1000000L +
+				(int64_t)(tv->tv_usec));
+}
+
+// Send the rest and check the result - the copy is always ended
+bool ckcopy_end(CKCOPY *copy)
+{
+	ExecStatusType rescode;
+	PGresult *res;
+	bool ok = false;
+
+	if (!copy->failed) {
+		// File trailer
+		ckcopy_int16(copy, -1);
+		ckcopy_flush(copy);
+	}
+	if (PQputCopyEnd(copy->conn, copy->failed ? "ckdb copy failed" : NULL) != 1) {
+		char *buf = pqerrmsg(copy->conn);
+		LOGERR("%s(): copy %s end failed '%s'", __func__, copy->table, buf);
+		free(buf);
+		copy->failed = true;
+	}
+	while ((res = PQgetResult(copy->conn))) {
+		rescode = PQresultStatus(res);
+		PQclear(res);
+		if (rescode == PGRES_COMMAND_OK)
+			ok = !copy->failed;
+		else {
+			PGLOGERR("Copy", rescode, copy->conn);
+			ok = false;
+		}
+	}
+	if (ok) {
+		LOGDEBUG("%s(): copied %"PRId64" rows to %s",
+			 __func__, copy->total, copy->table);
+	}
+	FREENULL(copy->buf);
+	copy->len = copy->siz = 0;
+	return ok;
+}
+
 int64_t nextid(PGconn *conn, char *idname, int64_t increment,
 		tv_t *cd, char *by, char *code, char *inet)
 {
@@ -1450,6 +1768,8 @@ bool workers_update(PGconn *conn, K_ITEM *item, char *difficultydefault,
 			char *idlenotificationtime, char *by, char *code,
 			char *inet, tv_t *cd, K_TREE *trf_root, bool check)
 {
+	static CKPQSTMT workers_upd_stmt = CKPQSTMT_INIT("workers_upd");
+	static CKPQSTMT workers_ins_stmt = CKPQSTMT_INIT("workers_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res;
@@ -1529,7 +1849,7 @@ bool workers_update(PGconn *conn, K_ITEM *item, char *difficultydefault,
 		goto unparam;
 	}
 
-	res = PQexecParams(conn, upd, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+	res = CKPQexecStmt(conn, &workers_upd_stmt, upd, par, (const char **)params, CKPQ_WRITE);
 	rescode = PQresultStatus(res);
 	PQclear(res);
 	if (!PGOK(rescode)) {
@@ -1556,7 +1876,7 @@ bool workers_update(PGconn *conn, K_ITEM *item, char *difficultydefault,
 	HISTORYDATEPARAMS(params, par, row);
 	PARCHK(par, params);
 
-	res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+	res = CKPQexecStmt(conn, &workers_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 	rescode = PQresultStatus(res);
 	PQclear(res);
 	if (!PGOK(rescode)) {
@@ -2106,6 +2426,8 @@ bool payments_add(PGconn *conn, bool add, K_ITEM *p_item, K_ITEM **old_p_item,
 		  char *by, char *code, char *inet, tv_t *cd, K_TREE *trf_root,
 		  bool already)
 {
+	static CKPQSTMT payments_upd_stmt = CKPQSTMT_INIT("payments_upd");
+	static CKPQSTMT payments_ins_stmt = CKPQSTMT_INIT("payments_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res;
@@ -2143,7 +2465,7 @@ bool payments_add(PGconn *conn, bool add, K_ITEM *p_item, K_ITEM **old_p_item,
 		params[par++] = tv_to_buf((tv_t *)&default_expiry, NULL, 0);
 		PARCHKVAL(par, 3, params);
 
-		res = PQexecParams(conn, upd, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &payments_upd_stmt, upd, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		PQclear(res);
 		if (!PGOK(rescode)) {
@@ -2192,7 +2514,7 @@ bool payments_add(PGconn *conn, bool add, K_ITEM *p_item, K_ITEM **old_p_item,
 			"originaltxn,amount,diffacc,committxn,commitblockhash"
 			HISTORYDATECONTROL ") values (" PQPARAM16 ")";
 
-		res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &payments_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		if (!PGOK(rescode)) {
 			PGLOGERR("Insert", rescode, conn);
@@ -2738,6 +3060,7 @@ int64_t workinfo_add(PGconn *conn, char *workinfoidstr, char *poolinstance,
 			char *code, char *inet, tv_t *cd, bool igndup,
 			K_TREE *trf_root)
 {
+	static CKPQSTMT workinfo_ins_stmt = CKPQSTMT_INIT("workinfo_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	K_TREE_CTX ctx[1];
@@ -2820,7 +3143,7 @@ int64_t workinfo_add(PGconn *conn, char *workinfoidstr, char *poolinstance,
 			conned = true;
 		}
 
-		res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &workinfo_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		if (!PGOK(rescode)) {
 			PGLOGERR("Insert", rescode, conn);
@@ -3322,9 +3645,7 @@ discard:
 		early_shares->createdate.tv_usec, cd_buf,
 		early_shares->oldcount, early_shares->redo, why);
 	FREENULL(st);
-	K_WLOCK(shares_free);
-	k_add_head(shares_free, es_item);
-	K_WUNLOCK(shares_free);
+	k_mag_add_head(shares_free, es_item);
 	return;
 }
 
@@ -3350,9 +3671,7 @@ bool shares_add(PGconn *conn, char *workinfoid, char *username, char *workername
 		 errn, cd->tv_sec, cd->tv_usec);
 	FREENULL(st);
 
-	K_WLOCK(shares_free);
-	s_item = k_unlink_head(shares_free);
-	K_WUNLOCK(shares_free);
+	s_item = k_mag_unlink_head(shares_free);
 
 	DATA_SHARES(shares, s_item);
 	bzero(shares, sizeof(*shares));
@@ -3441,9 +3760,7 @@ bool shares_add(PGconn *conn, char *workinfoid, char *username, char *workername
 	}
 
 tisbad:
-	K_WLOCK(shares_free);
-	k_add_head(shares_free, s_item);
-	K_WUNLOCK(shares_free);
+	k_mag_add_head(shares_free, s_item);
 	return false;
 }
 
@@ -3777,6 +4094,116 @@ static void markersummary_to_pool(MARKERSUMMARY *p_row, MARKERSUMMARY *row)
 	}
 }
 
+// Sharesummaries moved out of the store per sharesummary lock
+#define SS_TO_MS_BATCH 1024
+
+// One parallel part of sharesummaries_to_markersummaries()
+struct ss_to_ms_job {
+	WORKMARKERS *workmarkers;
+	K_ITEM **ss_items;
+	int ss_count;
+	K_STORE *ms_store;
+	K_TREE *ms_root;
+	int64_t diffacc;
+	int64_t shareacc;
+	pthread_t pt;
+};
+
+/* One of the parallel parts of sharesummaries_to_markersummaries()
+ * Summarise its sharesummaries into its own markersummaries
+ * The sharesummaries are no longer in sharesummary_store, and every
+ *  sharesummary of a markersummary is in the same job, so the only lock
+ *  needed is to get new markersummary items */
+static void *ss_to_ms_job(void *arg)
+{
+	// shorter name for log messages
+	static const char *shortname = "SS_to_MS";
+	struct ss_to_ms_job *job = (struct ss_to_ms_job *)arg;
+	WORKMARKERS *workmarkers = job->workmarkers;
+	MARKERSUMMARY *markersummary = NULL, lookmarkersummary;
+	SHARESUMMARY *sharesummary;
+	K_ITEM *ss_item, *ms_item = NULL, ms_look;
+	K_TREE_CTX ms_ctx[1];
+	char *st = NULL;
+	int n;
+
+	INIT_MARKERSUMMARY(&ms_look);
+	for (n = 0; n < job->ss_count; n++) {
+		ss_item = job->ss_items[n];
+		DATA_SHARESUMMARY(sharesummary, ss_item);
+
+		// Find/create the markersummary only once per worker change
+		if (!ms_item || markersummary->userid != sharesummary->userid ||
+		    strcmp(markersummary->workername, sharesummary->workername) != 0) {
+			lookmarkersummary.markerid = workmarkers->markerid;
+			lookmarkersummary.userid = sharesummary->userid;
+			lookmarkersummary.workername = sharesummary->workername;
+
+			ms_look.data = (void *)(&lookmarkersummary);
+			ms_item = find_in_ktree_nolock(job->ms_root, &ms_look, ms_ctx);
+			if (!ms_item) {
+				K_WLOCK(markersummary_free);
+				ms_item = k_unlink_head(markersummary_free);
+				K_WUNLOCK(markersummary_free);
+				k_add_head_nolock(job->ms_store, ms_item);
+				DATA_MARKERSUMMARY(markersummary, ms_item);
+				bzero(markersummary, sizeof(*markersummary));
+				markersummary->markerid = workmarkers->markerid;
+				markersummary->userid = sharesummary->userid;
+				// Both interned
+				markersummary->workername = sharesummary->workername;
+				add_to_ktree_nolock(job->ms_root, ms_item);
+
+				LOGDEBUG("%s() new ms %"PRId64"/%"PRId64"/%s",
+					 shortname, markersummary->markerid,
+					 markersummary->userid,
+					 st = safe_text(markersummary->workername));
+				FREENULL(st);
+			} else {
+				DATA_MARKERSUMMARY(markersummary, ms_item);
+			}
+		}
+		markersummary->diffacc += sharesummary->diffacc;
+		markersummary->diffsta += sharesummary->diffsta;
+		markersummary->diffdup += sharesummary->diffdup;
+		markersummary->diffhi += sharesummary->diffhi;
+		markersummary->diffrej += sharesummary->diffrej;
+		markersummary->shareacc += sharesummary->shareacc;
+		markersummary->sharesta += sharesummary->sharesta;
+		markersummary->sharedup += sharesummary->sharedup;
+		markersummary->sharehi += sharesummary->sharehi;
+		markersummary->sharerej += sharesummary->sharerej;
+		markersummary->sharecount += sharesummary->sharecount;
+		markersummary->errorcount += sharesummary->errorcount;
+		if (!markersummary->firstshare.tv_sec ||
+		     !tv_newer(&(markersummary->firstshare), &(sharesummary->firstshare))) {
+			copy_tv(&(markersummary->firstshare), &(sharesummary->firstshare));
+		}
+		if (tv_newer(&(markersummary->lastshare), &(sharesummary->lastshare)))
+			copy_tv(&(markersummary->lastshare), &(sharesummary->lastshare));
+		if (sharesummary->diffacc > 0) {
+			if (!markersummary->firstshareacc.tv_sec ||
+			     !tv_newer(&(markersummary->firstshareacc), &(sharesummary->firstshareacc))) {
+				copy_tv(&(markersummary->firstshareacc), &(sharesummary->firstshareacc));
+			}
+			if (tv_newer(&(markersummary->lastshareacc), &(sharesummary->lastshareacc))) {
+				copy_tv(&(markersummary->lastshareacc), &(sharesummary->lastshareacc));
+				markersummary->lastdiffacc = sharesummary->lastdiffacc;
+			}
+		}
+
+		job->diffacc += sharesummary->diffacc;
+		job->shareacc += sharesummary->shareacc;
+	}
+	return NULL;
+}
+
+static void *ss_to_ms_thread(void *arg)
+{
+	LOCK_INIT("db_ss_to_ms");
+	return ss_to_ms_job(arg);
+}
+
 /* TODO: what to do about a failure?
  *  since it will repeat every ~13s
  * Of course manual intervention is possible via cmd_marks,
@@ -3799,11 +4226,11 @@ bool sharesummaries_to_markersummaries(PGconn *conn, WORKMARKERS *workmarkers,
 	MARKERSUMMARY *markersummary, lookmarkersummary, *p_markersummary = NULL;
 	K_ITEM *ss_item, *ss_prev, ss_look, *ms_item, ms_look;
 	K_ITEM *p_ss_item, *p_ms_item;
+	struct ss_to_ms_job *job;
 	bool ok = false, conned = false;
-	int64_t diffacc, shareacc;
+	int64_t diffacc = 0, shareacc = 0;
 	char *reason = NULL;
-	int ss_count, ms_count;
-	char *st = NULL;
+	int ss_count, ms_count, jobs, i;
 
 	LOGWARNING("%s() Processing: workmarkers %"PRId64"/%s/"
 		   "End %"PRId64"/Stt %"PRId64"/%s/%s",
@@ -3853,9 +4280,6 @@ bool sharesummaries_to_markersummaries(PGconn *conn, WORKMARKERS *workmarkers,
 		goto flail;
 	}
 
-	diffacc = shareacc = 0;
-	ms_item = NULL;
-
 	looksharesummary.workinfoid = workmarkers->workinfoidend;
 	looksharesummary.userid = MAXID;
 	looksharesummary.workername = EMPTY;
@@ -3865,90 +4289,85 @@ bool sharesummaries_to_markersummaries(PGconn *conn, WORKMARKERS *workmarkers,
 	/* Since shares come in from ckpool at a high rate,
 	 *  we don't want to lock sharesummary for long
 	 * Those incoming shares will not be touching the sharesummaries
-	 *  we are processing here */
+	 *  we are processing here, so take them out of the store a batch
+	 *  at a time, then summarise them without any sharesummary lock */
 	K_RLOCK(sharesummary_free);
 	ss_item = find_before_in_ktree(sharesummary_workinfoid_root,
 					&ss_look, ss_ctx);
 	K_RUNLOCK(sharesummary_free);
 	while (ss_item) {
-		DATA_SHARESUMMARY(sharesummary, ss_item);
-		if (sharesummary->workinfoid < workmarkers->workinfoidstart)
-			break;
-		K_RLOCK(sharesummary_free);
-		ss_prev = prev_in_ktree(ss_ctx);
-		K_RUNLOCK(sharesummary_free);
-
-		// Find/create the markersummary only once per worker change
-		if (!ms_item || markersummary->userid != sharesummary->userid ||
-		    strcmp(markersummary->workername, sharesummary->workername) != 0) {
-			lookmarkersummary.markerid = workmarkers->markerid;
-			lookmarkersummary.userid = sharesummary->userid;
-			lookmarkersummary.workername = sharesummary->workername;
-
-			ms_look.data = (void *)(&lookmarkersummary);
-			ms_item = find_in_ktree_nolock(ms_root, &ms_look, ms_ctx);
-			if (!ms_item) {
-				K_WLOCK(markersummary_free);
-				ms_item = k_unlink_head(markersummary_free);
-				K_WUNLOCK(markersummary_free);
-				k_add_head_nolock(new_markersummary_store, ms_item);
-				DATA_MARKERSUMMARY(markersummary, ms_item);
-				bzero(markersummary, sizeof(*markersummary));
-				markersummary->markerid = workmarkers->markerid;
-				markersummary->userid = sharesummary->userid;
-				DUP_POINTER(markersummary_free,
-					    markersummary->workername,
-					    sharesummary->workername);
-				add_to_ktree_nolock(ms_root, ms_item);
-
-				LOGDEBUG("%s() new ms %"PRId64"/%"PRId64"/%s",
-					 shortname, markersummary->markerid,
-					 markersummary->userid,
-					 st = safe_text(markersummary->workername));
-				FREENULL(st);
-			} else {
-				DATA_MARKERSUMMARY(markersummary, ms_item);
-			}
-		}
-		markersummary->diffacc += sharesummary->diffacc;
-		markersummary->diffsta += sharesummary->diffsta;
-		markersummary->diffdup += sharesummary->diffdup;
-		markersummary->diffhi += sharesummary->diffhi;
-		markersummary->diffrej += sharesummary->diffrej;
-		markersummary->shareacc += sharesummary->shareacc;
-		markersummary->sharesta += sharesummary->sharesta;
-		markersummary->sharedup += sharesummary->sharedup;
-		markersummary->sharehi += sharesummary->sharehi;
-		markersummary->sharerej += sharesummary->sharerej;
-		markersummary->sharecount += sharesummary->sharecount;
-		markersummary->errorcount += sharesummary->errorcount;
-		if (!markersummary->firstshare.tv_sec ||
-		     !tv_newer(&(markersummary->firstshare), &(sharesummary->firstshare))) {
-			copy_tv(&(markersummary->firstshare), &(sharesummary->firstshare));
-		}
-		if (tv_newer(&(markersummary->lastshare), &(sharesummary->lastshare)))
-			copy_tv(&(markersummary->lastshare), &(sharesummary->lastshare));
-		if (sharesummary->diffacc > 0) {
-			if (!markersummary->firstshareacc.tv_sec ||
-			     !tv_newer(&(markersummary->firstshareacc), &(sharesummary->firstshareacc))) {
-				copy_tv(&(markersummary->firstshareacc), &(sharesummary->firstshareacc));
-			}
-			if (tv_newer(&(markersummary->lastshareacc), &(sharesummary->lastshareacc))) {
-				copy_tv(&(markersummary->lastshareacc), &(sharesummary->lastshareacc));
-				markersummary->lastdiffacc = sharesummary->lastdiffacc;
+		K_WLOCK(sharesummary_free);
+		for (i = 0; ss_item && i < SS_TO_MS_BATCH; i++) {
+			DATA_SHARESUMMARY(sharesummary, ss_item);
+			if (sharesummary->workinfoid < workmarkers->workinfoidstart) {
+				ss_item = NULL;
+				break;
 			}
+			ss_prev = prev_in_ktree(ss_ctx);
+			k_unlink_item(sharesummary_store, ss_item);
+			k_add_tail_nolock(old_sharesummary_store, ss_item);
+			ss_item = ss_prev;
 		}
-
-		diffacc += sharesummary->diffacc;
-		shareacc += sharesummary->shareacc;
-
-		K_WLOCK(sharesummary_free);
-		k_unlink_item(sharesummary_store, ss_item);
 		K_WUNLOCK(sharesummary_free);
-		k_add_head_nolock(old_sharesummary_store, ss_item);
+	}
 
-		ss_item = ss_prev;
+	/* Split the snapshot by userid, so each job has all the
+	 *  sharesummaries of a markersummary, in the same order as above */
+	jobs = marker_workers;
+	if (jobs > old_sharesummary_store->count / SS_TO_MS_BATCH + 1)
+		jobs = old_sharesummary_store->count / SS_TO_MS_BATCH + 1;
+	job = calloc(jobs, sizeof(*job));
+	if (!job)
+		quithere(1, "calloc (%d) OOM", (int)(jobs * sizeof(*job)));
+	ss_item = STORE_HEAD_NOLOCK(old_sharesummary_store);
+	while (ss_item) {
+		DATA_SHARESUMMARY(sharesummary, ss_item);
+		job[(uint64_t)(sharesummary->userid) % jobs].ss_count++;
+		ss_item = ss_item->next;
+	}
+	for (i = 0; i < jobs; i++) {
+		job[i].workmarkers = workmarkers;
+		job[i].ss_items = malloc(sizeof(K_ITEM *) * (job[i].ss_count + 1));
+		if (!job[i].ss_items) {
+			quithere(1, "malloc (%d) OOM",
+				 (int)(sizeof(K_ITEM *) * (job[i].ss_count + 1)));
+		}
+		job[i].ss_count = 0;
+		if (i == 0) {
+			job[i].ms_store = new_markersummary_store;
+			job[i].ms_root = ms_root;
+		} else {
+			job[i].ms_store = k_new_store(markersummary_free);
+			job[i].ms_root = new_ktree_local(shortname,
+							 cmp_markersummary,
+							 markersummary_free);
+		}
 	}
+	ss_item = STORE_HEAD_NOLOCK(old_sharesummary_store);
+	while (ss_item) {
+		DATA_SHARESUMMARY(sharesummary, ss_item);
+		i = (int)((uint64_t)(sharesummary->userid) % jobs);
+		job[i].ss_items[job[i].ss_count++] = ss_item;
+		ss_item = ss_item->next;
+	}
+
+	for (i = 1; i < jobs; i++)
+		create_pthread(&(job[i].pt), ss_to_ms_thread, &(job[i]));
+	ss_to_ms_job(&(job[0]));
+	diffacc = job[0].diffacc;
+	shareacc = job[0].shareacc;
+	for (i = 1; i < jobs; i++) {
+		join_pthread(job[i].pt);
+		diffacc += job[i].diffacc;
+		shareacc += job[i].shareacc;
+		k_list_transfer_to_tail_nolock(job[i].ms_store,
+						new_markersummary_store);
+		job[i].ms_store = k_free_store(job[i].ms_store);
+		free_ktree(job[i].ms_root, NULL);
+	}
+	for (i = 0; i < jobs; i++)
+		free(job[i].ss_items);
+	free(job);
 
 	if (conn == NULL) {
 		conn = dbconnect();
@@ -3963,14 +4382,22 @@ bool sharesummaries_to_markersummaries(PGconn *conn, WORKMARKERS *workmarkers,
 		goto flail;
 	}
 
-	ms_item = STORE_HEAD_NOLOCK(new_markersummary_store);
-	while (ms_item) {
-		if (!(markersummary_add(conn, ms_item, by, code, inet,
-					cd, trf_root))) {
+	if (copy_batch > 0 && new_markersummary_store->count > 1) {
+		if (!markersummary_copy(conn, new_markersummary_store, by,
+					code, inet, cd, trf_root)) {
 			reason = "db error";
 			goto rollback;
 		}
-		ms_item = ms_item->next;
+	} else {
+		ms_item = STORE_HEAD_NOLOCK(new_markersummary_store);
+		while (ms_item) {
+			if (!(markersummary_add(conn, ms_item, by, code, inet,
+						cd, trf_root))) {
+				reason = "db error";
+				goto rollback;
+			}
+			ms_item = ms_item->next;
+		}
 	}
 
 	ok = workmarkers_process(conn, true, true,
@@ -4408,8 +4835,7 @@ bool _sharesummary_update(SHARES *s_row, SHAREERRORS *e_row, char *by,
 		DATA_SHARESUMMARY(row, ss_item);
 		bzero(row, sizeof(*row));
 		row->userid = userid;
-		DUP_POINTER(sharesummary_free, row->workername,
-			    workername);
+		row->workername = intern_name(workername);
 		row->workinfoid = workinfoid;
 	}
 
@@ -5340,6 +5766,8 @@ bool miningpayouts_add(PGconn *conn, bool add, K_ITEM *mp_item,
 			K_ITEM **old_mp_item, char *by, char *code, char *inet,
 			tv_t *cd, K_TREE *trf_root, bool already)
 {
+	static CKPQSTMT miningpayouts_upd_stmt = CKPQSTMT_INIT("miningpayouts_upd");
+	static CKPQSTMT miningpayouts_ins_stmt = CKPQSTMT_INIT("miningpayouts_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res;
@@ -5378,7 +5806,7 @@ bool miningpayouts_add(PGconn *conn, bool add, K_ITEM *mp_item,
 		params[par++] = tv_to_buf((tv_t *)&default_expiry, NULL, 0);
 		PARCHKVAL(par, 4, params);
 
-		res = PQexecParams(conn, upd, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &miningpayouts_upd_stmt, upd, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		PQclear(res);
 		if (!PGOK(rescode)) {
@@ -5409,7 +5837,7 @@ bool miningpayouts_add(PGconn *conn, bool add, K_ITEM *mp_item,
 			"(payoutid,userid,diffacc,amount"
 			HISTORYDATECONTROL ") values (" PQPARAM9 ")";
 
-		res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &miningpayouts_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		if (!PGOK(rescode)) {
 			PGLOGERR("Insert", rescode, conn);
@@ -5433,6 +5861,68 @@ unparam:
 	return ok;
 }
 
+/* Add all of mu_root for a new payout with a single COPY, the bulk
+ *  version of miningpayouts_add() with already set
+ * Any that replace an existing record use miningpayouts_add()
+ *  first since they also need an update */
+bool miningpayouts_copy(PGconn *conn, K_TREE *mu_root, char *by, char *code,
+			char *inet, tv_t *cd, K_TREE *trf_root)
+{
+	K_TREE_CTX mu_ctx[1];
+	MININGPAYOUTS *row;
+	K_ITEM *mu_item;
+	CKCOPY copy;
+	int count = 0;
+
+	mu_item = first_in_ktree_nolock(mu_root, mu_ctx);
+	while (mu_item) {
+		DATA_MININGPAYOUTS(row, mu_item);
+		K_RLOCK(miningpayouts_free);
+		row->old_item = find_miningpayouts(row->payoutid, row->userid);
+		K_RUNLOCK(miningpayouts_free);
+		if (row->old_item) {
+			if (!miningpayouts_add(conn, true, mu_item,
+						&(row->old_item), by, code,
+						inet, cd, trf_root, true))
+				return false;
+		} else
+			count++;
+		mu_item = next_in_ktree_nolock(mu_ctx);
+	}
+
+	LOGDEBUG("%s(): copy %d", __func__, count);
+	if (count == 0)
+		return true;
+
+	if (!ckcopy_begin(&copy, conn, "miningpayouts",
+			  "payoutid,userid,diffacc,amount" HISTORYDATECONTROL,
+			  4 + HISTORYDATECOUNT))
+		return false;
+
+	mu_item = first_in_ktree_nolock(mu_root, mu_ctx);
+	while (mu_item) {
+		DATA_MININGPAYOUTS(row, mu_item);
+		if (!row->old_item) {
+			HISTORYDATEINIT(row, cd, by, code, inet);
+			HISTORYDATETRANSFER(trf_root, row);
+
+			ckcopy_row(&copy);
+			ckcopy_bigint(&copy, row->payoutid);
+			ckcopy_bigint(&copy, row->userid);
+			ckcopy_double(&copy, row->diffacc);
+			ckcopy_bigint(&copy, row->amount);
+			ckcopy_tv(&copy, &(row->createdate));
+			ckcopy_str(&copy, row->createby);
+			ckcopy_str(&copy, row->createcode);
+			ckcopy_str(&copy, row->createinet);
+			ckcopy_tv(&copy, &(row->expirydate));
+		}
+		mu_item = next_in_ktree_nolock(mu_ctx);
+	}
+
+	return ckcopy_end(&copy);
+}
+
 bool miningpayouts_fill(PGconn *conn)
 {
 	ExecStatusType rescode;
@@ -5594,6 +6084,8 @@ bool payouts_add(PGconn *conn, bool add, K_ITEM *p_item, K_ITEM **old_p_item,
 		 char *by, char *code, char *inet, tv_t *cd, K_TREE *trf_root,
 		 bool already)
 {
+	static CKPQSTMT payouts_upd_stmt = CKPQSTMT_INIT("payouts_upd");
+	static CKPQSTMT payouts_ins_stmt = CKPQSTMT_INIT("payouts_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res;
@@ -5631,7 +6123,7 @@ bool payouts_add(PGconn *conn, bool add, K_ITEM *p_item, K_ITEM **old_p_item,
 		params[par++] = tv_to_buf((tv_t *)&default_expiry, NULL, 0);
 		PARCHKVAL(par, 3, params);
 
-		res = PQexecParams(conn, upd, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &payouts_upd_stmt, upd, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		PQclear(res);
 		if (!PGOK(rescode)) {
@@ -5683,7 +6175,7 @@ bool payouts_add(PGconn *conn, bool add, K_ITEM *p_item, K_ITEM **old_p_item,
 			"lastshareacc,stats"
 			HISTORYDATECONTROL ") values (" PQPARAM18 ")";
 
-		res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &payouts_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		if (!PGOK(rescode)) {
 			PGLOGERR("Insert", rescode, conn);
@@ -6236,6 +6728,7 @@ bool poolstats_add(PGconn *conn, bool store, char *poolinstance,
 			char *by, char *code, char *inet, tv_t *cd,
 			bool igndup, K_TREE *trf_root)
 {
+	static CKPQSTMT poolstats_ins_stmt = CKPQSTMT_INIT("poolstats_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res;
@@ -6301,7 +6794,7 @@ bool poolstats_add(PGconn *conn, bool store, char *poolinstance,
 			conned = true;
 		}
 
-		res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &poolstats_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		if (!PGOK(rescode)) {
 			bool show_msg = true;
@@ -6689,6 +7182,7 @@ bool workerstats_add(char *poolinstance, char *elapsed, char *username,
 bool markersummary_add(PGconn *conn, K_ITEM *ms_item, char *by, char *code,
 			char *inet, tv_t *cd, K_TREE *trf_root)
 {
+	static CKPQSTMT markersummary_ins_stmt = CKPQSTMT_INIT("markersummary_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res;
@@ -6748,7 +7242,7 @@ bool markersummary_add(PGconn *conn, K_ITEM *ms_item, char *by, char *code,
 		conned = true;
 	}
 
-	res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+	res = CKPQexecStmt(conn, &markersummary_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 	rescode = PQresultStatus(res);
 	if (!PGOK(rescode)) {
 		PGLOGERR("Insert", rescode, conn);
@@ -6768,17 +7262,436 @@ unparam:
 	return ok;
 }
 
+/* Add all of ms_store with a single COPY, the bulk version of
+ *  markersummary_add() for a whole workmarker
+ * caller must already be in a transaction and do the
+ *  tree/list/store changes */
+bool markersummary_copy(PGconn *conn, K_STORE *ms_store, char *by, char *code,
+			char *inet, tv_t *cd, K_TREE *trf_root)
+{
+	MARKERSUMMARY *row;
+	K_ITEM *ms_item;
+	CKCOPY copy;
+
+	LOGDEBUG("%s(): copy %d", __func__, ms_store->count);
+
+	if (!ckcopy_begin(&copy, conn, "markersummary",
+			  "markerid,userid,workername,diffacc,diffsta,diffdup,"
+			  "diffhi,diffrej,shareacc,sharesta,sharedup,sharehi,"
+			  "sharerej,sharecount,errorcount,firstshare,lastshare,"
+			  "firstshareacc,lastshareacc,lastdiffacc"
+			  MODIFYDATECONTROL, 20 + MODIFYDATECOUNT))
+		return false;
+
+	ms_item = STORE_HEAD_NOLOCK(ms_store);
+	while (ms_item) {
+		DATA_MARKERSUMMARY(row, ms_item);
+
+		MODIFYDATEPOINTERS(markersummary_free, row, cd, by, code, inet);
+		MODIFYDATETRANSFER(markersummary_free, trf_root, row);
+
+		ckcopy_row(&copy);
+		ckcopy_bigint(&copy, row->markerid);
+		ckcopy_bigint(&copy, row->userid);
+		ckcopy_str(&copy, row->workername);
+		ckcopy_double(&copy, row->diffacc);
+		ckcopy_double(&copy, row->diffsta);
+		ckcopy_double(&copy, row->diffdup);
+		ckcopy_double(&copy, row->diffhi);
+		ckcopy_double(&copy, row->diffrej);
+		ckcopy_double(&copy, row->shareacc);
+		ckcopy_double(&copy, row->sharesta);
+		ckcopy_double(&copy, row->sharedup);
+		ckcopy_double(&copy, row->sharehi);
+		ckcopy_double(&copy, row->sharerej);
+		ckcopy_bigint(&copy, row->sharecount);
+		ckcopy_bigint(&copy, row->errorcount);
+		ckcopy_tv(&copy, &(row->firstshare));
+		ckcopy_tv(&copy, &(row->lastshare));
+		ckcopy_tv(&copy, &(row->firstshareacc));
+		ckcopy_tv(&copy, &(row->lastshareacc));
+		ckcopy_double(&copy, row->lastdiffacc);
+		ckcopy_tv(&copy, &(row->createdate));
+		ckcopy_str(&copy, row->createby);
+		ckcopy_str(&copy, row->createcode);
+		ckcopy_str(&copy, row->createinet);
+		ckcopy_tv(&copy, &(row->modifydate));
+		ckcopy_str(&copy, row->modifyby);
+		ckcopy_str(&copy, row->modifycode);
+		ckcopy_str(&copy, row->modifyinet);
+
+		ms_item = ms_item->next;
+	}
+
+	return ckcopy_end(&copy);
+}
+
+// Add a loaded markersummary to RAM and to the pool and userinfo totals
+static void markersummary_fill_add(K_ITEM *item)
+{
+	MARKERSUMMARY *row, *p_row;
+	K_ITEM *p_item;
+
+	DATA_MARKERSUMMARY(row, item);
+
+	/* Save having to do this everywhere in the code for old data
+	 * It's not always accurate, but soon after when it's not,
+	 *  and also what was used before the 2 fields were added */
+	if (row->diffacc > 0) {
+		if (row->firstshareacc.tv_sec == 0L)
+			copy_tv(&(row->firstshareacc), &(row->firstshare));
+		if (row->lastshareacc.tv_sec == 0L)
+			copy_tv(&(row->lastshareacc), &(row->lastshare));
+	}
+
+	add_to_ktree(markersummary_root, item);
+	add_to_ktree(markersummary_userid_root, item);
+	k_add_head(markersummary_store, item);
+
+	p_item = find_markersummary_p(row->markerid);
+	if (!p_item) {
+		/* N.B. this could be false due to the markerid
+		 *  having the wrong status TODO: deal with that? */
+		p_item = k_unlink_head(markersummary_free);
+		DATA_MARKERSUMMARY(p_row, p_item);
+		bzero(p_row, sizeof(*p_row));
+		p_row->markerid = row->markerid;
+		POOL_MS(p_row);
+		add_to_ktree(markersummary_pool_root, p_item);
+		k_add_head(markersummary_pool_store, p_item);
+	} else {
+		DATA_MARKERSUMMARY(p_row, p_item);
+	}
+
+	markersummary_to_pool(p_row, row);
+
+	userinfo_update(NULL, NULL, row, false);
+}
+
+#define MS_CHECKPOINT_STRS 7
+// The strings are all short, so anything longer means a corrupt file
+#define MS_CHECKPOINT_STR_MAX 65536
+
+static bool ms_checkpoint_str(FILE *fp, char *str)
+{
+	uint32_t len = str ? strlen(str) : 0;
+
+	if (fwrite(&len, sizeof(len), 1, fp) != 1)
+		return false;
+	if (len && fwrite(str, len, 1, fp) != 1)
+		return false;
+	return true;
+}
+
+/* Write all the markersummaries in RAM to filename, via a temporary file
+ *  renamed over it so there's always a complete checkpoint
+ * They are written directly while holding the markersummary read lock,
+ *  since a copy would need as much RAM again */
+bool markersummary_checkpoint(char *filename)
+{
+	MS_CHECKPOINT cp;
+	MARKERSUMMARY *row;
+	K_ITEM *item;
+	char *tmp = NULL;
+	bool ok = false;
+	tv_t stt, fin;
+	size_t len;
+	FILE *fp;
+
+	setnow(&stt);
+	len = strlen(filename) + 5;
+	tmp = malloc(len);
+	if (!tmp)
+		quithere(1, "(%d) OOM", (int)len);
+	snprintf(tmp, len, "%s.tmp", filename);
+
+	fp = fopen(tmp, "we");
+	if (!fp) {
+		int errn = errno;
+		LOGERR("%s(): failed to create '%s' (%d) %s",
+			__func__, tmp, errn, strerror(errn));
+		goto out;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	memcpy(cp.magic, MS_CHECKPOINT_MAGIC, sizeof(cp.magic));
+	STRNCPY(cp.version, CKDB_VERSION);
+	cp.rowsiz = (int32_t)sizeof(*row);
+	cp.markstart = mark_start ? atoll(mark_start) : 0;
+	// Written again at the end when it's complete
+	if (fwrite(&cp, sizeof(cp), 1, fp) != 1)
+		goto werr;
+
+	K_RLOCK(markersummary_free);
+	item = STORE_RHEAD(markersummary_store);
+	while (item) {
+		DATA_MARKERSUMMARY(row, item);
+		if (fwrite(row, sizeof(*row), 1, fp) != 1 ||
+		    !ms_checkpoint_str(fp, row->workername) ||
+		    !ms_checkpoint_str(fp, row->createby) ||
+		    !ms_checkpoint_str(fp, row->createcode) ||
+		    !ms_checkpoint_str(fp, row->createinet) ||
+		    !ms_checkpoint_str(fp, row->modifyby) ||
+		    !ms_checkpoint_str(fp, row->modifycode) ||
+		    !ms_checkpoint_str(fp, row->modifyinet)) {
+			K_RUNLOCK(markersummary_free);
+			goto werr;
+		}
+		if (cp.markerid < row->markerid)
+			cp.markerid = row->markerid;
+		if (tv_newer(&(cp.newest_createdate), &(row->createdate)))
+			copy_tv(&(cp.newest_createdate), &(row->createdate));
+		cp.rows++;
+		item = item->next;
+	}
+	K_RUNLOCK(markersummary_free);
+
+	if (fseek(fp, 0, SEEK_SET) ||
+	    fwrite(&cp, sizeof(cp), 1, fp) != 1 ||
+	    fflush(fp) || fsync(fileno(fp)))
+		goto werr;
+
+	if (fclose(fp)) {
+		fp = NULL;
+		goto werr;
+	}
+	fp = NULL;
+
+	if (rename(tmp, filename)) {
+		int errn = errno;
+		LOGERR("%s(): failed to rename '%s' (%d) %s",
+			__func__, tmp, errn, strerror(errn));
+		unlink(tmp);
+		goto out;
+	}
+
+	setnow(&fin);
+	LOGWARNING("%s(): wrote %"PRId64" markersummaries up to markerid %"
+		   PRId64" in %.3fs", __func__, cp.rows, cp.markerid,
+		   tvdiff(&fin, &stt));
+	ok = true;
+	goto out;
+werr:
+	{
+		int errn = errno;
+		LOGERR("%s(): failed writing '%s' (%d) %s",
+			__func__, tmp, errn, strerror(errn));
+	}
+	if (fp)
+		fclose(fp);
+	unlink(tmp);
+out:
+	free(tmp);
+	return ok;
+}
+
+// Read the next checkpoint string into *buf, growing it as needed
+static bool ms_checkpoint_read_str(FILE *fp, char **buf, size_t *siz)
+{
+	uint32_t len;
+
+	if (fread(&len, sizeof(len), 1, fp) != 1)
+		return false;
+	if (len > MS_CHECKPOINT_STR_MAX)
+		return false;
+	if (len >= *siz) {
+		*siz = len + 1;
+		*buf = realloc(*buf, *siz);
+		if (!(*buf))
+			quithere(1, "(%d) OOM", (int)(*siz));
+	}
+	if (len && fread(*buf, len, 1, fp) != 1)
+		return false;
+	(*buf)[len] = '\0';
+	return true;
+}
+
+/* Load the checkpoint if it's for this ckdb and still matches the DB
+ * The DB must have the same number of markersummaries from markstart up
+ *  to the checkpoint's highest markerid, with the same newest createdate,
+ *  since a marker being reprocessed deletes and adds them again
+ * Returns the highest markerid loaded or -1 if the checkpoint wasn't used */
+static int64_t markersummary_checkpoint_load(PGconn *conn, char *filename,
+					     int64_t markstart)
+{
+	ExecStatusType rescode;
+	PGresult *res;
+	MS_CHECKPOINT cp;
+	MARKERSUMMARY *row;
+	K_STORE *cp_store;
+	K_ITEM *item;
+	char *params[2];
+	char *field, *sel;
+	char *buf = NULL;
+	size_t siz = 0;
+	int64_t count = 0, ret = -1;
+	tv_t newest, stt, fin;
+	int par = 0, i;
+	bool ok;
+	FILE *fp;
+
+	setnow(&stt);
+	DATE_ZERO(&newest);
+	fp = fopen(filename, "re");
+	if (!fp) {
+		int errn = errno;
+		if (errn != ENOENT) {
+			LOGERR("%s(): failed to open '%s' (%d) %s",
+				__func__, filename, errn, strerror(errn));
+		}
+		return -1;
+	}
+
+	if (fread(&cp, sizeof(cp), 1, fp) != 1 ||
+	    memcmp(cp.magic, MS_CHECKPOINT_MAGIC, sizeof(cp.magic)) ||
+	    strncmp(cp.version, CKDB_VERSION, sizeof(cp.version)) ||
+	    cp.rowsiz != (int32_t)sizeof(*row)) {
+		LOGWARNING("%s(): ignoring '%s' not a checkpoint for this ckdb",
+			   __func__, filename);
+		goto out;
+	}
+
+	if (cp.markstart != markstart || cp.rows < 1) {
+		LOGWARNING("%s(): ignoring '%s' markstart %"PRId64" rows %"PRId64,
+			   __func__, filename, cp.markstart, cp.rows);
+		goto out;
+	}
+
+	sel = "select count(*) as cnt,max(createdate) as newest"
+		" from markersummary where markerid>=$1 and markerid<=$2";
+	par = 0;
+	params[par++] = bigint_to_buf(cp.markstart, NULL, 0);
+	params[par++] = bigint_to_buf(cp.markerid, NULL, 0);
+	PARCHK(par, params);
+	res = PQexecParams(conn, sel, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_READ);
+	for (i = 0; i < par; i++)
+		free(params[i]);
+	rescode = PQresultStatus(res);
+	if (!PGOK(rescode) || PQntuples(res) != 1) {
+		PGLOGERR("Select", rescode, conn);
+		PQclear(res);
+		goto out;
+	}
+	ok = true;
+	PQ_GET_FLD(res, 0, "cnt", field, ok);
+	if (ok)
+		TXT_TO_BIGINT("cnt", field, count);
+	if (ok)
+		PQ_GET_FLD(res, 0, "newest", field, ok);
+	if (ok && count > 0)
+		TXT_TO_TV("newest", field, newest);
+	PQclear(res);
+	if (!ok)
+		goto out;
+
+	if (count != cp.rows || !tv_equal(&newest, &(cp.newest_createdate))) {
+		LOGWARNING("%s(): ignoring '%s' the DB has changed since it was"
+			   " written", __func__, filename);
+		goto out;
+	}
+
+	/* Read them all before adding any, so a bad checkpoint
+	 *  just means loading them all from the DB */
+	cp_store = k_new_store(markersummary_free);
+	ok = true;
+	K_WLOCK(markersummary_free);
+	for (count = 0; count < cp.rows; count++) {
+		item = k_unlink_head(markersummary_free);
+		DATA_MARKERSUMMARY(row, item);
+		if (fread(row, sizeof(*row), 1, fp) != 1) {
+			bzero(row, sizeof(*row));
+			k_add_head(markersummary_free, item);
+			ok = false;
+			break;
+		}
+		row->workername = NULL;
+		row->createby = row->createcode = row->createinet = NULL;
+		row->modifyby = row->modifycode = row->modifyinet = NULL;
+		k_add_tail(cp_store, item);
+		for (i = 0; ok && i < MS_CHECKPOINT_STRS; i++) {
+			if (!ms_checkpoint_read_str(fp, &buf, &siz)) {
+				ok = false;
+				break;
+			}
+			switch (i) {
+				case 0:
+					row->workername = intern_name(buf);
+					break;
+				case 1:
+					SET_CREATEBY(markersummary_free,
+						     row->createby, buf);
+					break;
+				case 2:
+					SET_CREATECODE(markersummary_free,
+						       row->createcode, buf);
+					break;
+				case 3:
+					SET_CREATEINET(markersummary_free,
+						       row->createinet, buf);
+					break;
+				case 4:
+					SET_MODIFYBY(markersummary_free,
+						     row->modifyby, buf);
+					break;
+				case 5:
+					SET_MODIFYCODE(markersummary_free,
+						       row->modifycode, buf);
+					break;
+				case 6:
+					SET_MODIFYINET(markersummary_free,
+						       row->modifyinet, buf);
+					break;
+			}
+		}
+		if (!ok)
+			break;
+	}
+
+	if (!ok) {
+		LOGERR("%s(): '%s' is truncated or corrupt, ignored",
+			__func__, filename);
+		while ((item = k_unlink_head(cp_store))) {
+			free_markersummary_data(item);
+			k_add_head(markersummary_free, item);
+		}
+	} else {
+		K_RLOCK(workmarkers_free);
+		K_WLOCK(userinfo_free);
+		while ((item = k_unlink_head(cp_store)))
+			markersummary_fill_add(item);
+		K_WUNLOCK(userinfo_free);
+		K_RUNLOCK(workmarkers_free);
+		ret = cp.markerid;
+	}
+	K_WUNLOCK(markersummary_free);
+	cp_store = k_free_store(cp_store);
+
+	if (ret >= 0) {
+		setnow(&fin);
+		LOGWARNING("%s(): loaded %"PRId64" markersummaries up to"
+			   " markerid %"PRId64" from '%s' in %.3fs",
+			   __func__, cp.rows, cp.markerid, filename,
+			   tvdiff(&fin, &stt));
+	}
+out:
+	free(buf);
+	fclose(fp);
+	return ret;
+}
+
 bool markersummary_fill(PGconn *conn)
 {
 	ExecStatusType rescode;
 	PGresult *res;
-	K_ITEM *item = NULL, *p_item;
+	K_ITEM *item = NULL;
 	int n, t, i, p_n;
-	MARKERSUMMARY *row, *p_row;
+	MARKERSUMMARY *row;
 	char *params[1];
+	char cp_start[32];
 	char *field;
 	char *sel;
 	int fields = 20, par = 0;
+	int64_t cp_markerid = -1;
 	bool ok = false;
 
 	LOGDEBUG("%s(): select", __func__);
@@ -6801,6 +7714,17 @@ bool markersummary_fill(PGconn *conn)
 		params[par++] = "0";
 	PARCHK(par, params);
 
+	if (checkpoint_file) {
+		cp_markerid = markersummary_checkpoint_load(conn,
+							    checkpoint_file,
+							    atoll(params[0]));
+		if (cp_markerid >= 0) {
+			snprintf(cp_start, sizeof(cp_start), "%"PRId64,
+				 cp_markerid + 1);
+			params[0] = cp_start;
+		}
+	}
+
 	LOGWARNING("%s(): loading from markerid>=%s", __func__, params[0]);
 
 	res = PQexec(conn, "Begin", CKPQ_READ);
@@ -6867,8 +7791,7 @@ bool markersummary_fill(PGconn *conn)
 			PQ_GET_FLD(res, i, "workername", field, ok);
 			if (!ok)
 				break;
-			TXT_TO_PTR("workername", field, row->workername);
-			LIST_MEM_ADD(markersummary_free, row->workername);
+			row->workername = intern_name(field);
 
 			PQ_GET_FLD(res, i, "diffacc", field, ok);
 			if (!ok)
@@ -6959,38 +7882,7 @@ bool markersummary_fill(PGconn *conn)
 			if (!ok)
 				break;
 
-			/* Save having to do this everywhere in the code for old data
-			 * It's not always accurate, but soon after when it's not,
-			 *  and also what was used before the 2 fields were added */
-			if (row->diffacc > 0) {
-				if (row->firstshareacc.tv_sec == 0L)
-					copy_tv(&(row->firstshareacc), &(row->firstshare));
-				if (row->lastshareacc.tv_sec == 0L)
-					copy_tv(&(row->lastshareacc), &(row->lastshare));
-			}
-
-			add_to_ktree(markersummary_root, item);
-			add_to_ktree(markersummary_userid_root, item);
-			k_add_head(markersummary_store, item);
-
-			p_item = find_markersummary_p(row->markerid);
-			if (!p_item) {
-				/* N.B. this could be false due to the markerid
-				 *  having the wrong status TODO: deal with that? */
-				p_item = k_unlink_head(markersummary_free);
-				DATA_MARKERSUMMARY(p_row, p_item);
-				bzero(p_row, sizeof(*p_row));
-				p_row->markerid = row->markerid;
-				POOL_MS(p_row);
-				add_to_ktree(markersummary_pool_root, p_item);
-				k_add_head(markersummary_pool_store, p_item);
-			} else {
-				DATA_MARKERSUMMARY(p_row, p_item);
-			}
-
-			markersummary_to_pool(p_row, row);
-
-			userinfo_update(NULL, NULL, row, false);
+			markersummary_fill_add(item);
 
 			if (n == 0 || ((n+1) % 100000) == 0) {
 				printf(TICK_PREFIX"ms ");
@@ -7056,6 +7948,8 @@ bool _workmarkers_process(PGconn *conn, bool already, bool add,
 			  char *inet, tv_t *cd, K_TREE *trf_root,
 			  WHERE_FFL_ARGS)
 {
+	static CKPQSTMT workmarkers_upd_stmt = CKPQSTMT_INIT("workmarkers_upd");
+	static CKPQSTMT workmarkers_ins_stmt = CKPQSTMT_INIT("workmarkers_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res = NULL;
@@ -7106,7 +8000,7 @@ bool _workmarkers_process(PGconn *conn, bool already, bool add,
 		params[par++] = tv_to_buf((tv_t *)&default_expiry, NULL, 0);
 		PARCHKVAL(par, 3, params);
 
-		res = PQexecParams(conn, upd, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &workmarkers_upd_stmt, upd, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		PQclear(res);
 		if (!PGOK(rescode)) {
@@ -7196,7 +8090,7 @@ bool _workmarkers_process(PGconn *conn, bool already, bool add,
 		HISTORYDATEPARAMS(params, par, row);
 		PARCHK(par, params);
 
-		res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &workmarkers_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		PQclear(res);
 		if (!PGOK(rescode)) {
@@ -7415,6 +8309,8 @@ bool _marks_process(PGconn *conn, bool add, char *poolinstance,
 		    char *marktype, char *status, char *by, char *code,
 		    char *inet, tv_t *cd, K_TREE *trf_root, WHERE_FFL_ARGS)
 {
+	static CKPQSTMT marks_upd_stmt = CKPQSTMT_INIT("marks_upd");
+	static CKPQSTMT marks_ins_stmt = CKPQSTMT_INIT("marks_ins");
 	ExecStatusType rescode;
 	bool conned = false;
 	PGresult *res = NULL;
@@ -7456,7 +8352,7 @@ bool _marks_process(PGconn *conn, bool add, char *poolinstance,
 		params[par++] = tv_to_buf((tv_t *)&default_expiry, NULL, 0);
 		PARCHKVAL(par, 3, params);
 
-		res = PQexecParams(conn, upd, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &marks_upd_stmt, upd, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		PQclear(res);
 		if (!PGOK(rescode)) {
@@ -7531,7 +8427,7 @@ bool _marks_process(PGconn *conn, bool add, char *poolinstance,
 			begun = true;
 		}
 
-		res = PQexecParams(conn, ins, par, NULL, (const char **)params, NULL, NULL, 0, CKPQ_WRITE);
+		res = CKPQexecStmt(conn, &marks_ins_stmt, ins, par, (const char **)params, CKPQ_WRITE);
 		rescode = PQresultStatus(res);
 		PQclear(res);
 		if (!PGOK(rescode)) {
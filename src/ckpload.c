@@ -0,0 +1,833 @@
+/*
+ * Copyright 2014-2016 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Synthetic stratum load generator. Opens many connections to a pool, has
+ * them subscribe, authorise and submit shares at a fixed total rate, and
+ * reports throughput, response latency and handshake rate. It can also stand
+ * in for bitcoind with -B, serving a fixed block template for the pool under
+ * test to build work from. */
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "uthash.h"
+
+#define MAX_EVENTS 256
+#define RBUFSIZE 16384
+#define OUTSTANDING 256	/* Submits in flight per connection */
+#define FIRST_SUBMIT_ID 4
+
+enum conn_state {
+	CONN_CONNECTING,
+	CONN_SUBSCRIBING,
+	CONN_AUTHORISING,
+	CONN_MINING,
+	CONN_CLOSED
+};
+
+struct load_conn {
+	struct load_conn *next;
+	struct load_conn *prev;
+
+	int fd;
+	int num;
+	int state;
+
+	char *rbuf;
+	int rlen;
+	char *wbuf;
+	int wlen;
+	int wsize;
+	bool polling_out;
+
+	char *jobid;
+	char ntime[12];
+	int nonce2len;
+	uint64_t nonce2;
+
+	int64_t started;	/* When the connect began */
+	int64_t sent[OUTSTANDING];
+	int64_t next_id;
+	int outstanding;
+};
+
+typedef struct load_conn lconn_t;
+
+struct reject_reason {
+	UT_hash_handle hh;
+	char *reason;
+	int64_t count;
+};
+
+typedef struct reject_reason reason_t;
+
+/* Private data for the load generator */
+struct load_data {
+	struct addrinfo *addr;
+	int epfd;
+
+	char *username;
+	int conns;		/* Connections to keep open */
+	double rate;		/* Total submits per second */
+	double churn;		/* Reconnects per second */
+	int invalid;		/* Percentage of deliberately invalid submits */
+	double diff;		/* Difficulty to suggest, 0 for the pool's own */
+	int duration;
+
+	lconn_t *mining;	/* Authorised connections, round robin for submits */
+	lconn_t *nextconn;
+	int open;
+	int authorised;
+
+	int64_t submits;
+	int64_t responses;
+	int64_t accepted;
+	int64_t rejected;
+	int64_t handshakes;
+	int64_t connfails;
+	int64_t drops;
+	reason_t *reasons;
+
+	lhist_t submit_latency;
+	lhist_t handshake_latency;
+};
+
+typedef struct load_data ldata_t;
+
+static int loglevel = LOG_NOTICE;
+
+/* Log to stderr leaving stdout for the final report */
+void logmsg(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (level > loglevel)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void conn_write(ldata_t *ldata, lconn_t *conn, const char *buf, int len);
+
+static void open_conn(ldata_t *ldata, lconn_t *conn)
+{
+	struct epoll_event event;
+	int ret;
+
+	conn->fd = socket(ldata->addr->ai_family, SOCK_STREAM, 0);
+	if (unlikely(conn->fd < 0)) {
+		LOGWARNING("Failed to open socket: %s", strerror(errno));
+		conn->state = CONN_CLOSED;
+		ldata->connfails++;
+		return;
+	}
+	noblock_socket(conn->fd);
+	conn->started = monotonic_ns();
+	conn->state = CONN_CONNECTING;
+	conn->rlen = conn->wlen = 0;
+	conn->outstanding = 0;
+	conn->next_id = FIRST_SUBMIT_ID;
+	ret = connect(conn->fd, ldata->addr->ai_addr, ldata->addr->ai_addrlen);
+	if (unlikely(ret < 0 && errno != EINPROGRESS)) {
+		LOGINFO("Failed to connect %d: %s", conn->num, strerror(errno));
+		Close(conn->fd);
+		conn->state = CONN_CLOSED;
+		ldata->connfails++;
+		return;
+	}
+	event.data.ptr = conn;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	conn->polling_out = true;
+	epoll_ctl(ldata->epfd, EPOLL_CTL_ADD, conn->fd, &event);
+	ldata->open++;
+}
+
+static void close_conn(ldata_t *ldata, lconn_t *conn)
+{
+	if (conn->state == CONN_CLOSED)
+		return;
+	if (conn->state == CONN_MINING) {
+		if (ldata->nextconn == conn)
+			ldata->nextconn = conn->next;
+		DL_DELETE(ldata->mining, conn);
+		ldata->authorised--;
+	}
+	epoll_ctl(ldata->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	Close(conn->fd);
+	dealloc(conn->jobid);
+	conn->state = CONN_CLOSED;
+	ldata->open--;
+}
+
+static void drop_conn(ldata_t *ldata, lconn_t *conn, const char *why)
+{
+	LOGINFO("Connection %d dropped: %s", conn->num, why);
+	ldata->drops++;
+	close_conn(ldata, conn);
+}
+
+static void update_pollout(ldata_t *ldata, lconn_t *conn, const bool want)
+{
+	struct epoll_event event;
+
+	if (conn->polling_out == want)
+		return;
+	event.data.ptr = conn;
+	event.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0);
+	epoll_ctl(ldata->epfd, EPOLL_CTL_MOD, conn->fd, &event);
+	conn->polling_out = want;
+}
+
+static void conn_flush(ldata_t *ldata, lconn_t *conn)
+{
+	int ret;
+
+	while (conn->wlen) {
+		ret = write(conn->fd, conn->wbuf, conn->wlen);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			drop_conn(ldata, conn, "write failed");
+			return;
+		}
+		conn->wlen -= ret;
+		if (conn->wlen)
+			memmove(conn->wbuf, conn->wbuf + ret, conn->wlen);
+	}
+	update_pollout(ldata, conn, !!conn->wlen);
+}
+
+static void conn_write(ldata_t *ldata, lconn_t *conn, const char *buf, int len)
+{
+	if (conn->wlen + len > conn->wsize) {
+		conn->wsize = round_up_page(conn->wlen + len);
+		conn->wbuf = realloc(conn->wbuf, conn->wsize);
+		if (unlikely(!conn->wbuf))
+			quit(1, "Failed to realloc write buffer of %d", conn->wsize);
+	}
+	memcpy(conn->wbuf + conn->wlen, buf, len);
+	conn->wlen += len;
+	if (conn->state != CONN_CONNECTING)
+		conn_flush(ldata, conn);
+}
+
+static void send_subscribe(ldata_t *ldata, lconn_t *conn)
+{
+	static const char *subscribe = "{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[\"ckpload\"]}\n";
+
+	conn->state = CONN_SUBSCRIBING;
+	conn_write(ldata, conn, subscribe, strlen(subscribe));
+}
+
+static void parse_subscribe(ldata_t *ldata, lconn_t *conn, json_t *val)
+{
+	json_t *res_val = json_object_get(val, "result");
+	char buf[256];
+	int len;
+
+	if (unlikely(!json_is_array(res_val) || json_array_size(res_val) < 3)) {
+		drop_conn(ldata, conn, "invalid subscribe response");
+		return;
+	}
+	conn->nonce2len = json_integer_value(json_array_get(res_val, 2));
+	if (unlikely(conn->nonce2len < 1 || conn->nonce2len > 8)) {
+		drop_conn(ldata, conn, "unusable nonce2 length");
+		return;
+	}
+	if (ldata->diff > 0) {
+		len = snprintf(buf, sizeof(buf), "{\"id\":2,\"method\":\"mining.suggest_difficulty\","
+			       "\"params\":[%f]}\n", ldata->diff);
+		conn_write(ldata, conn, buf, len);
+	}
+	len = snprintf(buf, sizeof(buf), "{\"id\":3,\"method\":\"mining.authorize\","
+		       "\"params\":[\"%s.%d\",\"x\"]}\n", ldata->username, conn->num);
+	conn->state = CONN_AUTHORISING;
+	conn_write(ldata, conn, buf, len);
+}
+
+static void parse_authorise(ldata_t *ldata, lconn_t *conn, json_t *val)
+{
+	if (unlikely(!json_is_true(json_object_get(val, "result")))) {
+		drop_conn(ldata, conn, "authorisation failed");
+		return;
+	}
+	conn->state = CONN_MINING;
+	DL_APPEND(ldata->mining, conn);
+	ldata->authorised++;
+	ldata->handshakes++;
+	lhist_add(&ldata->handshake_latency, monotonic_ns() - conn->started);
+}
+
+static void parse_notify(lconn_t *conn, json_t *val)
+{
+	json_t *params = json_object_get(val, "params");
+	const char *jobid, *ntime;
+
+	if (unlikely(!json_is_array(params) || json_array_size(params) < 9))
+		return;
+	jobid = json_string_value(json_array_get(params, 0));
+	ntime = json_string_value(json_array_get(params, 7));
+	if (unlikely(!jobid || !ntime || strlen(ntime) >= sizeof(conn->ntime)))
+		return;
+	free(conn->jobid);
+	conn->jobid = strdup(jobid);
+	strcpy(conn->ntime, ntime);
+}
+
+static void add_reject_reason(ldata_t *ldata, json_t *val)
+{
+	json_t *err_val = json_object_get(val, "error");
+	const char *reason = NULL;
+	reason_t *rr;
+
+	if (json_is_array(err_val))
+		reason = json_string_value(json_array_get(err_val, 1));
+	else if (json_is_string(err_val))
+		reason = json_string_value(err_val);
+	if (!reason)
+		reason = json_string_value(json_object_get(val, "reject-reason"));
+	if (!reason)
+		reason = "unknown";
+	HASH_FIND_STR(ldata->reasons, reason, rr);
+	if (!rr) {
+		rr = ckzalloc(sizeof(reason_t));
+		rr->reason = strdup(reason);
+		HASH_ADD_KEYPTR(hh, ldata->reasons, rr->reason, strlen(rr->reason), rr);
+	}
+	rr->count++;
+}
+
+static void parse_submit_result(ldata_t *ldata, lconn_t *conn, json_t *val, int64_t id)
+{
+	int64_t now = monotonic_ns();
+
+	/* Ignore responses to submits so old their slot has been reused */
+	if (unlikely(id < conn->next_id - OUTSTANDING || id >= conn->next_id))
+		return;
+	lhist_add(&ldata->submit_latency, now - conn->sent[id % OUTSTANDING]);
+	conn->outstanding--;
+	ldata->responses++;
+	if (json_is_true(json_object_get(val, "result")))
+		ldata->accepted++;
+	else {
+		ldata->rejected++;
+		add_reject_reason(ldata, val);
+	}
+}
+
+static void parse_line(ldata_t *ldata, lconn_t *conn, const char *line)
+{
+	json_t *val = json_loads(line, 0, NULL), *id_val;
+	const char *method;
+	int64_t id;
+
+	if (unlikely(!val)) {
+		drop_conn(ldata, conn, "invalid json");
+		return;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	if (method) {
+		if (!strcmp(method, "mining.notify"))
+			parse_notify(conn, val);
+		goto out;
+	}
+	id_val = json_object_get(val, "id");
+	if (!json_is_integer(id_val))
+		goto out;
+	id = json_integer_value(id_val);
+	if (id == 1)
+		parse_subscribe(ldata, conn, val);
+	else if (id == 3)
+		parse_authorise(ldata, conn, val);
+	else if (id >= FIRST_SUBMIT_ID)
+		parse_submit_result(ldata, conn, val, id);
+out:
+	json_decref(val);
+}
+
+static void conn_read(ldata_t *ldata, lconn_t *conn)
+{
+	char *eol, *line;
+	int ret;
+
+	while (42) {
+		ret = read(conn->fd, conn->rbuf + conn->rlen, RBUFSIZE - conn->rlen);
+		if (ret < 1) {
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			drop_conn(ldata, conn, ret ? "read failed" : "closed by pool");
+			return;
+		}
+		conn->rlen += ret;
+		conn->rbuf[conn->rlen] = '\0';
+		line = conn->rbuf;
+		while ((eol = strchr(line, '\n'))) {
+			*eol = '\0';
+			parse_line(ldata, conn, line);
+			if (conn->state == CONN_CLOSED)
+				return;
+			line = eol + 1;
+		}
+		conn->rlen -= line - conn->rbuf;
+		if (conn->rlen == RBUFSIZE) {
+			drop_conn(ldata, conn, "line too long");
+			return;
+		}
+		memmove(conn->rbuf, line, conn->rlen);
+	}
+}
+
+static void conn_event(ldata_t *ldata, lconn_t *conn, const uint32_t events)
+{
+	if (conn->state == CONN_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			return;
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			ldata->connfails++;
+			drop_conn(ldata, conn, strerror(err));
+			return;
+		}
+		send_subscribe(ldata, conn);
+		if (conn->state == CONN_CLOSED)
+			return;
+	}
+	if (events & EPOLLIN)
+		conn_read(ldata, conn);
+	if (conn->state == CONN_CLOSED)
+		return;
+	if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+		drop_conn(ldata, conn, "hung up");
+		return;
+	}
+	if (events & EPOLLOUT)
+		conn_flush(ldata, conn);
+}
+
+/* Send one submit on the next mining connection with work, returning false if
+ * none could take one */
+static bool send_submit(ldata_t *ldata)
+{
+	lconn_t *conn;
+	char buf[512];
+	int i, len;
+
+	for (i = 0; i < ldata->authorised; i++) {
+		conn = ldata->nextconn ? ldata->nextconn : ldata->mining;
+		ldata->nextconn = conn->next;
+		if (conn->jobid && conn->outstanding < OUTSTANDING)
+			goto found;
+	}
+	return false;
+found:
+	/* Valid submits are well formed against the current job so the pool
+	 * hashes and checks them in full, invalid ones name a job that does
+	 * not exist. */
+	len = snprintf(buf, sizeof(buf), "{\"id\":%"PRId64",\"method\":\"mining.submit\","
+		       "\"params\":[\"%s.%d\",\"%s\",\"%0*"PRIx64"\",\"%s\",\"%08x\"]}\n",
+		       conn->next_id, ldata->username, conn->num,
+		       random() % 100 < ldata->invalid ? "ffffffffffff" : conn->jobid,
+		       conn->nonce2len * 2, conn->nonce2++, conn->ntime, (uint32_t)random());
+	conn->sent[conn->next_id % OUTSTANDING] = monotonic_ns();
+	conn->next_id++;
+	conn->outstanding++;
+	ldata->submits++;
+	conn_write(ldata, conn, buf, len);
+	return true;
+}
+
+static json_t *load_report(ldata_t *ldata, const double elapsed)
+{
+	json_t *val, *subval;
+	reason_t *rr, *tmp;
+
+	JSON_CPACK(val, "{sf,si,si,sI,sI,sf,sI,sI,sI,sI,sI,sf}",
+		   "elapsed", elapsed, "open", ldata->open, "authorised", ldata->authorised,
+		   "submits", ldata->submits, "responses", ldata->responses,
+		   "sharerate", ldata->responses / elapsed, "accepted", ldata->accepted,
+		   "rejected", ldata->rejected, "connfails", ldata->connfails,
+		   "drops", ldata->drops, "handshakes", ldata->handshakes,
+		   "handshakerate", ldata->handshakes / elapsed);
+	subval = json_object();
+	HASH_ITER(hh, ldata->reasons, rr, tmp)
+		json_object_set_new(subval, rr->reason, json_integer(rr->count));
+	json_object_set_new_nocheck(val, "reasons", subval);
+	lhist_stats(&ldata->submit_latency, &subval);
+	json_object_set_new_nocheck(val, "latency", subval);
+	lhist_stats(&ldata->handshake_latency, &subval);
+	json_object_set_new_nocheck(val, "handshake", subval);
+	return val;
+}
+
+static int run_load(ldata_t *ldata)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int64_t start, now, last_report, churned = 0;
+	double sent = 0, elapsed;
+	lconn_t *conns;
+	json_t *val;
+	char *buf;
+	int i, ret;
+
+	conns = ckzalloc(sizeof(lconn_t) * ldata->conns);
+	ldata->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ldata->epfd < 0)
+		quit(1, "Failed to epoll_create1");
+	start = last_report = monotonic_ns();
+	for (i = 0; i < ldata->conns; i++) {
+		conns[i].num = i;
+		conns[i].rbuf = ckalloc(RBUFSIZE + 1);
+		open_conn(ldata, &conns[i]);
+	}
+
+	do {
+		ret = epoll_wait(ldata->epfd, events, MAX_EVENTS, 1);
+		if (unlikely(ret < 0 && errno != EINTR))
+			quit(1, "Failed to epoll_wait: %s", strerror(errno));
+		for (i = 0; i < ret; i++)
+			conn_event(ldata, events[i].data.ptr, events[i].events);
+
+		now = monotonic_ns();
+		elapsed = (double)(now - start) / 1000000000;
+
+		/* Pace submits to the total rate since starting */
+		while (sent < ldata->rate * elapsed) {
+			if (!send_submit(ldata)) {
+				sent = ldata->rate * elapsed;
+				break;
+			}
+			sent++;
+		}
+
+		/* Reconnect mining connections at the churn rate, and always
+		 * reopen any that have closed */
+		while (ldata->mining && churned < ldata->churn * elapsed) {
+			close_conn(ldata, ldata->mining);
+			churned++;
+		}
+		for (i = 0; i < ldata->conns; i++) {
+			if (conns[i].state == CONN_CLOSED)
+				open_conn(ldata, &conns[i]);
+		}
+
+		if (now - last_report >= 1000000000) {
+			last_report = now;
+			LOGNOTICE("%.0fs: %d open %d authorised %"PRId64" submits %"PRId64" responses %.0f/s",
+				  elapsed, ldata->open, ldata->authorised, ldata->submits,
+				  ldata->responses, ldata->responses / elapsed);
+		}
+	} while (elapsed < ldata->duration);
+
+	val = load_report(ldata, elapsed);
+	buf = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	printf("%s\n", buf);
+	free(buf);
+	return 0;
+}
+
+/* Minimal bitcoind stand in serving the calls ckpool makes */
+struct fake_btcd {
+	mutex_t lock;
+	int height;
+	char prevhash[68];
+	int transactions;
+	int blocks;
+};
+
+typedef struct fake_btcd btcd_t;
+
+static btcd_t fake_btcd;
+
+static json_t *btcd_template(btcd_t *btcd)
+{
+	json_t *val, *txns, *txn;
+	char data[256], hash[68];
+	int i;
+
+	txns = json_array();
+	mutex_lock(&btcd->lock);
+	for (i = 0; i < btcd->transactions; i++) {
+		snprintf(data, sizeof(data), "%0200x", btcd->height * 1000 + i);
+		snprintf(hash, sizeof(hash), "%064x", btcd->height * 1000 + i + 1);
+		JSON_CPACK(txn, "{ss,ss,ss}", "data", data, "hash", hash, "txid", hash);
+		json_array_append_new(txns, txn);
+	}
+	JSON_CPACK(val, "{ss,ss,si,sI,ss,si,sI,s{ss},so}",
+		   "previousblockhash", btcd->prevhash,
+		   "target", "7fffff0000000000000000000000000000000000000000000000000000000000",
+		   "version", 536870912, "curtime", (json_int_t)time(NULL), "bits", "207fffff",
+		   "height", btcd->height + 1, "coinbasevalue", (json_int_t)5000000000ll,
+		   "coinbaseaux", "flags", "", "transactions", txns);
+	mutex_unlock(&btcd->lock);
+	return val;
+}
+
+static json_t *btcd_call(btcd_t *btcd, const char *method)
+{
+	json_t *res_val;
+
+	if (!safecmp(method, "getblocktemplate"))
+		return btcd_template(btcd);
+	mutex_lock(&btcd->lock);
+	if (!safecmp(method, "validateaddress"))
+		JSON_CPACK(res_val, "{sb}", "isvalid", true);
+	else if (!safecmp(method, "getbestblockhash") || !safecmp(method, "getblockhash"))
+		res_val = json_string(btcd->prevhash);
+	else if (!safecmp(method, "getblockcount"))
+		res_val = json_integer(btcd->height);
+	else {
+		if (!safecmp(method, "submitblock"))
+			btcd->blocks++;
+		res_val = json_null();
+	}
+	mutex_unlock(&btcd->lock);
+	return res_val;
+}
+
+/* Serve one connection's http requests till it closes */
+static void *btcd_conn(void *arg)
+{
+	int fd = *(int *)arg, len, clen, ofs = 0, bufsize = 4096;
+	char *buf = ckalloc(bufsize), *body, *hdr, *resp;
+	json_t *req, *val, *id_val;
+
+	free(arg);
+	pthread_detach(pthread_self());
+	while (42) {
+		while (!(body = strstr(buf, "\r\n\r\n")) && !(body = strstr(buf, "\n\n"))) {
+			if (ofs + 1 >= bufsize) {
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+			len = read(fd, buf + ofs, bufsize - ofs - 1);
+			if (len < 1)
+				goto out;
+			ofs += len;
+			buf[ofs] = '\0';
+		}
+		body += body[0] == '\r' ? 4 : 2;
+		hdr = strcasestr(buf, "Content-Length:");
+		clen = hdr ? atoi(hdr + 15) : 0;
+		while (buf + ofs < body + clen) {
+			int need = body - buf + clen + 1;
+
+			if (need > bufsize) {
+				int bofs = body - buf;
+
+				bufsize = round_up_page(need);
+				buf = realloc(buf, bufsize);
+				body = buf + bofs;
+			}
+			len = read(fd, buf + ofs, bufsize - ofs - 1);
+			if (len < 1)
+				goto out;
+			ofs += len;
+			buf[ofs] = '\0';
+		}
+		req = json_loadb(body, clen, 0, NULL);
+		if (!req)
+			goto out;
+		id_val = json_object_get(req, "id");
+		JSON_CPACK(val, "{sososO}", "result",
+			   btcd_call(&fake_btcd, json_string_value(json_object_get(req, "method"))),
+			   "error", json_null(), "id", id_val ? id_val : json_null());
+		json_decref(req);
+		body = json_dumps(val, JSON_COMPACT | JSON_EOL);
+		json_decref(val);
+		ASPRINTF(&resp, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+			 "Content-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+		free(body);
+		len = strlen(resp);
+		if (write_socket(fd, resp, len) != len) {
+			free(resp);
+			goto out;
+		}
+		free(resp);
+		/* ckpool waits for each response so nothing follows the body */
+		ofs = 0;
+		buf[0] = '\0';
+	}
+out:
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int run_btcd(const int port, const int blocktime)
+{
+	struct sockaddr_in addr;
+	int sockd, one = 1;
+	time_t last_block;
+
+	mutex_init(&fake_btcd.lock);
+	fake_btcd.height = 100;
+	snprintf(fake_btcd.prevhash, sizeof(fake_btcd.prevhash), "%08lx%056x", random(), 0);
+
+	sockd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockd < 0)
+		quit(1, "Failed to open socket");
+	setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(sockd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sockd, SOMAXCONN) < 0)
+		quit(1, "Failed to bind fake bitcoind to port %d", port);
+	LOGNOTICE("Serving block templates on 127.0.0.1:%d", port);
+
+	last_block = time(NULL);
+	while (42) {
+		pthread_t pth;
+		int *fd;
+
+		if (wait_read_select(sockd, 1) > 0) {
+			fd = ckalloc(sizeof(int));
+			*fd = accept(sockd, NULL, NULL);
+			if (*fd < 0)
+				free(fd);
+			else
+				create_pthread(&pth, btcd_conn, fd);
+		}
+		if (blocktime && time(NULL) - last_block >= blocktime) {
+			last_block = time(NULL);
+			mutex_lock(&fake_btcd.lock);
+			fake_btcd.height++;
+			snprintf(fake_btcd.prevhash, sizeof(fake_btcd.prevhash), "%08lx%056x",
+				 random(), fake_btcd.height);
+			mutex_unlock(&fake_btcd.lock);
+			LOGNOTICE("New block height %d", fake_btcd.height);
+		}
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -u host:port   Pool to connect to (default 127.0.0.1:3333)\n"
+		"  -U username    Base username, workers are username.N (default ckpload)\n"
+		"  -n conns       Connections to open (default 1000)\n"
+		"  -r rate        Total share submissions per second (default 1000)\n"
+		"  -i percent     Percentage of deliberately invalid submissions (default 0)\n"
+		"  -d diff        Difficulty to suggest to the pool (default pool's own)\n"
+		"  -c churn       Connections to drop and reopen per second (default 0)\n"
+		"  -t seconds     Duration of the run (default 30)\n"
+		"  -l loglevel    Log level for progress on stderr (default 5)\n"
+		"  -B port        Serve block templates as bitcoind on port instead\n"
+		"  -b seconds     With -B, seconds between new blocks (default 0, never)\n"
+		"  -x txns        With -B, transactions per template (default 5)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *url = NULL, *host, *port;
+	int c, btcdport = 0, blocktime = 0;
+	struct addrinfo hints;
+	struct rlimit rlim;
+	ldata_t ldata;
+
+	memset(&ldata, 0, sizeof(ldata));
+	ldata.conns = 1000;
+	ldata.rate = 1000;
+	ldata.duration = 30;
+	fake_btcd.transactions = 5;
+
+	while ((c = getopt(argc, argv, "B:b:c:d:hi:l:n:r:t:U:u:x:")) != -1) {
+		switch(c) {
+			case 'B':
+				btcdport = atoi(optarg);
+				break;
+			case 'b':
+				blocktime = atoi(optarg);
+				break;
+			case 'c':
+				ldata.churn = atof(optarg);
+				break;
+			case 'd':
+				ldata.diff = atof(optarg);
+				break;
+			case 'i':
+				ldata.invalid = atoi(optarg);
+				break;
+			case 'l':
+				loglevel = atoi(optarg);
+				break;
+			case 'n':
+				ldata.conns = atoi(optarg);
+				break;
+			case 'r':
+				ldata.rate = atof(optarg);
+				break;
+			case 't':
+				ldata.duration = atoi(optarg);
+				break;
+			case 'U':
+				ldata.username = strdup(optarg);
+				break;
+			case 'u':
+				url = strdup(optarg);
+				break;
+			case 'x':
+				fake_btcd.transactions = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	srandom(time(NULL) ^ getpid());
+	json_slab_init();
+
+	if (btcdport)
+		return run_btcd(btcdport, blocktime);
+
+	if (ldata.conns < 1 || ldata.rate < 0 || ldata.duration < 1)
+		usage(argv[0]);
+	if (!ldata.username)
+		ldata.username = strdup("ckpload");
+	if (!url)
+		url = strdup("127.0.0.1:3333");
+	if (!extract_sockaddr(url, &host, &port))
+		quit(1, "Failed to extract address from %s", url);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ldata.addr))
+		quit(1, "Failed to resolve %s:%s", host, port);
+
+	/* Make room for every connection's fd */
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < (rlim_t)ldata.conns + 64) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+		if (rlim.rlim_cur < (rlim_t)ldata.conns + 64)
+			LOGWARNING("Open file limit %d too low for %d connections",
+				   (int)rlim.rlim_cur, ldata.conns);
+	}
+	/* Writes to connections the pool has dropped should just fail */
+	signal(SIGPIPE, SIG_IGN);
+
+	return run_load(&ldata);
+}
@@ -14,6 +14,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <ctype.h>
 #include <fenv.h>
@@ -35,175 +36,1014 @@
 
 ckpool_t *global_ckp;
 
-static void proclog(ckpool_t *ckp, char *msg)
+/* Each thread that logs to the logfile adds to its own ring of records that
+ * only it writes to, and the one logwriter thread of each process drains them
+ * all, so queueing a log message takes no lock, malloc or syscall. Messages
+ * too long for a record are malloced, and those logged while the ring is full
+ * go on the ring's overflow stack, unless logbounded is set when they're
+ * truncated and dropped instead so the logger never uses more than the rings */
+#define LOGREC_LEN 488
+#define LOGWRITE_BUFSIZ 65536
+
+struct logrec {
+	tv_t stamp;
+	uint32_t seq; /* Order the ring's owner logged it in */
+	int errnum; /* Non zero to add the errno to the message */
+	int len;
+	char *big; /* Malloced message too long for msg */
+	char msg[LOGREC_LEN];
+};
+
+typedef struct logrec logrec_t;
+
+struct logover {
+	struct logover *next;
+	tv_t stamp;
+	uint32_t seq;
+	int errnum;
+	int len;
+	char msg[];
+};
+
+typedef struct logover logover_t;
+
+struct logring {
+	struct logring *next; /* All rings, only ever added to */
+	bool owned; /* By a running thread, rings are reused once released */
+	uint32_t seq; /* Only changed by the owner */
+	uint32_t head; /* Next slot to fill, only changed by the owner */
+	uint32_t tail; /* Next slot to write, only changed by the logwriter */
+	logover_t *over; /* Overflow stack, newest first */
+	logrec_t *recs;
+};
+
+typedef struct logring logring_t;
+
+static logring_t *logrings;
+static __thread logring_t *logring;
+static pthread_key_t logring_key;
+static pthread_once_t logring_once = PTHREAD_ONCE_INIT;
+/* Records per ring, a power of 2 */
+static uint32_t logring_size = 256;
+static bool logbounded;
+
+static pthread_t logwriter_pth;
+static mutex_t logwriter_lock;
+static pthread_cond_t logwriter_cond;
+static bool logwriter_sleeping;
+
+static int64_t log_written;
+static int64_t log_dropped;
+static int64_t log_truncated;
+static int64_t log_overflowed;
+
+static void logring_release(void *arg)
+{
+	logring_t *ring = arg;
+
+	__atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE);
+}
+
+static void logring_key_create(void)
+{
+	pthread_key_create(&logring_key, logring_release);
+}
+
+/* Return this thread's ring, reusing one released by an exited thread if
+ * there is one */
+static logring_t *logring_get(void)
+{
+	logring_t *ring = logring;
+	bool owned;
+
+	if (likely(ring))
+		return ring;
+
+	pthread_once(&logring_once, logring_key_create);
+	for (ring = __atomic_load_n(&logrings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		owned = false;
+		if (__atomic_compare_exchange_n(&ring->owned, &owned, true, false,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!ring) {
+		ring = ckzalloc(sizeof(logring_t));
+		ring->recs = ckalloc(sizeof(logrec_t) * logring_size);
+		ring->owned = true;
+		ring->next = __atomic_load_n(&logrings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&logrings, &ring->next, ring, true,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(logring_key, ring);
+	logring = ring;
+	return ring;
+}
+
+static bool logrings_pending(void)
+{
+	logring_t *ring;
+
+	for (ring = __atomic_load_n(&logrings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) !=
+		    __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) ||
+		    __atomic_load_n(&ring->over, __ATOMIC_SEQ_CST))
+			return true;
+	}
+	return false;
+}
+
+/* Queue a formatted message for the logwriter */
+static void log_queue(const tv_t *stamp, const int errnum, const char *msg, int len)
 {
-	FILE *LOGFP;
-	int logfd;
+	logring_t *ring = logring_get();
+	uint32_t head = ring->head;
+	logover_t *over;
+	logrec_t *rec;
 
-	if (unlikely(!msg)) {
-		fprintf(stderr, "Proclog received null message");
+	if (len >= LOGREC_LEN && logbounded) {
+		len = LOGREC_LEN - 1;
+		__atomic_add_fetch(&log_truncated, 1, __ATOMIC_RELAXED);
+	}
+	/* Once anything is in overflow everything goes there until the
+	 * logwriter takes it, so the ring is never ahead of the overflow */
+	if (!__atomic_load_n(&ring->over, __ATOMIC_ACQUIRE) &&
+	    head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < logring_size) {
+		rec = &ring->recs[head & (logring_size - 1)];
+		rec->big = NULL;
+		if (len >= LOGREC_LEN) {
+			rec->big = malloc(len);
+			if (unlikely(!rec->big)) {
+				__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			memcpy(rec->big, msg, len);
+			__atomic_add_fetch(&log_overflowed, 1, __ATOMIC_RELAXED);
+		} else
+			memcpy(rec->msg, msg, len);
+		rec->stamp = *stamp;
+		rec->seq = ring->seq++;
+		rec->errnum = errnum;
+		rec->len = len;
+		__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	} else if (logbounded || !(over = malloc(sizeof(logover_t) + len))) {
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
 		return;
+	} else {
+		over->stamp = *stamp;
+		over->seq = ring->seq++;
+		over->errnum = errnum;
+		over->len = len;
+		memcpy(over->msg, msg, len);
+		over->next = __atomic_load_n(&ring->over, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&ring->over, &over->next, over, true,
+						    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+		__atomic_add_fetch(&log_overflowed, 1, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_load_n(&logwriter_sleeping, __ATOMIC_SEQ_CST)) {
+		mutex_lock(&logwriter_lock);
+		pthread_cond_signal(&logwriter_cond);
+		mutex_unlock(&logwriter_lock);
+	}
+}
+
+struct logwrite {
+	int fd;
+	char *buf;
+	size_t len;
+	time_t sec;
+	char date[64];
+};
+
+typedef struct logwrite logwrite_t;
+
+/* Write all of data to the logfile with exclusive access */
+static void logwrite_out(const int fd, const char *data, size_t len)
+{
+	ssize_t ret;
+
+	flock(fd, LOCK_EX);
+	while (len) {
+		ret = write(fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		data += ret;
+		len -= ret;
 	}
-	if (unlikely(!strlen(msg))) {
-		fprintf(stderr, "Proclog received zero length message");
-		free(msg);
+	flock(fd, LOCK_UN);
+}
+
+static void logwrite_flush(logwrite_t *lw)
+{
+	if (!lw->len)
+		return;
+	logwrite_out(lw->fd, lw->buf, lw->len);
+	lw->len = 0;
+}
+
+static void logwrite_add(logwrite_t *lw, const char *data, const size_t len)
+{
+	if (lw->len + len > LOGWRITE_BUFSIZ)
+		logwrite_flush(lw);
+	/* Only a huge overflow message won't fit, write it as is */
+	if (len > LOGWRITE_BUFSIZ) {
+		logwrite_out(lw->fd, data, len);
 		return;
 	}
-	LOGFP = ckp->logfp;
-	logfd = ckp->logfd;
+	memcpy(lw->buf + lw->len, data, len);
+	lw->len += len;
+}
+
+/* Add a message to the write buffer in the same format logmsg() always used,
+ * only formatting the date when the second changes */
+static void logwrite_msg(logwrite_t *lw, const tv_t *stamp, const int errnum,
+			 const char *msg, const int len)
+{
+	char tmp[128];
+	struct tm tm;
+	int n;
+
+	if (stamp->tv_sec != lw->sec) {
+		localtime_r(&(stamp->tv_sec), &tm);
+		snprintf(lw->date, sizeof(lw->date), "[%d-%02d-%02d %02d:%02d:%02d",
+			 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			 tm.tm_hour, tm.tm_min, tm.tm_sec);
+		lw->sec = stamp->tv_sec;
+	}
+	n = snprintf(tmp, sizeof(tmp), "%s.%03d] ", lw->date, (int)(stamp->tv_usec / 1000));
+	logwrite_add(lw, tmp, n);
+	logwrite_add(lw, msg, len);
+	if (errnum)
+		n = snprintf(tmp, sizeof(tmp), " with errno %d: %s\n", errnum, strerror(errnum));
+	else
+		n = snprintf(tmp, sizeof(tmp), "\n");
+	logwrite_add(lw, tmp, n);
+}
+
+/* Write everything queued on ring, returning how many messages there were.
+ * The overflow is taken before looking at the head so nothing in the ring
+ * can be newer than the overflow, then both are written in seq order */
+static int logring_drain(logwrite_t *lw, logring_t *ring)
+{
+	logover_t *over, *list = NULL, *next;
+	uint32_t head, tail = ring->tail;
+	logrec_t *rec;
+	int count = 0;
+
+	over = __atomic_exchange_n(&ring->over, NULL, __ATOMIC_SEQ_CST);
+	while (over) {
+		next = over->next;
+		over->next = list;
+		list = over;
+		over = next;
+	}
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	while (tail != head || list) {
+		rec = tail != head ? &ring->recs[tail & (logring_size - 1)] : NULL;
+		if (list && (!rec || (int32_t)(list->seq - rec->seq) < 0)) {
+			logwrite_msg(lw, &list->stamp, list->errnum, list->msg, list->len);
+			next = list->next;
+			free(list);
+			list = next;
+		} else {
+			logwrite_msg(lw, &rec->stamp, rec->errnum,
+				     rec->big ? rec->big : rec->msg, rec->len);
+			free(rec->big);
+			__atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+		}
+		count++;
+	}
+	return count;
+}
+
+static void logwriter_sleep(void)
+{
+	tv_t now;
+	ts_t abs;
+
+	mutex_lock(&logwriter_lock);
+	__atomic_store_n(&logwriter_sleeping, true, __ATOMIC_SEQ_CST);
+	if (!logrings_pending()) {
+		tv_time(&now);
+		tv_to_ts(&abs, &now);
+		abs.tv_sec++;
+		cond_timedwait(&logwriter_cond, &logwriter_lock, &abs);
+	}
+	__atomic_store_n(&logwriter_sleeping, false, __ATOMIC_RELAXED);
+	mutex_unlock(&logwriter_lock);
+}
+
+/* The one thread per process that writes the log rings to the logfile,
+ * batching writes under one flock, and noting any messages lost */
+static void *logwriter(void *arg)
+{
+	const char *name = arg;
+	int64_t dropped, reported = 0;
+	logwrite_t lw;
+	logring_t *ring;
+	tv_t now;
+	int count;
+
+	pthread_detach(pthread_self());
+	rename_proc(name);
+
+	memset(&lw, 0, sizeof(lw));
+	lw.buf = ckalloc(LOGWRITE_BUFSIZ);
+	while (42) {
+		/* The logfd isn't set in the main process until after this
+		 * thread is started */
+		lw.fd = global_ckp->logfd;
+		count = 0;
+		for (ring = __atomic_load_n(&logrings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+			count += logring_drain(&lw, ring);
+		dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED) +
+			  __atomic_load_n(&log_truncated, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			char msg[128];
+			int len;
+
+			len = snprintf(msg, sizeof(msg), "Logger has dropped %"PRId64
+				       " and truncated %"PRId64" messages",
+				       __atomic_load_n(&log_dropped, __ATOMIC_RELAXED),
+				       __atomic_load_n(&log_truncated, __ATOMIC_RELAXED));
+			tv_time(&now);
+			logwrite_msg(&lw, &now, 0, msg, len);
+			reported = dropped;
+		}
+		logwrite_flush(&lw);
+		__atomic_add_fetch(&log_written, count, __ATOMIC_RELAXED);
+		if (!count)
+			logwriter_sleep();
+	}
+	return NULL;
+}
 
-	flock(logfd, LOCK_EX);
-	fprintf(LOGFP, "%s", msg);
-	flock(logfd, LOCK_UN);
+void logger_counters(logger_counters_t *counters)
+{
+	logring_t *ring;
 
-	free(msg);
+	memset(counters, 0, sizeof(logger_counters_t));
+	counters->written = __atomic_load_n(&log_written, __ATOMIC_RELAXED);
+	counters->dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	counters->truncated = __atomic_load_n(&log_truncated, __ATOMIC_RELAXED);
+	counters->overflowed = __atomic_load_n(&log_overflowed, __ATOMIC_RELAXED);
+	for (ring = __atomic_load_n(&logrings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		counters->rings++;
+		counters->pending += __atomic_load_n(&ring->head, __ATOMIC_RELAXED) -
+				     __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+	counters->memory = (int64_t)counters->rings * (sizeof(logring_t) +
+			   sizeof(logrec_t) * logring_size);
 }
 
 /* Log everything to the logfile, but display warnings on the console as well */
 void logmsg(int loglevel, const char *fmt, ...) {
 	if (global_ckp->loglevel >= loglevel && fmt) {
 		int logfd = global_ckp->logfd;
-		char *buf = NULL;
+		int errnum = loglevel <= LOG_ERR ? errno : 0;
+		char local[LOGREC_LEN], *buf = local, *heap = NULL;
 		struct tm tm;
 		tv_t now_tv;
-		int ms;
+		int len, ms;
 		va_list ap;
 		char stamp[128];
 
 		va_start(ap, fmt);
-		VASPRINTF(&buf, fmt, ap);
+		len = vsnprintf(local, sizeof(local), fmt, ap);
 		va_end(ap);
+		if (unlikely(len < 0))
+			return;
+		if (unlikely(len >= (int)sizeof(local))) {
+			va_start(ap, fmt);
+			VASPRINTF(&heap, fmt, ap);
+			va_end(ap);
+			buf = heap;
+		}
 
 		tv_time(&now_tv);
-		ms = (int)(now_tv.tv_usec / 1000);
-		localtime_r(&(now_tv.tv_sec), &tm);
-		sprintf(stamp, "[%d-%02d-%02d %02d:%02d:%02d.%03d]",
-				tm.tm_year + 1900,
-				tm.tm_mon + 1,
-				tm.tm_mday,
-				tm.tm_hour,
-				tm.tm_min,
-				tm.tm_sec, ms);
 		if (loglevel <= LOG_WARNING) {
+			ms = (int)(now_tv.tv_usec / 1000);
+			localtime_r(&(now_tv.tv_sec), &tm);
+			sprintf(stamp, "[%d-%02d-%02d %02d:%02d:%02d.%03d]",
+					tm.tm_year + 1900,
+					tm.tm_mon + 1,
+					tm.tm_mday,
+					tm.tm_hour,
+					tm.tm_min,
+					tm.tm_sec, ms);
 			fprintf(stderr, "\33[2K\r");
-			if (loglevel <= LOG_ERR && errno != 0)
-				fprintf(stderr, "%s %s with errno %d: %s\n", stamp, buf, errno, strerror(errno));
+			if (errnum)
+				fprintf(stderr, "%s %s with errno %d: %s\n", stamp, buf, errnum, strerror(errnum));
 			else
 				fprintf(stderr, "%s %s\n", stamp, buf);
 			fflush(stderr);
 		}
-		if (logfd) {
-			char *msg;
+		if (logfd)
+			log_queue(&now_tv, errnum, buf, len);
+		free(heap);
+	}
+}
 
-			if (loglevel <= LOG_ERR && errno != 0)
-				ASPRINTF(&msg, "%s %s with errno %d: %s\n", stamp, buf, errno, strerror(errno));
-			else
-				ASPRINTF(&msg, "%s %s\n", stamp, buf);
-			ckmsgq_add(global_ckp->logger, msg);
+#define CKMSGQ_MAXBATCH 64
+/* Routing slots that ids are hashed to in a stealing group */
+#define CKMSGQ_ROUTES 1024
+
+static slab_cache_t *ckmsg_slab;
+
+ckmsg_t *ckmsg_alloc(void)
+{
+	ckmsg_t *msg = slab_alloc(ckmsg_slab);
+
+	msg->route = -1;
+	return msg;
+}
+
+/* Return a chain of processed messages linked by next to this thread's slab
+ * magazines */
+static void ckmsg_recycle(ckmsg_t *first)
+{
+	ckmsg_t *msg;
+
+	while (first) {
+		msg = first;
+		first = msg->next;
+		slab_free(ckmsg_slab, msg);
+	}
+}
+
+static inline int64_t ckmsg_stamp(void)
+{
+	ts_t ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/* Push a chain of messages, linked newest first from first to last, on to a
+ * message stack. This is the only operation producers do on the queue so any
+ * number of them can do it concurrently. */
+static void ckmsgq_push(ckmsg_t **stack, ckmsg_t *first, ckmsg_t *last)
+{
+	ckmsg_t *head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+
+	do {
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(stack, &head, first, true, __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+}
+
+/* Take everything from a message stack in one go, returning it oldest first */
+static ckmsg_t *ckmsgq_grab(ckmsg_t **stack, int *count)
+{
+	ckmsg_t *msg = __atomic_exchange_n(stack, NULL, __ATOMIC_ACQUIRE), *list = NULL, *next;
+
+	*count = 0;
+	while (msg) {
+		next = msg->next;
+		msg->next = list;
+		list = msg;
+		msg = next;
+		(*count)++;
+	}
+	return list;
+}
+
+/* Wake the thread of a queue if it's sleeping or has been kicked */
+static void ckmsgq_wake(ckmsgq_t *ckmsgq, const bool kick)
+{
+	if (!kick && !__atomic_load_n(&ckmsgq->sleeping, __ATOMIC_SEQ_CST))
+		return;
+	mutex_lock(ckmsgq->lock);
+	if (kick)
+		ckmsgq->kicked = true;
+	pthread_cond_signal(ckmsgq->cond);
+	mutex_unlock(ckmsgq->lock);
+}
+
+/* Wake one idle thread in the group other than the one for ckmsgq to come and
+ * steal from the backlog it has. */
+static void ckmsgq_kick(ckmsgq_t *ckmsgq)
+{
+	ckmsgq_t *group = ckmsgq->group;
+	int i;
+
+	for (i = 1; i < group->queues; i++) {
+		ckmsgq_t *idle = &group[(ckmsgq->qid + i) % group->queues];
+
+		if (__atomic_load_n(&idle->idle, __ATOMIC_SEQ_CST)) {
+			ckmsgq_wake(idle, true);
+			break;
 		}
-		free(buf);
 	}
 }
 
-/* Generic function for creating a message queue receiving and parsing thread */
+/* Put messages taken off a stack back underneath any pushed since, as
+ * they're older. Only safe with the queue's lock held since its own thread
+ * must not grab the newer ones before the older ones are back. */
+static void ckmsgq_return(ckmsg_t **stack, ckmsg_t *old)
+{
+	ckmsg_t *head, *last;
+
+	while (42) {
+		head = NULL;
+		if (__atomic_compare_exchange_n(stack, &head, old, false, __ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			break;
+		head = __atomic_exchange_n(stack, NULL, __ATOMIC_ACQUIRE);
+		if (!head)
+			continue;
+		for (last = head; last->next; last = last->next);
+		last->next = old;
+		old = head;
+	}
+}
+
+/* Take up to half of what is queued on the first other queue in the group
+ * that has more than one message waiting to be processed. Routed messages are
+ * only taken a whole slot at a time, when everything counted on the slot is
+ * still queued, moving the slot to this queue in the same atomic op. Messages
+ * with the same id are then never processed on two threads at once or out of
+ * order. The victim's lock keeps its own thread off its queue meanwhile. */
+static ckmsg_t *ckmsgq_steal(ckmsgq_t *ckmsgq, int *count)
+{
+	int seen[CKMSGQ_ROUTES], i, limit, queued;
+	int8_t taken[CKMSGQ_ROUTES];
+	ckmsgq_t *group = ckmsgq->group;
+	ckmsg_t *list = NULL;
+
+	*count = 0;
+	for (i = 1; i < group->queues && !list; i++) {
+		ckmsgq_t *victim = &group[(ckmsgq->qid + i) % group->queues];
+		ckmsg_t *stack, *rest = NULL, **tail = &rest, *msg, *next;
+
+		if (__atomic_load_n(&victim->pending, __ATOMIC_RELAXED) < 2 ||
+		    !__atomic_load_n(&victim->msgs, __ATOMIC_RELAXED))
+			continue;
+		mutex_lock(victim->lock);
+		stack = __atomic_exchange_n(&victim->msgs, NULL, __ATOMIC_ACQUIRE);
+		if (!stack) {
+			mutex_unlock(victim->lock);
+			continue;
+		}
+
+		memset(seen, 0, sizeof(seen));
+		memset(taken, 0, sizeof(taken));
+		for (queued = 0, msg = stack; msg; msg = msg->next) {
+			if (msg->route >= 0)
+				seen[msg->route]++;
+			queued++;
+		}
+		limit = (queued + 1) / 2;
+
+		/* Split the newest first stack into what we take and the rest,
+		 * both staying newest first */
+		for (msg = stack; msg; msg = next) {
+			int route = msg->route;
+
+			next = msg->next;
+			if (route >= 0 && !taken[route]) {
+				int64_t from = ((int64_t)victim->qid << 32) | seen[route],
+					to = ((int64_t)ckmsgq->qid << 32) | seen[route];
+
+				taken[route] = -1;
+				if (*count + seen[route] <= limit &&
+				    __atomic_compare_exchange_n(&group->routes[route], &from, to, false,
+								__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+					taken[route] = 1;
+			}
+			if (route >= 0 ? taken[route] > 0 : *count < limit) {
+				msg->next = list;
+				list = msg;
+				(*count)++;
+			} else {
+				*tail = msg;
+				tail = &msg->next;
+			}
+		}
+		*tail = NULL;
+		if (rest)
+			ckmsgq_return(&victim->msgs, rest);
+		mutex_unlock(victim->lock);
+		if (rest)
+			ckmsgq_wake(victim, false);
+
+		if (list) {
+			__atomic_sub_fetch(&victim->pending, *count, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ckmsgq->pending, *count, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ckmsgq->stolen, *count, __ATOMIC_RELAXED);
+		}
+	}
+	return list;
+}
+
+/* Append the oldest first list to the end of tail's list */
+static ckmsg_t *ckmsg_join(ckmsg_t *list, ckmsg_t *tail)
+{
+	ckmsg_t *msg = list;
+
+	if (!list)
+		return tail;
+	while (msg->next)
+		msg = msg->next;
+	msg->next = tail;
+	return list;
+}
+
+/* Sleep for up to a second unless there's something to do, flagging we're
+ * asleep first so producers know to signal us. */
+static void ckmsgq_sleep(ckmsgq_t *ckmsgq)
+{
+	tv_t now;
+	ts_t abs;
+
+	mutex_lock(ckmsgq->lock);
+	__atomic_store_n(&ckmsgq->sleeping, true, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&ckmsgq->msgs, __ATOMIC_SEQ_CST) &&
+	    !__atomic_load_n(&ckmsgq->prio, __ATOMIC_SEQ_CST) && !ckmsgq->kicked) {
+		tv_time(&now);
+		tv_to_ts(&abs, &now);
+		abs.tv_sec++;
+		cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
+	}
+	__atomic_store_n(&ckmsgq->sleeping, false, __ATOMIC_RELAXED);
+	ckmsgq->kicked = false;
+	mutex_unlock(ckmsgq->lock);
+}
+
+/* Generic function for creating a message queue receiving and parsing thread.
+ * Everything queued is taken in one atomic exchange and worked through up to
+ * the batch size at a time, passed to the batch function if there is one.
+ * High priority messages are taken before each batch. */
 static void *ckmsg_queue(void *arg)
 {
 	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
 	ckpool_t *ckp = ckmsgq->ckp;
+	ckmsg_t *list = NULL;
 
 	pthread_detach(pthread_self());
 	rename_proc(ckmsgq->name);
 
 	while (42) {
-		ckmsg_t *msg;
-		tv_t now;
-		ts_t abs;
-
-		mutex_lock(ckmsgq->lock);
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec++;
-		if (!ckmsgq->msgs)
-			cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
-		msg = ckmsgq->msgs;
-		if (msg)
-			DL_DELETE(ckmsgq->msgs, msg);
-		mutex_unlock(ckmsgq->lock);
-
-		if (!msg)
+		ckmsg_t *msgs[CKMSGQ_MAXBATCH], *msg;
+		void *data[CKMSGQ_MAXBATCH];
+		int64_t now, latency;
+		int i, count;
+
+		if (unlikely(__atomic_load_n(&ckmsgq->prio, __ATOMIC_RELAXED)))
+			list = ckmsg_join(ckmsgq_grab(&ckmsgq->prio, &count), list);
+		if (!list && ckmsgq->group->steal) {
+			/* Thieves hold our lock while they have our queue out */
+			mutex_lock(ckmsgq->lock);
+			list = ckmsgq_grab(&ckmsgq->msgs, &count);
+			mutex_unlock(ckmsgq->lock);
+		} else if (!list)
+			list = ckmsgq_grab(&ckmsgq->msgs, &count);
+		if (!list && ckmsgq->group->steal) {
+			/* Flag we're idle before looking so anything queued
+			 * elsewhere after we've looked will kick us */
+			__atomic_store_n(&ckmsgq->idle, true, __ATOMIC_SEQ_CST);
+			list = ckmsgq_steal(ckmsgq, &count);
+			if (!list)
+				ckmsgq_sleep(ckmsgq);
+			__atomic_store_n(&ckmsgq->idle, false, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!list) {
+			ckmsgq_sleep(ckmsgq);
 			continue;
-		ckmsgq->func(ckp, msg->data);
-		free(msg);
+		}
+
+		now = ckmsg_stamp();
+		for (count = 0; list && count < ckmsgq->batch; count++) {
+			msg = list;
+			list = msg->next;
+			msgs[count] = msg;
+			data[count] = msg->data;
+			latency = now - msg->stamp;
+			if (latency > __atomic_load_n(&ckmsgq->maxlatency, __ATOMIC_RELAXED))
+				__atomic_store_n(&ckmsgq->maxlatency, latency, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ckmsgq->latency, latency, __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&ckmsgq->latencies, count, __ATOMIC_RELAXED);
+		if (ckmsgq->batchfunc)
+			ckmsgq->batchfunc(ckp, data, count);
+		else {
+			for (i = 0; i < count; i++)
+				ckmsgq->func(ckp, data[i]);
+		}
+		__atomic_sub_fetch(&ckmsgq->pending, count, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ckmsgq->processed, count, __ATOMIC_RELAXED);
+		for (i = 0; i < count; i++) {
+			if (msgs[i]->route >= 0)
+				__atomic_sub_fetch(&ckmsgq->group->routes[msgs[i]->route], 1,
+						   __ATOMIC_SEQ_CST);
+		}
+
+		for (i = 0; i < count - 1; i++)
+			msgs[i]->next = msgs[i + 1];
+		msgs[count - 1]->next = NULL;
+		ckmsg_recycle(msgs[0]);
 	}
 	return NULL;
 }
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 {
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
-
-	strncpy(ckmsgq->name, name, 15);
-	ckmsgq->func = func;
-	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
-	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
-
-	return ckmsgq;
+	return create_ckmsgqs_batch(ckp, name, func, NULL, 1, 1, false);
 }
 
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+{
+	return create_ckmsgqs_batch(ckp, name, func, NULL, count, 1, false);
+}
+
+/* Create a group of count queues, each with its own thread. batchfunc, if
+ * set, is handed up to batch messages at a time instead of func being called
+ * on each one. With steal set, idle threads take messages from the backlog
+ * of other queues in the group. */
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func,
+			       const void *batchfunc, const int count, int batch, const bool steal)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
-	mutex_t *lock;
-	pthread_cond_t *cond;
 	int i;
 
-	lock = ckalloc(sizeof(mutex_t));
-	cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(lock);
-	cond_init(cond);
+	if (batch < 1)
+		batch = 1;
+	else if (batch > CKMSGQ_MAXBATCH)
+		batch = CKMSGQ_MAXBATCH;
+
+	ckmsgq->queues = count;
+	ckmsgq->steal = steal && count > 1;
+	if (ckmsgq->steal) {
+		ckmsgq->routes = ckalloc(sizeof(int64_t) * CKMSGQ_ROUTES);
+		for (i = 0; i < CKMSGQ_ROUTES; i++)
+			ckmsgq->routes[i] = (int64_t)(i % count) << 32;
+	}
 
 	for (i = 0; i < count; i++) {
-		snprintf(ckmsgq[i].name, 15, "%.8s%x", name, i);
+		if (count > 1)
+			snprintf(ckmsgq[i].name, 15, "%.8s%x", name, i);
+		else
+			strncpy(ckmsgq[i].name, name, 15);
 		ckmsgq[i].func = func;
+		ckmsgq[i].batchfunc = batchfunc;
+		ckmsgq[i].batch = batch;
 		ckmsgq[i].ckp = ckp;
-		ckmsgq[i].lock = lock;
-		ckmsgq[i].cond = cond;
+		ckmsgq[i].group = ckmsgq;
+		ckmsgq[i].qid = i;
+		ckmsgq[i].lock = ckalloc(sizeof(mutex_t));
+		ckmsgq[i].cond = ckalloc(sizeof(pthread_cond_t));
+		mutex_init(ckmsgq[i].lock);
+		cond_init(ckmsgq[i].cond);
+	}
+	for (i = 0; i < count; i++)
 		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
-	}
 
 	return ckmsgq;
 }
 
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
+/* Queue a chain of messages linked oldest first by next, on the high priority
+ * stack if prio is set. */
+static void __ckmsgq_add(ckmsgq_t *ckmsgq, ckmsg_t *list, const int count, const bool prio)
+{
+	ckmsg_t *first = NULL, *last = list, *msg, *next;
+	int64_t stamp = ckmsg_stamp();
+	int pending;
+
+	/* Reverse the list into a newest first chain for the stack */
+	for (msg = list; msg; msg = next) {
+		next = msg->next;
+		msg->stamp = stamp;
+		msg->next = first;
+		first = msg;
+	}
+
+	__atomic_add_fetch(&ckmsgq->messages, count, __ATOMIC_RELAXED);
+	pending = __atomic_add_fetch(&ckmsgq->pending, count, __ATOMIC_RELAXED);
+	if (pending > __atomic_load_n(&ckmsgq->maxpending, __ATOMIC_RELAXED))
+		__atomic_store_n(&ckmsgq->maxpending, pending, __ATOMIC_RELAXED);
+	ckmsgq_push(prio ? &ckmsgq->prio : &ckmsgq->msgs, first, last);
+
+	ckmsgq_wake(ckmsgq, false);
+	if (pending > 1 && ckmsgq->group->steal)
+		ckmsgq_kick(ckmsgq);
+}
+
+static void ckmsgq_add_one(ckmsgq_t *ckmsgq, void *data)
+{
+	ckmsg_t *msg = ckmsg_alloc();
+
+	msg->data = data;
+	msg->next = NULL;
+	__ckmsgq_add(ckmsgq, msg, 1, false);
+}
+
+/* Generic function for adding messages to a ckmsgq and waking the ckmsgq
+ * parsing thread to process it. Messages added to a group of queues are
+ * distributed round robin. */
 void ckmsgq_add(ckmsgq_t *ckmsgq, void *data)
 {
-	ckmsg_t *msg = ckalloc(sizeof(ckmsg_t));
+	int qid = 0;
+
+	if (ckmsgq->queues > 1) {
+		qid = __atomic_fetch_add(&ckmsgq->rr, 1, __ATOMIC_RELAXED);
+		qid = (unsigned int)qid % ckmsgq->queues;
+	}
+	ckmsgq_add_one(&ckmsgq[qid], data);
+}
+
+/* As ckmsgq_add but messages with the same id are always processed in order
+ * by one queue in a group. In a stealing group ids are hashed to routing
+ * slots which can move between queues, so the message is counted on its slot
+ * in the same atomic op that reads which queue owns it. */
+void ckmsgq_add_id(ckmsgq_t *ckmsgq, void *data, const int64_t id)
+{
+	ckmsg_t *msg;
+	int64_t route;
+	int slot;
 
+	if (!ckmsgq->steal) {
+		ckmsgq_add_one(&ckmsgq[(uint64_t)id % ckmsgq->queues], data);
+		return;
+	}
+	slot = (uint64_t)id % CKMSGQ_ROUTES;
+	route = __atomic_fetch_add(&ckmsgq->routes[slot], 1, __ATOMIC_SEQ_CST);
+	msg = ckmsg_alloc();
 	msg->data = data;
+	msg->next = NULL;
+	msg->route = slot;
+	__ckmsgq_add(&ckmsgq[route >> 32], msg, 1, false);
+}
 
-	mutex_lock(ckmsgq->lock);
-	ckmsgq->messages++;
-	DL_APPEND(ckmsgq->msgs, msg);
-	pthread_cond_broadcast(ckmsgq->cond);
-	mutex_unlock(ckmsgq->lock);
+/* Add a list of count messages from ckmsg_alloc, linked oldest first by next,
+ * to the first queue of ckmsgq in one go, to be processed before anything
+ * else already queued if prio is set. */
+void ckmsgq_add_bulk(ckmsgq_t *ckmsgq, ckmsg_t *list, const int count, const bool prio)
+{
+	if (likely(list))
+		__ckmsgq_add(ckmsgq, list, count, prio);
 }
 
-/* Return whether there are any messages queued in the ckmsgq linked list. */
+/* Return whether there are any messages queued in the ckmsgq. */
 bool ckmsgq_empty(ckmsgq_t *ckmsgq)
 {
-	bool ret = true;
+	return !__atomic_load_n(&ckmsgq->pending, __ATOMIC_RELAXED);
+}
 
-	mutex_lock(ckmsgq->lock);
-	if (ckmsgq->msgs)
-		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
-	mutex_unlock(ckmsgq->lock);
+/* Fill in the counters of ckmsgq, summing all the queues in a group. The
+ * latencies and maximum pending are since the last time this was called. */
+void ckmsgq_counters(ckmsgq_t *ckmsgq, ckmsgq_counters_t *counters)
+{
+	int64_t latency = 0, latencies = 0;
+	int i;
 
-	return ret;
+	memset(counters, 0, sizeof(ckmsgq_counters_t));
+	for (i = 0; i < ckmsgq->queues; i++) {
+		ckmsgq_t *q = &ckmsgq[i];
+		int64_t maxlatency;
+		int maxpending;
+
+		counters->pending += __atomic_load_n(&q->pending, __ATOMIC_RELAXED);
+		counters->messages += __atomic_load_n(&q->messages, __ATOMIC_RELAXED);
+		counters->processed += __atomic_load_n(&q->processed, __ATOMIC_RELAXED);
+		counters->stolen += __atomic_load_n(&q->stolen, __ATOMIC_RELAXED);
+		latency += __atomic_exchange_n(&q->latency, 0, __ATOMIC_RELAXED);
+		latencies += __atomic_exchange_n(&q->latencies, 0, __ATOMIC_RELAXED);
+		maxpending = __atomic_exchange_n(&q->maxpending, 0, __ATOMIC_RELAXED);
+		if (maxpending > counters->maxpending)
+			counters->maxpending = maxpending;
+		maxlatency = __atomic_exchange_n(&q->maxlatency, 0, __ATOMIC_RELAXED);
+		if (maxlatency > counters->maxlatency)
+			counters->maxlatency = maxlatency;
+	}
+	if (latencies)
+		counters->avglatency = latency / latencies;
+}
+
+/* A message length of all ones sent as the first 4 bytes of a unix socket
+ * connection denotes a persistent channel of length framed messages that
+ * require no response, as used by send_proc. */
+#define UNIX_CHANNEL 0xFFFFFFFFu
+
+typedef struct unix_channel unix_channel_t;
+
+struct unix_channel {
+	proc_instance_t *pi;
+	int sockd;
+};
+
+/* Hand a message straight to the process' urgent_func if it matches its
+ * urgent_cmd, freeing it afterwards, returning whether it was consumed */
+static bool urgent_unix_msg(proc_instance_t *pi, unix_msg_t *umsg)
+{
+	void (*func)(ckpool_t *, unix_msg_t *) = __atomic_load_n(&pi->urgent_func, __ATOMIC_ACQUIRE);
+
+	if (likely(!func || !cmdmatch(umsg->buf, pi->urgent_cmd)))
+		return false;
+	func(pi->ckp, umsg);
+	if (umsg->sockd >= 0)
+		Close(umsg->sockd);
+	free(umsg->buf);
+	free(umsg);
+	return true;
+}
+
+/* Drain as many length framed messages as are available on a persistent
+ * channel with each read, adding them all to the proc instance's received
+ * messages in one batch. */
+static void *channel_receiver(void *arg)
+{
+	unix_channel_t *uc = (unix_channel_t *)arg;
+	proc_instance_t *pi = uc->pi;
+	int bufsize = PAGESIZE * 16, bufofs = 0, ret;
+	char qname[16], *buf;
+
+	sprintf(qname, "%cchanrq", pi->processname[0]);
+	rename_proc(qname);
+	pthread_detach(pthread_self());
+
+	buf = ckalloc(bufsize);
+	while (42) {
+		unix_msg_t *umsgs = NULL, *umsg;
+		int parsed = 0;
+
+		ret = read(uc->sockd, buf + bufofs, bufsize - bufofs);
+		if (ret < 1) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		bufofs += ret;
+
+		while (bufofs - parsed >= 4) {
+			uint32_t msglen;
+
+			memcpy(&msglen, buf + parsed, 4);
+			msglen = le32toh(msglen);
+			if (unlikely(msglen < 1 || msglen > 0x80000000)) {
+				LOGWARNING("Invalid message length %u on %s channel", msglen, qname);
+				goto out;
+			}
+			if (bufofs - parsed - 4 < (int)msglen) {
+				/* Make sure the whole message will fit */
+				if ((int)msglen + 4 > bufsize) {
+					bufsize = round_up_page(msglen + 4);
+					buf = realloc(buf, bufsize);
+					if (unlikely(!buf))
+						quit(1, "Failed to realloc %d in channel_receiver", bufsize);
+				}
+				break;
+			}
+			umsg = ckalloc(sizeof(unix_msg_t));
+			umsg->sockd = -1;
+			umsg->buf = ckalloc(msglen + 1);
+			memcpy(umsg->buf, buf + parsed + 4, msglen);
+			umsg->buf[msglen] = '\0';
+			parsed += msglen + 4;
+			if (!urgent_unix_msg(pi, umsg))
+				DL_APPEND(umsgs, umsg);
+		}
+		bufofs -= parsed;
+		if (bufofs && parsed)
+			memmove(buf, buf + parsed, bufofs);
+
+		if (umsgs) {
+			mutex_lock(&pi->rmsg_lock);
+			DL_CONCAT(pi->unix_msgs, umsgs);
+			pthread_cond_signal(&pi->rmsg_cond);
+			mutex_unlock(&pi->rmsg_lock);
+		}
+	}
+out:
+	LOGDEBUG("Closing %s channel on socket %d", qname, uc->sockd);
+	Close(uc->sockd);
+	free(buf);
+	free(uc);
+	return NULL;
+}
+
+/* See if a newly accepted connection is requesting a persistent channel and
+ * if so, hand it off to its own channel_receiver thread. */
+static bool open_channel(proc_instance_t *pi, const int sockd)
+{
+	unix_channel_t *uc;
+	uint32_t msglen;
+	pthread_t pth;
+
+	if (wait_read_select(sockd, UNIX_READ_TIMEOUT) < 1)
+		return false;
+	if (recv(sockd, &msglen, 4, MSG_PEEK) != 4 || le32toh(msglen) != UNIX_CHANNEL)
+		return false;
+	if (read_length(sockd, &msglen, 4) != 4)
+		return false;
+	uc = ckalloc(sizeof(unix_channel_t));
+	uc->pi = pi;
+	uc->sockd = sockd;
+	create_pthread(&pth, channel_receiver, uc);
+	return true;
 }
 
 /* Create a standalone thread that queues received unix messages for a proc
@@ -231,6 +1071,8 @@ static void *unix_receiver(void *arg)
 			childsighandler(15);
 			break;
 		}
+		if (open_channel(pi, sockd))
+			continue;
 		buf = recv_unix_msg(sockd);
 		if (unlikely(!buf)) {
 			Close(sockd);
@@ -240,6 +1082,8 @@ static void *unix_receiver(void *arg)
 		umsg = ckalloc(sizeof(unix_msg_t));
 		umsg->sockd = sockd;
 		umsg->buf = buf;
+		if (urgent_unix_msg(pi, umsg))
+			continue;
 
 		mutex_lock(&pi->rmsg_lock);
 		DL_APPEND(pi->unix_msgs, umsg);
@@ -714,57 +1558,206 @@ out:
 	return ret;
 }
 
-/* Send a single message to a process instance when there will be no response,
- * closing the socket immediately. */
-void _send_proc(proc_instance_t *pi, const char *msg, const char *file, const char *func, const int line)
+/* Write one length framed message to a persistent channel with a single
+ * writev. */
+static bool write_channel_msg(const int sockd, const char *msg, const uint32_t len)
+{
+	uint32_t msglen = htole32(len);
+	struct iovec iov[2];
+	int iovcnt = 2;
+	ssize_t ret;
+
+	iov[0].iov_base = &msglen;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = len;
+	while (iovcnt) {
+		ret = writev(sockd, iov + 2 - iovcnt, iovcnt);
+		if (unlikely(ret < 1)) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		while (iovcnt && ret >= (ssize_t)iov[2 - iovcnt].iov_len) {
+			ret -= iov[2 - iovcnt].iov_len;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov[2 - iovcnt].iov_base += ret;
+			iov[2 - iovcnt].iov_len -= ret;
+		}
+	}
+	return true;
+}
+
+/* Open a persistent channel to the process instance, writing the magic
+ * header that unix_receiver uses to distinguish it from a one shot message. */
+static int open_channel_client(const proc_instance_t *pi)
 {
-	char *path = pi->us.path;
-	bool ret = false;
+	const uint32_t magic = htole32(UNIX_CHANNEL);
+	struct timeval tv = {UNIX_WRITE_TIMEOUT, 0};
 	int sockd;
 
-	if (unlikely(!msg || !strlen(msg))) {
-		LOGERR("Attempted to send null message to %s in send_proc", pi->processname);
-		return;
+	sockd = open_unix_client(pi->us.path);
+	if (unlikely(sockd < 0))
+		return -1;
+	/* Don't let a hung receiver block us indefinitely */
+	setsockopt(sockd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (unlikely(write_length(sockd, &magic, 4) != 4)) {
+		Close(sockd);
+		return -1;
 	}
+	LOGDEBUG("Opened persistent channel to %s on socket %d", pi->processname, sockd);
+	return sockd;
+}
 
-	if (unlikely(!path || !strlen(path))) {
-		LOGERR("Attempted to send message %s to null path in send_proc", msg ? msg : "");
+/* The main process listener only handles one shot messages so send to it
+ * with its own connection, closing the socket immediately. */
+static bool send_proc_oneshot(proc_instance_t *pi, const char *msg)
+{
+	char *path = pi->us.path;
+	bool ret = false;
+	int sockd;
+
+	sockd = open_unix_client(path);
+	if (unlikely(sockd < 0)) {
+		LOGWARNING("Failed to open socket %s", path);
 		goto out;
 	}
+	if (unlikely(!send_unix_msg(sockd, msg)))
+		LOGWARNING("Failed to send %s to socket %s", msg, path);
+	else
+		ret = true;
+	Close(sockd);
+out:
+	return ret;
+}
 
+/* Check the process we're sending to exists, looking up its pid if it was
+ * never set. */
+static bool send_proc_alive(proc_instance_t *pi, const char *desc)
+{
 	/* At startup the pid fields are not set up before some processes are
 	 * forked so they never inherit them. */
 	if (unlikely(!pi->pid)) {
 		pi->pid = get_proc_pid(pi);
 		if (!pi->pid) {
-			LOGALERT("Attempting to send message %s to non existent process %s", msg, pi->processname);
-			return;
+			LOGALERT("Attempting to send message %s to non existent process %s", desc, pi->processname);
+			return false;
 		}
 	}
 	if (unlikely(kill_pid(pi->pid, 0))) {
 		LOGALERT("Attempting to send message %s to non existent process %s pid %d",
-			 msg, pi->processname, pi->pid);
+			 desc, pi->processname, pi->pid);
+		return false;
+	}
+	return true;
+}
+
+/* Write a message to a process instance over its persistent channel, opening
+ * it on first use and reopening it once if it has failed, such as when the
+ * process has restarted. */
+static bool send_proc_channel(proc_instance_t *pi, const char *msg, const int len)
+{
+	bool ret = false;
+	int tries;
+	pid_t pid;
+
+	pid = getpid();
+	mutex_lock(&pi->chan_lock);
+	/* A channel inherited across fork belongs to the parent process */
+	if (unlikely(pi->chan_pid != pid)) {
+		if (pi->chan_fd > 0)
+			Close(pi->chan_fd);
+		pi->chan_fd = 0;
+		pi->chan_pid = pid;
+	}
+	for (tries = 0; tries < 2 && !ret; tries++) {
+		if (pi->chan_fd <= 0) {
+			pi->chan_fd = open_channel_client(pi);
+			if (unlikely(pi->chan_fd < 0)) {
+				LOGWARNING("Failed to open socket %s", pi->us.path);
+				continue;
+			}
+		}
+		ret = write_channel_msg(pi->chan_fd, msg, len);
+		if (unlikely(!ret)) {
+			LOGINFO("Failed to send to %s channel, reopening", pi->processname);
+			Close(pi->chan_fd);
+		}
+	}
+	mutex_unlock(&pi->chan_lock);
+	return ret;
+}
+
+/* Send a single message to a process instance when there will be no response
+ * over a persistent channel. */
+void _send_proc(proc_instance_t *pi, const char *msg, const char *file, const char *func, const int line)
+{
+	char *path = pi->us.path;
+	bool ret = false;
+
+	if (unlikely(!msg || !strlen(msg))) {
+		LOGERR("Attempted to send null message to %s in send_proc", pi->processname);
+		return;
+	}
+
+	if (unlikely(!path || !strlen(path))) {
+		LOGERR("Attempted to send message %s to null path in send_proc", msg ? msg : "");
 		goto out;
 	}
-	sockd = open_unix_client(path);
-	if (unlikely(sockd < 0)) {
-		LOGWARNING("Failed to open socket %s", path);
+
+	if (unlikely(!send_proc_alive(pi, msg)))
+		goto out;
+
+	if (unlikely(pi == &pi->ckp->main)) {
+		ret = send_proc_oneshot(pi, msg);
 		goto out;
 	}
-	if (unlikely(!send_unix_msg(sockd, msg)))
+
+	ret = send_proc_channel(pi, msg, strlen(msg));
+	if (unlikely(!ret))
 		LOGWARNING("Failed to send %s to socket %s", msg, path);
-	else
-		ret = true;
-	Close(sockd);
 out:
 	if (unlikely(!ret))
 		LOGERR("Failure in send_proc from %s %s:%d", file, func, line);
 }
 
+/* As send_proc but for a binary message of len bytes which may contain NULs,
+ * only usable between child processes since it relies on the channel. */
+void _send_proc_data(proc_instance_t *pi, const char *msg, const int len, const char *file,
+		     const char *func, const int line)
+{
+	char *path = pi->us.path;
+	bool ret = false;
+
+	if (unlikely(!msg || len < 1)) {
+		LOGERR("Attempted to send null data to %s in send_proc_data", pi->processname);
+		return;
+	}
+
+	if (unlikely(!path || !strlen(path))) {
+		LOGERR("Attempted to send data to null path in send_proc_data");
+		goto out;
+	}
+
+	if (unlikely(!send_proc_alive(pi, "data")))
+		goto out;
+
+	ret = send_proc_channel(pi, msg, len);
+	if (unlikely(!ret))
+		LOGWARNING("Failed to send %d bytes to socket %s", len, path);
+out:
+	if (unlikely(!ret))
+		LOGERR("Failure in send_proc_data from %s %s:%d", file, func, line);
+}
+
 /* Send a single message to a process instance and retrieve the response, then
  * close the socket. */
-char *_send_recv_proc(proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
-		      const char *file, const char *func, const int line)
+/* As send_recv_proc but also returning the length of the response, if len is
+ * set, for binary responses */
+char *_send_recv_proc_buf(proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
+			  uint32_t *len, const char *file, const char *func, const int line)
 {
 	char *path = pi->us.path, *buf = NULL;
 	int sockd;
@@ -797,7 +1790,7 @@ char *_send_recv_proc(proc_instance_t *pi, const char *msg, int writetimeout, in
 	if (unlikely(!_send_unix_msg(sockd, msg, writetimeout, file, func, line)))
 		LOGWARNING("Failed to send %s to socket %s", msg, path);
 	else
-		buf = _recv_unix_msg(sockd, readtimedout, readtimedout, file, func, line);
+		buf = _recv_unix_buf(sockd, readtimedout, readtimedout, len, file, func, line);
 	Close(sockd);
 out:
 	if (unlikely(!buf))
@@ -805,6 +1798,12 @@ out:
 	return buf;
 }
 
+char *_send_recv_proc(proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
+		      const char *file, const char *func, const int line)
+{
+	return _send_recv_proc_buf(pi, msg, writetimeout, readtimedout, NULL, file, func, line);
+}
+
 /* As send_recv_proc but only to ckdb */
 char *_send_recv_ckdb(const ckpool_t *ckp, const char *msg, const char *file, const char *func, const int line)
 {
@@ -856,10 +1855,14 @@ static const char *rpc_method(const char *rpc_req)
 	return rpc_req;
 }
 
-/* All of these calls are made to bitcoind which prefers open/close instead
- * of persistent connections so cs->fd is always invalid. */
+/* All of these calls are made to bitcoind. The connection is kept alive for
+ * the next call unless bitcoind asks to close it, and is only reused while
+ * it is younger than RPC_KEEPALIVE and bitcoind hasn't closed it. A spare
+ * connection opened ahead of time is checked the same way. A kept or spare
+ * connection that fails is retried once on a new connection. */
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 {
+	bool reused = false, keepalive = true;
 	float timeout = RPC_TIMEOUT;
 	char *http_req = NULL;
 	json_error_t err_val;
@@ -870,7 +1873,29 @@ json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 
 	/* Serialise all calls in case we use cs from multiple threads */
 	cksem_wait(&cs->sem);
-	cs->fd = connect_socket(cs->url, cs->port);
+retry:
+	if (cs->kept) {
+		cs->kept = false;
+		/* Anything to read on an idle connection means it's closed */
+		if (cs->fd >= 0 && time(NULL) - cs->kept_time < RPC_KEEPALIVE &&
+		    !wait_read_select(cs->fd, 0))
+			reused = true;
+		else
+			Close(cs->fd);
+	}
+	if (!reused) {
+		cs->fd = -1;
+		if (cs->spare) {
+			cs->spare = false;
+			if (!wait_read_select(cs->spare_fd, 0)) {
+				cs->fd = cs->spare_fd;
+				reused = true;
+			} else
+				Close(cs->spare_fd);
+		}
+		if (cs->fd < 0)
+			cs->fd = connect_socket(cs->url, cs->port);
+	}
 	if (unlikely(cs->fd < 0)) {
 		LOGWARNING("Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
 		goto out;
@@ -909,6 +1934,8 @@ json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 	tv_time(&stt_tv);
 	ret = write_socket(cs->fd, http_req, len);
 	if (ret != len) {
+		if (reused)
+			goto reconnect;
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		LOGWARNING("Failed to write to socket in %s (%.10s...) %.3fs",
@@ -917,6 +1944,8 @@ json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 	}
 	ret = read_socket_line(cs, &timeout);
 	if (ret < 1) {
+		if (reused && ret < 0)
+			goto reconnect;
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		LOGWARNING("Failed to read socket line in %s (%.10s...) %.3fs",
@@ -939,6 +1968,8 @@ json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 				   __func__, rpc_method(rpc_req), elapsed);
 			goto out_empty;
 		}
+		if (!strncasecmp(cs->buf, "Connection: close", 17))
+			keepalive = false;
 	} while (strncmp(cs->buf, "{", 1));
 	tv_time(&fin_tv);
 	elapsed = tvdiff(&fin_tv, &stt_tv);
@@ -956,11 +1987,54 @@ out_empty:
 	empty_socket(cs->fd);
 	empty_buffer(cs);
 out:
-	Close(cs->fd);
+	if (val && keepalive) {
+		cs->kept = true;
+		cs->kept_time = time(NULL);
+	} else
+		Close(cs->fd);
 	free(http_req);
 	dealloc(cs->buf);
 	cksem_post(&cs->sem);
 	return val;
+
+reconnect:
+	/* bitcoind closed the kept or spare connection, so try again on a new one */
+	LOGDEBUG("Reconnecting kept alive connection to %s:%s", cs->url, cs->port);
+	Close(cs->fd);
+	empty_buffer(cs);
+	free(http_req);
+	http_req = NULL;
+	reused = false;
+	timeout = RPC_TIMEOUT;
+	goto retry;
+}
+
+/* Open the connection for the next json_rpc_call on cs ahead of time to save
+ * the connect latency, replacing any spare more than maxage seconds old that
+ * bitcoind may have timed out by now. */
+void json_rpc_preconnect(connsock_t *cs, const int maxage)
+{
+	time_t now_t = time(NULL);
+	int fd;
+
+	cksem_wait(&cs->sem);
+	/* A kept alive connection will be reused instead */
+	if (cs->kept && now_t - cs->kept_time < RPC_KEEPALIVE)
+		goto out;
+	if (cs->spare) {
+		if (now_t - cs->spare_time < maxage)
+			goto out;
+		Close(cs->spare_fd);
+		cs->spare = false;
+	}
+	fd = connect_socket(cs->url, cs->port);
+	if (fd >= 0) {
+		cs->spare_fd = fd;
+		cs->spare_time = now_t;
+		cs->spare = true;
+	}
+out:
+	cksem_post(&cs->sem);
 }
 
 static void terminate_oldpid(const ckpool_t *ckp, proc_instance_t *pi, const pid_t oldpid)
@@ -1132,15 +2206,32 @@ void childsighandler(const int sig)
 	exit(0);
 }
 
+/* Start the logwriter of this process. In a child just forked, the rings are
+ * copies of the parent's that its own logwriter is writing, and any owned by
+ * threads other than this one are free for reuse since those threads don't
+ * exist in the child */
 static void launch_logger(const proc_instance_t *pi)
 {
 	ckpool_t *ckp = pi->ckp;
-	char loggername[16];
+	static char loggername[16];
+	logring_t *ring;
 
-	/* Note that the logger is unique per process so it is the only value
-	 * in ckp that differs between processes */
+	/* Note that the logger is unique per process */
 	snprintf(loggername, 15, "%clogger", pi->processname[0]);
-	ckp->logger = create_ckmsgq(ckp, loggername, &proclog);
+	logring_size = ckp->logbuffer;
+	logbounded = ckp->logbounded;
+	for (ring = logrings; ring; ring = ring->next) {
+		/* Left to the parent, but not freed here since its logwriter
+		 * could have been part way through freeing them */
+		ring->over = NULL;
+		ring->tail = ring->head;
+		ring->owned = (ring == logring);
+	}
+	log_written = log_dropped = log_truncated = log_overflowed = 0;
+	mutex_init(&logwriter_lock);
+	cond_init(&logwriter_cond);
+	logwriter_sleeping = false;
+	create_pthread(&logwriter_pth, logwriter, loggername);
 }
 
 static void launch_process(proc_instance_t *pi)
@@ -1154,7 +2245,7 @@ static void launch_process(proc_instance_t *pi)
 		struct sigaction handler;
 		int ret;
 
-		json_set_alloc_funcs(json_ckalloc, free);
+		set_affinity_process(pi->processname);
 		launch_logger(pi);
 		handler.sa_handler = &childsighandler;
 		handler.sa_flags = 0;
@@ -1434,12 +2525,14 @@ static void parse_btcds(ckpool_t *ckp, const json_t *arr_val, const int arr_size
 	ckp->btcdauth = ckzalloc(sizeof(char *) * arr_size);
 	ckp->btcdpass = ckzalloc(sizeof(char *) * arr_size);
 	ckp->btcdnotify = ckzalloc(sizeof(bool *) * arr_size);
+	ckp->btcdzmq = ckzalloc(sizeof(char *) * arr_size);
 	for (i = 0; i < arr_size; i++) {
 		val = json_array_get(arr_val, i);
 		json_get_string(&ckp->btcdurl[i], val, "url");
 		json_get_string(&ckp->btcdauth[i], val, "auth");
 		json_get_string(&ckp->btcdpass[i], val, "pass");
 		json_get_bool(&ckp->btcdnotify[i], val, "notify");
+		json_get_string(&ckp->btcdzmq[i], val, "zmq");
 	}
 }
 
@@ -1586,6 +2679,23 @@ out:
 	return ret;
 }
 
+/* An object of process or thread names, each with a cpu list to run on */
+static void parse_affinity(const json_t *obj_val)
+{
+	const char *role;
+	json_t *val;
+
+	if (!obj_val)
+		return;
+	if (!json_is_object(obj_val))
+		quit(0, "Invalid affinity entry, must be an object");
+	json_object_foreach((json_t *)obj_val, role, val) {
+		if (!json_is_string(val))
+			quit(0, "Invalid affinity entry for %s, must be a string", role);
+		if (!add_affinity_role(role, json_string_value(val)))
+			quit(0, "Invalid affinity entry %s : %s", role, json_string_value(val));
+	}
+}
 
 static void parse_config(ckpool_t *ckp)
 {
@@ -1630,11 +2740,18 @@ static void parse_config(ckpool_t *ckp)
 	arr_val = json_object_get(json_conf, "trusted");
 	parse_trusted(ckp, arr_val);
 	json_get_string(&ckp->upstream, json_conf, "upstream");
+	json_get_int(&ckp->remoteinterval, json_conf, "remoteinterval");
 	json_get_int64(&ckp->mindiff, json_conf, "mindiff");
 	json_get_int64(&ckp->startdiff, json_conf, "startdiff");
 	json_get_int64(&ckp->maxdiff, json_conf, "maxdiff");
 	json_get_string(&ckp->logdir, json_conf, "logdir");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
+	json_get_int(&ckp->receivers, json_conf, "receivers");
+	json_get_int(&ckp->threads, json_conf, "threads");
+	json_get_int(&ckp->logbuffer, json_conf, "logbuffer");
+	json_get_bool(&ckp->logbounded, json_conf, "logbounded");
+	arr_val = json_object_get(json_conf, "affinity");
+	parse_affinity(arr_val);
 	arr_val = json_object_get(json_conf, "proxy");
 	if (arr_val && json_is_array(arr_val)) {
 		arr_size = json_array_size(arr_val);
@@ -1686,6 +2803,7 @@ static proc_instance_t *prepare_child(ckpool_t *ckp, int (*process)(), char *nam
 	pi->processname = name;
 	pi->sockname = pi->processname;
 	pi->process = process;
+	mutex_init(&pi->chan_lock);
 	create_process_unixsock(pi);
 	manage_old_child(ckp, pi);
 	/* Remove the old pid file if we've succeeded in coming this far */
@@ -1820,7 +2938,12 @@ static bool send_recv_path(const char *path, const char *msg)
 	return ret;
 }
 
+#ifdef CKBENCH
+/* ckbench links in the pool's code and provides its own main */
+int ckpool_main(int argc, char **argv)
+#else
 int main(int argc, char **argv)
+#endif
 {
 	struct sigaction handler;
 	int c, ret, i = 0, j;
@@ -1829,7 +2952,8 @@ int main(int argc, char **argv)
 
 	/* Make significant floating point errors fatal to avoid subtle bugs being missed */
 	feenableexcept(FE_DIVBYZERO | FE_INVALID);
-	json_set_alloc_funcs(json_ckalloc, free);
+	json_slab_init();
+	ckmsg_slab = create_slab_cache("ckmsg", sizeof(ckmsg_t));
 
 	global_ckp = &ckp;
 	memset(&ckp, 0, sizeof(ckp));
@@ -2001,6 +3125,7 @@ int main(int argc, char **argv)
 		ckp.btcdauth = ckzalloc(sizeof(char *));
 		ckp.btcdpass = ckzalloc(sizeof(char *));
 		ckp.btcdnotify = ckzalloc(sizeof(bool));
+		ckp.btcdzmq = ckzalloc(sizeof(char *));
 	}
 	if (ckp.btcds) {
 		for (i = 0; i < ckp.btcds; i++) {
@@ -2028,12 +3153,31 @@ int main(int argc, char **argv)
 		quit(0, "Invalid nonce2length %d specified, must be 2~8", ckp.nonce2length);
 	if (!ckp.update_interval)
 		ckp.update_interval = 30;
+	if (!ckp.remoteinterval)
+		ckp.remoteinterval = 1000;
+	else if (ckp.remoteinterval < 1 || ckp.remoteinterval > 60000)
+		quit(0, "Invalid remoteinterval %d specified, must be 1~60000", ckp.remoteinterval);
 	if (!ckp.mindiff)
 		ckp.mindiff = 1;
 	if (!ckp.startdiff)
 		ckp.startdiff = 42;
 	if (!ckp.logdir)
 		ckp.logdir = strdup("logs");
+	if (!ckp.receivers)
+		ckp.receivers = 1;
+	else if (ckp.receivers < 1 || ckp.receivers > 64)
+		quit(0, "Invalid receivers %d specified, must be 1~64", ckp.receivers);
+	/* Default to half as many stratifier threads as there are CPUs */
+	if (!ckp.threads)
+		ckp.threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
+	else if (ckp.threads < 1 || ckp.threads > 256)
+		quit(0, "Invalid threads %d specified, must be 1~256", ckp.threads);
+
+	if (!ckp.logbuffer)
+		ckp.logbuffer = 256;
+	else if (ckp.logbuffer < 16 || ckp.logbuffer > 65536 ||
+		 (ckp.logbuffer & (ckp.logbuffer - 1)))
+		quit(0, "Invalid logbuffer %d specified, must be a power of 2 16~65536", ckp.logbuffer);
 	if (!ckp.serverurls)
 		ckp.serverurl = ckzalloc(sizeof(char *));
 	if (ckp.proxy && !ckp.proxies)
@@ -2047,18 +3191,6 @@ int main(int argc, char **argv)
 	if (ret && errno != EEXIST)
 		quit(1, "Failed to make log directory %s", ckp.logdir);
 
-	/* Create the workers logdir */
-	sprintf(buf, "%s/workers", ckp.logdir);
-	ret = mkdir(buf, 0750);
-	if (ret && errno != EEXIST)
-		quit(1, "Failed to make workers log directory %s", buf);
-
-	/* Create the user logdir */
-	sprintf(buf, "%s/users", ckp.logdir);
-	ret = mkdir(buf, 0750);
-	if (ret && errno != EEXIST)
-		quit(1, "Failed to make user log directory %s", buf);
-
 	/* Create the pool logdir */
 	sprintf(buf, "%s/pool", ckp.logdir);
 	ret = mkdir(buf, 0750);
@@ -2076,6 +3208,7 @@ int main(int argc, char **argv)
 	ckp.main.ckp = &ckp;
 	ckp.main.processname = strdup("main");
 	ckp.main.sockname = strdup("listener");
+	mutex_init(&ckp.main.chan_lock);
 	name_process_sockname(&ckp.main.us, &ckp.main);
 	ckp.oldconnfd = ckzalloc(sizeof(int *) * ckp.serverurls);
 	if (ckp.handover) {
@@ -2126,6 +3259,7 @@ int main(int argc, char **argv)
 		}
 	}
 
+	set_affinity_process(ckp.main.processname);
 	write_namepid(&ckp.main);
 	open_process_sock(&ckp, &ckp.main, &ckp.main.us);
 	launch_logger(&ckp.main);
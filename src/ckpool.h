@@ -12,6 +12,7 @@
 
 #include "config.h"
 
+#include <netinet/in.h>
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -20,6 +21,9 @@
 #include "uthash.h"
 
 #define RPC_TIMEOUT 60
+/* Seconds an idle connection to bitcoind is reused for, within bitcoind's
+ * default rpcservertimeout of 30 */
+#define RPC_KEEPALIVE 20
 
 struct ckpool_instance;
 typedef struct ckpool_instance ckpool_t;
@@ -28,10 +32,31 @@ struct ckmsg {
 	struct ckmsg *next;
 	struct ckmsg *prev;
 	void *data;
+	int64_t stamp; /* When queued on a ckmsgq */
+	int route; /* Routing slot in a stealing group, -1 if not routed */
 };
 
 typedef struct ckmsg ckmsg_t;
 
+/* Binary envelope the connector prefixes to client messages it passes on to
+ * the stratifier, followed by the raw NUL terminated stratum line from the
+ * client. The type byte can never begin a json message or text command. */
+#define CLIENT_ENVELOPE '\x01'
+
+struct client_envelope {
+	char type;
+	char address[INET6_ADDRSTRLEN];
+	int32_t server;
+	int64_t client_id;
+
+	/* monotonic_ns when the connector read the line and when the
+	 * stratifier queued it for srecv_process */
+	int64_t received;
+	int64_t queued;
+};
+
+typedef struct client_envelope client_envelope_t;
+
 typedef struct unix_msg unix_msg_t;
 
 struct unix_msg {
@@ -41,19 +66,74 @@ struct unix_msg {
 	char *buf;
 };
 
+/* Message queue with its own processing thread. Any number of threads can
+ * add to it without locking, the queue thread taking everything queued in one
+ * atomic exchange. The lock and cond are only used to sleep and wake it. */
 struct ckmsgq {
 	ckpool_t *ckp;
 	char name[16];
 	pthread_t pth;
 	mutex_t *lock;
 	pthread_cond_t *cond;
-	ckmsg_t *msgs;
+	ckmsg_t *msgs; /* Stack of queued messages, newest first */
+	ckmsg_t *prio; /* As above for messages to process before msgs */
 	void (*func)(ckpool_t *, void *);
+	/* Optional function taking up to batch queued messages at once */
+	void (*batchfunc)(ckpool_t *, void **, int);
+	int batch;
+	bool sleeping; /* Thread is waiting on cond */
+
+	/* Each queue in a group has its own thread. The first queue in the
+	 * group holds the group wide settings. */
+	struct ckmsgq *group;
+	int qid;
+	int queues;
+	bool steal;
+	int rr;
+	/* For each routing slot of a stealing group, the qid owning it above
+	 * the count of its messages queued or being processed */
+	int64_t *routes;
+
+	bool idle; /* Thread is out of messages and looking to steal */
+	bool kicked; /* Woken to steal, protected by lock */
+
+	/* Counters */
 	int64_t messages;
+	int64_t processed;
+	int64_t stolen;
+	int pending; /* Queued and not yet processed */
+	int maxpending;
+	int64_t latency; /* Total ns from being queued till being processed */
+	int64_t latencies; /* Number of messages in above */
+	int64_t maxlatency;
 };
 
 typedef struct ckmsgq ckmsgq_t;
 
+struct ckmsgq_counters {
+	int pending;
+	int maxpending;
+	int64_t messages;
+	int64_t processed;
+	int64_t stolen;
+	int64_t avglatency;
+	int64_t maxlatency;
+};
+
+typedef struct ckmsgq_counters ckmsgq_counters_t;
+
+struct logger_counters {
+	int64_t written;
+	int64_t dropped;
+	int64_t truncated;
+	int64_t overflowed; /* Malloced since the ring was full or too short */
+	int64_t pending;
+	int64_t memory;
+	int rings;
+};
+
+typedef struct logger_counters logger_counters_t;
+
 typedef struct proc_instance proc_instance_t;
 
 struct proc_instance {
@@ -69,6 +149,18 @@ struct proc_instance {
 	unix_msg_t *unix_msgs;
 	mutex_t rmsg_lock;
 	pthread_cond_t rmsg_cond;
+
+	/* Messages starting with urgent_cmd skip unix_msgs and are handed to
+	 * urgent_func straight from the receiving thread, which may steal the
+	 * buf but leaves freeing the message to the receiver */
+	const char *urgent_cmd;
+	void (*urgent_func)(ckpool_t *ckp, unix_msg_t *umsg);
+
+	/* Persistent channel for sending messages to this process from the
+	 * process that opened it, serialised by chan_lock */
+	int chan_fd;
+	pid_t chan_pid;
+	mutex_t chan_lock;
 };
 
 struct connsock {
@@ -87,6 +179,15 @@ struct connsock {
 	ckpool_t *ckp;
 	/* Semaphore used to serialise request/responses */
 	sem_t sem;
+
+	/* Connection opened ahead of the next json_rpc_call */
+	bool spare;
+	int spare_fd;
+	time_t spare_time;
+
+	/* Connection kept alive after the last json_rpc_call */
+	bool kept;
+	time_t kept_time;
 };
 
 typedef struct connsock connsock_t;
@@ -99,15 +200,6 @@ struct char_entry {
 	char *buf;
 };
 
-typedef struct log_entry log_entry_t;
-
-struct log_entry {
-	log_entry_t *next;
-	log_entry_t *prev;
-	char *fname;
-	char *buf;
-};
-
 struct server_instance {
 	/* Hash table data */
 	UT_hash_handle hh;
@@ -117,9 +209,25 @@ struct server_instance {
 	char *auth;
 	char *pass;
 	bool notify;
+	char *zmq; /* Address bitcoind publishes hashblock on */
+	bool zmq_live; /* Subscribed to hashblock so polling isn't needed */
 	bool alive;
 	connsock_t cs;
 
+	/* Connection and thread used only to submit blocks, with the time in ms
+	 * each submission took from being received */
+	connsock_t submit_cs;
+	ckmsgq_t *submitq;
+	int64_t submits;
+	int64_t submits_accepted;
+	double submit_last;
+	double submit_max;
+
+	/* Thread racing getblocktemplate against the other servers, and
+	 * whether data holds a valid template for the current race */
+	ckmsgq_t *gbtq;
+	bool gbt_ready;
+
 	void *data; // Private data
 };
 
@@ -165,12 +273,18 @@ struct ckpool_instance {
 	bool handover;
 	/* How many clients maximum to accept before rejecting further */
 	int maxclients;
+	/* Number of connector receiver threads */
+	int receivers;
+	/* Number of stratifier share processing and receiving threads each */
+	int threads;
 
 	/* API message queue */
 	ckmsgq_t *ckpapi;
 
-	/* Logger message queue NOTE: Unique per process */
-	ckmsgq_t *logger;
+	/* Log records per thread ring, a power of 2 */
+	int logbuffer;
+	/* Truncate and drop log messages rather than use more memory */
+	bool logbounded;
 	/* Process instance data of parent/child processes */
 	proc_instance_t main;
 
@@ -219,6 +333,7 @@ struct ckpool_instance {
 	char **btcdauth;
 	char **btcdpass;
 	bool *btcdnotify;
+	char **btcdzmq; // Optional zmqpubhashblock address of each btcd
 	int blockpoll; // How frequently in ms to poll bitcoind for block updates
 	int nonce1length; // Extranonce1 length
 	int nonce2length; // Extranonce2 length
@@ -241,6 +356,7 @@ struct ckpool_instance {
 	bool *nodeserver; // If this server URL serves node information
 	bool *trusted; // If this server URL accepts trusted remote nodes
 	char *upstream; // Upstream pool in trusted remote mode
+	int remoteinterval; // How frequently in ms to send batched shares upstream
 
 	int update_interval; // Seconds between stratum updates
 
@@ -311,8 +427,15 @@ static const char __maybe_unused *stratum_msgs[] = {
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func,
+			       const void *batchfunc, const int count, int batch, const bool steal);
 void ckmsgq_add(ckmsgq_t *ckmsgq, void *data);
+void ckmsgq_add_id(ckmsgq_t *ckmsgq, void *data, const int64_t id);
+ckmsg_t *ckmsg_alloc(void);
+void ckmsgq_add_bulk(ckmsgq_t *ckmsgq, ckmsg_t *list, const int count, const bool prio);
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
+void ckmsgq_counters(ckmsgq_t *ckmsgq, ckmsgq_counters_t *counters);
+void logger_counters(logger_counters_t *counters);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 void create_unix_receiver(proc_instance_t *pi);
 
@@ -325,6 +448,11 @@ int set_recvbufsize(ckpool_t *ckp, const int fd, const int len);
 int read_socket_line(connsock_t *cs, float *timeout);
 void _send_proc(proc_instance_t *pi, const char *msg, const char *file, const char *func, const int line);
 #define send_proc(pi, msg) _send_proc(pi, msg, __FILE__, __func__, __LINE__)
+void _send_proc_data(proc_instance_t *pi, const char *msg, const int len, const char *file,
+		     const char *func, const int line);
+#define send_proc_data(pi, msg, len) _send_proc_data(pi, msg, len, __FILE__, __func__, __LINE__)
+char *_send_recv_proc_buf(proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
+			  uint32_t *len, const char *file, const char *func, const int line);
 char *_send_recv_proc(proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
 		      const char *file, const char *func, const int line);
 #define send_recv_proc(pi, msg) _send_recv_proc(pi, msg, UNIX_WRITE_TIMEOUT, UNIX_READ_TIMEOUT, __FILE__, __func__, __LINE__)
@@ -335,6 +463,7 @@ char *_ckdb_msg_call(const ckpool_t *ckp, const char *msg,  const char *file, co
 #define ckdb_msg_call(ckp, msg) _ckdb_msg_call(ckp, msg, __FILE__, __func__, __LINE__)
 
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req);
+void json_rpc_preconnect(connsock_t *cs, const int maxage);
 bool send_json_msg(connsock_t *cs, const json_t *json_msg);
 json_t *json_msg_result(const char *msg, json_t **res_val, json_t **err_val);
 
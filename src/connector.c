@@ -12,7 +12,9 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
 #include <zlib.h>
@@ -23,11 +25,30 @@
 #include "utlist.h"
 
 #define MAX_MSGSIZE 1024
+/* Read buffer size for passthroughs and trusted remote servers which send
+ * much larger messages */
+#define NODE_BUFSIZE 1048576
+
+/* Client ids are never reused since the stratifier and ckdb key on them.
+ * Live clients are found by id without locking through a table indexed by the
+ * low bits of their ids, with any id whose entry is still in use skipped over
+ * when handing out new ones. */
+#define CLIENT_TABLE_BITS 21
+#define CLIENT_TABLE_MASK ((1 << CLIENT_TABLE_BITS) - 1)
+#define CLIENT_CHUNK_BITS 10
+#define CLIENT_CHUNK_SIZE (1 << CLIENT_CHUNK_BITS)
+#define CLIENT_CHUNKS (1 << (CLIENT_TABLE_BITS - CLIENT_CHUNK_BITS))
+/* Maximum number of epoll events each receiver thread drains per wait */
+#define MAX_EVENTS 64
+/* Maximum number of queued messages coalesced into one writev to a client */
+#define MAX_SEND_IOVS 64
 
 typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
+typedef struct bcast_buf bcast_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
+typedef struct receiver_instance rinstance_t;
 
 struct client_instance {
 	/* For clients hashtable */
@@ -37,8 +58,12 @@ struct client_instance {
 	/* fd cannot be changed while a ref is held */
 	int fd;
 
+	/* The epoll fd of the receiver thread this client is assigned to */
+	int epfd;
+
 	/* Reference count for when this instance is used outside of the
-	 * connector_data lock */
+	 * connector_data lock, only modified atomically. Once it drops to zero
+	 * on a dead client it is never raised again till it's reused. */
 	int ref;
 
 	/* Have we disabled this client to be removed when there are no refs? */
@@ -55,11 +80,27 @@ struct client_instance {
 	/* Which serverurl is this instance connected to */
 	int server;
 
-	char buf[PAGESIZE];
+	/* Read buffer with one spare byte for terminating messages in place.
+	 * Messages are parsed from parseofs up to bufofs with remaining data
+	 * only moved down when we run short of room to read into. */
+	char *buf;
+	int bufsize;
 	unsigned long bufofs;
+	unsigned long parseofs;
+
+	/* Messages queued for this client by other threads, protected by
+	 * sender_lock, and the messages the sender thread is writing out */
+	sender_send_t *sender_sends;
+	sender_send_t *sends;
 
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	/* Is this client on the sender's ready or blocked list */
+	bool send_queued;
+	/* Has the client fd been added to the sender epoll set */
+	bool send_polled;
+
+	/* For the sender ready and blocked lists */
+	client_instance_t *send_next;
+	client_instance_t *send_prev;
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -67,6 +108,9 @@ struct client_instance {
 	/* Is this the parent passthrough client */
 	bool passthrough;
 
+	/* Has the passthrough sent raw framed lines, so it takes them too */
+	bool rawpass;
+
 	/* Linked list of shares in redirector mode.*/
 	share_t *shares;
 
@@ -88,6 +132,20 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	/* Shared buffer buf points into for broadcast messages */
+	bcast_t *bcast;
+
+	/* monotonic_ns when queued for the sender */
+	int64_t queued;
+};
+
+/* A message broadcast to many clients, serialised once by the stratifier and
+ * shared by all the sends to it, freed when the last send completes. The
+ * refcount is protected by sender_lock. */
+struct bcast_buf {
+	char *buf;
+	int ref;
 };
 
 struct share {
@@ -105,7 +163,24 @@ struct redirect {
 	int redirect_no;
 };
 
+/* Each receiver thread has its own epoll set with clients assigned to them
+ * round robin by the first receiver which also owns the server fds. */
+struct receiver_instance {
+	struct connector_data *cdata;
+	int id;
+	int epfd;
+	pthread_t pth;
+};
+
 /* Private data for the connector */
+enum connector_stage {
+	CSTAGE_RECEIVE,
+	CSTAGE_SEND,
+	CSTAGES
+};
+
+static const char *connector_stages[] = { "receive", "send" };
+
 struct connector_data {
 	ckpool_t *ckp;
 	cklock_t lock;
@@ -117,12 +192,13 @@ struct connector_data {
 	int *serverfd;
 	/* All time count of clients connected */
 	int nfds;
-	/* The epoll fd */
-	int epfd;
 
 	bool accept;
 	pthread_t pth_sender;
-	pthread_t pth_receiver;
+
+	/* Array of receiver threads */
+	rinstance_t *receivers;
+	int receiver_count;
 
 	/* For the hashtable of all clients */
 	client_instance_t *clients;
@@ -131,22 +207,36 @@ struct connector_data {
 	/* Linked list of client structures we can reuse */
 	client_instance_t *recycled_clients;
 
+	/* Chunks of the table of live clients indexed by the low bits of their
+	 * ids, allocated on demand and never freed so may be read without
+	 * locking. Client structures are never freed either. */
+	client_instance_t **client_table[CLIENT_CHUNKS];
+
+	int64_t client_id;
 	int clients_generated;
 	int dead_generated;
 
-	int64_t client_id;
+	/* Linked list of clients with new sends for the sender thread */
+	client_instance_t *sender_clients;
+	/* Linked list of clients waiting on EPOLLOUT, only used by the sender */
+	client_instance_t *blocked_clients;
 
-	/* For the linked list of pending sends */
-	sender_send_t *sender_sends;
+	/* Sender epoll set for EPOLLOUT and eventfd to wake it on new sends */
+	int sender_epfd;
+	int sender_evfd;
 
 	int64_t sends_generated;
 	int64_t sends_delayed;
 	int64_t sends_queued;
 	int64_t sends_size;
+	int64_t sends_blocked;
 
-	/* For protecting the pending sends list */
+	/* For protecting the per client send queues and sender lists */
 	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
+
+	/* Time from reading a client line to passing it to the stratifier and
+	 * from queueing a send to it being written to the client */
+	lhist_t latency[CSTAGES];
 
 	/* Hash list of all redirected IP address in redirector mode */
 	redirect_t *redirects;
@@ -156,6 +246,8 @@ struct connector_data {
 	/* Pending sends to the upstream server */
 	ckmsgq_t *upstream_sends;
 	connsock_t upstream_cs;
+	/* Upstream server accepts batch messages */
+	bool upstream_batch;
 };
 
 typedef struct connector_data cdata_t;
@@ -163,27 +255,23 @@ typedef struct connector_data cdata_t;
 /* Increase the reference count of instance */
 static void __inc_instance_ref(client_instance_t *client)
 {
-	client->ref++;
+	__atomic_add_fetch(&client->ref, 1, __ATOMIC_SEQ_CST);
 }
 
-static void inc_instance_ref(cdata_t *cdata, client_instance_t *client)
+static void inc_instance_ref(cdata_t __maybe_unused *cdata, client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
 	__inc_instance_ref(client);
-	ck_wunlock(&cdata->lock);
 }
 
-/* Increase the reference count of instance */
+/* Decrease the reference count of instance */
 static void __dec_instance_ref(client_instance_t *client)
 {
-	client->ref--;
+	__atomic_sub_fetch(&client->ref, 1, __ATOMIC_SEQ_CST);
 }
 
-static void dec_instance_ref(cdata_t *cdata, client_instance_t *client)
+static void dec_instance_ref(cdata_t __maybe_unused *cdata, client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
 	__dec_instance_ref(client);
-	ck_wunlock(&cdata->lock);
 }
 
 /* Recruit a client structure from a recycled one if available, creating a
@@ -203,15 +291,60 @@ static client_instance_t *recruit_client(cdata_t *cdata)
 	if (!client) {
 		LOGDEBUG("Connector created new client instance");
 		client = ckzalloc(sizeof(client_instance_t));
+		client->id = -1;
 	} else
 		LOGDEBUG("Connector recycled client instance");
 	return client;
 }
 
+static client_instance_t **__client_entry(cdata_t *cdata, const int64_t id)
+{
+	int index = id & CLIENT_TABLE_MASK;
+	client_instance_t **chunk;
+
+	chunk = cdata->client_table[index >> CLIENT_CHUNK_BITS];
+	if (!chunk) {
+		chunk = ckzalloc(sizeof(client_instance_t *) * CLIENT_CHUNK_SIZE);
+		__atomic_store_n(&cdata->client_table[index >> CLIENT_CHUNK_BITS], chunk,
+				 __ATOMIC_RELEASE);
+	}
+	return &chunk[index & (CLIENT_CHUNK_SIZE - 1)];
+}
+
+/* Give the client the next id whose table entry is free and publish it there.
+ * Returns false only if every entry is taken by a live client. */
+static bool __assign_client_id(cdata_t *cdata, client_instance_t *client)
+{
+	int64_t id, last = cdata->client_id + CLIENT_TABLE_MASK;
+	client_instance_t **entry;
+
+	for (id = cdata->client_id; id <= last; id++) {
+		entry = __client_entry(cdata, id);
+		if (*entry)
+			continue;
+		client->id = id;
+		__atomic_store_n(entry, client, __ATOMIC_RELEASE);
+		cdata->client_id = id + 1;
+		return true;
+	}
+	return false;
+}
+
 static void __recycle_client(cdata_t *cdata, client_instance_t *client)
 {
+	char *buf = client->buf;
+
+	/* Clients that never got an id have no table entry to free */
+	if (client->id >= 0)
+		__atomic_store_n(__client_entry(cdata, client->id), NULL, __ATOMIC_RELEASE);
+	/* Keep regular sized read buffers with the recycled client */
+	if (client->bufsize > PAGESIZE) {
+		free(buf);
+		buf = NULL;
+	}
 	memset(client, 0, sizeof(client_instance_t));
 	client->id = -1;
+	client->buf = buf;
 	DL_APPEND(cdata->recycled_clients, client);
 }
 
@@ -222,9 +355,11 @@ static void recycle_client(cdata_t *cdata, client_instance_t *client)
 	ck_wunlock(&cdata->lock);
 }
 
+static int drop_client(cdata_t *cdata, client_instance_t *client);
+
 /* Accepts incoming connections on the server socket and generates client
- * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
+ * instances, distributing them round robin to each receiver's epoll set */
+static int accept_client(cdata_t *cdata, const uint64_t server)
 {
 	int fd, port, no_clients, sockd;
 	ckpool_t *ckp = cdata->ckp;
@@ -253,6 +388,7 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 		 * socket */
 		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
 			LOGERR("Recoverable error on accept in accept_client");
+			recycle_client(cdata, client);
 			return 0;
 		}
 		LOGERR("Failed to accept on socket %d in acceptor", sockd);
@@ -288,28 +424,45 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	LOGINFO("Connected new client %d on socket %d to %d active clients from %s:%d",
 		cdata->nfds, fd, no_clients, client->address_name, port);
 
+	client->fd = fd;
+	if (!client->buf)
+		client->buf = ckalloc(PAGESIZE + 1);
+	client->bufsize = PAGESIZE;
+	optlen = sizeof(client->sendbufsize);
+	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
+	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
+
+	/* We increase the ref count on this client as epoll creates a pointer
+	 * to it. We drop that reference when the socket is closed which
+	 * removes it automatically from the epoll list. The reference must be
+	 * held before it is added to epoll since another receiver thread may
+	 * service it immediately. */
 	ck_wlock(&cdata->lock);
-	client->id = cdata->client_id++;
+	if (unlikely(!__assign_client_id(cdata, client))) {
+		ck_wunlock(&cdata->lock);
+		LOGWARNING("Connector ran out of client table entries with %d clients", no_clients);
+		Close(fd);
+		recycle_client(cdata, client);
+		return 0;
+	}
+	client->epfd = cdata->receivers[cdata->nfds % cdata->receiver_count].epfd;
+	__inc_instance_ref(client);
 	HASH_ADD_I64(cdata->clients, id, client);
 	cdata->nfds++;
 	ck_wunlock(&cdata->lock);
 
 	event.data.u64 = client->id;
 	event.events = EPOLLIN | EPOLLRDHUP;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+	if (unlikely(epoll_ctl(client->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
 		LOGERR("Failed to epoll_ctl add in accept_client");
+		/* Drops the reference held for epoll, leaving the client to
+		 * be recycled from the dead list like any other */
+		__inc_instance_ref(client);
+		drop_client(cdata, client);
+		__dec_instance_ref(client);
 		return 0;
 	}
 
-	/* We increase the ref count on this client as epoll creates a pointer
-	 * to it. We drop that reference when the socket is closed which
-	 * removes it automatically from the epoll list. */
-	__inc_instance_ref(client);
-	client->fd = fd;
-	optlen = sizeof(client->sendbufsize);
-	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
-	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
-
 	return 1;
 }
 
@@ -322,7 +475,7 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 	client->invalid = true;
 	ret = client->fd;
 	Close(client->fd);
-	epoll_ctl(cdata->epfd, EPOLL_CTL_DEL, ret, NULL);
+	epoll_ctl(client->epfd, EPOLL_CTL_DEL, ret, NULL);
 	HASH_DEL(cdata->clients, client);
 	DL_APPEND(cdata->dead_clients, client);
 	/* This is the reference to this client's presence in the
@@ -396,7 +549,7 @@ static int invalidate_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *c
 	 * counts for them. */
 	ck_wlock(&cdata->lock);
 	DL_FOREACH_SAFE(cdata->dead_clients, client, tmp) {
-		if (!client->ref) {
+		if (!__atomic_load_n(&client->ref, __ATOMIC_SEQ_CST)) {
 			DL_DELETE(cdata->dead_clients, client);
 			LOGINFO("Connector recycling client %"PRId64, client->id);
 			/* We only close the client fd once we're sure there
@@ -453,22 +606,128 @@ static void parse_redirector_share(client_instance_t *client, const json_t *val)
 	}
 }
 
+/* Pass a client's message on to the stratifier untouched, prefixed with a
+ * binary envelope describing the client, leaving all json parsing to the
+ * stratifier. */
+static void envelope_client_msg(cdata_t *cdata, const client_instance_t *client,
+				const int64_t client_id, const char *address, const char *msg,
+				const int len, const int64_t stamp)
+{
+	ckpool_t *ckp = cdata->ckp;
+	struct {
+		client_envelope_t env;
+		char line[MAX_MSGSIZE];
+	} envmsg;
+	client_envelope_t *env = &envmsg.env;
+
+	/* Only trusted remote servers send lines larger than MAX_MSGSIZE */
+	if (unlikely(len > MAX_MSGSIZE))
+		env = ckalloc(sizeof(client_envelope_t) + len);
+	env->type = CLIENT_ENVELOPE;
+	strcpy(env->address, address);
+	env->server = client->server;
+	env->client_id = client_id;
+	env->received = stamp;
+	env->queued = 0;
+	memcpy(env + 1, msg, len);
+	send_proc_data(ckp->stratifier, (const char *)env, sizeof(client_envelope_t) + len);
+	lhist_add(&cdata->latency[CSTAGE_RECEIVE], monotonic_ns() - stamp);
+	if (env != &envmsg.env)
+		free(env);
+}
+
+/* Raw framed lines from a passthrough are "id address line", the line being
+ * the untouched one from the passthrough's client, so they can be enveloped
+ * for the stratifier as is. */
+static void passthrough_envelope(cdata_t *cdata, client_instance_t *client, const char *msg,
+				 const int len, const int64_t stamp)
+{
+	char address[INET6_ADDRSTRLEN];
+	const char *addr, *line;
+	int64_t client_id;
+	char *end;
+
+	client_id = strtoll(msg, &end, 10);
+	addr = end + 1;
+	if (unlikely(*end != ' ' || client_id < 0 || client_id > 0xffffffffll))
+		goto invalid;
+	line = memchr(addr, ' ', msg + len - addr);
+	if (unlikely(!line || line - addr >= INET6_ADDRSTRLEN))
+		goto invalid;
+	memcpy(address, addr, line - addr);
+	address[line - addr] = '\0';
+	line++;
+	if (unlikely(!client->rawpass)) {
+		LOGINFO("Passthrough client %"PRId64" using raw framing", client->id);
+		client->rawpass = true;
+	}
+	envelope_client_msg(cdata, client, (client->id << 32) | client_id, address, line,
+			    msg + len - line, stamp);
+	return;
+invalid:
+	LOGINFO("Passthrough client %"PRId64" sent invalid framed message %s", client->id, msg);
+}
+
+/* In passthrough mode client lines are framed with their id and address for
+ * the upstream pool instead of being parsed and rebuilt as json. */
+static void frame_passthrough_msg(cdata_t *cdata, const client_instance_t *client, const char *msg,
+				  int len)
+{
+	ckpool_t *ckp = cdata->ckp;
+	char frame[MAX_MSGSIZE + 96];
+	char *buf = frame;
+	int ofs;
+
+	/* Drop the EOL, the generator terminates each line it sends */
+	while (len && (msg[len - 1] == '\n' || msg[len - 1] == '\r'))
+		len--;
+	if (unlikely(len > MAX_MSGSIZE))
+		buf = ckalloc(len + 96);
+	ofs = sprintf(buf, "%"PRId64" %s ", client->id, client->address_name);
+	memcpy(buf + ofs, msg, len);
+	buf[ofs + len] = '\0';
+	send_proc(ckp->generator, buf);
+	if (buf != frame)
+		free(buf);
+}
+
 /* Client is holding a reference count from being on the epoll list */
 static void parse_client_msg(cdata_t *cdata, client_instance_t *client)
 {
 	ckpool_t *ckp = cdata->ckp;
-	char msg[PAGESIZE], *eol;
-	int buflen, ret;
+	int buflen, ret, maxmsg;
+	char *msg, *eol, c;
+	int64_t stamp;
 	json_t *val;
 
+	/* Give passthroughs and remote servers a larger buffer once we know
+	 * what they are, done here since only the receiver uses the buffer. */
+	if (unlikely((client->passthrough || client->remote) && client->bufsize < NODE_BUFSIZE)) {
+		char *newbuf = realloc(client->buf, NODE_BUFSIZE + 1);
+
+		if (likely(newbuf)) {
+			client->buf = newbuf;
+			client->bufsize = NODE_BUFSIZE;
+		}
+	}
+	maxmsg = client->bufsize > PAGESIZE ? client->bufsize / 2 : MAX_MSGSIZE;
 retry:
-	if (unlikely(client->bufofs > MAX_MSGSIZE)) {
+	if (unlikely(client->bufofs - client->parseofs > (unsigned long)maxmsg)) {
 		LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
 			  client->id, client->fd);
 		invalidate_client(ckp, cdata, client);
 		return;
 	}
-	buflen = PAGESIZE - client->bufofs;
+	/* Start from the beginning of the buffer once everything is parsed,
+	 * only moving a partial message down when short of room to read. */
+	if (client->parseofs == client->bufofs)
+		client->parseofs = client->bufofs = 0;
+	else if (client->parseofs && client->bufsize - client->bufofs < (unsigned long)maxmsg) {
+		client->bufofs -= client->parseofs;
+		memmove(client->buf, client->buf + client->parseofs, client->bufofs);
+		client->parseofs = 0;
+	}
+	buflen = client->bufsize - client->bufofs;
 	/* This read call is non-blocking since the socket is set to O_NOBLOCK */
 	ret = read(client->fd, client->buf + client->bufofs, buflen);
 	if (ret < 1) {
@@ -480,25 +739,39 @@ retry:
 		return;
 	}
 	client->bufofs += ret;
+	stamp = monotonic_ns();
 reparse:
-	eol = memchr(client->buf, '\n', client->bufofs);
+	msg = client->buf + client->parseofs;
+	eol = memchr(msg, '\n', client->bufofs - client->parseofs);
 	if (!eol)
 		goto retry;
 
 	/* Do something useful with this message now */
-	buflen = eol - client->buf + 1;
-	if (unlikely(buflen > MAX_MSGSIZE)) {
+	buflen = eol - msg + 1;
+	if (unlikely(buflen > maxmsg)) {
 		LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
 		invalidate_client(ckp, cdata, client);
 		return;
 	}
+	client->parseofs += buflen;
 
-	memcpy(msg, client->buf, buflen);
+	/* Terminate the message in place, restoring the next byte after */
+	c = msg[buflen];
 	msg[buflen] = '\0';
-	client->bufofs -= buflen;
-	memmove(client->buf, client->buf + buflen, client->bufofs);
-	client->buf[client->bufofs] = '\0';
-	if (!(val = json_loads(msg, 0, NULL))) {
+
+	/* In pool mode the line is passed on as is, the stratifier being
+	 * the only process to parse it. */
+	if (likely(!ckp->passthrough && !client->passthrough)) {
+		if (likely(!client->invalid))
+			envelope_client_msg(cdata, client, client->id, client->address_name,
+					    msg, buflen, stamp);
+	} else if (client->passthrough && msg[0] >= '0' && msg[0] <= '9') {
+		if (likely(!client->invalid))
+			passthrough_envelope(cdata, client, msg, buflen, stamp);
+	} else if (ckp->passthrough && !ckp->node && !ckp->redirector) {
+		if (likely(!client->invalid))
+			frame_passthrough_msg(cdata, client, msg, buflen);
+	} else if (!(val = json_loads(msg, 0, NULL))) {
 		char *buf = strdup("Invalid JSON, disconnecting\n");
 
 		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, msg);
@@ -536,52 +809,68 @@ reparse:
 		free(s);
 		json_decref(val);
 	}
+	msg[buflen] = c;
 
-	if (client->bufofs)
+	if (client->parseofs < client->bufofs)
 		goto reparse;
 	goto retry;
 }
 
+/* Look up a client by id without locking, taking a reference only if it's
+ * still live. The reference is taken before checking the id since a client
+ * whose refcount has dropped to zero can be recycled and reused. */
 static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
 {
-	client_instance_t *client;
-
-	ck_wlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
-	if (client) {
-		if (!client->invalid)
-			__inc_instance_ref(client);
-		else
-			client = NULL;
+	int index = id & CLIENT_TABLE_MASK, ref;
+	client_instance_t *client, **chunk;
+
+	if (unlikely(id < 0))
+		return NULL;
+	chunk = __atomic_load_n(&cdata->client_table[index >> CLIENT_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	if (unlikely(!chunk))
+		return NULL;
+	client = __atomic_load_n(&chunk[index & (CLIENT_CHUNK_SIZE - 1)], __ATOMIC_ACQUIRE);
+	if (!client)
+		return NULL;
+
+	ref = __atomic_load_n(&client->ref, __ATOMIC_SEQ_CST);
+	do {
+		if (!ref)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&client->ref, &ref, ref + 1, false,
+					      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	if (unlikely(client->id != id || client->invalid)) {
+		__dec_instance_ref(client);
+		return NULL;
 	}
-	ck_wunlock(&cdata->lock);
-
 	return client;
 }
 
 /* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
+ * handles the incoming messages. Each receiver thread drains up to MAX_EVENTS
+ * from its own epoll set per wait, with only the first receiver listening on
+ * the server fds for new clients. */
 void *receiver(void *arg)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event event;
-	uint64_t serverfds, i;
-	int ret, epfd;
+	rinstance_t *rinst = (rinstance_t *)arg;
+	struct epoll_event events[MAX_EVENTS];
+	cdata_t *cdata = rinst->cdata;
+	int ret, epfd = rinst->epfd, i;
+	uint64_t serverfds, j;
+	char qname[16];
 
-	rename_proc("creceiver");
+	snprintf(qname, 15, "creceiver%d", rinst->id);
+	rename_proc(qname);
 
-	epfd = cdata->epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0) {
-		LOGEMERG("FATAL: Failed to create epoll in receiver");
-		goto out;
-	}
 	serverfds = cdata->ckp->serverurls;
-	/* Add all the serverfds to the epoll */
-	for (i = 0; i < serverfds; i++) {
+	/* Add all the serverfds to the first receiver's epoll */
+	for (j = 0; !rinst->id && j < serverfds; j++) {
+		struct epoll_event event;
+
 		/* The small values will be less than the first client ids */
-		event.data.u64 = i;
+		event.data.u64 = j;
 		event.events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], &event);
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[j], &event);
 		if (ret < 0) {
 			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
 			goto out;
@@ -592,11 +881,9 @@ void *receiver(void *arg)
 		cksleep_ms(1);
 
 	while (42) {
-		client_instance_t *client;
-
 		while (unlikely(!cdata->accept))
 			cksleep_ms(10);
-		ret = epoll_wait(epfd, &event, 1, 1000);
+		ret = epoll_wait(epfd, events, MAX_EVENTS, 1000);
 		if (unlikely(ret < 1)) {
 			if (unlikely(ret == -1)) {
 				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
@@ -605,53 +892,57 @@ void *receiver(void *arg)
 			/* Nothing to service, still very unlikely */
 			continue;
 		}
-		if (event.data.u64 < serverfds) {
-			ret = accept_client(cdata, epfd, event.data.u64);
-			if (unlikely(ret < 0)) {
-				LOGEMERG("FATAL: Failed to accept_client in receiver");
-				break;
+		for (i = 0; i < ret; i++) {
+			struct epoll_event *event = &events[i];
+			client_instance_t *client;
+
+			if (event->data.u64 < serverfds) {
+				if (unlikely(accept_client(cdata, event->data.u64) < 0)) {
+					LOGEMERG("FATAL: Failed to accept_client in receiver");
+					goto out;
+				}
+				continue;
 			}
-			continue;
-		}
-		client = ref_client_by_id(cdata, event.data.u64);
-		if (unlikely(!client)) {
-			LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", event.data.u64);
-			continue;
-		}
-		if (unlikely(client->invalid))
-			goto noparse;
-		/* We can have both messages and read hang ups so process the
-		 * message first. */
-		if (likely(event.events & EPOLLIN))
-			parse_client_msg(cdata, client);
-		if (unlikely(client->invalid))
-			goto noparse;
-		if (unlikely(event.events & EPOLLERR)) {
-			socklen_t errlen = sizeof(int);
-			int error = 0;
-
-			/* See what type of error this is and raise the log
-			 * level of the message if it's unexpected. */
-			getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
-			if (error != 104) {
-				LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-					  client->id, client->fd, error, strerror(error));
-			} else {
-				LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-					client->id, client->fd, error, strerror(error));
+			client = ref_client_by_id(cdata, event->data.u64);
+			if (unlikely(!client)) {
+				LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", event->data.u64);
+				continue;
+			}
+			if (unlikely(client->invalid))
+				goto noparse;
+			/* We can have both messages and read hang ups so process the
+			 * message first. */
+			if (likely(event->events & EPOLLIN))
+				parse_client_msg(cdata, client);
+			if (unlikely(client->invalid))
+				goto noparse;
+			if (unlikely(event->events & EPOLLERR)) {
+				socklen_t errlen = sizeof(int);
+				int error = 0;
+
+				/* See what type of error this is and raise the log
+				 * level of the message if it's unexpected. */
+				getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
+				if (error != 104) {
+					LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+						  client->id, client->fd, error, strerror(error));
+				} else {
+					LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+						client->id, client->fd, error, strerror(error));
+				}
+				invalidate_client(cdata->pi->ckp, cdata, client);
+			} else if (unlikely(event->events & EPOLLHUP)) {
+				/* Client connection reset by peer */
+				LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
+				invalidate_client(cdata->pi->ckp, cdata, client);
+			} else if (unlikely(event->events & EPOLLRDHUP)) {
+				/* Client disconnected by peer */
+				LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
+				invalidate_client(cdata->pi->ckp, cdata, client);
 			}
-			invalidate_client(cdata->pi->ckp, cdata, client);
-		} else if (unlikely(event.events & EPOLLHUP)) {
-			/* Client connection reset by peer */
-			LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
-			invalidate_client(cdata->pi->ckp, cdata, client);
-		} else if (unlikely(event.events & EPOLLRDHUP)) {
-			/* Client disconnected by peer */
-			LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
-			invalidate_client(cdata->pi->ckp, cdata, client);
-		}
 noparse:
-		dec_instance_ref(cdata, client);
+			dec_instance_ref(cdata, client);
+		}
 	}
 out:
 	/* We shouldn't get here unless there's an error */
@@ -659,115 +950,298 @@ out:
 	return NULL;
 }
 
-/* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
-static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
 {
-	client_instance_t *client = sender_send->client;
-	time_t now_t;
+	bcast_t *bcast = sender_send->bcast;
+
+	dec_instance_ref(cdata, sender_send->client);
+	if (bcast) {
+		bool last;
 
-	if (unlikely(client->invalid))
-		goto out_true;
+		mutex_lock(&cdata->sender_lock);
+		last = !--bcast->ref;
+		mutex_unlock(&cdata->sender_lock);
+		if (last) {
+			free(bcast->buf);
+			free(bcast);
+		}
+	} else
+		free(sender_send->buf);
+	free(sender_send);
+}
 
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
+/* Free a list of completed sends, dropping the references they hold */
+static void clear_sender_sends(cdata_t *cdata, sender_send_t *sends)
+{
+	int64_t sends_queued = 0, sends_size = 0;
+	sender_send_t *sender_send, *tmp;
 
-	client->sending = sender_send;
-	now_t = time(NULL);
+	if (!sends)
+		return;
+	DL_FOREACH_SAFE(sends, sender_send, tmp) {
+		DL_DELETE(sends, sender_send);
+		sends_queued++;
+		if (!sender_send->bcast)
+			sends_size += sizeof(sender_send_t) + sender_send->ofs + sender_send->len + 1;
+		else
+			sends_size += sizeof(sender_send_t);
+		clear_sender_send(sender_send, cdata);
+	}
 
-	/* Increase sendbufsize to match large messages sent to clients - this
-	 * usually only applies to clients as mining nodes. */
-	if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
-		client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
+	mutex_lock(&cdata->sender_lock);
+	cdata->sends_queued -= sends_queued;
+	cdata->sends_size -= sends_size;
+	mutex_unlock(&cdata->sender_lock);
+}
 
-	while (sender_send->len) {
-		int ret = write(client->fd, sender_send->buf + sender_send->ofs, sender_send->len);
+/* Write out as many of the client's queued sends as the socket will accept,
+ * coalescing up to MAX_SEND_IOVS messages per writev call. Completed sends
+ * are moved to the done list. Returns false if the socket would block with
+ * sends still pending. */
+static bool write_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			       sender_send_t **done, const time_t now_t)
+{
+	struct iovec iov[MAX_SEND_IOVS];
+	sender_send_t *sender_send, *tmp;
+	bool ret = true;
 
-		if (unlikely(ret < 1)) {
-			/* Invalidate clients that block for more than 60 seconds */
-			if (unlikely(client->blocked_time && now_t - client->blocked_time >= 60)) {
-				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
-					  client->id, client->fd);
-				invalidate_client(ckp, cdata, client);
-				goto out_true;
-			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
+	mutex_lock(&cdata->sender_lock);
+	DL_CONCAT(client->sends, client->sender_sends);
+	client->sender_sends = NULL;
+	mutex_unlock(&cdata->sender_lock);
+
+	while (client->sends && likely(!client->invalid)) {
+		int iovcnt = 0, len = 0;
+		ssize_t written;
+		int64_t now;
+
+		DL_FOREACH(client->sends, sender_send) {
+			iov[iovcnt].iov_base = sender_send->buf + sender_send->ofs;
+			iov[iovcnt].iov_len = sender_send->len;
+			len += sender_send->len;
+			if (++iovcnt >= MAX_SEND_IOVS)
+				break;
+		}
+
+		/* Increase sendbufsize to match large messages sent to clients - this
+		 * usually only applies to clients as mining nodes. */
+		if (unlikely(!ckp->wmem_warn && len > client->sendbufsize))
+			client->sendbufsize = set_sendbufsize(ckp, client->fd, len);
+
+		written = writev(client->fd, iov, iovcnt);
+		if (unlikely(written < 1)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || !written) {
 				if (!client->blocked_time)
 					client->blocked_time = now_t;
-				return false;
+				ret = false;
+				break;
 			}
 			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
 				client->id, client->fd, errno, strerror(errno));
 			invalidate_client(ckp, cdata, client);
-			goto out_true;
+			break;
 		}
-		sender_send->ofs += ret;
-		sender_send->len -= ret;
 		client->blocked_time = 0;
+		now = monotonic_ns();
+
+		DL_FOREACH_SAFE(client->sends, sender_send, tmp) {
+			if (written < sender_send->len) {
+				sender_send->ofs += written;
+				sender_send->len -= written;
+				break;
+			}
+			written -= sender_send->len;
+			sender_send->ofs += sender_send->len;
+			sender_send->len = 0;
+			DL_DELETE(client->sends, sender_send);
+			DL_APPEND(*done, sender_send);
+			lhist_add(&cdata->latency[CSTAGE_SEND], now - sender_send->queued);
+		}
 	}
-out_true:
-	client->sending = NULL;
-	return true;
+
+	/* Discard anything left for clients that have been invalidated */
+	if (unlikely(client->invalid)) {
+		DL_CONCAT(*done, client->sends);
+		client->sends = NULL;
+		ret = true;
+	}
+	return ret;
 }
 
-static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+/* Wait on EPOLLOUT for a client whose socket buffer is full. One shot so we
+ * only get woken once per blocked write. */
+static void poll_client_send(cdata_t *cdata, client_instance_t *client)
 {
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
+	struct epoll_event event;
+	int op;
+
+	op = client->send_polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	event.data.ptr = client;
+	event.events = EPOLLOUT | EPOLLONESHOT;
+	if (unlikely(epoll_ctl(cdata->sender_epfd, op, client->fd, &event) < 0)) {
+		/* Will be culled by the blocked client checks if it's dead */
+		LOGINFO("Failed to epoll_ctl client id %"PRId64" fd %d in sender",
+			client->id, client->fd);
+		return;
+	}
+	client->send_polled = true;
+}
+
+/* Write out all pending sends for a client owned by the sender thread,
+ * moving it to the blocked list if its socket fills up. The client is only
+ * released by the sender once it has nothing left queued, and its sends must
+ * not be freed till then since they hold the references keeping it alive. */
+static void service_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			   const time_t now_t)
+{
+	bool again;
+
+	do {
+		sender_send_t *done = NULL;
+
+		if (!write_client_sends(ckp, cdata, client, &done, now_t)) {
+			poll_client_send(cdata, client);
+			DL_APPEND2(cdata->blocked_clients, client, send_prev, send_next);
+			mutex_lock(&cdata->sender_lock);
+			cdata->sends_delayed++;
+			cdata->sends_blocked++;
+			mutex_unlock(&cdata->sender_lock);
+			clear_sender_sends(cdata, done);
+			return;
+		}
+
+		mutex_lock(&cdata->sender_lock);
+		again = !!client->sender_sends;
+		if (!again)
+			client->send_queued = false;
+		mutex_unlock(&cdata->sender_lock);
+
+		clear_sender_sends(cdata, done);
+	} while (again);
 }
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
+/* Use a thread to write out queued messages to clients. Clients with new
+ * sends are placed on the sender_clients list and the sender woken via its
+ * eventfd. Clients that would block are only serviced again once epoll tells
+ * us they're writeable, so stalled clients cost nothing till then. */
 static void *sender(void *arg)
 {
+	struct epoll_event events[MAX_EVENTS];
 	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
 	ckpool_t *ckp = cdata->ckp;
+	time_t last_check = 0;
 
 	rename_proc("csender");
 
 	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
-
-		/* Check all sends to see if they can be written out */
-		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
+		client_instance_t *client, *tmp, *clients;
+		time_t now_t;
+		int ret, i;
+
+		ret = epoll_wait(cdata->sender_epfd, events, MAX_EVENTS, 1000);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGEMERG("FATAL: Failed to epoll_wait in sender");
+			break;
+		}
+		now_t = time(NULL);
+
+		for (i = 0; i < ret; i++) {
+			client = events[i].data.ptr;
+			if (!client) {
+				eventfd_t val;
+
+				eventfd_read(cdata->sender_evfd, &val);
+				continue;
 			}
+			DL_DELETE2(cdata->blocked_clients, client, send_prev, send_next);
+			mutex_lock(&cdata->sender_lock);
+			cdata->sends_blocked--;
+			mutex_unlock(&cdata->sender_lock);
+			service_client(ckp, cdata, client, now_t);
 		}
 
 		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
-		cdata->sends_queued = sends_queued;
-		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
+		clients = cdata->sender_clients;
+		cdata->sender_clients = NULL;
+		mutex_unlock(&cdata->sender_lock);
+
+		DL_FOREACH_SAFE2(clients, client, tmp, send_next) {
+			DL_DELETE2(clients, client, send_prev, send_next);
+			service_client(ckp, cdata, client, now_t);
 		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
+
+		if (now_t == last_check)
+			continue;
+		last_check = now_t;
+
+		/* Cull blocked clients that are dead or have blocked too long */
+		DL_FOREACH_SAFE2(cdata->blocked_clients, client, tmp, send_next) {
+			if (likely(!client->invalid && now_t - client->blocked_time < 60))
+				continue;
+			/* Invalidate clients that block for more than 60 seconds */
+			if (!client->invalid) {
+				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+					  client->id, client->fd);
+				invalidate_client(ckp, cdata, client);
+			}
+			DL_DELETE2(cdata->blocked_clients, client, send_prev, send_next);
+			mutex_lock(&cdata->sender_lock);
+			cdata->sends_blocked--;
+			mutex_unlock(&cdata->sender_lock);
+			service_client(ckp, cdata, client, now_t);
 		}
-		mutex_unlock(&cdata->sender_lock);
 	}
 	/* We shouldn't get here unless there's an error */
 	childsighandler(15);
 	return NULL;
 }
 
+/* Must be called with sender_lock held. Returns true if the sender needs
+ * waking. */
+static bool __queue_sender_send(cdata_t *cdata, sender_send_t *sender_send)
+{
+	client_instance_t *client = sender_send->client;
+	bool wake = false;
+
+	sender_send->queued = monotonic_ns();
+	cdata->sends_generated++;
+	cdata->sends_queued++;
+	if (!sender_send->bcast)
+		cdata->sends_size += sizeof(sender_send_t) + sender_send->len + 1;
+	else
+		cdata->sends_size += sizeof(sender_send_t);
+	DL_APPEND(client->sender_sends, sender_send);
+	/* Clients already on a sender list pick this up when next serviced */
+	if (!client->send_queued) {
+		client->send_queued = true;
+		wake = !cdata->sender_clients;
+		DL_APPEND2(cdata->sender_clients, client, send_prev, send_next);
+	}
+	return wake;
+}
+
+/* Queue a heap allocated buffer to a client we hold a reference to, the
+ * reference being held until the sender has finished with it. */
+static void queue_client_send(cdata_t *cdata, client_instance_t *client, char *buf, const int len)
+{
+	sender_send_t *sender_send;
+	bool wake;
+
+	sender_send = ckzalloc(sizeof(sender_send_t));
+	sender_send->client = client;
+	sender_send->buf = buf;
+	sender_send->len = len;
+
+	mutex_lock(&cdata->sender_lock);
+	wake = __queue_sender_send(cdata, sender_send);
+	mutex_unlock(&cdata->sender_lock);
+
+	if (wake)
+		eventfd_write(cdata->sender_evfd, 1);
+}
+
 static int add_redirect(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
 {
 	redirect_t *redirect;
@@ -794,7 +1268,6 @@ static int add_redirect(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client
 
 static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 {
-	sender_send_t *sender_send;
 	cdata_t *cdata = ckp->data;
 	json_t *val;
 	char *buf;
@@ -809,17 +1282,8 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
 	json_decref(val);
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
-	sender_send->client = client;
-	sender_send->buf = buf;
-	sender_send->len = strlen(buf);
 	inc_instance_ref(cdata, client);
-
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_client_send(cdata, client, buf, strlen(buf));
 }
 
 /* Look for accepted shares in redirector mode to know we can redirect this
@@ -883,7 +1347,6 @@ out:
 static void send_client(cdata_t *cdata, const int64_t id, char *buf)
 {
 	ckpool_t *ckp = cdata->ckp;
-	sender_send_t *sender_send;
 	client_instance_t *client;
 	int len;
 
@@ -953,36 +1416,120 @@ static void send_client(cdata_t *cdata, const int64_t id, char *buf)
 			test_redirector_shares(ckp, client, buf);
 	}
 out:
-	sender_send = ckzalloc(sizeof(sender_send_t));
-	sender_send->client = client;
-	sender_send->buf = buf;
-	sender_send->len = len;
+	queue_client_send(cdata, client, buf, len);
+}
 
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+/* Fan out a message serialised once by the stratifier to a list of client
+ * ids in the form broadcast=id,id,...:msg, taking ownership of the unix
+ * message buffer and sharing it between all the sends. */
+static void broadcast_clients(cdata_t *cdata, unix_msg_t *umsg)
+{
+	int64_t *ids, *missing;
+	int i, clients = 1, nomiss = 0, len;
+	sender_send_t *sends = NULL, *sender_send, *tmp;
+	ckpool_t *ckp = cdata->ckp;
+	char *buf, *msg, *p;
+	bcast_t *bcast;
+	bool wake = false;
+
+	buf = umsg->buf + 10;
+	msg = strchr(buf, ':');
+	if (unlikely(!msg)) {
+		LOGWARNING("Connector failed to parse broadcast message");
+		return;
+	}
+	*msg++ = '\0';
+	len = strlen(msg);
+	if (unlikely(!len)) {
+		LOGWARNING("Connector sent a zero length broadcast message");
+		return;
+	}
+	for (p = buf; *p; p++) {
+		if (*p == ',')
+			clients++;
+	}
+	ids = ckalloc(sizeof(int64_t) * clients);
+	missing = ckalloc(sizeof(int64_t) * clients);
+	for (i = 0, p = buf; i < clients && *p; i++) {
+		ids[i] = strtoll(p, &p, 10);
+		if (*p == ',')
+			p++;
+	}
+	clients = i;
+
+	bcast = ckalloc(sizeof(bcast_t));
+	bcast->buf = umsg->buf;
+	bcast->ref = 0;
+	umsg->buf = NULL;
+
+	for (i = 0; i < clients; i++) {
+		client_instance_t *client = ref_client_by_id(cdata, ids[i]);
+
+		if (unlikely(!client)) {
+			missing[nomiss++] = ids[i];
+			continue;
+		}
+		sender_send = ckzalloc(sizeof(sender_send_t));
+		sender_send->client = client;
+		sender_send->buf = msg;
+		sender_send->len = len;
+		sender_send->bcast = bcast;
+		DL_APPEND(sends, sender_send);
+		bcast->ref++;
+	}
+
+	if (likely(sends)) {
+		mutex_lock(&cdata->sender_lock);
+		DL_FOREACH_SAFE(sends, sender_send, tmp) {
+			DL_DELETE(sends, sender_send);
+			wake |= __queue_sender_send(cdata, sender_send);
+		}
+		mutex_unlock(&cdata->sender_lock);
+	} else {
+		free(bcast->buf);
+		free(bcast);
+	}
+
+	if (wake)
+		eventfd_write(cdata->sender_evfd, 1);
+
+	for (i = 0; i < nomiss; i++) {
+		LOGINFO("Connector failed to find client id %"PRId64" to broadcast to", missing[i]);
+		stratifier_drop_id(ckp, missing[i]);
+	}
+	free(missing);
+	free(ids);
 }
 
 static bool client_exists(cdata_t *cdata, const int64_t id)
 {
-	client_instance_t *client;
-
-	ck_rlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
-	ck_runlock(&cdata->lock);
+	client_instance_t *client = ref_client_by_id(cdata, id);
 
+	if (client)
+		dec_instance_ref(cdata, client);
 	return !!client;
 }
 
+static bool raw_passthrough(cdata_t *cdata, const int64_t id)
+{
+	client_instance_t *client = ref_client_by_id(cdata, id);
+	bool ret = false;
+
+	if (client) {
+		ret = client->rawpass;
+		dec_instance_ref(cdata, client);
+	}
+	return ret;
+}
+
 static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
 {
 	char *buf;
 
 	LOGINFO("Connector adding passthrough client %"PRId64, client->id);
 	client->passthrough = true;
-	ASPRINTF(&buf, "{\"result\": true}\n");
+	/* Tell the passthrough we accept raw framed lines */
+	ASPRINTF(&buf, "{\"result\": true, \"raw\": true}\n");
 	send_client(cdata, client->id, buf);
 	if (!ckp->rmem_warn)
 		set_recvbufsize(ckp, client->fd, 1048576);
@@ -997,7 +1544,8 @@ static void remote_server(ckpool_t *ckp, cdata_t *cdata, client_instance_t *clie
 	LOGWARNING("Connector adding client %"PRId64" %s as remote trusted server",
 		   client->id, client->address_name);
 	client->remote = true;
-	ASPRINTF(&buf, "{\"result\": true}\n");
+	/* Tell the remote server we accept batched messages */
+	ASPRINTF(&buf, "{\"result\": true, \"batch\": true}\n");
 	send_client(cdata, client->id, buf);
 	if (!ckp->rmem_warn)
 		set_recvbufsize(ckp, client->fd, 1048576);
@@ -1006,6 +1554,7 @@ static void remote_server(ckpool_t *ckp, cdata_t *cdata, client_instance_t *clie
 static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 {
 	json_t *req, *val = NULL, *res_val, *err_val;
+	cdata_t *cdata = ckp->data;
 	bool res, ret = false;
 	float timeout = 10;
 
@@ -1044,16 +1593,53 @@ static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 		LOGWARNING("Denied upstream trusted connection");
 		goto out;
 	}
-	LOGWARNING("Connected to upstream server %s:%s as trusted remote", cs->url, cs->port);
+	cdata->upstream_batch = json_is_true(json_object_get(val, "batch"));
+	LOGWARNING("Connected to upstream server %s:%s as trusted remote%s", cs->url, cs->port,
+		   cdata->upstream_batch ? " with batching" : "");
 	ret = true;
 out:
 	return ret;
 }
 
+/* Convert a batch message into individual messages for an upstream server
+ * that does not accept batches. */
+static char *unbatch_msg(const char *buf)
+{
+	json_t *val, *arr_val, *entry;
+	char *msg = NULL, *line;
+	size_t index;
+
+	val = json_loads(buf, 0, NULL);
+	if (unlikely(!val)) {
+		LOGWARNING("Failed to parse batch message %s", buf);
+		return NULL;
+	}
+	arr_val = json_object_get(val, "shares");
+	json_array_foreach(arr_val, index, entry) {
+		ASPRINTF(&line, "{\"method\":\"shares\",\"workername\":\"%s\",\"diff\":%"PRId64",\"sdiff\":%lf}\n",
+			 json_string_value(json_array_get(entry, 0)),
+			 (int64_t)json_integer_value(json_array_get(entry, 1)),
+			 json_number_value(json_array_get(entry, 2)));
+		realloc_strcat(&msg, line);
+		free(line);
+	}
+	arr_val = json_object_get(val, "workers");
+	json_array_foreach(arr_val, index, entry) {
+		ASPRINTF(&line, "{\"method\":\"workers\",\"username\":\"%s\",\"workers\":%d}\n",
+			 json_string_value(json_array_get(entry, 0)),
+			 (int)json_integer_value(json_array_get(entry, 1)));
+		realloc_strcat(&msg, line);
+		free(line);
+	}
+	json_decref(val);
+	return msg;
+}
+
 static void usend_process(ckpool_t *ckp, char *buf)
 {
 	cdata_t *cdata = ckp->data;
 	connsock_t *cs = &cdata->upstream_cs;
+	char *msg = NULL;
 	int len, sent;
 
 	if (unlikely(!buf || !strlen(buf))) {
@@ -1061,9 +1647,19 @@ static void usend_process(ckpool_t *ckp, char *buf)
 		goto out;
 	}
 	LOGDEBUG("Sending upstream msg: %s", buf);
-	len = strlen(buf);
 	while (42) {
-		sent = write_socket(cs->fd, buf, len);
+		const char *send = buf;
+
+		/* Check for batching each time as we may have reconnected */
+		if (!cdata->upstream_batch && cmdmatch(buf, "{\"method\":\"batch\"")) {
+			if (!msg)
+				msg = unbatch_msg(buf);
+			if (unlikely(!msg))
+				goto out;
+			send = msg;
+		}
+		len = strlen(send);
+		sent = write_socket(cs->fd, send, len);
 		if (sent == len)
 			break;
 		if (cs->fd > 0) {
@@ -1075,6 +1671,7 @@ static void usend_process(ckpool_t *ckp, char *buf)
 		while (!connect_upstream(ckp, cs));
 	}
 out:
+	free(msg);
 	free(buf);
 }
 
@@ -1120,15 +1717,42 @@ static void process_client_msg(cdata_t *cdata, const char *buf)
 	client_id = json_integer_value(json_object_get(json_msg, "client_id"));
 	json_object_del(json_msg, "client_id");
 	/* Put client_id back in for a passthrough subclient, passing its
-	 * upstream client_id instead of the passthrough's. */
-	if (client_id > 0xffffffffll)
+	 * upstream client_id instead of the passthrough's, or frame the line
+	 * with it if the passthrough takes raw lines. */
+	if (client_id > 0xffffffffll) {
+		if (raw_passthrough(cdata, client_id >> 32)) {
+			char *s = json_dumps(json_msg, JSON_COMPACT);
+			int64_t subclient_id = client_id & 0xffffffffll;
+
+			ASPRINTF(&msg, "%"PRId64" %s\n", subclient_id, s);
+			free(s);
+			goto send;
+		}
 		json_object_set_new_nocheck(json_msg, "client_id", json_integer(client_id & 0xffffffffll));
+	}
 
 	msg = json_dumps(json_msg, JSON_EOL | JSON_COMPACT);
+send:
 	send_client(cdata, client_id, msg);
 	json_decref(json_msg);
 }
 
+/* A raw framed "id line" from the upstream pool in passthrough mode, sent on
+ * to the client untouched. */
+static void process_passthrough_msg(cdata_t *cdata, const char *buf)
+{
+	int64_t client_id;
+	char *line, *msg;
+
+	client_id = strtoll(buf, &line, 10);
+	if (unlikely(*line != ' ')) {
+		LOGWARNING("Invalid framed message in process_passthrough_msg: %s", buf);
+		return;
+	}
+	ASPRINTF(&msg, "%s\n", line + 1);
+	send_client(cdata, client_id, msg);
+}
+
 /* Send the passthrough the terminate node.method */
 static void drop_passthrough_client(cdata_t *cdata, const int64_t id)
 {
@@ -1145,10 +1769,9 @@ static void drop_passthrough_client(cdata_t *cdata, const int64_t id)
 
 static char *connector_stats(cdata_t *cdata, const int runtime)
 {
-	json_t *val = json_object(), *subval;
+	json_t *val = json_object(), *subval, *latency;
 	client_instance_t *client;
-	int objects, generated;
-	sender_send_t *send;
+	int objects, generated, i;
 	int64_t memsize;
 	char *buf;
 
@@ -1158,7 +1781,7 @@ static char *connector_stats(cdata_t *cdata, const int runtime)
 
 	ck_rlock(&cdata->lock);
 	objects = HASH_COUNT(cdata->clients);
-	memsize = SAFE_HASH_OVERHEAD(cdata->clients) + sizeof(client_instance_t) * objects;
+	memsize = SAFE_HASH_OVERHEAD(cdata->clients) + (sizeof(client_instance_t) + PAGESIZE) * objects;
 	generated = cdata->clients_generated;
 	ck_runlock(&cdata->lock);
 
@@ -1170,26 +1793,29 @@ static char *connector_stats(cdata_t *cdata, const int runtime)
 	generated = cdata->dead_generated;
 	ck_runlock(&cdata->lock);
 
-	memsize = objects * sizeof(client_instance_t);
+	memsize = objects * (sizeof(client_instance_t) + PAGESIZE);
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "dead", subval);
 
-	objects = 0;
-	memsize = 0;
-
 	mutex_lock(&cdata->sender_lock);
-	DL_FOREACH(cdata->sender_sends, send) {
-		objects++;
-		memsize += sizeof(sender_send_t) + send->len + 1;
-	}
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated);
+	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_generated);
 	json_set_object(val, "sends", subval);
 
-	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_delayed);
+	JSON_CPACK(subval, "{si,si}", "count", cdata->sends_blocked, "generated", cdata->sends_delayed);
 	mutex_unlock(&cdata->sender_lock);
 
 	json_set_object(val, "delays", subval);
 
+	latency = json_object();
+	for (i = 0; i < CSTAGES; i++) {
+		lhist_stats(&cdata->latency[i], &subval);
+		json_set_object(latency, connector_stages[i], subval);
+	}
+	json_set_object(val, "latency", latency);
+
+	thread_stats(&subval);
+	json_set_object(val, "threads", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1239,6 +1865,10 @@ retry:
 	 * so look for them first. */
 	if (likely(buf[0] == '{')) {
 		process_client_msg(cdata, buf);
+	} else if (ckp->passthrough && buf[0] >= '0' && buf[0] <= '9') {
+		process_passthrough_msg(cdata, buf);
+	} else if (cmdmatch(buf, "broadcast=")) {
+		broadcast_clients(cdata, umsg);
 	} else if (cmdmatch(buf, "upstream=")) {
 		char *msg = strdup(buf + 9);
 
@@ -1267,6 +1897,23 @@ retry:
 		dec_instance_ref(cdata, client);
 		if (ret >= 0)
 			LOGINFO("Connector dropped client id: %"PRId64, client_id);
+	} else if (cmdmatch(buf, "invalidjson")) {
+		client_instance_t *client;
+
+		/* The stratifier found a pool mode client's line wasn't json */
+		ret = sscanf(buf, "invalidjson=%"PRId64, &client_id);
+		if (ret < 0) {
+			LOGDEBUG("Connector failed to parse invalidjson command: %s", buf);
+			goto retry;
+		}
+		client = ref_client_by_id(cdata, client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Connector failed to find client id %"PRId64" to drop", client_id);
+			goto retry;
+		}
+		send_client(cdata, client_id, strdup("Invalid JSON, disconnecting\n"));
+		invalidate_client(ckp, cdata, client);
+		dec_instance_ref(cdata, client);
 	} else if (cmdmatch(buf, "testclient")) {
 		ret = sscanf(buf, "testclient=%"PRId64, &client_id);
 		if (unlikely(ret < 0)) {
@@ -1346,6 +1993,7 @@ int connector(proc_instance_t *pi)
 {
 	cdata_t *cdata = ckzalloc(sizeof(cdata_t));
 	ckpool_t *ckp = pi->ckp;
+	struct epoll_event event;
 	int sockd, ret = 0, i;
 	const int on = 1;
 	int tries = 0;
@@ -1454,9 +2102,37 @@ int connector(proc_instance_t *pi)
 	 * them from the server fds in epoll. */
 	cdata->client_id = ckp->serverurls;
 	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
+	cdata->sender_epfd = epoll_create1(EPOLL_CLOEXEC);
+	cdata->sender_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cdata->sender_epfd < 0 || cdata->sender_evfd < 0) {
+		LOGEMERG("FATAL: Failed to create sender epoll in connector");
+		ret = 1;
+		goto out;
+	}
+	/* A NULL pointer distinguishes the eventfd from clients */
+	event.data.ptr = NULL;
+	event.events = EPOLLIN;
+	epoll_ctl(cdata->sender_epfd, EPOLL_CTL_ADD, cdata->sender_evfd, &event);
 	create_pthread(&cdata->pth_sender, sender, cdata);
-	create_pthread(&cdata->pth_receiver, receiver, cdata);
+
+	/* Create all the epoll fds before any receiver starts since the first
+	 * receiver will be adding clients to all of them. */
+	cdata->receiver_count = ckp->receivers;
+	cdata->receivers = ckzalloc(sizeof(rinstance_t) * cdata->receiver_count);
+	for (i = 0; i < cdata->receiver_count; i++) {
+		rinstance_t *rinst = &cdata->receivers[i];
+
+		rinst->cdata = cdata;
+		rinst->id = i;
+		rinst->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (rinst->epfd < 0) {
+			LOGEMERG("FATAL: Failed to create epoll in connector");
+			ret = 1;
+			goto out;
+		}
+	}
+	for (i = 0; i < cdata->receiver_count; i++)
+		create_pthread(&cdata->receivers[i].pth, receiver, &cdata->receivers[i]);
 	cdata->start_time = time(NULL);
 
 	create_unix_receiver(pi);
@@ -48,10 +48,10 @@ typedef struct proxy_instance proxy_instance_t;
 
 struct share_msg {
 	UT_hash_handle hh;
-	int id; // Our own id for submitting upstream
+	int64_t id; // Our own id for submitting upstream
 
 	int64_t client_id;
-	time_t submit_time;
+	tv_t submit_time;
 	double diff;
 };
 
@@ -86,6 +86,7 @@ struct proxy_instance {
 	ckpool_t *ckp;
 	connsock_t cs;
 	bool passthrough;
+	bool rawpass; /* Upstream accepts raw framed passthrough lines */
 	bool node;
 	int id; /* Proxy server id*/
 	int subid; /* Subproxy id */
@@ -121,6 +122,21 @@ struct proxy_instance {
 
 	 /* Are we in the middle of a blocked write of this message? */
 	cs_msg_t *sending;
+	/* Queued message not yet being written that more shares can join */
+	cs_msg_t *queued;
+
+	mutex_t share_lock; /* Lock protecting hashlist of shares */
+	share_msg_t *shares; /* Shares sent awaiting a response, by id */
+	time_t shares_aged; /* When unanswered shares were last aged */
+
+	/* Share counters, with the round trip time of responses in ms */
+	int64_t shares_submitted;
+	int64_t shares_answered;
+	double sps1; /* Shares per second submitted, decaying over a minute */
+	tv_t last_submit;
+	double rtt_last;
+	double rtt_avg; /* Moving average over roughly the last 100 */
+	double rtt_max;
 
 	pthread_t pth_precv;
 
@@ -160,11 +176,54 @@ struct generator_data {
 	mutex_t notify_lock;
 	notify_instance_t *notify_instances;
 
-	mutex_t share_lock;
-	share_msg_t *shares;
-	int64_t share_id;
+	int64_t share_id; /* Atomically increasing id of shares sent upstream */
+
+	mutex_t submit_lock;	/* Protects block_submit_t and server submit stats */
+
+	mutex_t race_lock;	/* Protects gbt_race_t and server gbt_ready */
+	pthread_cond_t race_cond;
+	char race_prevhash[68];	/* Prevhash of the last template sent */
+	int race_height;	/* Height of the last template sent */
+};
+
+/* A block solve being submitted to every configured server in parallel */
+struct block_submit {
+	char *buf;		/* submitblock:hash,data as received */
+	const char *hash;
+	const char *data;
+	tv_t received;
+	int pending;		/* Servers yet to respond */
+	bool accepted;		/* Reported as a block to the stratifier already */
 };
 
+typedef struct block_submit block_submit_t;
+
+struct submit_msg {
+	block_submit_t *bs;
+	server_instance_t *si;
+};
+
+typedef struct submit_msg submit_msg_t;
+
+/* A getblocktemplate requested from every live server in parallel */
+struct gbt_race {
+	int pending;		/* Servers yet to respond */
+	bool answered;		/* A template was chosen, discard any later ones */
+	server_instance_t *won;	/* First template on a new block */
+};
+
+typedef struct gbt_race gbt_race_t;
+
+/* How long to wait for fuller templates once one arrives on the same block */
+#define GBT_RACE_MS 500
+
+struct gbt_msg {
+	gbt_race_t *race;
+	server_instance_t *si;
+};
+
+typedef struct gbt_msg gbt_msg_t;
+
 typedef struct generator_data gdata_t;
 
 /* Use a temporary fd when testing server_alive to avoid races on cs->fd */
@@ -173,7 +232,7 @@ static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 	char *userpass = NULL;
 	bool ret = false;
 	connsock_t *cs;
-	gbtbase_t *gbt;
+	gbtbase_t gbt;
 	int fd;
 
 	if (si->alive)
@@ -200,17 +259,23 @@ static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 		return ret;
 	}
 
-	/* Test we can connect, authorise and get a block template */
-	gbt = ckzalloc(sizeof(gbtbase_t));
-	si->data = gbt;
-	if (!gen_gbtbase(cs, gbt)) {
+	/* Test we can connect, authorise and get a block template, using a
+	 * temporary gbtbase since another thread may be testing the server
+	 * too, keeping si->data and its transaction store for gen_loop */
+	memset(&gbt, 0, sizeof(gbt));
+	if (!gen_gbtbase(cs, &gbt)) {
+		clear_gbtbase(&gbt);
+		clear_gbtstore(&gbt);
 		if (!pinging) {
 			LOGINFO("Failed to get test block template from %s:%s!",
 				cs->url, cs->port);
 		}
 		goto out;
 	}
-	clear_gbtbase(gbt);
+	clear_gbtbase(&gbt);
+	clear_gbtstore(&gbt);
+	if (!si->data)
+		si->data = ckzalloc(sizeof(gbtbase_t));
 	if (!ckp->node && !validate_address(cs, ckp->btcaddress)) {
 		LOGWARNING("Invalid btcaddress: %s !", ckp->btcaddress);
 		goto out;
@@ -277,10 +342,13 @@ static void kill_server(server_instance_t *si)
 	LOGNOTICE("Killing server");
 	cs = &si->cs;
 	Close(cs->fd);
+	cs->kept = false;
 	empty_buffer(cs);
 	dealloc(cs->url);
 	dealloc(cs->port);
 	dealloc(cs->auth);
+	if (si->data)
+		clear_gbtstore(si->data);
 	dealloc(si->data);
 }
 
@@ -294,6 +362,236 @@ static void clear_unix_msg(unix_msg_t **umsg)
 	}
 }
 
+/* Submit a block to one server on its own submit thread and connection. The
+ * first server to accept it reports the block to the stratifier, otherwise
+ * the last one to respond reports it wasn't accepted. */
+static void submit_server_block(ckpool_t *ckp, submit_msg_t *sm)
+{
+	block_submit_t *bs = sm->bs;
+	server_instance_t *si = sm->si;
+	gdata_t *gdata = ckp->data;
+	connsock_t *cs = &si->submit_cs;
+	bool ret, report = false, last;
+	char blockmsg[80];
+	tv_t now;
+	double ms;
+
+	ret = submit_block(cs, bs->data);
+	tv_time(&now);
+	ms = us_tvdiff(&now, &bs->received) / 1000;
+
+	mutex_lock(&gdata->submit_lock);
+	si->submits++;
+	if (ret)
+		si->submits_accepted++;
+	si->submit_last = ms;
+	if (ms > si->submit_max)
+		si->submit_max = ms;
+	if (ret && !bs->accepted)
+		bs->accepted = report = true;
+	last = !--bs->pending;
+	if (last && !bs->accepted)
+		report = true;
+	mutex_unlock(&gdata->submit_lock);
+
+	LOGNOTICE("Block %s %saccepted by %s:%s in %.3fms", bs->hash, ret ? "" : "not ",
+		  cs->url, cs->port, ms);
+	if (report) {
+		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", bs->hash);
+		send_proc(ckp->stratifier, blockmsg);
+	}
+	if (last) {
+		free(bs->buf);
+		free(bs);
+	}
+	free(sm);
+}
+
+/* Called directly from the unix receivers so a block solve never waits behind
+ * other requests to the generator, stealing the message buf. */
+static void submit_blocks(ckpool_t *ckp, unix_msg_t *umsg)
+{
+	block_submit_t *bs;
+	int i;
+
+	if (unlikely(strlen(umsg->buf) < 12 + 64 + 1)) {
+		LOGWARNING("Invalid submitblock message: %s", umsg->buf);
+		return;
+	}
+	LOGNOTICE("Submitting block data!");
+	bs = ckzalloc(sizeof(block_submit_t));
+	tv_time(&bs->received);
+	bs->buf = umsg->buf;
+	umsg->buf = NULL;
+	bs->buf[12 + 64] = '\0';
+	bs->hash = bs->buf + 12;
+	bs->data = bs->buf + 12 + 64 + 1;
+	bs->pending = ckp->btcds;
+	for (i = 0; i < ckp->btcds; i++) {
+		submit_msg_t *sm = ckalloc(sizeof(submit_msg_t));
+
+		sm->bs = bs;
+		sm->si = ckp->servers[i];
+		ckmsgq_add(sm->si->submitq, sm);
+	}
+}
+
+/* Get a template from one server for a gbt race, waking gen_loop to check if
+ * it wins */
+static void race_server_gbt(ckpool_t *ckp, gbt_msg_t *gm)
+{
+	gbt_race_t *race = gm->race;
+	server_instance_t *si = gm->si;
+	gdata_t *gdata = ckp->data;
+	gbtbase_t *gbt = si->data;
+	connsock_t *cs = &si->cs;
+	bool ret;
+
+	ret = gen_gbtbase(cs, gbt);
+	if (!ret) {
+		LOGWARNING("Failed to get block template from %s:%s", cs->url, cs->port);
+		si->alive = false;
+	}
+
+	mutex_lock(&gdata->race_lock);
+	if (!ret || race->answered)
+		clear_gbtbase(gbt);
+	else {
+		si->gbt_ready = true;
+		/* Only a template ahead of the last one sent is a new block,
+		 * a server still behind on the old tip mustn't win */
+		if (!race->won && (gbt->height > gdata->race_height ||
+		    (gbt->height == gdata->race_height &&
+		     strcmp(gbt->prevhash, gdata->race_prevhash))))
+			race->won = si;
+	}
+	if (!--race->pending && race->answered)
+		free(race);
+	else
+		pthread_cond_signal(&gdata->race_cond);
+	mutex_unlock(&gdata->race_lock);
+	free(gm);
+}
+
+/* Request a template from every live server at once. The first template on a
+ * higher block is used straight away, otherwise the highest and fullest
+ * template by coinbase value arriving within GBT_RACE_MS of the first is.
+ * Returns the server whose data holds the template. */
+static server_instance_t *race_gbtbase(ckpool_t *ckp)
+{
+	gdata_t *gdata = ckp->data;
+	server_instance_t *best;
+	bool waiting = false;
+	ts_t deadline, racetime;
+	gbt_race_t *race;
+	int i;
+
+	race = ckzalloc(sizeof(gbt_race_t));
+	mutex_lock(&gdata->race_lock);
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+		gbt_msg_t *gm;
+
+		if (!si->alive || !si->data)
+			continue;
+		gm = ckalloc(sizeof(gbt_msg_t));
+		gm->race = race;
+		gm->si = si;
+		race->pending++;
+		ckmsgq_add(si->gbtq, gm);
+	}
+	while (race->pending && !race->won) {
+		if (!waiting) {
+			for (i = 0; i < ckp->btcds; i++) {
+				if (ckp->servers[i]->gbt_ready)
+					waiting = true;
+			}
+			if (waiting) {
+				ms_to_ts(&racetime, GBT_RACE_MS);
+				ts_realtime(&deadline);
+				timeraddspec(&deadline, &racetime);
+			}
+		}
+		if (!waiting)
+			cond_wait(&gdata->race_cond, &gdata->race_lock);
+		else if (cond_timedwait(&gdata->race_cond, &gdata->race_lock, &deadline))
+			break;
+	}
+
+	/* Without a winner take the highest template, fullest first */
+	best = race->won;
+	for (i = 0; !race->won && i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+		gbtbase_t *gbt = si->data, *bestgbt;
+
+		if (!si->gbt_ready)
+			continue;
+		if (!best) {
+			best = si;
+			continue;
+		}
+		bestgbt = best->data;
+		if (gbt->height > bestgbt->height || (gbt->height == bestgbt->height &&
+		    gbt->coinbasevalue > bestgbt->coinbasevalue))
+			best = si;
+	}
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+
+		if (si->gbt_ready && si != best)
+			clear_gbtbase(si->data);
+		si->gbt_ready = false;
+	}
+	if (best) {
+		strcpy(gdata->race_prevhash, ((gbtbase_t *)best->data)->prevhash);
+		gdata->race_height = ((gbtbase_t *)best->data)->height;
+	}
+	race->answered = true;
+	if (!race->pending)
+		free(race);
+	mutex_unlock(&gdata->race_lock);
+	return best;
+}
+
+static void send_gbtbase(const int sockd, const gbtbase_t *gbt, const bool binary)
+{
+	char *buf;
+
+	if (binary) {
+		send_unix_buf(sockd, gbt->bin, gbt->binlen);
+		return;
+	}
+	buf = gbtbase_json(gbt);
+	send_unix_msg(sockd, buf);
+	free(buf);
+}
+
+static void send_server_stats(ckpool_t *ckp, const int sockd)
+{
+	gdata_t *gdata = ckp->data;
+	json_t *val, *arr_val;
+	char *buf;
+	int i;
+
+	arr_val = json_array();
+	mutex_lock(&gdata->submit_lock);
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+
+		JSON_CPACK(val, "{si,ss,sb,sI,sI,sf,sf}", "id", si->id, "url", si->url,
+			   "alive", si->alive, "submits", si->submits,
+			   "accepted", si->submits_accepted, "submitlast", si->submit_last,
+			   "submitmax", si->submit_max);
+		json_array_append_new(arr_val, val);
+	}
+	mutex_unlock(&gdata->submit_lock);
+	JSON_CPACK(val, "{so}", "servers", arr_val);
+	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	send_unix_msg(sockd, buf);
+	free(buf);
+}
+
 static int gen_loop(proc_instance_t *pi)
 {
 	server_instance_t *si = NULL, *old_si;
@@ -347,22 +645,44 @@ retry:
 		ret = 0;
 		goto out;
 	}
-	if (cmdmatch(buf, "getbase")) {
-		if (!gen_gbtbase(cs, gbt)) {
+	if (cmdmatch(buf, "getbinbase") || cmdmatch(buf, "getbase")) {
+		/* The stratifier takes the binary image, anything else
+		 * asking for getbase still gets json */
+		bool binary = cmdmatch(buf, "getbinbase");
+		server_instance_t *rsi;
+		tv_t start_tv, end_tv;
+		gbtbase_t *rgbt;
+
+		tv_time(&start_tv);
+		if (ckp->btcds > 1) {
+			/* Race all the live servers for the template */
+			rsi = race_gbtbase(ckp);
+			if (!rsi) {
+				LOGWARNING("Failed to get block template from any bitcoind");
+				send_unix_msg(umsg->sockd, "Failed");
+				goto reconnect;
+			}
+			rgbt = rsi->data;
+			tv_time(&end_tv);
+			LOGDEBUG("Generated %u byte binary base from %s:%s in %.3fms", rgbt->binlen,
+				 rsi->cs.url, rsi->cs.port, us_tvdiff(&end_tv, &start_tv) / 1000);
+			send_gbtbase(umsg->sockd, rgbt, binary);
+			clear_gbtbase(rgbt);
+		} else if (!gen_gbtbase(cs, gbt)) {
 			LOGWARNING("Failed to get block template from %s:%s",
 				   cs->url, cs->port);
 			si->alive = false;
 			send_unix_msg(umsg->sockd, "Failed");
 			goto reconnect;
 		} else {
-			char *s = json_dumps(gbt->json, JSON_NO_UTF8);
-
-			send_unix_msg(umsg->sockd, s);
-			free(s);
+			tv_time(&end_tv);
+			LOGDEBUG("Generated %u byte binary base in %.3fms", gbt->binlen,
+				 us_tvdiff(&end_tv, &start_tv) / 1000);
+			send_gbtbase(umsg->sockd, gbt, binary);
 			clear_gbtbase(gbt);
 		}
 	} else if (cmdmatch(buf, "getbest")) {
-		if (si->notify)
+		if (si->notify || si->zmq_live)
 			send_unix_msg(umsg->sockd, "notify");
 		else if (!get_bestblockhash(cs, hash)) {
 			LOGINFO("No best block hash support from %s:%s",
@@ -375,7 +695,7 @@ retry:
 	} else if (cmdmatch(buf, "getlast")) {
 		int height;
 
-		if (si->notify)
+		if (si->notify || si->zmq_live)
 			send_unix_msg(umsg->sockd, "notify");
 		else if ((height = get_blockcount(cs)) == -1) {
 			si->alive = false;
@@ -393,14 +713,9 @@ retry:
 			}
 		}
 	} else if (cmdmatch(buf, "submitblock:")) {
-		char blockmsg[80];
-		bool ret;
-
-		LOGNOTICE("Submitting block data!");
-		ret = submit_block(cs, buf + 12 + 64 + 1);
-		memset(buf + 12 + 64, 0, 1);
-		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", buf + 12);
-		send_proc(ckp->stratifier, blockmsg);
+		submit_blocks(ckp, umsg);
+	} else if (cmdmatch(buf, "stats")) {
+		send_server_stats(ckp, umsg->sockd);
 	} else if (cmdmatch(buf, "checkaddr:")) {
 		if (validate_address(cs, buf + 10))
 			send_unix_msg(umsg->sockd, "true");
@@ -732,6 +1047,10 @@ static bool passthrough_stratum(connsock_t *cs, proxy_instance_t *proxi)
 		goto out;
 	}
 	proxi->passthrough = true;
+	/* Newer upstream pools take client lines as is behind an id prefix */
+	proxi->rawpass = json_is_true(json_object_get(val, "raw"));
+	if (proxi->rawpass)
+		LOGNOTICE("Passthrough %d:%s accepts raw framing", proxi->id, proxi->url);
 out:
 	if (val)
 		json_decref(val);
@@ -931,6 +1250,7 @@ static proxy_instance_t *create_subproxy(ckpool_t *ckp, gdata_t *gdata, proxy_in
 	} else {
 		gdata->subproxies_generated++;
 		subproxy = ckzalloc(sizeof(proxy_instance_t));
+		mutex_init(&subproxy->share_lock);
 	}
 	mutex_unlock(&gdata->lock);
 
@@ -968,11 +1288,27 @@ static proxy_instance_t *__subproxy_by_id(proxy_instance_t *proxy, const int sub
 	return subproxy;
 }
 
+/* Drop all shares of a proxy that will never get a response */
+static void clear_shares(proxy_instance_t *proxi)
+{
+	share_msg_t *share, *tmp;
+
+	mutex_lock(&proxi->share_lock);
+	HASH_ITER(hh, proxi->shares, share, tmp) {
+		HASH_DEL(proxi->shares, share);
+		free(share);
+	}
+	mutex_unlock(&proxi->share_lock);
+}
+
 /* Add to the dead list to be recycled if possible */
 static void store_proxy(gdata_t *gdata, proxy_instance_t *proxy)
 {
 	LOGINFO("Recycling data from proxy %d:%d", proxy->id, proxy->subid);
 
+	clear_shares(proxy);
+	proxy->shares_submitted = proxy->shares_answered = 0;
+	proxy->sps1 = proxy->rtt_last = proxy->rtt_avg = proxy->rtt_max = 0;
 	mutex_lock(&gdata->lock);
 	dealloc(proxy->enonce1);
 	dealloc(proxy->url);
@@ -1395,36 +1731,49 @@ static void stratifier_reconnect_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->stratifier, buf);
 }
 
-/* Add a share to the gdata share hashlist. Returns the share id */
-static int add_share(gdata_t *gdata, const int64_t client_id, const double diff)
+/* Add a share to the hashlist of the subproxy it's sent to, so only that
+ * subproxy's receive thread contends for it. Returns the share id */
+static int64_t add_share(gdata_t *gdata, proxy_instance_t *proxi, const int64_t client_id,
+			 const double diff)
 {
-	share_msg_t *share = ckzalloc(sizeof(share_msg_t)), *tmpshare;
-	time_t now;
-	int ret;
+	share_msg_t *share = ckzalloc(sizeof(share_msg_t));
+	int64_t ret;
 
-	share->submit_time = now = time(NULL);
+	tv_time(&share->submit_time);
 	share->client_id = client_id;
 	share->diff = diff;
+	ret = share->id = __atomic_fetch_add(&gdata->share_id, 1, __ATOMIC_RELAXED);
 
-	/* Add new share entry to the share hashtable. Age old shares */
-	mutex_lock(&gdata->share_lock);
-	ret = share->id = gdata->share_id++;
-	HASH_ADD_I64(gdata->shares, id, share);
-	HASH_ITER(hh, gdata->shares, share, tmpshare) {
-		if (share->submit_time < now - 120)
-			HASH_DEL(gdata->shares, share);
-	}
-	mutex_unlock(&gdata->share_lock);
+	mutex_lock(&proxi->share_lock);
+	HASH_ADD_I64(proxi->shares, id, share);
+	mutex_unlock(&proxi->share_lock);
 
 	return ret;
 }
 
+/* Drop shares older than 2 mins without a response, at most once a second */
+static void __age_shares(proxy_instance_t *proxi, const time_t now)
+{
+	share_msg_t *share, *tmp;
+
+	if (proxi->shares_aged == now)
+		return;
+	proxi->shares_aged = now;
+	HASH_ITER(hh, proxi->shares, share, tmp) {
+		if (share->submit_time.tv_sec < now - 120) {
+			HASH_DEL(proxi->shares, share);
+			free(share);
+		}
+	}
+}
+
 static void submit_share(gdata_t *gdata, json_t *val)
 {
 	proxy_instance_t *proxy, *proxi;
 	ckpool_t *ckp = gdata->ckp;
-	int id, subid, share_id;
+	int id, subid;
 	bool success = false;
+	int64_t share_id;
 	stratum_msg_t *msg;
 	int64_t client_id;
 
@@ -1466,7 +1815,7 @@ static void submit_share(gdata_t *gdata, json_t *val)
 	success = true;
 	msg = ckzalloc(sizeof(stratum_msg_t));
 	msg->json_msg = val;
-	share_id = add_share(gdata, client_id, proxi->diff);
+	share_id = add_share(gdata, proxi, client_id, proxi->diff);
 	json_object_set_nocheck(val, "id", json_integer(share_id));
 
 	/* Add the new message to the psend list */
@@ -1512,6 +1861,8 @@ static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 	json_t *val = NULL, *idval;
 	bool result = false;
 	share_msg_t *share;
+	tv_t now;
+	double rtt;
 	int ret = 0;
 	int64_t id;
 
@@ -1531,11 +1882,20 @@ static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 		goto out;
 	}
 
-	mutex_lock(&gdata->share_lock);
-	HASH_FIND_I64(gdata->shares, &id, share);
-	if (share)
-		HASH_DEL(gdata->shares, share);
-	mutex_unlock(&gdata->share_lock);
+	tv_time(&now);
+	mutex_lock(&proxi->share_lock);
+	HASH_FIND_I64(proxi->shares, &id, share);
+	if (share) {
+		HASH_DEL(proxi->shares, share);
+		rtt = us_tvdiff(&now, &share->submit_time) / 1000;
+		proxi->shares_answered++;
+		proxi->rtt_last = rtt;
+		proxi->rtt_avg = proxi->rtt_avg ? proxi->rtt_avg * 0.99 + rtt * 0.01 : rtt;
+		if (rtt > proxi->rtt_max)
+			proxi->rtt_max = rtt;
+	}
+	__age_shares(proxi, now.tv_sec);
+	mutex_unlock(&proxi->share_lock);
 
 	if (!share) {
 		LOGINFO("Proxy %d:%d failed to find matching share to result: %s",
@@ -1580,6 +1940,9 @@ static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
 		 * to avoid sending parts of different messages */
 		if (proxy->sending  && proxy->sending != csmsg)
 			continue;
+		/* Nothing more can be appended once it starts sending */
+		if (proxy->queued == csmsg)
+			proxy->queued = NULL;
 		while (csmsg->len) {
 			int fd;
 
@@ -1606,28 +1969,115 @@ static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
 	}
 }
 
+/* Largest message built up of shares to the one proxy for a single write */
+#define PROXY_BATCH_BYTES 65536
+
+/* Queue a message to a proxy, appending it to any message to the same proxy
+ * not yet being sent so shares are batched into as few writes as possible */
 static void add_json_msgq(cs_msg_t **csmsgq, proxy_instance_t *proxy, json_t **val)
 {
-	cs_msg_t *csmsg = ckzalloc(sizeof(cs_msg_t));
+	cs_msg_t *csmsg = proxy->queued;
+	char *buf;
+	int len;
 
-	csmsg->buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
+	buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
 	json_decref(*val);
 	*val = NULL;
-	if (unlikely(!csmsg->buf)) {
+	if (unlikely(!buf)) {
 		LOGWARNING("Failed to create json dump in add_json_msgq");
 		return;
 	}
-	csmsg->len = strlen(csmsg->buf);
+	len = strlen(buf);
+	if (csmsg && csmsg->len + len <= PROXY_BATCH_BYTES) {
+		csmsg->buf = realloc(csmsg->buf, csmsg->len + len + 1);
+		memcpy(csmsg->buf + csmsg->len, buf, len + 1);
+		csmsg->len += len;
+		free(buf);
+		return;
+	}
+	csmsg = ckzalloc(sizeof(cs_msg_t));
+	csmsg->buf = buf;
+	csmsg->len = len;
 	csmsg->proxy = proxy;
 	DL_APPEND(*csmsgq, csmsg);
+	proxy->queued = csmsg;
+}
+
+/* Turn a share from the stratifier into a submit queued to its subproxy */
+static void queue_proxy_share(ckpool_t *ckp, gdata_t *gdata, cs_msg_t **csmsgq,
+			      stratum_msg_t *msg)
+{
+	proxy_instance_t *proxy, *subproxy;
+	int proxyid = 0, subid = 0;
+	int64_t client_id = 0, id;
+	notify_instance_t *ni;
+	json_t *jobid = NULL;
+	json_t *val;
+	tv_t now;
+
+	if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
+		LOGWARNING("Failed to find subproxy in proxy_send msg");
+		return;
+	}
+	if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
+		LOGWARNING("Failed to find jobid in proxy_send msg");
+		return;
+	}
+	if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
+		LOGWARNING("Failed to find proxy in proxy_send msg");
+		return;
+	}
+	if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
+		LOGWARNING("Failed to find client_id in proxy_send msg");
+		return;
+	}
+	proxy = proxy_by_id(gdata, proxyid);
+	if (unlikely(!proxy)) {
+		LOGWARNING("Proxysend for got message for non-existent proxy %d",
+			   proxyid);
+		return;
+	}
+	subproxy = subproxy_by_id(proxy, subid);
+	if (unlikely(!subproxy)) {
+		LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
+			   proxyid, subid);
+		return;
+	}
+
+	mutex_lock(&gdata->notify_lock);
+	HASH_FIND_INT(gdata->notify_instances, &id, ni);
+	if (ni)
+		jobid = json_copy(ni->jobid);
+	mutex_unlock(&gdata->notify_lock);
+
+	if (unlikely(!jobid)) {
+		stratifier_reconnect_client(ckp, client_id);
+		LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
+			  subproxy->id, subproxy->url);
+		return;
+	}
+
+	JSON_CPACK(val, "{s[soooo]soss}", "params", subproxy->auth, jobid,
+			json_object_dup(msg->json_msg, "nonce2"),
+			json_object_dup(msg->json_msg, "ntime"),
+			json_object_dup(msg->json_msg, "nonce"),
+			"id", json_object_dup(msg->json_msg, "id"),
+			"method", "mining.submit");
+	add_json_msgq(csmsgq, subproxy, &val);
+
+	tv_time(&now);
+	subproxy->shares_submitted++;
+	decay_time(&subproxy->sps1, 1, tvdiff(&now, &subproxy->last_submit), 60);
+	copy_tv(&subproxy->last_submit, &now);
 }
 
-/* For processing and sending shares. proxy refers to parent proxy here */
+/* For processing and sending shares. Every share waiting is taken at once
+ * and queued to its subproxy before anything is sent, so that each upstream
+ * gets as many shares as possible in each write. */
 static void *proxy_send(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->data;
-	stratum_msg_t *msg = NULL;
 	cs_msg_t *csmsgq = NULL;
 
 	rename_proc("proxysend");
@@ -1635,17 +2085,7 @@ static void *proxy_send(void *arg)
 	pthread_detach(pthread_self());
 
 	while (42) {
-		proxy_instance_t *proxy, *subproxy;
-		int proxyid = 0, subid = 0;
-		int64_t client_id = 0, id;
-		notify_instance_t *ni;
-		json_t *jobid = NULL;
-		json_t *val;
-
-		if (unlikely(msg)) {
-			json_decref(msg->json_msg);
-			free(msg);
-		}
+		stratum_msg_t *msgs, *msg, *tmp;
 
 		mutex_lock(&gdata->psend_lock);
 		if (!gdata->psends) {
@@ -1657,70 +2097,28 @@ static void *proxy_send(void *arg)
 			timeraddspec(&timeout_ts, &polltime);
 			cond_timedwait(&gdata->psend_cond, &gdata->psend_lock, &timeout_ts);
 		}
-		msg = gdata->psends;
-		if (likely(msg))
-			DL_DELETE(gdata->psends, msg);
+		msgs = gdata->psends;
+		gdata->psends = NULL;
 		mutex_unlock(&gdata->psend_lock);
 
-		if (!msg) {
-			send_json_msgq(gdata, &csmsgq);
-			continue;
-		}
-
-		if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
-			LOGWARNING("Failed to find subproxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
-			LOGWARNING("Failed to find jobid in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
-			LOGWARNING("Failed to find proxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
-			LOGWARNING("Failed to find client_id in proxy_send msg");
-			continue;
-		}
-		proxy = proxy_by_id(gdata, proxyid);
-		if (unlikely(!proxy)) {
-			LOGWARNING("Proxysend for got message for non-existent proxy %d",
-				   proxyid);
-			continue;
-		}
-		subproxy = subproxy_by_id(proxy, subid);
-		if (unlikely(!subproxy)) {
-			LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
-				   proxyid, subid);
-			continue;
-		}
-
-		mutex_lock(&gdata->notify_lock);
-		HASH_FIND_INT(gdata->notify_instances, &id, ni);
-		if (ni)
-			jobid = json_copy(ni->jobid);
-		mutex_unlock(&gdata->notify_lock);
-
-		if (unlikely(!jobid)) {
-			stratifier_reconnect_client(ckp, client_id);
-			LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
-				  subproxy->id, subproxy->url);
-			continue;
+		DL_FOREACH_SAFE(msgs, msg, tmp) {
+			DL_DELETE(msgs, msg);
+			queue_proxy_share(ckp, gdata, &csmsgq, msg);
+			json_decref(msg->json_msg);
+			free(msg);
 		}
-
-		JSON_CPACK(val, "{s[soooo]soss}", "params", subproxy->auth, jobid,
-				json_object_dup(msg->json_msg, "nonce2"),
-				json_object_dup(msg->json_msg, "ntime"),
-				json_object_dup(msg->json_msg, "nonce"),
-				"id", json_object_dup(msg->json_msg, "id"),
-				"method", "mining.submit");
-		add_json_msgq(&csmsgq, subproxy, &val);
 		send_json_msgq(gdata, &csmsgq);
 	}
 	return NULL;
 }
 
+static void passthrough_fail(ckpool_t *ckp, proxy_instance_t *proxy, connsock_t *cs)
+{
+	Close(cs->fd);
+	proxy->alive = false;
+	reconnect_generator(ckp);
+}
+
 static void passthrough_send(ckpool_t *ckp, pass_msg_t *pm)
 {
 	proxy_instance_t *proxy = pm->proxy;
@@ -1737,22 +2135,94 @@ static void passthrough_send(ckpool_t *ckp, pass_msg_t *pm)
 	if (unlikely(sent != len)) {
 		LOGWARNING("Failed to passthrough %d bytes of message %s, attempting reconnect",
 			   len, pm->msg);
-		Close(cs->fd);
-		proxy->alive = false;
-		reconnect_generator(ckp);
+		passthrough_fail(ckp, proxy, cs);
 	}
 out:
 	free(pm->msg);
 	free(pm);
 }
 
+/* Everything queued for a passthrough goes to the same upstream so write it
+ * out with as few writes as possible. */
+static void passthrough_send_batch(ckpool_t *ckp, pass_msg_t **pms, const int count)
+{
+	proxy_instance_t *proxy = pms[0]->proxy;
+	connsock_t *cs = pms[0]->cs;
+	char *buf = NULL;
+	int i, len, sent;
+	size_t ofs = 0;
+
+	if (count == 1) {
+		passthrough_send(ckp, pms[0]);
+		return;
+	}
+	if (unlikely(!proxy->alive || cs->fd < 0)) {
+		LOGDEBUG("Dropping %d sends to dead passthrough proxy", count);
+		goto out;
+	}
+	for (i = 0; i < count; i++)
+		ofs += strlen(pms[i]->msg);
+	buf = ckalloc(ofs);
+	for (len = i = 0; i < count; i++) {
+		int msglen = strlen(pms[i]->msg);
+
+		memcpy(buf + len, pms[i]->msg, msglen);
+		len += msglen;
+	}
+	LOGDEBUG("Sending %d upstream msgs in %d bytes", count, len);
+	sent = write_socket(cs->fd, buf, len);
+	if (unlikely(sent != len)) {
+		LOGWARNING("Failed to passthrough %d bytes of %d messages, attempting reconnect",
+			   len, count);
+		passthrough_fail(ckp, proxy, cs);
+	}
+out:
+	free(buf);
+	for (i = 0; i < count; i++) {
+		free(pms[i]->msg);
+		free(pms[i]);
+	}
+}
+
+/* The connector frames client lines as "id address line" for upstream pools
+ * that take them raw. Turn them back into the json older pools expect. */
+static char *unframe_passthrough(const char *msg)
+{
+	char address[INET6_ADDRSTRLEN];
+	const char *line;
+	int64_t client_id;
+	json_t *val;
+	char *buf;
+	int len;
+
+	if (sscanf(msg, "%"PRId64" %45s %n", &client_id, address, &len) < 2)
+		return NULL;
+	line = msg + len;
+	val = json_loads(line, 0, NULL);
+	if (unlikely(!val))
+		return NULL;
+	json_object_set_new_nocheck(val, "client_id", json_integer(client_id));
+	json_object_set_new_nocheck(val, "address", json_string(address));
+	buf = json_dumps(val, JSON_COMPACT | JSON_EOL);
+	json_decref(val);
+	return buf;
+}
+
 static void passthrough_add_send(proxy_instance_t *proxy, const char *msg)
 {
 	pass_msg_t *pm = ckzalloc(sizeof(pass_msg_t));
 
 	pm->proxy = proxy;
 	pm->cs = &proxy->cs;
-	ASPRINTF(&pm->msg, "%s\n", msg);
+	if (msg[0] != '{' && !proxy->rawpass) {
+		pm->msg = unframe_passthrough(msg);
+		if (unlikely(!pm->msg)) {
+			LOGINFO("Dropping invalid passthrough message %s", msg);
+			free(pm);
+			return;
+		}
+	} else
+		ASPRINTF(&pm->msg, "%s\n", msg);
 	ckmsgq_add(proxy->passsends, pm);
 }
 
@@ -2017,7 +2487,6 @@ static void *proxy_recv(void *arg)
 
 	while (42) {
 		notify_instance_t *ni, *tmp;
-		share_msg_t *share, *tmpshare;
 		float timeout;
 		time_t now;
 		int ret;
@@ -2056,15 +2525,6 @@ static void *proxy_recv(void *arg)
 		}
 		mutex_unlock(&gdata->notify_lock);
 
-		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
-
 		cs = NULL;
 		/* If we don't get an update within 10 minutes the upstream pool
 		 * has likely stopped responding. */
@@ -2127,7 +2587,6 @@ static void *userproxy_recv(void *arg)
 
 	while (42) {
 		proxy_instance_t *proxy, *tmpproxy;
-		share_msg_t *share, *tmpshare;
 		notify_instance_t *ni, *tmp;
 		connsock_t *cs;
 		float timeout;
@@ -2175,15 +2634,6 @@ static void *userproxy_recv(void *arg)
 		}
 		mutex_unlock(&gdata->notify_lock);
 
-		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
-
 		timeout = 0;
 		cs = &proxy->cs;
 
@@ -2337,6 +2787,7 @@ static proxy_instance_t *__add_userproxy(ckpool_t *ckp, gdata_t *gdata, const in
 	proxy->auth = auth;
 	proxy->pass = pass;
 	proxy->ckp = proxy->cs.ckp = ckp;
+	mutex_init(&proxy->share_lock);
 	cksem_init(&proxy->cs.sem);
 	cksem_post(&proxy->cs.sem);
 	HASH_ADD_INT(gdata->proxies, id, proxy);
@@ -2512,10 +2963,10 @@ out:
 static void send_stats(gdata_t *gdata, const int sockd)
 {
 	json_t *val = json_object(), *subval;
+	int64_t memsize, shares, sharesize;
 	int total_objects, objects, generated;
 	proxy_instance_t *proxy;
 	stratum_msg_t *msg;
-	int64_t memsize;
 
 	mutex_lock(&gdata->lock);
 	objects = HASH_COUNT(gdata->proxies);
@@ -2529,11 +2980,19 @@ static void send_stats(gdata_t *gdata, const int sockd)
 	JSON_CPACK(subval, "{si,si}", "count", objects, "memory", memsize);
 	json_set_object(val, "dead_proxies", subval);
 
-	total_objects = memsize = 0;
+	total_objects = memsize = shares = sharesize = 0;
 	for (proxy = gdata->proxies; proxy; proxy=proxy->hh.next) {
+		proxy_instance_t *subproxy, *tmpsub;
+
 		mutex_lock(&proxy->proxy_lock);
 		total_objects += objects = HASH_COUNT(proxy->subproxies);
 		memsize += SAFE_HASH_OVERHEAD(proxy->subproxies) + sizeof(proxy_instance_t) * objects;
+		HASH_ITER(sh, proxy->subproxies, subproxy, tmpsub) {
+			mutex_lock(&subproxy->share_lock);
+			shares += objects = HASH_COUNT(subproxy->shares);
+			sharesize += SAFE_HASH_OVERHEAD(subproxy->shares) + sizeof(share_msg_t) * objects;
+			mutex_unlock(&subproxy->share_lock);
+		}
 		mutex_unlock(&proxy->proxy_lock);
 	}
 	generated = gdata->subproxies_generated;
@@ -2551,13 +3010,8 @@ static void send_stats(gdata_t *gdata, const int sockd)
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "notifies", subval);
 
-	mutex_lock(&gdata->share_lock);
-	objects = HASH_COUNT(gdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(gdata->shares) + sizeof(share_msg_t) * objects;
-	generated = gdata->share_id;
-	mutex_unlock(&gdata->share_lock);
-
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
+	JSON_CPACK(subval, "{sI,sI,sI}", "count", shares, "memory", sharesize, "generated",
+		   __atomic_load_n(&gdata->share_id, __ATOMIC_RELAXED));
 	json_set_object(val, "shares", subval);
 
 	mutex_lock(&gdata->psend_lock);
@@ -2574,8 +3028,13 @@ static void send_stats(gdata_t *gdata, const int sockd)
 
 static json_t *proxystats(const proxy_instance_t *proxy)
 {
+	double sps1 = proxy->sps1;
 	json_t *val;
+	tv_t now;
 
+	/* Decay the share rate to now */
+	tv_time(&now);
+	decay_time(&sps1, 0, tvdiff(&now, (tv_t *)&proxy->last_submit), 60);
 	val = json_object();
 	json_set_int(val, "id", proxy->id);
 	json_set_int(val, "userid", proxy->userid);
@@ -2594,6 +3053,12 @@ static json_t *proxystats(const proxy_instance_t *proxy)
 	json_set_double(val, "accepted", proxy->diff_accepted);
 	json_set_double(val, "rejected", proxy->diff_rejected);
 	json_set_int(val, "lastshare", proxy->last_share.tv_sec);
+	json_set_int(val, "submitted", proxy->shares_submitted);
+	json_set_int(val, "answered", proxy->shares_answered);
+	json_set_double(val, "sps1", sps1);
+	json_set_double(val, "rtt_last", proxy->rtt_last);
+	json_set_double(val, "rtt_avg", proxy->rtt_avg);
+	json_set_double(val, "rtt_max", proxy->rtt_max);
 	json_set_bool(val, "global", proxy->global);
 	json_set_bool(val, "disabled", proxy->disabled);
 	json_set_bool(val, "alive", proxy->alive);
@@ -2733,7 +3198,10 @@ retry:
 
 	buf = umsg->buf;
 	LOGDEBUG("Proxy received request: %s", buf);
-	if (likely(buf[0] == '{')) {
+	if (ckp->passthrough && buf[0] >= '0' && buf[0] <= '9') {
+		/* Raw framed client lines from the connector */
+		passthrough_add_send(proxi, buf);
+	} else if (likely(buf[0] == '{')) {
 		if (ckp->passthrough)
 			passthrough_add_send(proxi, buf);
 		else {
@@ -2769,14 +3237,8 @@ retry:
 	} else if (cmdmatch(buf, "reconnect")) {
 		goto reconnect;
 	} else if (cmdmatch(buf, "submitblock:")) {
-		char blockmsg[80];
-		bool ret;
-
 		LOGNOTICE("Submitting likely block solve share from upstream pool");
-		ret = submit_block(cs, buf + 12 + 64 + 1);
-		memset(buf + 12 + 64, 0, 1);
-		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", buf + 12);
-		send_proc(ckp->stratifier, blockmsg);
+		submit_blocks(ckp, umsg);
 	} else if (cmdmatch(buf, "loglevel")) {
 		sscanf(buf, "loglevel=%d", &ckp->loglevel);
 	} else if (cmdmatch(buf, "ping")) {
@@ -2794,6 +3256,135 @@ out:
 	return ret;
 }
 
+/* bitcoind publishes new block hashes with zmqpubhashblock over ZMTP, which
+ * is simple enough for a SUB socket to be implemented here directly instead
+ * of depending on libzmq. */
+#define ZMQ_MORE 0x01
+#define ZMQ_LONG 0x02
+#define ZMQ_COMMAND 0x04
+#define ZMQ_MAXFRAME 4096
+
+/* Read one ZMTP frame into buf, returning its length or -1 on error */
+static int read_zmq_frame(const int fd, uchar *flags, uchar *buf)
+{
+	uint64_t len64;
+	uchar len8;
+	int len;
+
+	if (read_length(fd, flags, 1) < 1)
+		return -1;
+	if (*flags & ZMQ_LONG) {
+		if (read_length(fd, &len64, 8) < 8)
+			return -1;
+		len64 = be64toh(len64);
+		if (len64 > ZMQ_MAXFRAME) {
+			LOGWARNING("Oversized %"PRIu64" byte zmq frame", len64);
+			return -1;
+		}
+		len = len64;
+	} else {
+		if (read_length(fd, &len8, 1) < 1)
+			return -1;
+		len = len8;
+	}
+	if (len && read_length(fd, buf, len) < len)
+		return -1;
+	return len;
+}
+
+/* Exchange greetings with the NULL security mechanism and subscribe to the
+ * hashblock topic */
+static bool zmq_subscribe(const int fd, uchar *buf)
+{
+	static const uchar ready[] = { ZMQ_COMMAND, 25, 5, 'R', 'E', 'A', 'D', 'Y',
+		11, 'S', 'o', 'c', 'k', 'e', 't', '-', 'T', 'y', 'p', 'e', 0, 0, 0, 3,
+		'S', 'U', 'B' };
+	static const uchar subscribe[] = { 0, 10, 1, 'h', 'a', 's', 'h', 'b', 'l',
+		'o', 'c', 'k' };
+	uchar greeting[64], flags;
+	int len;
+
+	memset(greeting, 0, 64);
+	greeting[0] = 0xff;
+	greeting[9] = 0x7f;
+	greeting[10] = 3;
+	memcpy(greeting + 12, "NULL", 4);
+	if (write_socket(fd, greeting, 64) != 64)
+		return false;
+	if (read_length(fd, greeting, 64) < 64)
+		return false;
+	if (greeting[0] != 0xff || greeting[9] != 0x7f || greeting[10] < 3 ||
+	    memcmp(greeting + 12, "NULL", 5)) {
+		LOGWARNING("Unsupported zmq greeting");
+		return false;
+	}
+	if (write_socket(fd, ready, sizeof(ready)) != sizeof(ready))
+		return false;
+	len = read_zmq_frame(fd, &flags, buf);
+	if (len < 6 || !(flags & ZMQ_COMMAND) || memcmp(buf, "\x05READY", 6)) {
+		LOGWARNING("Failed to receive zmq READY");
+		return false;
+	}
+	return write_socket(fd, subscribe, sizeof(subscribe)) == sizeof(subscribe);
+}
+
+/* Subscribe to block notifications from a bitcoind, telling the stratifier
+ * to update as soon as one arrives. While subscribed the server needs no
+ * polling for new blocks. */
+static void *zmq_notifier(void *arg)
+{
+	server_instance_t *si = (server_instance_t *)arg;
+	ckpool_t *ckp = si->cs.ckp;
+	char *url = NULL, *port = NULL;
+	uchar buf[ZMQ_MAXFRAME];
+	int fd = -1;
+
+	rename_proc("zmqnotifier");
+	pthread_detach(pthread_self());
+
+	if (!extract_sockaddr(si->zmq, &url, &port)) {
+		LOGWARNING("Failed to extract zmq address from %s", si->zmq);
+		return NULL;
+	}
+	while (42) {
+		bool hashblock = false;
+		uchar flags;
+		int len;
+
+		fd = connect_socket(url, port);
+		if (fd < 0 || !zmq_subscribe(fd, buf)) {
+			LOGWARNING("Failed to subscribe to zmq hashblock on %s:%s", url, port);
+			goto reconnect;
+		}
+		keep_sockalive(fd);
+		LOGNOTICE("Subscribed to zmq hashblock on %s:%s", url, port);
+		si->zmq_live = true;
+		/* Messages are the topic, the block hash and a sequence number */
+		while ((len = read_zmq_frame(fd, &flags, buf)) >= 0) {
+			if (flags & ZMQ_COMMAND)
+				continue;
+			if (hashblock && len == 32) {
+				char hash[68];
+
+				/* Published in the same order as rpc calls */
+				__bin2hex(hash, buf, 32);
+				LOGNOTICE("Zmq block hash %s from %s:%s", hash, url, port);
+				send_proc(ckp->stratifier, "update");
+			}
+			if (flags & ZMQ_MORE)
+				hashblock = !hashblock && len == 9 && !memcmp(buf, "hashblock", 9);
+			else
+				hashblock = false;
+		}
+		LOGWARNING("Lost zmq connection to %s:%s", url, port);
+reconnect:
+		si->zmq_live = false;
+		Close(fd);
+		sleep(5);
+	}
+	return NULL;
+}
+
 /* Check which servers are alive, maintaining a connection with them and
  * reconnect if a higher priority one is available. */
 static void *server_watchdog(void *arg)
@@ -2813,6 +3404,10 @@ static void *server_watchdog(void *arg)
 			/* Have we reached the current server? */
 			if (server_alive(ckp, si, true) && !best)
 				best = si;
+			/* Keep a connection ready for the next block submission,
+			 * well inside bitcoind's default 30s idle timeout */
+			if (si->alive)
+				json_rpc_preconnect(&si->submit_cs, 15);
 		}
 		if (best && best != gdata->si) {
 			gdata->si = best;
@@ -2823,9 +3418,11 @@ static void *server_watchdog(void *arg)
 	return NULL;
 }
 
-static void setup_servers(ckpool_t *ckp)
+static void setup_servers(ckpool_t *ckp, proc_instance_t *pi)
 {
+	gdata_t *gdata = ckp->data;
 	pthread_t pth_watchdog;
+	char *userpass;
 	int i;
 
 	ckp->servers = ckalloc(sizeof(server_instance_t *) * ckp->btcds);
@@ -2839,12 +3436,40 @@ static void setup_servers(ckpool_t *ckp)
 		si->auth = ckp->btcdauth[i];
 		si->pass = ckp->btcdpass[i];
 		si->notify = ckp->btcdnotify[i];
+		si->zmq = ckp->btcdzmq[i];
 		si->id = i;
 		cs = &si->cs;
 		cs->ckp = ckp;
 		cksem_init(&cs->sem);
 		cksem_post(&cs->sem);
+
+		cs = &si->submit_cs;
+		cs->ckp = ckp;
+		cksem_init(&cs->sem);
+		cksem_post(&cs->sem);
+		if (!extract_sockaddr(si->url, &cs->url, &cs->port))
+			LOGWARNING("Failed to extract address from %s", si->url);
+		userpass = strdup(si->auth);
+		realloc_strcat(&userpass, ":");
+		realloc_strcat(&userpass, si->pass);
+		cs->auth = http_base64(userpass);
+		dealloc(userpass);
+		si->submitq = create_ckmsgq(ckp, "submitter", &submit_server_block);
+		if (ckp->btcds > 1)
+			si->gbtq = create_ckmsgq(ckp, "gbtracer", &race_server_gbt);
+		if (si->zmq) {
+			pthread_t pth;
+
+			create_pthread(&pth, zmq_notifier, si);
+		}
 	}
+	mutex_init(&gdata->submit_lock);
+	mutex_init(&gdata->race_lock);
+	cond_init(&gdata->race_cond);
+
+	/* Block submissions no longer need to go through the generator loop */
+	pi->urgent_cmd = "submitblock:";
+	__atomic_store_n(&pi->urgent_func, submit_blocks, __ATOMIC_RELEASE);
 
 	create_pthread(&pth_watchdog, server_watchdog, ckp);
 }
@@ -2853,7 +3478,7 @@ static int server_mode(ckpool_t *ckp, proc_instance_t *pi)
 {
 	int i, ret;
 
-	setup_servers(ckp);
+	setup_servers(ckp, pi);
 
 	ret = gen_loop(pi);
 
@@ -2881,6 +3506,7 @@ static proxy_instance_t *__add_proxy(ckpool_t *ckp, gdata_t *gdata, const int id
 	else
 		proxy->pass = strdup("");
 	proxy->ckp = proxy->cs.ckp = ckp;
+	mutex_init(&proxy->share_lock);
 	HASH_ADD_INT(gdata->proxies, id, proxy);
 	proxy->global = true;
 	cksem_init(&proxy->cs.sem);
@@ -2896,17 +3522,17 @@ static int proxy_mode(ckpool_t *ckp, proc_instance_t *pi)
 
 	mutex_init(&gdata->lock);
 	mutex_init(&gdata->notify_lock);
-	mutex_init(&gdata->share_lock);
 
 	if (ckp->node)
-		setup_servers(ckp);
+		setup_servers(ckp, pi);
 
 	/* Create all our proxy structures and pointers */
 	for (i = 0; i < ckp->proxies; i++) {
 		proxy = __add_proxy(ckp, gdata, i);
 		if (ckp->passthrough) {
 			create_pthread(&proxy->pth_precv, passthrough_recv, proxy);
-			proxy->passsends = create_ckmsgq(ckp, "passsend", &passthrough_send);
+			proxy->passsends = create_ckmsgqs_batch(ckp, "passsend", &passthrough_send,
+								 &passthrough_send_batch, 1, 64, false);
 		} else {
 			prepare_proxy(proxy);
 			create_pthread(&gdata->pth_uprecv, userproxy_recv, ckp);
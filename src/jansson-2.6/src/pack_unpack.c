@@ -122,8 +122,8 @@ static void set_error(scanner_t *s, const char *source, const char *fmt, ...)
 static json_t *pack(scanner_t *s, va_list *ap);
 
 
-/* ours will be set to 1 if jsonp_free() must be called for the result
-   afterwards */
+/* ours will be set to 1 if free() must be called for the result
+   afterwards, the strbuffer being allocated with plain malloc */
 static char *read_string(scanner_t *s, va_list *ap,
                          const char *purpose, int *ours)
 {
@@ -192,6 +192,7 @@ static char *read_string(scanner_t *s, va_list *ap,
 
     if(!utf8_check_string(result, -1)) {
         set_error(s, "<args>", "Invalid UTF-8 %s", purpose);
+        free(result);
         return NULL;
     }
 
@@ -231,14 +232,14 @@ static json_t *pack_object(scanner_t *s, va_list *ap)
 
         if(json_object_set_new_nocheck(object, key, value)) {
             if(ours)
-                jsonp_free(key);
+                free(key);
 
             set_error(s, "<internal>", "Unable to add key \"%s\"", key);
             goto error;
         }
 
         if(ours)
-            jsonp_free(key);
+            free(key);
 
         next_token(s);
     }
@@ -301,7 +302,7 @@ static json_t *pack(scanner_t *s, va_list *ap)
 
             result = json_string_nocheck(str);
             if(ours)
-                jsonp_free(str);
+                free(str);
 
             return result;
         }
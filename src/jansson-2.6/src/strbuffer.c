@@ -25,7 +25,9 @@ int strbuffer_init(strbuffer_t *strbuff)
     strbuff->size = STRBUFFER_MIN_SIZE;
     strbuff->length = 0;
 
-    strbuff->value = jsonp_malloc(strbuff->size);
+    /* Plain malloc since the buffer is grown with realloc and may be handed
+     * back to the caller from json_dumps to be freed with free */
+    strbuff->value = malloc(strbuff->size);
     if(!strbuff->value)
         return -1;
 
@@ -36,8 +38,7 @@ int strbuffer_init(strbuffer_t *strbuff)
 
 void strbuffer_close(strbuffer_t *strbuff)
 {
-    if(strbuff->value)
-        jsonp_free(strbuff->value);
+    free(strbuff->value);
 
     strbuff->size = 0;
     strbuff->length = 0;
@@ -36,6 +36,10 @@ bool lock_check_init = false;
 cklock_t lock_check_lock;
 K_LISTS *all_klists;
 
+// Protected by lock_check_lock
+static int next_magazine = 0;
+static __thread K_MAGAZINE my_magazines[K_MAGAZINES];
+
 #define _CHKLIST(_list, _name) do {\
 		if (!_list) { \
 			quithere(1, "%s() can't process a NULL " _name \
@@ -332,6 +336,8 @@ void _k_add_head(K_LIST *list, K_ITEM *item, LOCK_MAYBE bool chklock, KLIST_FFL_
 
 	list->count++;
 	list->count_up++;
+	if (list->count_hi < list->count)
+		list->count_hi = list->count;
 }
 
 /* slows it down (of course) - only for debugging
@@ -379,6 +385,8 @@ void _k_add_tail(K_LIST *list, K_ITEM *item, LOCK_MAYBE bool chklock, KLIST_FFL_
 
 	list->count++;
 	list->count_up++;
+	if (list->count_hi < list->count)
+		list->count_hi = list->count;
 }
 
 // Insert item into the list next after 'after'
@@ -417,6 +425,8 @@ void _k_insert_after(K_LIST *list, K_ITEM *item, K_ITEM *after, LOCK_MAYBE bool
 
 	list->count++;
 	list->count_up++;
+	if (list->count_hi < list->count)
+		list->count_hi = list->count;
 }
 
 void _k_unlink_item(K_LIST *list, K_ITEM *item, LOCK_MAYBE bool chklock, KLIST_FFL_ARGS)
@@ -481,6 +491,8 @@ void _k_list_transfer_to_head(K_LIST *from, K_LIST *to, LOCK_MAYBE bool chklock,
 	from->head = from->tail = NULL;
 	to->count += from->count;
 	from->count = 0;
+	if (to->count_hi < to->count)
+		to->count_hi = to->count;
 	to->count_up += from->count_up;
 	from->count_up = 0;
 }
@@ -517,6 +529,8 @@ void _k_list_transfer_to_tail(K_LIST *from, K_LIST *to, LOCK_MAYBE bool chklock,
 	from->head = from->tail = NULL;
 	to->count += from->count;
 	from->count = 0;
+	if (to->count_hi < to->count)
+		to->count_hi = to->count;
 	to->count_up += from->count_up;
 	from->count_up = 0;
 }
@@ -630,8 +644,171 @@ void _k_cull_list(K_LIST *list, LOCK_MAYBE bool chklock, KLIST_FFL_ARGS)
 
 	list->total = list->count = list->count_up = 0;
 	list->head = list->tail = NULL;
+	list->mag_drain = false;
 
 	list->cull_count++;
 
 	k_alloc_items(list, KLIST_FFL_PASS);
 }
+
+// Give the list thread magazines of size items - before any thread uses it
+void _k_magazine(K_LIST *list, int size, KLIST_FFL_ARGS)
+{
+	CHKLIST(list);
+
+	if (list->is_store || list->is_lock_only || !(list->lock)) {
+		quithere(1, "List %s can't %s() without a lock or as a store"
+				KLIST_FFL,
+				list->name, __func__, KLIST_FFL_PASS);
+	}
+
+	if (size < 2 || size > K_MAGAZINE_MAX) {
+		quithere(1, "List %s can't %s() size %d must be 2..%d" KLIST_FFL,
+				list->name, __func__, size, K_MAGAZINE_MAX,
+				KLIST_FFL_PASS);
+	}
+
+	if (list->magazine)
+		return;
+
+	ck_wlock(&lock_check_lock);
+	if (next_magazine >= K_MAGAZINES) {
+		ck_wunlock(&lock_check_lock);
+		quithere(1, "List %s can't %s() all %d are in use" KLIST_FFL,
+				list->name, __func__, K_MAGAZINES,
+				KLIST_FFL_PASS);
+	}
+	list->mag_size = size;
+	list->magazine = ++next_magazine;
+	ck_wunlock(&lock_check_lock);
+}
+
+// Return all of a thread's magazine items to the list - with the list locked
+static void k_mag_return(K_LIST *list, K_MAGAZINE *mag, KLIST_FFL_ARGS)
+{
+	__atomic_sub_fetch(&(list->mag_count), mag->count, __ATOMIC_RELAXED);
+	while (mag->count)
+		_k_add_head(list, mag->item[--(mag->count)], true, KLIST_FFL_PASS);
+}
+
+/* Like k_unlink_head() it only returns NULL if the list limit has been
+ *  reached, though the limit includes items in all thread magazines */
+K_ITEM *_k_mag_unlink_head(K_LIST *list, bool zero, KLIST_FFL_ARGS)
+{
+	K_MAGAZINE *mag;
+	K_ITEM *item;
+	int had;
+
+	CHKLIST(list);
+
+	if (!(list->magazine)) {
+		K_WLOCK(list);
+		item = _k_unlink_head(list, true, KLIST_FFL_PASS);
+		K_WUNLOCK(list);
+	} else {
+		mag = &(my_magazines[list->magazine - 1]);
+		if (mag->count == 0 || list->mag_drain) {
+			mag->list = list;
+			K_WLOCK(list);
+			if (list->mag_drain) {
+				k_mag_return(list, mag, KLIST_FFL_PASS);
+				item = _k_unlink_head(list, true, KLIST_FFL_PASS);
+				K_WUNLOCK(list);
+				goto zero;
+			}
+			had = mag->count;
+			while (mag->count < list->mag_size / 2) {
+				item = _k_unlink_head(list, true, KLIST_FFL_PASS);
+				if (!item)
+					break;
+				mag->item[mag->count++] = item;
+			}
+			__atomic_add_fetch(&(list->mag_count), mag->count - had,
+					   __ATOMIC_RELAXED);
+			K_WUNLOCK(list);
+		}
+		if (mag->count) {
+			item = mag->item[--(mag->count)];
+			__atomic_sub_fetch(&(list->mag_count), 1,
+					   __ATOMIC_RELAXED);
+		} else
+			item = NULL;
+	}
+
+zero:
+	if (item && zero)
+		memset(item->data, 0, list->siz);
+
+	return item;
+}
+
+void _k_mag_add_head(K_LIST *list, K_ITEM *item, KLIST_FFL_ARGS)
+{
+	K_MAGAZINE *mag;
+	int i, half;
+
+	CHKLIST(list);
+	CHKITEM(item, list);
+
+	if (item->name != list->name) {
+		quithere(1, "List %s can't %s() a %s item" KLIST_FFL,
+				list->name, __func__, item->name, KLIST_FFL_PASS);
+	}
+
+	if (item->prev || item->next) {
+		quithere(1, "%s() added item %s still linked" KLIST_FFL,
+				__func__, item->name, KLIST_FFL_PASS);
+	}
+
+	if (!(list->magazine)) {
+		K_WLOCK(list);
+		_k_add_head(list, item, true, KLIST_FFL_PASS);
+		K_WUNLOCK(list);
+		return;
+	}
+
+	mag = &(my_magazines[list->magazine - 1]);
+	mag->list = list;
+	if (list->mag_drain) {
+		K_WLOCK(list);
+		if (list->mag_drain) {
+			k_mag_return(list, mag, KLIST_FFL_PASS);
+			_k_add_head(list, item, true, KLIST_FFL_PASS);
+			K_WUNLOCK(list);
+			return;
+		}
+		K_WUNLOCK(list);
+	}
+	if (mag->count >= list->mag_size) {
+		// Return the oldest half, keeping the most recently used
+		half = list->mag_size / 2;
+		K_WLOCK(list);
+		for (i = 0; i < half; i++)
+			_k_add_head(list, mag->item[i], true, KLIST_FFL_PASS);
+		__atomic_sub_fetch(&(list->mag_count), half, __ATOMIC_RELAXED);
+		K_WUNLOCK(list);
+		mag->count -= half;
+		memmove(&(mag->item[0]), &(mag->item[half]),
+			mag->count * sizeof(mag->item[0]));
+	}
+	mag->item[mag->count++] = item;
+	__atomic_add_fetch(&(list->mag_count), 1, __ATOMIC_RELAXED);
+}
+
+// Return all of this thread's magazine items to their lists
+void _k_mags_flush(KLIST_FFL_ARGS)
+{
+	K_MAGAZINE *mag;
+	K_LIST *list;
+	int i;
+
+	for (i = 0; i < K_MAGAZINES; i++) {
+		mag = &(my_magazines[i]);
+		if (mag->count == 0)
+			continue;
+		list = mag->list;
+		K_WLOCK(list);
+		k_mag_return(list, mag, KLIST_FFL_PASS);
+		K_WUNLOCK(list);
+	}
+}
@@ -115,6 +115,24 @@ typedef struct k_item {
 	void *data;
 } K_ITEM;
 
+/* Thread local caches of free items, called magazines, for the busiest
+ *  K_LISTs, so that most k_mag_unlink_head()/k_mag_add_head() calls don't
+ *  need the list lock at all
+ * An empty magazine is refilled with half of its size from the K_LIST in
+ *  one lock, and a full magazine gives half of its size back in one lock
+ * Items in magazines are not in the K_LIST count, so they show as in use
+ *  and a list can't be culled until they are flushed back to it
+ * Setting mag_drain makes every thread return its magazine items on its next
+ *  k_mag_ call and bypass its magazine until the list is culled */
+#define K_MAGAZINES 8
+#define K_MAGAZINE_MAX 32
+
+typedef struct k_magazine {
+	struct k_list *list;
+	int count;
+	K_ITEM *item[K_MAGAZINE_MAX];
+} K_MAGAZINE;
+
 #if LOCK_CHECK
 typedef struct k_lock {
 	int r_count;
@@ -140,6 +158,7 @@ typedef struct k_list {
 	int total;		// total allocated
 	int count;		// in this list
 	int count_up;		// incremented every time one is added
+	int count_hi;		// highest count it has had
 	int allocate;		// number to intially allocate and each time we run out
 	int limit;		// total limit - 0 means unlimited
 	bool do_tail;		// track the tail?
@@ -151,6 +170,10 @@ typedef struct k_list {
 	int cull_count;
 	int ram;		// ram allocated for data pointers - code must manage it
 	int stores;		// how many stores it currently has
+	int magazine;		// 1+ index of the thread magazines, 0 = none
+	int mag_size;		// items per thread magazine
+	int mag_count;		// items in all thread magazines - atomic
+	bool mag_drain;		// magazines are returned and bypassed until a cull
 #if LOCK_CHECK
 	// Since each thread has it's own k_lock no locking is required on this
 	K_LOCK k_lock[MAX_THREADS];
@@ -634,5 +657,15 @@ extern K_STORE *_k_free_store(K_STORE *store, KLIST_FFL_ARGS);
 extern void _k_cull_list(K_LIST *list, LOCK_MAYBE bool chklock, KLIST_FFL_ARGS);
 #define k_cull_list(_list) _k_cull_list(_list, true, KLIST_FFL_HERE)
 //#define k_cull_list_nolock(_list) _k_cull_list(_list, false, KLIST_FFL_HERE)
+// The k_mag_ functions take the list lock themselves when they need it
+extern void _k_magazine(K_LIST *list, int size, KLIST_FFL_ARGS);
+#define k_magazine(_list, _size) _k_magazine(_list, _size, KLIST_FFL_HERE)
+extern K_ITEM *_k_mag_unlink_head(K_LIST *list, bool zero, KLIST_FFL_ARGS);
+#define k_mag_unlink_head(_list) _k_mag_unlink_head(_list, false, KLIST_FFL_HERE)
+#define k_mag_unlink_head_zero(_list) _k_mag_unlink_head(_list, true, KLIST_FFL_HERE)
+extern void _k_mag_add_head(K_LIST *list, K_ITEM *item, KLIST_FFL_ARGS);
+#define k_mag_add_head(_list, _item) _k_mag_add_head(_list, _item, KLIST_FFL_HERE)
+extern void _k_mags_flush(KLIST_FFL_ARGS);
+#define k_mags_flush() _k_mags_flush(KLIST_FFL_HERE)
 
 #endif
@@ -9,7 +9,7 @@
 
 #include "ktree.h"
 
-static const int dbg = 0;
+static const int __maybe_unused dbg = 0;
 #define DBG	if (dbg != 0) printf
 
 #define FAIL(fmt, ...) do \
@@ -52,7 +52,7 @@ static K_NODE *_new_knode(K_TREE *tree, LOCK_MAYBE bool chklock, KTREE_FFL_ARGS)
 
 K_TREE *_new_ktree(const char *name, cmp_t (*cmp_funct)(K_ITEM *, K_ITEM *),
 		   K_LIST *master, int alloc, int limit, bool local_tree,
-		   KTREE_FFL_ARGS)
+		   bool btree, KTREE_FFL_ARGS)
 {
 	K_TREE *tree = (K_TREE *)malloc(sizeof(*tree));
 
@@ -64,9 +64,20 @@ K_TREE *_new_ktree(const char *name, cmp_t (*cmp_funct)(K_ITEM *, K_ITEM *),
 	else
 		tree->name = name;
 
+	tree->btree = btree;
+	tree->broot = NULL;
+	tree->bversion = 0;
+
 	/* A unique "name" isn't needed since it can't use the wrong list
-	 *  and thus we can also identify all tree node lists */
-	tree->node_free = k_new_tree_list(tree_node_list_name, sizeof(K_NODE),
+	 *  and thus we can also identify all tree node lists
+	 * B+ tree nodes are at least half full so need a lot less of them */
+	if (btree) {
+		alloc = alloc / KTREE_BMIN + 1;
+		if (limit > 0)
+			limit = limit / KTREE_BMIN * 2 + 2;
+	}
+	tree->node_free = k_new_tree_list(tree_node_list_name,
+					  btree ? sizeof(K_BNODE) : sizeof(K_NODE),
 					  alloc, limit, true, local_tree,
 					  tree->name);
 #if LOCK_CHECK
@@ -75,7 +86,10 @@ K_TREE *_new_ktree(const char *name, cmp_t (*cmp_funct)(K_ITEM *, K_ITEM *),
 	tree->node_store = k_new_store(tree->node_free);
 
 	// A new tree's list doesn't need to be locked during creation
-	tree->root = _new_knode(tree, false, KTREE_FFL_PASS);
+	if (btree)
+		tree->root = nil;
+	else
+		tree->root = _new_knode(tree, false, KTREE_FFL_PASS);
 
 	tree->cmp_funct = cmp_funct;
 
@@ -109,6 +123,535 @@ static K_NODE *new_data(K_TREE *tree, K_ITEM *data, LOCK_MAYBE bool chklock, KTR
 	return knode;
 }
 
+static K_BNODE *new_bnode(K_TREE *tree, bool leaf, KTREE_FFL_ARGS)
+{
+	K_ITEM *kitem;
+	K_BNODE *bnode;
+
+	// The caller has already tested the lock
+	kitem = k_unlink_head_nolock(tree->node_free);
+	if (!kitem)
+		FAIL("%s", "bnode list OOM");
+	k_add_head_nolock(tree->node_store, kitem);
+	bnode = (K_BNODE *)(kitem->data);
+
+	bnode->kitem = kitem;
+	bnode->leaf = leaf;
+	bnode->count = 0;
+	bnode->parent = NULL;
+	bnode->prev = NULL;
+	bnode->next = NULL;
+
+	return bnode;
+}
+
+static void free_bnode(K_TREE *tree, K_BNODE *bnode)
+{
+	k_unlink_item_nolock(tree->node_store, bnode->kitem);
+	k_add_head_nolock(tree->node_free, bnode->kitem);
+}
+
+static int bchild_pos(K_BNODE *parent, K_BNODE *child, KTREE_FFL_ARGS)
+{
+	int i;
+
+	for (i = 0; i < parent->count; i++) {
+		if (parent->child[i] == child)
+			return i;
+	}
+	FAIL("%s", "BCHILD child not in parent");
+	return -1;
+}
+
+// After data[0] of bnode changes, change it in each parent it's first in
+static void bfirst_changed(K_BNODE *bnode, KTREE_FFL_ARGS)
+{
+	K_BNODE *parent;
+	int i;
+
+	while ((parent = bnode->parent) && bnode->count > 0) {
+		i = bchild_pos(parent, bnode, KTREE_FFL_PASS);
+		parent->data[i] = bnode->data[0];
+		if (i != 0)
+			break;
+		bnode = parent;
+	}
+}
+
+/* Find the leaf and pos of the first item >= data, or > data if after
+ * pos can be the leaf count when it's past the end of the leaf */
+static K_BNODE *bleaf_find(K_TREE *tree, K_ITEM *data, bool after, int *pos)
+{
+	K_BNODE *bnode = tree->broot;
+	int lo, hi, mid, i;
+	cmp_t cmp;
+
+	while (!bnode->leaf) {
+		// The last child that starts before data, else the first
+		i = 0;
+		lo = 1;
+		hi = bnode->count - 1;
+		while (lo <= hi) {
+			mid = (lo + hi) / 2;
+			cmp = tree->cmp_funct(bnode->data[mid], data);
+			if (cmp < 0 || (after && cmp == 0)) {
+				i = mid;
+				lo = mid + 1;
+			} else
+				hi = mid - 1;
+		}
+		bnode = bnode->child[i];
+	}
+
+	lo = 0;
+	hi = bnode->count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = tree->cmp_funct(bnode->data[mid], data);
+		if (cmp < 0 || (after && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return bnode;
+}
+
+static K_ITEM *bctx_set(K_TREE *tree, K_TREE_CTX *ctx, K_BNODE *bnode, int pos)
+{
+	// Move back, or on, to the previous or next leaf
+	if (bnode && pos < 0) {
+		bnode = bnode->prev;
+		if (bnode)
+			pos = bnode->count - 1;
+	} else if (bnode && pos >= bnode->count) {
+		bnode = bnode->next;
+		pos = 0;
+	}
+
+	ctx->tree = tree;
+	if (!bnode) {
+		ctx->node = NULL;
+		ctx->item = NULL;
+		return NULL;
+	}
+	ctx->node = bnode;
+	ctx->pos = pos;
+	ctx->item = bnode->data[pos];
+	ctx->bversion = tree->bversion;
+	return ctx->item;
+}
+
+/* Find the leaf and pos of data itself
+ * If the tree has more than one item that compares equal to data and none
+ *  of them are data, it returns the first of them like find_in_ktree() */
+static K_BNODE *bleaf_item(K_TREE *tree, K_ITEM *data, int *pos)
+{
+	K_BNODE *bnode, *first;
+	int i, firstpos;
+
+	if (!tree->broot)
+		return NULL;
+
+	first = bnode = bleaf_find(tree, data, false, &i);
+	firstpos = i;
+	while (bnode) {
+		if (i >= bnode->count) {
+			bnode = bnode->next;
+			i = 0;
+			continue;
+		}
+		if (bnode->data[i] == data) {
+			*pos = i;
+			return bnode;
+		}
+		if (tree->cmp_funct(bnode->data[i], data) != 0)
+			break;
+		i++;
+	}
+
+	// Not there, so return the first equal one, if any
+	if (firstpos >= first->count) {
+		first = first->next;
+		firstpos = 0;
+	}
+	if (first && tree->cmp_funct(first->data[firstpos], data) == 0) {
+		*pos = firstpos;
+		return first;
+	}
+	return NULL;
+}
+
+// If the tree has changed since ctx was set, find ctx->item again
+static void bctx_refind(K_TREE_CTX *ctx, bool forward)
+{
+	K_TREE *tree = ctx->tree;
+	K_BNODE *bnode;
+	int pos;
+
+	if (ctx->bversion == tree->bversion)
+		return;
+
+	if (tree->broot) {
+		bnode = bleaf_item(tree, ctx->item, &pos);
+		if (bnode && bnode->data[pos] == ctx->item) {
+			ctx->node = bnode;
+			ctx->pos = pos;
+			ctx->bversion = tree->bversion;
+			return;
+		}
+	}
+
+	/* ctx->item has been removed so go to where it would be, so that
+	 *  the next or prev is the item after or before it */
+	if (!tree->broot) {
+		ctx->node = NULL;
+		return;
+	}
+	bnode = bleaf_find(tree, ctx->item, forward, &pos);
+	ctx->node = bnode;
+	ctx->pos = forward ? pos - 1 : pos;
+	ctx->bversion = tree->bversion;
+}
+
+static K_ITEM *_first_in_kbtree(K_TREE *tree, K_TREE_CTX *ctx)
+{
+	K_BNODE *bnode = tree->broot;
+
+	if (bnode) {
+		while (!bnode->leaf)
+			bnode = bnode->child[0];
+	}
+	return bctx_set(tree, ctx, bnode, 0);
+}
+
+static K_ITEM *_last_in_kbtree(K_TREE *tree, K_TREE_CTX *ctx)
+{
+	K_BNODE *bnode = tree->broot;
+
+	if (!bnode)
+		return bctx_set(tree, ctx, NULL, 0);
+
+	while (!bnode->leaf)
+		bnode = bnode->child[bnode->count - 1];
+	return bctx_set(tree, ctx, bnode, bnode->count - 1);
+}
+
+static K_ITEM *_next_in_kbtree(K_TREE_CTX *ctx)
+{
+	bctx_refind(ctx, true);
+	if (!ctx->node)
+		return NULL;
+	return bctx_set(ctx->tree, ctx, (K_BNODE *)(ctx->node), ctx->pos + 1);
+}
+
+static K_ITEM *_prev_in_kbtree(K_TREE_CTX *ctx)
+{
+	bctx_refind(ctx, false);
+	if (!ctx->node)
+		return NULL;
+	return bctx_set(ctx->tree, ctx, (K_BNODE *)(ctx->node), ctx->pos - 1);
+}
+
+static K_ITEM *_find_in_kbtree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx)
+{
+	K_BNODE *bnode;
+	K_ITEM *item;
+	int pos;
+
+	if (!tree->broot)
+		return bctx_set(tree, ctx, NULL, 0);
+
+	bnode = bleaf_find(tree, data, false, &pos);
+	item = bctx_set(tree, ctx, bnode, pos);
+	if (item && tree->cmp_funct(item, data) != 0)
+		item = bctx_set(tree, ctx, NULL, 0);
+	return item;
+}
+
+static K_ITEM *_find_after_in_kbtree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx)
+{
+	K_BNODE *bnode;
+	int pos;
+
+	if (!tree->broot)
+		return bctx_set(tree, ctx, NULL, 0);
+
+	bnode = bleaf_find(tree, data, true, &pos);
+	return bctx_set(tree, ctx, bnode, pos);
+}
+
+static K_ITEM *_find_before_in_kbtree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx)
+{
+	K_BNODE *bnode;
+	int pos;
+
+	if (!tree->broot)
+		return bctx_set(tree, ctx, NULL, 0);
+
+	bnode = bleaf_find(tree, data, false, &pos);
+	return bctx_set(tree, ctx, bnode, pos - 1);
+}
+
+// Add child, that starts with first, to parent after pos
+static void badd_child(K_TREE *tree, K_BNODE *parent, int pos, K_BNODE *child,
+			KTREE_FFL_ARGS)
+{
+	K_BNODE *right, *root;
+	int i, half;
+
+	if (!parent) {
+		// child was split from the root
+		root = new_bnode(tree, false, KTREE_FFL_PASS);
+		root->data[0] = tree->broot->data[0];
+		root->child[0] = tree->broot;
+		root->data[1] = child->data[0];
+		root->child[1] = child;
+		root->count = 2;
+		tree->broot->parent = root;
+		child->parent = root;
+		tree->broot = root;
+		return;
+	}
+
+	pos++;
+	if (parent->count < KTREE_BORDER) {
+		for (i = parent->count; i > pos; i--) {
+			parent->data[i] = parent->data[i-1];
+			parent->child[i] = parent->child[i-1];
+		}
+		parent->data[pos] = child->data[0];
+		parent->child[pos] = child;
+		parent->count++;
+		child->parent = parent;
+		return;
+	}
+
+	// Split parent in half and add child to the half it belongs in
+	right = new_bnode(tree, false, KTREE_FFL_PASS);
+	half = KTREE_BORDER / 2;
+	for (i = half; i < KTREE_BORDER; i++) {
+		right->data[i - half] = parent->data[i];
+		right->child[i - half] = parent->child[i];
+		right->child[i - half]->parent = right;
+	}
+	right->count = KTREE_BORDER - half;
+	parent->count = half;
+
+	if (pos <= half) {
+		for (i = parent->count; i > pos; i--) {
+			parent->data[i] = parent->data[i-1];
+			parent->child[i] = parent->child[i-1];
+		}
+		parent->data[pos] = child->data[0];
+		parent->child[pos] = child;
+		parent->count++;
+		child->parent = parent;
+	} else {
+		pos -= half;
+		for (i = right->count; i > pos; i--) {
+			right->data[i] = right->data[i-1];
+			right->child[i] = right->child[i-1];
+		}
+		right->data[pos] = child->data[0];
+		right->child[pos] = child;
+		right->count++;
+		child->parent = right;
+	}
+
+	badd_child(tree, parent->parent,
+		   parent->parent ? bchild_pos(parent->parent, parent,
+					      KTREE_FFL_PASS) : 0,
+		   right, KTREE_FFL_PASS);
+}
+
+// Equal items are added after the existing ones, the same as a red black tree
+static void _add_to_kbtree(K_TREE *tree, K_ITEM *data, KTREE_FFL_ARGS)
+{
+	K_BNODE *leaf, *right;
+	int pos, i, half;
+
+	tree->bversion++;
+
+	if (!tree->broot) {
+		leaf = new_bnode(tree, true, KTREE_FFL_PASS);
+		leaf->data[0] = data;
+		leaf->count = 1;
+		tree->broot = leaf;
+		return;
+	}
+
+	leaf = bleaf_find(tree, data, true, &pos);
+	if (leaf->count < KTREE_BORDER) {
+		for (i = leaf->count; i > pos; i--)
+			leaf->data[i] = leaf->data[i-1];
+		leaf->data[pos] = data;
+		leaf->count++;
+		if (pos == 0)
+			bfirst_changed(leaf, KTREE_FFL_PASS);
+		return;
+	}
+
+	// Split the leaf in half and add data to the half it belongs in
+	right = new_bnode(tree, true, KTREE_FFL_PASS);
+	half = KTREE_BORDER / 2;
+	for (i = half; i < KTREE_BORDER; i++)
+		right->data[i - half] = leaf->data[i];
+	right->count = KTREE_BORDER - half;
+	leaf->count = half;
+	right->next = leaf->next;
+	if (right->next)
+		right->next->prev = right;
+	right->prev = leaf;
+	leaf->next = right;
+
+	if (pos <= half) {
+		for (i = leaf->count; i > pos; i--)
+			leaf->data[i] = leaf->data[i-1];
+		leaf->data[pos] = data;
+		leaf->count++;
+		if (pos == 0)
+			bfirst_changed(leaf, KTREE_FFL_PASS);
+	} else {
+		pos -= half;
+		for (i = right->count; i > pos; i--)
+			right->data[i] = right->data[i-1];
+		right->data[pos] = data;
+		right->count++;
+	}
+
+	badd_child(tree, leaf->parent,
+		   leaf->parent ? bchild_pos(leaf->parent, leaf,
+					    KTREE_FFL_PASS) : 0,
+		   right, KTREE_FFL_PASS);
+}
+
+// Remove child pos from parent, it is never child 0
+static void bremove_child(K_BNODE *parent, int pos)
+{
+	int i;
+
+	for (i = pos; i < parent->count - 1; i++) {
+		parent->data[i] = parent->data[i+1];
+		parent->child[i] = parent->child[i+1];
+	}
+	parent->count--;
+}
+
+// Move n entries from src pos to dst pos, keeping the child parents right
+static void bmove(K_BNODE *dst, int dpos, K_BNODE *src, int spos, int n)
+{
+	int i;
+
+	memmove(&(dst->data[dpos]), &(src->data[spos]), n * sizeof(K_ITEM *));
+	if (!dst->leaf) {
+		memmove(&(dst->child[dpos]), &(src->child[spos]),
+			n * sizeof(K_BNODE *));
+		for (i = dpos; i < dpos + n; i++)
+			dst->child[i]->parent = dst;
+	}
+}
+
+// bnode has less than KTREE_BMIN entries
+static void bunderflow(K_TREE *tree, K_BNODE *bnode, KTREE_FFL_ARGS)
+{
+	K_BNODE *parent = bnode->parent, *left, *right;
+	bool empty;
+	int pos;
+
+	if (!parent) {
+		// The root can have any number of entries
+		if (bnode->count == 0) {
+			free_bnode(tree, bnode);
+			tree->broot = NULL;
+		} else if (!bnode->leaf && bnode->count == 1) {
+			tree->broot = bnode->child[0];
+			tree->broot->parent = NULL;
+			free_bnode(tree, bnode);
+		}
+		return;
+	}
+
+	empty = (bnode->count == 0);
+	pos = bchild_pos(parent, bnode, KTREE_FFL_PASS);
+	left = (pos > 0) ? parent->child[pos - 1] : NULL;
+	right = (pos < parent->count - 1) ? parent->child[pos + 1] : NULL;
+
+	if (left && left->count > KTREE_BMIN) {
+		// Take the last entry of left
+		bmove(bnode, 1, bnode, 0, bnode->count);
+		bmove(bnode, 0, left, left->count - 1, 1);
+		left->count--;
+		bnode->count++;
+		parent->data[pos] = bnode->data[0];
+		return;
+	}
+
+	if (right && right->count > KTREE_BMIN) {
+		// Take the first entry of right
+		bmove(bnode, bnode->count, right, 0, 1);
+		bnode->count++;
+		bmove(right, 0, right, 1, right->count - 1);
+		right->count--;
+		parent->data[pos + 1] = right->data[0];
+		if (empty)
+			bfirst_changed(bnode, KTREE_FFL_PASS);
+		return;
+	}
+
+	if (left) {
+		// Merge bnode into left
+		bmove(left, left->count, bnode, 0, bnode->count);
+		left->count += bnode->count;
+		if (bnode->leaf) {
+			left->next = bnode->next;
+			if (left->next)
+				left->next->prev = left;
+		}
+		bremove_child(parent, pos);
+		free_bnode(tree, bnode);
+	} else {
+		// Merge right into bnode
+		bmove(bnode, bnode->count, right, 0, right->count);
+		bnode->count += right->count;
+		if (bnode->leaf) {
+			bnode->next = right->next;
+			if (bnode->next)
+				bnode->next->prev = bnode;
+		}
+		bremove_child(parent, pos + 1);
+		free_bnode(tree, right);
+		if (empty)
+			bfirst_changed(bnode, KTREE_FFL_PASS);
+	}
+
+	if (parent->count < KTREE_BMIN)
+		bunderflow(tree, parent, KTREE_FFL_PASS);
+}
+
+static void _remove_from_kbtree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx,
+				KTREE_FFL_ARGS)
+{
+	K_BNODE *leaf;
+	int pos;
+
+	ctx->tree = tree;
+	ctx->node = NULL;
+
+	leaf = bleaf_item(tree, data, &pos);
+	if (!leaf)
+		return;
+
+	tree->bversion++;
+
+	bmove(leaf, pos, leaf, pos + 1, leaf->count - pos - 1);
+	leaf->count--;
+	if (pos == 0)
+		bfirst_changed(leaf, KTREE_FFL_PASS);
+	if (leaf->count < KTREE_BMIN)
+		bunderflow(tree, leaf, KTREE_FFL_PASS);
+}
+
 static int bCount = 0;
 static long bTestValue = 0;
 static long nilTestValue = 0;
@@ -160,7 +703,21 @@ void _dump_ktree(K_TREE *tree, char *(*dsp_funct)(K_ITEM *), KTREE_FFL_ARGS)
 	_TREE_READ(tree, true, file, func, line);
 
 	printf("dump:\n");
-	if (tree->root->isNil == No)
+	if (tree->btree)
+	{
+		K_TREE_CTX ctx[1];
+		K_ITEM *item;
+
+		item = _first_in_kbtree(tree, ctx);
+		if (!item)
+			printf(" Empty tree\n");
+		while (item)
+		{
+			printf(" %d=%s\n", ctx->pos, dsp_funct(item));
+			item = _next_in_kbtree(ctx);
+		}
+	}
+	else if (tree->root->isNil == No)
 	{
 		buf[0] = 'T';
 		buf[1] = '\0';
@@ -208,7 +765,7 @@ void _dsp_ktree(K_TREE *tree, char *filename, char *msg, KTREE_FFL_ARGS)
 	else
 		fprintf(stream, "%s Dump of tree '%s':\n", stamp, tree->master->name);
 
-	if (tree->root->isNil == No)
+	if (tree->btree ? (tree->broot != NULL) : (tree->root->isNil == No))
 	{
 		item = first_in_ktree(tree, ctx);
 		while (item)
@@ -375,11 +932,11 @@ static K_ITEM *_first_in_knode(K_NODE *node, K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 		while (node->left->isNil == No)
 			node = node->left;
 
-		*ctx = node;
+		ctx->node = node;
 		return(node->data);
 	}
 
-	*ctx = NULL;
+	ctx->node = NULL;
 	return(NULL);
 }
 
@@ -387,6 +944,10 @@ K_ITEM *_first_in_ktree(K_TREE *tree, K_TREE_CTX *ctx, LOCK_MAYBE bool chklock,
 {
 	_TREE_READ(tree, chklock, file, func, line);
 
+	if (tree->btree)
+		return _first_in_kbtree(tree, ctx);
+
+	ctx->tree = tree;
 	return _first_in_knode(tree->root, ctx, KTREE_FFL_PASS);
 }
 
@@ -397,11 +958,11 @@ static K_ITEM *_last_in_knode(K_NODE *node, K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 		while (node->right->isNil == No)
 			node = node->right;
 
-		*ctx = node;
+		ctx->node = node;
 		return(node->data);
 	}
 
-	*ctx = NULL;
+	ctx->node = NULL;
 	return(NULL);
 }
 
@@ -409,6 +970,10 @@ K_ITEM *_last_in_ktree(K_TREE *tree, K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 {
 	_TREE_READ(tree, true, file, func, line);
 
+	if (tree->btree)
+		return _last_in_kbtree(tree, ctx);
+
+	ctx->tree = tree;
 	return _last_in_knode(tree->root, ctx, KTREE_FFL_PASS);
 }
 
@@ -420,7 +985,10 @@ K_ITEM *_last_in_ktree(K_TREE *tree, K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 K_ITEM *_next_in_ktree(K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 {
 	K_NODE *parent;
-	K_NODE *knode = (K_NODE *)(*ctx);
+	K_NODE *knode = (K_NODE *)(ctx->node);
+
+	if (ctx->tree->btree)
+		return _next_in_kbtree(ctx);
 
 	if (knode->isNil == No)
 	{
@@ -436,20 +1004,23 @@ K_ITEM *_next_in_ktree(K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 			}
 			if (parent->isNil == No)
 			{
-				*ctx = parent;
+				ctx->node = parent;
 				return(parent->data);
 			}
 		}
 	}
 
-	*ctx = NULL;
+	ctx->node = NULL;
 	return(NULL);
 }
 
 K_ITEM *_prev_in_ktree(K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 {
 	K_NODE *parent;
-	K_NODE *knode = (K_NODE *)(*ctx);
+	K_NODE *knode = (K_NODE *)(ctx->node);
+
+	if (ctx->tree->btree)
+		return _prev_in_kbtree(ctx);
 
 	if (knode->isNil == No)
 	{
@@ -465,13 +1036,13 @@ K_ITEM *_prev_in_ktree(K_TREE_CTX *ctx, KTREE_FFL_ARGS)
 			}
 			if (parent->isNil == No)
 			{
-				*ctx = parent;
+				ctx->node = parent;
 				return(parent->data);
 			}
 		}
 	}
 
-	*ctx = NULL;
+	ctx->node = NULL;
 	return(NULL);
 }
 
@@ -539,6 +1110,13 @@ void _add_to_ktree(K_TREE *tree, K_ITEM *data, LOCK_MAYBE bool chklock, KTREE_FF
 	if (tree == NULL)
 		FAIL("%s", "ADDNULL add tree is NULL");
 
+	if (tree->btree)
+	{
+		_TREE_WRITE(tree, chklock, file, func, line);
+		_add_to_kbtree(tree, data, KTREE_FFL_PASS);
+		return;
+	}
+
 //check_ktree(tree, ">add", NULL, 1, 1, 1, KTREE_FFL_PASS);
 
 	if (tree->root->parent != nil && tree->root->parent != NULL)
@@ -650,6 +1228,10 @@ K_ITEM *_find_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, bool chklock
 		_TREE_READ(tree, true, file, func, line);
 	}
 
+	if (tree->btree)
+		return _find_in_kbtree(tree, data, ctx);
+
+	ctx->tree = tree;
 	knode = tree->root;
 
 	while (knode->isNil == No && cmp != 0)
@@ -665,12 +1247,12 @@ K_ITEM *_find_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, bool chklock
 
 	if (knode->isNil == No)
 	{
-		*ctx = knode;
+		ctx->node = knode;
 		return(knode->data);
 	}
 	else
 	{
-		*ctx = NULL;
+		ctx->node = NULL;
 		return(NULL);
 	}
 }
@@ -689,6 +1271,10 @@ K_ITEM *_find_after_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, LOCK_M
 
 	_TREE_READ(tree, chklock, file, func, line);
 
+	if (tree->btree)
+		return _find_after_in_kbtree(tree, data, ctx);
+
+	ctx->tree = tree;
 	knode = tree->root;
 
 	while (knode->isNil == No && cmp != 0)
@@ -706,7 +1292,7 @@ K_ITEM *_find_after_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, LOCK_M
 
 	if (knode->isNil == No)
 	{
-		*ctx = knode;
+		ctx->node = knode;
 		return next_in_ktree(ctx);
 	}
 	else
@@ -715,15 +1301,15 @@ K_ITEM *_find_after_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, LOCK_M
 		{
 			if (oldcmp > 0)
 			{
-				*ctx = old;
+				ctx->node = old;
 				return(old->data);
 			}
 
-			*ctx = old;
+			ctx->node = old;
 			return next_in_ktree(ctx);
 		}
 
-		*ctx = NULL;
+		ctx->node = NULL;
 		return(NULL);
 	}
 }
@@ -742,6 +1328,10 @@ K_ITEM *_find_before_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, KTREE
 
 	_TREE_READ(tree, true, file, func, line);
 
+	if (tree->btree)
+		return _find_before_in_kbtree(tree, data, ctx);
+
+	ctx->tree = tree;
 	knode = tree->root;
 
 	while (knode->isNil == No && cmp != 0)
@@ -759,7 +1349,7 @@ K_ITEM *_find_before_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, KTREE
 
 	if (knode->isNil == No)
 	{
-		*ctx = knode;
+		ctx->node = knode;
 		return prev_in_ktree(ctx);
 	}
 	else
@@ -768,15 +1358,15 @@ K_ITEM *_find_before_in_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, KTREE
 		{
 			if (oldcmp < 0)
 			{
-				*ctx = old;
+				ctx->node = old;
 				return(old->data);
 			}
 
-			*ctx = old;
+			ctx->node = old;
 			return prev_in_ktree(ctx);
 		}
 
-		*ctx = NULL;
+		ctx->node = NULL;
 		return(NULL);
 	}
 }
@@ -881,9 +1471,16 @@ void _remove_from_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, LOCK_MAYBE
 
 	_TREE_WRITE(tree, chklock, file, func, line);
 
+	if (tree->btree)
+	{
+		_remove_from_kbtree(tree, data, ctx, KTREE_FFL_PASS);
+		return;
+	}
+
+	ctx->tree = tree;
 	if (tree->root->isNil == Yo)
 	{
-		*ctx = NULL;
+		ctx->node = NULL;
 		return;
 	}
 
@@ -898,7 +1495,7 @@ void _remove_from_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, LOCK_MAYBE
 	if (tree->cmp_funct(fdata, data) != 0)
 		FAIL("%s", "BADFIND cmp(found, remove) != 0");
 
-	found = *ctx;
+	found = (K_NODE *)(ctx->node);
 
 	x = nil;
 	y = nil;
@@ -907,9 +1504,10 @@ void _remove_from_ktree(K_TREE *tree, K_ITEM *data, K_TREE_CTX *ctx, LOCK_MAYBE
 		y = found;
 	else
 	{
-		*tmpctx = found;
+		tmpctx->tree = tree;
+		tmpctx->node = found;
 		next_in_ktree(tmpctx);
-		y = *tmpctx;
+		y = (K_NODE *)(tmpctx->node);
 	}
 
 	yred = y->red;
@@ -1061,8 +1659,8 @@ void _remove_from_ktree_free(K_TREE *tree, K_ITEM *data, bool chklock, KTREE_FFL
 
 	_remove_from_ktree(tree, data, ctx, chklock, KTREE_FFL_PASS);
 
-	if (ctx[0]) {
-		knode = (K_NODE *)(ctx[0]);
+	if (!tree->btree && ctx->node) {
+		knode = (K_NODE *)(ctx->node);
 		kitem = knode->kitem;
 		// _nolock since _remove_from_ktree() already tested it
 		k_unlink_item_nolock(tree->node_store, kitem);
@@ -1093,7 +1691,22 @@ void _free_ktree(K_TREE *tree, void (*free_funct)(void *), KTREE_FFL_ARGS)
 		FAIL("%s", "FREENOTROOT free tree->root not root");
 
 	if (free_funct)
-		free_ktree_sub(tree->root, free_funct);
+	{
+		if (tree->btree)
+		{
+			K_TREE_CTX ctx[1];
+			K_ITEM *item;
+
+			item = _first_in_kbtree(tree, ctx);
+			while (item)
+			{
+				free_funct(item);
+				item = _next_in_kbtree(ctx);
+			}
+		}
+		else
+			free_ktree_sub(tree->root, free_funct);
+	}
 
 	tree->node_store = k_free_store(tree->node_store);
 	tree->node_free = k_free_list(tree->node_free);
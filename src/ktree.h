@@ -26,6 +26,8 @@
 #define cmp_t int32_t
 
 #define CMP_STR(a,b) strcmp((a),(b))
+// Strings that are often the same pointer, e.g. interned
+#define CMP_NAME(a,b) (((a) == (b)) ? 0 : CMP_STR(a,b))
 #define CMP_INT(a,b) ((a)-(b))
 #define CMP_BIG_Z(a,b) (((a) < (b)) ? -1 : 1)
 #define CMP_BIG(a,b) (((a) == (b)) ? 0 : CMP_BIG_Z(a,b))
@@ -49,17 +51,50 @@ typedef struct knode
 	long	test;
 } K_NODE;
 
+/* A B+ tree keeps up to KTREE_BORDER items in each leaf, in order, and the
+ *  leaves are linked for the next/prev walks. An inner node has up to
+ *  KTREE_BORDER children and data[i] is the first item under child[i]
+ * KTREE_BORDER must be even so that every node but the root has a sibling */
+#define KTREE_BORDER 32
+#define KTREE_BMIN (KTREE_BORDER / 2)
+
+typedef struct kbnode
+{
+	K_ITEM	*kitem;
+	bool	leaf;
+	int	count;
+	struct	kbnode	*parent;
+	struct	kbnode	*prev;
+	struct	kbnode	*next;
+	K_ITEM	*data[KTREE_BORDER];
+	struct	kbnode	*child[KTREE_BORDER];
+} K_BNODE;
+
 typedef struct ktree
 {
 	const char *name;
 	K_NODE	*root;
+	bool	btree;
+	K_BNODE	*broot;
+	// Changed by every B+ tree add/remove so a K_TREE_CTX can tell
+	uint64_t bversion;
 	cmp_t (*cmp_funct)(K_ITEM *, K_ITEM *);
 	K_LIST	*master;
 	K_LIST	*node_free;
 	K_STORE	*node_store;
 } K_TREE;
 
-typedef void *K_TREE_CTX;
+/* node is the K_NODE, or the K_BNODE leaf and pos, of item
+ * Items can move between B+ tree leaves when the tree changes so, if it
+ *  has, next/prev find item again before moving on from it */
+typedef struct ktree_ctx
+{
+	K_TREE	*tree;
+	void	*node;
+	int	pos;
+	K_ITEM	*item;
+	uint64_t bversion;
+} K_TREE_CTX;
 
 // Avoid allocating too much ram up front for temporary trees
 #define NODE_ALLOC 64
@@ -67,15 +102,18 @@ typedef void *K_TREE_CTX;
 
 extern K_TREE *_new_ktree(const char *name, cmp_t (*cmp_funct)(K_ITEM *, K_ITEM *),
 			  K_LIST *master, int alloc, int limit, bool local_tree,
-			  KTREE_FFL_ARGS);
+			  bool btree, KTREE_FFL_ARGS);
 #define new_ktree(_name, _cmp_funct, _master) \
-	_new_ktree(_name, _cmp_funct, _master, _master->allocate, _master->limit, false, KLIST_FFL_HERE)
+	_new_ktree(_name, _cmp_funct, _master, _master->allocate, _master->limit, false, false, KLIST_FFL_HERE)
+// A B+ tree, for the very large trees
+#define new_ktree_btree(_name, _cmp_funct, _master) \
+	_new_ktree(_name, _cmp_funct, _master, _master->allocate, _master->limit, false, true, KLIST_FFL_HERE)
 #define new_ktree_local(_name, _cmp_funct, _master) \
-	_new_ktree(_name, _cmp_funct, _master, _master->allocate, _master->limit, true, KLIST_FFL_HERE)
+	_new_ktree(_name, _cmp_funct, _master, _master->allocate, _master->limit, true, false, KLIST_FFL_HERE)
 #define new_ktree_auto(_name, _cmp_funct, _master) \
-	_new_ktree(_name, _cmp_funct, _master, NODE_ALLOC, NODE_LIMIT, true, KLIST_FFL_HERE)
+	_new_ktree(_name, _cmp_funct, _master, NODE_ALLOC, NODE_LIMIT, true, false, KLIST_FFL_HERE)
 #define new_ktree_size(_name, _cmp_funct, _master, _alloc, _limit) \
-	_new_ktree(_name, _cmp_funct, _master, _alloc, _limit, false, KLIST_FFL_HERE)
+	_new_ktree(_name, _cmp_funct, _master, _alloc, _limit, false, false, KLIST_FFL_HERE)
 extern void _dump_ktree(K_TREE *tree, char *(*dsp_funct)(K_ITEM *), KTREE_FFL_ARGS);
 #define dump_ktree(_tree, _dsp_funct) _dump_ktree(_tree, _dsp_funct, KLIST_FFL_HERE)
 extern void _dsp_ktree(K_TREE *tree, char *filename, char *msg, KTREE_FFL_ARGS);
@@ -20,6 +20,8 @@
 #include <sys/file.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,6 +34,8 @@
 #include <math.h>
 #include <poll.h>
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <sched.h>
 
 #include "libckpool.h"
 #include "sha2.h"
@@ -56,13 +60,281 @@ void __attribute__((weak)) logmsg(int __maybe_unused loglevel, const char *fmt,
 	free(buf);
 }
 
+/* CPU sets for thread and process roles from the affinity config. Threads
+ * are pinned as they name themselves in rename_proc, to the longest role
+ * their name starts with, or else to their process' set. */
+#define AFFINITY_ROLES 64
+
+static struct affinity_role {
+	char name[16];
+	cpu_set_t cpus;
+} affinity_roles[AFFINITY_ROLES];
+
+static int affinity_nroles;
+static cpu_set_t affinity_startup;	/* The set the pool was started with */
+static cpu_set_t affinity_default;	/* This process' set */
+static bool affinity_saved;
+
+/* Add the cpus in a list like 0-3,8,node1 to cpus, where nodeN is every
+ * cpu on that NUMA node */
+static bool parse_cpulist(cpu_set_t *cpus, const char *list, const bool nodes)
+{
+	char *buf = strdup(list), *tok, *saveptr = NULL;
+	bool ret = false;
+
+	for (tok = strtok_r(buf, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		int first, last, node;
+		char *endptr;
+
+		while (isspace(*tok))
+			tok++;
+		if (nodes && sscanf(tok, "node%d", &node) == 1) {
+			char path[64], *nodelist = NULL;
+			size_t len = 0;
+			FILE *fp;
+			bool ok;
+
+			snprintf(path, 63, "/sys/devices/system/node/node%d/cpulist", node);
+			fp = fopen(path, "re");
+			if (!fp) {
+				LOGWARNING("No NUMA node %d for affinity", node);
+				goto out;
+			}
+			ok = getline(&nodelist, &len, fp) > 0 && parse_cpulist(cpus, nodelist, false);
+			fclose(fp);
+			free(nodelist);
+			if (!ok)
+				goto out;
+			continue;
+		}
+		if (!*tok || *tok == '\n')
+			continue;
+		first = last = strtol(tok, &endptr, 10);
+		if (endptr == tok)
+			goto out;
+		if (*endptr == '-')
+			last = strtol(endptr + 1, &endptr, 10);
+		if ((*endptr && !isspace(*endptr)) || first < 0 || last < first || last >= CPU_SETSIZE)
+			goto out;
+		while (first <= last)
+			CPU_SET(first++, cpus);
+	}
+	ret = true;
+out:
+	free(buf);
+	return ret;
+}
+
+/* Parsed on startup before any processes or threads are launched */
+bool add_affinity_role(const char *role, const char *cpulist)
+{
+	struct affinity_role *ar;
+	cpu_set_t allowed;
+
+	if (affinity_nroles >= AFFINITY_ROLES) {
+		LOGWARNING("Too many affinity roles, ignoring %s", role);
+		return false;
+	}
+	ar = &affinity_roles[affinity_nroles];
+	strncpy(ar->name, role, 15);
+	CPU_ZERO(&ar->cpus);
+	if (!parse_cpulist(&ar->cpus, cpulist, true) || !CPU_COUNT(&ar->cpus)) {
+		LOGWARNING("Invalid affinity cpu list %s for %s", cpulist, role);
+		return false;
+	}
+	if (!sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) {
+		CPU_AND(&allowed, &allowed, &ar->cpus);
+		if (!CPU_COUNT(&allowed)) {
+			LOGWARNING("No usable cpus in affinity cpu list %s for %s", cpulist, role);
+			return false;
+		}
+	}
+	affinity_nroles++;
+	return true;
+}
+
+static struct affinity_role *affinity_match(const char *name)
+{
+	struct affinity_role *match = NULL;
+	size_t len, matchlen = 0;
+	int i;
+
+	for (i = 0; i < affinity_nroles; i++) {
+		len = strlen(affinity_roles[i].name);
+		if (len > matchlen && !strncmp(name, affinity_roles[i].name, len)) {
+			match = &affinity_roles[i];
+			matchlen = len;
+		}
+	}
+	return match;
+}
+
+static void set_affinity(const char *name, const cpu_set_t *cpus)
+{
+	if (unlikely(sched_setaffinity(0, sizeof(cpu_set_t), cpus)))
+		LOGWARNING("Failed to set cpu affinity for %s", name);
+}
+
+/* Pin the calling thread to the process' set before it allocates its data
+ * so the kernel places those pages on the process' NUMA node, and make it
+ * the set for any of the process' threads without a role of their own.
+ * Processes without a role get the set the pool was started with. */
+void set_affinity_process(const char *name)
+{
+	struct affinity_role *ar;
+
+	if (!affinity_nroles)
+		return;
+	if (!affinity_saved) {
+		sched_getaffinity(0, sizeof(cpu_set_t), &affinity_startup);
+		affinity_saved = true;
+	}
+	ar = affinity_match(name);
+	memcpy(&affinity_default, ar ? &ar->cpus : &affinity_startup, sizeof(cpu_set_t));
+	set_affinity(name, &affinity_default);
+}
+
+/* Threads named with rename_proc in this process, for their cpu usage */
+#define THREAD_STATS 256
+
+static struct thread_stat {
+	pid_t pid;
+	pid_t tid;
+	char name[16];
+} named_threads[THREAD_STATS];
+
+static mutex_t named_threads_lock = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 };
+
+/* Threads may be naming themselves as the process forks */
+static void named_threads_prefork(void)
+{
+	mutex_lock(&named_threads_lock);
+}
+
+static void named_threads_postfork(void)
+{
+	mutex_unlock(&named_threads_lock);
+}
+
+static pthread_once_t named_threads_once = PTHREAD_ONCE_INIT;
+
+static void named_threads_init(void)
+{
+	pthread_atfork(named_threads_prefork, named_threads_postfork, named_threads_postfork);
+}
+
+/* Reuse the slot of an exited thread or one inherited from another process */
+static void register_thread(const char *name)
+{
+	pid_t pid = getpid(), tid = syscall(SYS_gettid);
+	struct thread_stat *ts = NULL;
+	char path[64];
+	int i;
+
+	pthread_once(&named_threads_once, named_threads_init);
+	mutex_lock(&named_threads_lock);
+	for (i = 0; i < THREAD_STATS; i++) {
+		struct thread_stat *slot = &named_threads[i];
+
+		if (slot->tid == tid && slot->pid == pid) {
+			ts = slot;
+			break;
+		}
+		if (ts)
+			continue;
+		if (!slot->tid || slot->pid != pid)
+			ts = slot;
+		else {
+			snprintf(path, 63, "/proc/self/task/%d", slot->tid);
+			if (access(path, F_OK))
+				ts = slot;
+		}
+	}
+	if (ts) {
+		ts->pid = pid;
+		ts->tid = tid;
+		strncpy(ts->name, name, 15);
+	}
+	mutex_unlock(&named_threads_lock);
+}
+
 void rename_proc(const char *name)
 {
+	struct affinity_role *ar;
 	char buf[16];
 
 	snprintf(buf, 15, "ckp@%s", name);
 	buf[15] = '\0';
 	prctl(PR_SET_NAME, buf, 0, 0, 0);
+
+	if (affinity_nroles) {
+		ar = affinity_match(name);
+		if (ar)
+			set_affinity(name, &ar->cpus);
+		else if (affinity_saved)
+			set_affinity(name, &affinity_default);
+	}
+	register_thread(name);
+}
+
+/* Cpu time in seconds, context switches and the last cpu each of this
+ * process' named threads ran on, from /proc */
+void thread_stats(json_t **val)
+{
+	pid_t pid = getpid();
+	long ticks = sysconf(_SC_CLK_TCK);
+	int i;
+
+	*val = json_array();
+	mutex_lock(&named_threads_lock);
+	for (i = 0; i < THREAD_STATS; i++) {
+		struct thread_stat *ts = &named_threads[i];
+		int64_t vcsw = 0, ivcsw = 0;
+		unsigned long utime, stime;
+		char path[64], line[1024];
+		int cpu, fields;
+		json_t *subval;
+		char *p;
+		FILE *fp;
+
+		if (!ts->tid || ts->pid != pid)
+			continue;
+		snprintf(path, 63, "/proc/self/task/%d/stat", ts->tid);
+		fp = fopen(path, "re");
+		if (!fp) {
+			ts->tid = 0;
+			continue;
+		}
+		p = fgets(line, sizeof(line), fp);
+		fclose(fp);
+		/* The name can contain spaces so skip past its closing bracket */
+		if (p)
+			p = strrchr(line, ')');
+		if (!p)
+			continue;
+		fields = sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+				"%*d %*d %*d %*d %*d %*d %*u %*u %*d %*u %*u %*u %*u %*u %*u "
+				"%*u %*u %*u %*u %*u %*u %*u %*d %d", &utime, &stime, &cpu);
+		if (fields != 3)
+			continue;
+
+		snprintf(path, 63, "/proc/self/task/%d/status", ts->tid);
+		fp = fopen(path, "re");
+		if (fp) {
+			while (fgets(line, sizeof(line), fp)) {
+				if (!strncmp(line, "voluntary_ctxt_switches:", 24))
+					vcsw = strtoll(line + 24, NULL, 10);
+				else if (!strncmp(line, "nonvoluntary_ctxt_switches:", 27))
+					ivcsw = strtoll(line + 27, NULL, 10);
+			}
+			fclose(fp);
+		}
+		JSON_CPACK(subval, "{ss,si,sf,sf,sI,sI,si}", "name", ts->name, "tid", (int)ts->tid,
+			   "user", (double)utime / ticks, "system", (double)stime / ticks,
+			   "voluntary", vcsw, "involuntary", ivcsw, "cpu", cpu);
+		json_array_append_new(*val, subval);
+	}
+	mutex_unlock(&named_threads_lock);
 }
 
 void create_pthread(pthread_t *thread, void *(*start_routine)(void *), void *arg)
@@ -997,7 +1269,10 @@ int read_length(int sockd, void *buf, int len)
 /* Use a standard message across the unix sockets:
  * 4 byte length of message as little endian encoded uint32_t followed by the
  * string. Return NULL in case of failure. */
-char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
+/* As recv_unix_msg but also returning the length of the message received
+ * for binary messages that may contain nulls, if len is set */
+char *_recv_unix_buf(int sockd, int timeout1, int timeout2, uint32_t *len, const char *file,
+		     const char *func, const int line)
 {
 	char *buf = NULL;
 	uint32_t msglen;
@@ -1033,7 +1308,8 @@ char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, co
 		ern = errno;
 		LOGERR("Failed to read %u bytes in recv_unix_msg (%d?)", msglen, ern);
 		dealloc(buf);
-	}
+	} else if (len)
+		*len = msglen;
 out:
 	shutdown(sockd, SHUT_RD);
 	if (unlikely(!buf))
@@ -1041,6 +1317,11 @@ out:
 	return buf;
 }
 
+char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
+{
+	return _recv_unix_buf(sockd, timeout1, timeout2, NULL, file, func, line);
+}
+
 /* Emulate a select write wait for high fds that select doesn't support */
 int wait_write_select(int sockd, float timeout)
 {
@@ -1085,9 +1366,12 @@ int _write_length(int sockd, const void *buf, int len, const char *file, const c
 	return ofs;
 }
 
-bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
+/* Send a length prefixed buffer which may contain binary data, as read back
+ * by recv_unix_msg */
+bool _send_unix_buf(int sockd, const void *buf, uint32_t len, int timeout, const char *file,
+		    const char *func, const int line)
 {
-	uint32_t msglen, len;
+	uint32_t msglen;
 	bool retval = false;
 	int ret, ern;
 
@@ -1096,45 +1380,49 @@ bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, c
 		goto out;
 	}
 	if (unlikely(!buf)) {
-		LOGWARNING("Null message sent to send_unix_msg");
+		LOGWARNING("Null message sent to send_unix_buf");
 		goto out;
 	}
-	len = strlen(buf);
 	if (unlikely(!len)) {
-		LOGWARNING("Zero length message sent to send_unix_msg");
+		LOGWARNING("Zero length message sent to send_unix_buf");
 		goto out;
 	}
 	msglen = htole32(len);
 	ret = wait_write_select(sockd, timeout);
 	if (unlikely(ret < 1)) {
 		ern = errno;
-		LOGERR("Select1 failed in send_unix_msg (%d)", ern);
+		LOGERR("Select1 failed in send_unix_buf (%d)", ern);
 		goto out;
 	}
 	ret = _write_length(sockd, &msglen, 4, file, func, line);
 	if (unlikely(ret < 4)) {
-		LOGERR("Failed to write 4 byte length in send_unix_msg");
+		LOGERR("Failed to write 4 byte length in send_unix_buf");
 		goto out;
 	}
 	ret = wait_write_select(sockd, timeout);
 	if (unlikely(ret < 1)) {
 		ern = errno;
-		LOGERR("Select2 failed in send_unix_msg (%d)", ern);
+		LOGERR("Select2 failed in send_unix_buf (%d)", ern);
 		goto out;
 	}
 	ret = _write_length(sockd, buf, len, file, func, line);
 	if (unlikely(ret < 0)) {
-		LOGERR("Failed to write %d bytes in send_unix_msg", len);
+		LOGERR("Failed to write %d bytes in send_unix_buf", len);
 		goto out;
 	}
 	retval = true;
 out:
 	shutdown(sockd, SHUT_WR);
 	if (unlikely(!retval))
-		LOGERR("Failure in send_unix_msg from %s %s:%d", file, func, line);
+		LOGERR("Failure in send_unix_buf from %s %s:%d", file, func, line);
 	return retval;
 }
 
+bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
+{
+	return _send_unix_buf(sockd, buf, buf ? strlen(buf) : 0, timeout, file, func, line);
+}
+
 bool _send_unix_data(int sockd, const struct msghdr *msg, const char *file, const char *func, const int line)
 {
 	bool retval = false;
@@ -1307,37 +1595,70 @@ char *rotating_filename(const char *path, time_t when)
 	return filename;
 }
 
+/* The file each path is currently writing to, kept open until the hour
+ * changes so rotating_log() doesn't open and close it for every entry */
+#define ROTATING_LOGS 4
+
+static struct rotating_fd {
+	char *path;
+	time_t hour;
+	int fd;
+} rotating_fds[ROTATING_LOGS];
+
+static mutex_t rotating_lock = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 };
+
 /* Creates a logfile entry which changes filename hourly with exclusive access */
 bool rotating_log(const char *path, const char *msg)
 {
 	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-	char *filename;
-	FILE *fp;
-	int fd;
+	struct rotating_fd *rfd = NULL;
+	time_t now = time(NULL);
+	char *filename = NULL;
+	struct iovec iov[2];
 	bool ok = false;
+	int i, fd;
 
-	filename = rotating_filename(path, time(NULL));
-	fd = open(filename, O_CREAT | O_RDWR | O_CLOEXEC , mode);
-	if (unlikely(fd == -1)) {
-		LOGERR("Failed to open %s in rotating_log!", filename);
-		goto stageleft;
+	mutex_lock(&rotating_lock);
+	for (i = 0; i < ROTATING_LOGS; i++) {
+		if (!rotating_fds[i].path || !strcmp(rotating_fds[i].path, path)) {
+			rfd = &rotating_fds[i];
+			break;
+		}
 	}
-	fp = fdopen(fd, "ae");
-	if (unlikely(!fp)) {
-		Close(fd);
-		LOGERR("Failed to fdopen %s in rotating_log!", filename);
-		goto stageleft;
+	if (rfd && rfd->path && rfd->hour == now / 3600)
+		fd = rfd->fd;
+	else {
+		filename = rotating_filename(path, now);
+		fd = open(filename, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, mode);
+		if (unlikely(fd == -1)) {
+			LOGERR("Failed to open %s in rotating_log!", filename);
+			goto stageleft;
+		}
+		/* Without a free slot it's opened for this entry only */
+		if (rfd) {
+			if (rfd->path)
+				Close(rfd->fd);
+			else
+				rfd->path = strdup(path);
+			rfd->hour = now / 3600;
+			rfd->fd = fd;
+		}
 	}
 	if (unlikely(flock(fd, LOCK_EX))) {
-		fclose(fp);
-		LOGERR("Failed to flock %s in rotating_log!", filename);
-		goto stageleft;
+		LOGERR("Failed to flock %s in rotating_log!", filename ? filename : path);
+		goto out;
 	}
-	fprintf(fp, "%s\n", msg);
-	fclose(fp);
-	ok = true;
-
+	iov[0].iov_base = (void *)msg;
+	iov[0].iov_len = strlen(msg);
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = 1;
+	ok = (writev(fd, iov, 2) == (ssize_t)(iov[0].iov_len + 1));
+	flock(fd, LOCK_UN);
+out:
+	if (!rfd)
+		Close(fd);
 stageleft:
+	mutex_unlock(&rotating_lock);
 	free(filename);
 
 	return ok;
@@ -1452,7 +1773,522 @@ size_t round_up_page(size_t len)
 	return len;
 }
 
+#define SLAB_BATCH 64
+#define SLAB_MAX_CACHES 32
+
+typedef struct slab_obj slab_obj_t;
+
+struct slab_obj {
+	slab_obj_t *next;	/* Next free object in this batch */
+	slab_obj_t *batch;	/* Next batch in the depot, on a batch's first object */
+};
+
+/* Per thread magazines for one cache. prev is always either empty or a full
+ * batch so that alternating allocs and frees at a batch boundary don't keep
+ * going back to the depot. */
+struct slab_mag {
+	slab_obj_t *loaded;
+	slab_obj_t *prev;
+	int rounds;		/* Objects in loaded */
+	int delta;		/* Allocs less frees not yet added to inuse */
+};
+
+static slab_cache_t *slab_caches[SLAB_MAX_CACHES];
+static int slab_ncaches;
+static __thread struct slab_mag slab_mags[SLAB_MAX_CACHES];
+static pthread_key_t slab_key;
+static __thread bool slab_keyed;
+
+/* Hold every depot lock over fork so no child inherits one locked by a thread
+ * that no longer exists there */
+static void slab_prefork(void)
+{
+	int i, caches = __atomic_load_n(&slab_ncaches, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < caches; i++)
+		mutex_lock(&slab_caches[i]->lock);
+}
+
+static void slab_postfork(void)
+{
+	int i, caches = __atomic_load_n(&slab_ncaches, __ATOMIC_ACQUIRE);
+
+	for (i = caches - 1; i >= 0; i--)
+		mutex_unlock(&slab_caches[i]->lock);
+}
+
+/* Return an exiting thread's magazines to the depots so its free objects
+ * aren't stranded. Full batches go straight back while odd objects are
+ * gathered into batches with those of other exited threads. */
+static void slab_thread_exit(void *arg)
+{
+	int i, caches = __atomic_load_n(&slab_ncaches, __ATOMIC_ACQUIRE);
+	struct slab_mag *mags = arg;
+
+	for (i = 0; i < caches; i++) {
+		slab_cache_t *sc = slab_caches[i];
+		struct slab_mag *mag = &mags[i];
+		slab_obj_t *obj;
+
+		mutex_lock(&sc->lock);
+		sc->inuse += mag->delta;
+		if (mag->prev) {
+			mag->prev->batch = sc->depot;
+			sc->depot = mag->prev;
+			sc->batches++;
+		}
+		while ((obj = mag->loaded)) {
+			mag->loaded = obj->next;
+			obj->next = sc->loose;
+			sc->loose = obj;
+			if (++sc->nloose == SLAB_BATCH) {
+				obj->batch = sc->depot;
+				sc->depot = obj;
+				sc->batches++;
+				sc->loose = NULL;
+				sc->nloose = 0;
+			}
+		}
+		mutex_unlock(&sc->lock);
+		memset(mag, 0, sizeof(struct slab_mag));
+	}
+	/* Anything freed by later destructors registers us again */
+	slab_keyed = false;
+}
+
+/* Have this thread's magazines returned to the depots when it exits */
+static inline void slab_key_thread(void)
+{
+	if (unlikely(!slab_keyed)) {
+		slab_keyed = true;
+		pthread_setspecific(slab_key, slab_mags);
+	}
+}
+
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static void slab_init(void)
+{
+	pthread_key_create(&slab_key, slab_thread_exit);
+	pthread_atfork(slab_prefork, slab_postfork, slab_postfork);
+}
+
+/* Caches are process wide and live for the life of the process. Create them
+ * on startup before the threads using them. */
+slab_cache_t *create_slab_cache(const char *name, size_t size)
+{
+	slab_cache_t *sc = ckzalloc(sizeof(slab_cache_t));
+
+	pthread_once(&slab_once, slab_init);
+	if (size < sizeof(slab_obj_t))
+		size = sizeof(slab_obj_t);
+	/* Keep every object in a batch 16 byte aligned like malloc */
+	sc->size = (size + 15) & ~(size_t)15;
+	sc->name = name;
+	mutex_init(&sc->lock);
+	sc->id = __atomic_load_n(&slab_ncaches, __ATOMIC_RELAXED);
+	if (unlikely(sc->id >= SLAB_MAX_CACHES))
+		quit(1, "Too many slab caches creating %s", name);
+	slab_caches[sc->id] = sc;
+	__atomic_store_n(&slab_ncaches, sc->id + 1, __ATOMIC_RELEASE);
+	return sc;
+}
+
+/* Take a full batch from the depot or carve a new one if it's empty */
+static slab_obj_t *slab_get_batch(slab_cache_t *sc, struct slab_mag *mag)
+{
+	slab_obj_t *batch, *obj;
+	char *chunk;
+	int i;
+
+	mutex_lock(&sc->lock);
+	sc->inuse += mag->delta;
+	mag->delta = 0;
+	batch = sc->depot;
+	if (batch) {
+		sc->depot = batch->batch;
+		sc->batches--;
+	} else
+		sc->objects += SLAB_BATCH;
+	mutex_unlock(&sc->lock);
+
+	if (batch)
+		return batch;
+	chunk = ckalloc(sc->size * SLAB_BATCH);
+	batch = (slab_obj_t *)chunk;
+	for (i = 0; i < SLAB_BATCH; i++) {
+		obj = (slab_obj_t *)(chunk + sc->size * i);
+		obj->next = i < SLAB_BATCH - 1 ? (slab_obj_t *)(chunk + sc->size * (i + 1)) : NULL;
+	}
+	return batch;
+}
+
+static void slab_put_batch(slab_cache_t *sc, struct slab_mag *mag, slab_obj_t *batch)
+{
+	mutex_lock(&sc->lock);
+	sc->inuse += mag->delta;
+	mag->delta = 0;
+	batch->batch = sc->depot;
+	sc->depot = batch;
+	sc->batches++;
+	mutex_unlock(&sc->lock);
+}
+
+void *slab_alloc(slab_cache_t *sc)
+{
+	struct slab_mag *mag = &slab_mags[sc->id];
+	slab_obj_t *obj;
+
+	slab_key_thread();
+	if (unlikely(!mag->rounds)) {
+		if (mag->prev) {
+			mag->loaded = mag->prev;
+			mag->prev = NULL;
+		} else
+			mag->loaded = slab_get_batch(sc, mag);
+		mag->rounds = SLAB_BATCH;
+	}
+	obj = mag->loaded;
+	mag->loaded = obj->next;
+	mag->rounds--;
+	mag->delta++;
+	return obj;
+}
+
+void *slab_zalloc(slab_cache_t *sc)
+{
+	void *ptr = slab_alloc(sc);
+
+	memset(ptr, 0, sc->size);
+	return ptr;
+}
+
+/* Objects can be freed from any thread, going into that thread's magazines */
+void slab_free(slab_cache_t *sc, void *ptr)
+{
+	struct slab_mag *mag = &slab_mags[sc->id];
+	slab_obj_t *obj = ptr;
+
+	if (unlikely(!obj))
+		return;
+	slab_key_thread();
+	if (unlikely(mag->rounds == SLAB_BATCH)) {
+		if (mag->prev)
+			slab_put_batch(sc, mag, mag->prev);
+		mag->prev = mag->loaded;
+		mag->loaded = NULL;
+		mag->rounds = 0;
+	}
+	obj->next = mag->loaded;
+	mag->loaded = obj;
+	mag->rounds++;
+	mag->delta--;
+}
+
+/* Occupancy of every cache in this process. inuse lags by up to a couple of
+ * batches per thread since threads only report when they visit the depot. */
+void slab_stats(json_t **val)
+{
+	int i, caches = __atomic_load_n(&slab_ncaches, __ATOMIC_ACQUIRE);
+
+	*val = json_object();
+	for (i = 0; i < caches; i++) {
+		slab_cache_t *sc = slab_caches[i];
+		int64_t objects, depot, inuse;
+		json_t *subval;
+
+		mutex_lock(&sc->lock);
+		objects = sc->objects;
+		depot = sc->batches * SLAB_BATCH + sc->nloose;
+		inuse = sc->inuse;
+		mutex_unlock(&sc->lock);
+		JSON_CPACK(subval, "{si,sI,sI,sI,sI}", "size", (int)sc->size, "objects", objects,
+			   "inuse", inuse, "depot", depot, "memory", objects * (int64_t)sc->size);
+		json_object_set_new_nocheck(*val, sc->name, subval);
+	}
+}
+
+/* Size classes for jansson's own allocations. Each is prefixed with a header
+ * holding its class so it can be freed without knowing its size, and anything
+ * larger than the biggest class falls through to ckalloc. */
+#define JSON_SLAB_HDR 16
+#define JSON_SLAB_MAX 512
+
+static const int json_slab_sizes[] = { 32, 48, 64, 96, 128, 192, 256, 384, 512 };
+static const char *json_slab_names[] = { "json32", "json48", "json64", "json96", "json128",
+					 "json192", "json256", "json384", "json512" };
+#define JSON_SLAB_CLASSES (int)(sizeof(json_slab_sizes) / sizeof(int))
+
+static slab_cache_t *json_slabs[JSON_SLAB_CLASSES];
+static char json_slab_class[JSON_SLAB_MAX / 16 + 1];
+
+void *json_slab_alloc(size_t size)
+{
+	size_t len = size + JSON_SLAB_HDR;
+	int64_t *hdr;
+	int class;
+
+	if (unlikely(len > JSON_SLAB_MAX)) {
+		hdr = _ckalloc(len, __FILE__, __func__, __LINE__);
+		*hdr = -1;
+	} else {
+		class = json_slab_class[(len + 15) / 16];
+		hdr = slab_alloc(json_slabs[class]);
+		*hdr = class;
+	}
+	return (char *)hdr + JSON_SLAB_HDR;
+}
+
+void json_slab_free(void *ptr)
+{
+	int64_t *hdr = (int64_t *)((char *)ptr - JSON_SLAB_HDR);
+
+	if (unlikely(*hdr < 0))
+		free(hdr);
+	else
+		slab_free(json_slabs[*hdr], hdr);
+}
+
+/* Point jansson at the size class caches. Must be called before any json is
+ * created as nothing allocated beforehand can be freed by json_slab_free. */
+void json_slab_init(void)
+{
+	int i, class = 0;
+
+	for (i = 0; i < JSON_SLAB_CLASSES; i++)
+		json_slabs[i] = create_slab_cache(json_slab_names[i], json_slab_sizes[i]);
+	for (i = 0; i <= JSON_SLAB_MAX / 16; i++) {
+		while (json_slab_sizes[class] < i * 16)
+			class++;
+		json_slab_class[i] = class;
+	}
+	json_set_alloc_funcs(json_slab_alloc, json_slab_free);
+}
+
+/* Monotonic clock shared by every process on the host, for timestamps that
+ * are passed between them */
+int64_t monotonic_ns(void)
+{
+	ts_t ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+void lhist_add(lhist_t *hist, int64_t ns)
+{
+	int msb, bucket;
+
+	if (unlikely(ns < LHIST_SUB))
+		bucket = ns < 0 ? 0 : ns;
+	else {
+		msb = 63 - __builtin_clzll(ns);
+		bucket = (msb - LHIST_SUBBITS + 1) * LHIST_SUB +
+			 ((ns >> (msb - LHIST_SUBBITS)) & (LHIST_SUB - 1));
+	}
+	__atomic_add_fetch(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+}
 
+/* Midpoint of a bucket in microseconds */
+static double lhist_value(const int bucket)
+{
+	int shift = bucket / LHIST_SUB - 1;
+	double lower, width;
+
+	if (bucket < LHIST_SUB)
+		return (double)bucket / 1000;
+	lower = (double)((int64_t)(LHIST_SUB + bucket % LHIST_SUB) << shift);
+	width = (double)((int64_t)1 << shift);
+	return (lower + width / 2) / 1000;
+}
+
+/* Percentiles in microseconds of everything recorded since startup. The
+ * buckets are read without locking so may be a few samples out. */
+void lhist_stats(lhist_t *hist, json_t **val)
+{
+	static const double centiles[] = { 0.5, 0.99, 0.999 };
+	static const char *names[] = { "p50", "p99", "p999" };
+	int64_t count = 0, total, target;
+	int i, bucket = 0;
+
+	total = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	*val = json_object();
+	json_object_set_new_nocheck(*val, "count", json_integer(total));
+	for (i = 0; i < 3; i++) {
+		target = total * centiles[i];
+		if (target < 1)
+			target = 1;
+		while (bucket < LHIST_BUCKETS - 1 && count < target)
+			count += __atomic_load_n(&hist->buckets[bucket++], __ATOMIC_RELAXED);
+		json_object_set_new_nocheck(*val, names[i],
+					    json_real(total ? lhist_value(bucket - 1) : 0));
+	}
+}
+
+#if defined(__x86_64__) && defined(HAVE_AVX2_INTRIN)
+#include <immintrin.h>
+
+#define HEX_VECTOR
+
+/* Hex conversion is done 16 or 32 bytes at a time when the CPU we're running
+ * on supports it, falling back to a byte at a time for what's left over */
+static bool hex_ssse3, hex_avx2;
+
+static void __attribute__((constructor)) hex_select_kernel(void)
+{
+	__builtin_cpu_init();
+	hex_ssse3 = __builtin_cpu_supports("ssse3");
+	hex_avx2 = __builtin_cpu_supports("avx2");
+}
+
+/* Decoding reads a whole block before knowing where the string ends, so it
+ * must not read across into a page that may not be mapped */
+static inline bool hex_page_cross(const void *ptr, const int len)
+{
+	return ((uintptr_t)ptr & 4095) > (uintptr_t)(4096 - len);
+}
+
+__attribute__((target("ssse3")))
+static size_t bin2hex_ssse3(uchar *s, const uchar *p, size_t len)
+{
+	const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+					     '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+		__m128i lo = _mm_and_si128(x, mask);
+
+		_mm_storeu_si128((__m128i *)(s + i * 2),
+				 _mm_shuffle_epi8(digits, _mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i *)(s + i * 2 + 16),
+				 _mm_shuffle_epi8(digits, _mm_unpackhi_epi8(hi, lo)));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t bin2hex_avx2(uchar *s, const uchar *p, size_t len)
+{
+	const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+						'8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+						'0', '1', '2', '3', '4', '5', '6', '7',
+						'8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), mask);
+		__m256i lo = _mm256_and_si256(x, mask);
+		/* Unpacking works within each 128 bit lane so put the lanes
+		 * back in order when storing */
+		__m256i a = _mm256_shuffle_epi8(digits, _mm256_unpacklo_epi8(hi, lo));
+		__m256i b = _mm256_shuffle_epi8(digits, _mm256_unpackhi_epi8(hi, lo));
+
+		_mm256_storeu_si256((__m256i *)(s + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *)(s + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	return i + bin2hex_ssse3(s + i * 2, p + i, len - i);
+}
+
+/* Convert 16 hex characters to their nibble values, clearing lanes of valid
+ * for any characters that aren't hex */
+__attribute__((target("ssse3")))
+static inline __m128i hex_nibbles_ssse3(const __m128i c, __m128i *valid)
+{
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i isd = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i isa = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+
+	*valid = _mm_and_si128(*valid, _mm_or_si128(isd, isa));
+	return _mm_or_si128(_mm_and_si128(isd, d),
+			    _mm_and_si128(isa, _mm_add_epi8(a, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hex_nibbles_avx2(const __m256i c, __m256i *valid)
+{
+	__m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i a = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i isd = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	__m256i isa = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+
+	*valid = _mm256_and_si256(*valid, _mm256_or_si256(isd, isa));
+	return _mm256_or_si256(_mm256_and_si256(isd, d),
+			       _mm256_and_si256(isa, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+}
+
+/* Decode whole blocks of valid hex into up to len bytes, returning how many
+ * were decoded. It stops short of any block with an invalid character, which
+ * includes the string's terminator, leaving it for the byte at a time decode
+ * to report. Each block is validated before anything is stored so decoding
+ * in place works. */
+__attribute__((target("ssse3")))
+static size_t hex2bin_ssse3(uchar *p, const uchar *hexstr, size_t len)
+{
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	size_t i;
+
+	for (i = 0; i + 16 <= len && !hex_page_cross(hexstr + i * 2, 32); i += 16) {
+		__m128i valid = _mm_set1_epi8(-1), lo, hi;
+
+		lo = hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(hexstr + i * 2)), &valid);
+		hi = hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(hexstr + i * 2 + 16)), &valid);
+		if (_mm_movemask_epi8(valid) != 0xffff)
+			break;
+		/* Combine each pair of nibbles into high * 16 + low */
+		lo = _mm_maddubs_epi16(lo, weights);
+		hi = _mm_maddubs_epi16(hi, weights);
+		_mm_storeu_si128((__m128i *)(p + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t hex2bin_avx2(uchar *p, const uchar *hexstr, size_t len)
+{
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	size_t i;
+
+	for (i = 0; i + 32 <= len && !hex_page_cross(hexstr + i * 2, 64); i += 32) {
+		__m256i valid = _mm256_set1_epi8(-1), lo, hi;
+
+		lo = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hexstr + i * 2)), &valid);
+		hi = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hexstr + i * 2 + 32)), &valid);
+		if (_mm256_movemask_epi8(valid) != -1)
+			break;
+		lo = _mm256_maddubs_epi16(lo, weights);
+		hi = _mm256_maddubs_epi16(hi, weights);
+		/* Packing also works within lanes, leaving the 8 byte quarters
+		 * in the order 0 2 1 3 */
+		_mm256_storeu_si256((__m256i *)(p + i),
+				    _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8));
+	}
+	return i + hex2bin_ssse3(p + i, hexstr + i * 2, len - i);
+}
+
+/* Returns how many of the first len characters of buf are valid hex in whole
+ * blocks, stopping short of any block with an invalid character */
+__attribute__((target("ssse3")))
+static size_t validhex_ssse3(const uchar *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i valid = _mm_set1_epi8(-1);
+
+		hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(buf + i)), &valid);
+		if (_mm_movemask_epi8(valid) != 0xffff)
+			break;
+	}
+	return i;
+}
+#endif
 
 /* Adequate size s==len*2 + 1 must be alloced to use this variant */
 void __bin2hex(void *vs, const void *vp, size_t len)
@@ -1460,9 +2296,16 @@ void __bin2hex(void *vs, const void *vp, size_t len)
 	static const char hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 	const uchar *p = vp;
 	uchar *s = vs;
-	int i;
-
-	for (i = 0; i < (int)len; i++) {
+	int i = 0;
+
+#ifdef HEX_VECTOR
+	if (hex_avx2)
+		i = bin2hex_avx2(s, p, len);
+	else if (hex_ssse3)
+		i = bin2hex_ssse3(s, p, len);
+	s += i * 2;
+#endif
+	for (; i < (int)len; i++) {
 		*s++ = hex[p[i] >> 4];
 		*s++ = hex[p[i] & 0xF];
 	}
@@ -1506,7 +2349,7 @@ const int hex2bin_tbl[256] = {
 
 bool _validhex(const char *buf, const char *file, const char *func, const int line)
 {
-	unsigned int i, slen;
+	unsigned int i = 0, slen;
 	bool ret = false;
 
 	slen = strlen(buf);
@@ -1514,7 +2357,11 @@ bool _validhex(const char *buf, const char *file, const char *func, const int li
 		LOGDEBUG("Invalid hex due to length %u from %s %s:%d", slen, file, func, line);
 		goto out;
 	}
-	for (i = 0; i < slen; i++) {
+#ifdef HEX_VECTOR
+	if (hex_ssse3)
+		i = validhex_ssse3((const uchar *)buf, slen);
+#endif
+	for (; i < slen; i++) {
 		uchar idx = buf[i];
 
 		if (hex2bin_tbl[idx] == -1) {
@@ -1528,7 +2375,8 @@ out:
 	return ret;
 }
 
-/* Does the reverse of bin2hex but does not allocate any ram */
+/* Does the reverse of bin2hex but does not allocate any ram. The hex is
+ * validated as it's decoded so it needs no separate validhex pass. */
 bool _hex2bin(void *vp, const void *vhexstr, size_t len, const char *file, const char *func, const int line)
 {
 	const uchar *hexstr = vhexstr;
@@ -1538,6 +2386,22 @@ bool _hex2bin(void *vp, const void *vhexstr, size_t len, const char *file, const
 	uchar idx;
 
 	while (*hexstr && len) {
+#ifdef HEX_VECTOR
+		if (len >= 16) {
+			size_t done = 0;
+
+			if (hex_avx2)
+				done = hex2bin_avx2(p, hexstr, len);
+			else if (hex_ssse3)
+				done = hex2bin_ssse3(p, hexstr, len);
+			if (done) {
+				p += done;
+				hexstr += done * 2;
+				len -= done;
+				continue;
+			}
+		}
+#endif
 		if (unlikely(!hexstr[1])) {
 			LOGWARNING("Early end of string in hex2bin from %s %s:%d", file, func, line);
 			return ret;
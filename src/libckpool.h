@@ -318,6 +318,37 @@ struct unixsock {
 
 typedef struct unixsock unixsock_t;
 
+/* Cache of fixed size objects. Objects are carved a batch at a time and never
+ * given back to the system. Each thread keeps private magazines of free
+ * objects and only swaps whole batches with the shared depot under lock. */
+struct slab_cache {
+	mutex_t lock;
+	const char *name;
+	size_t size;
+	int id;
+	void *depot;		/* Full batches of free objects */
+	int64_t batches;	/* Batches in the depot */
+	void *loose;		/* Objects from exited threads short of a batch */
+	int nloose;
+	int64_t objects;	/* Objects ever carved */
+	int64_t inuse;		/* Objects in use as last reported by each thread */
+};
+
+typedef struct slab_cache slab_cache_t;
+
+/* Latency histogram in nanoseconds updated without locking. Each power of two
+ * is split into LHIST_SUB linear buckets so percentiles are good to 1/8th. */
+#define LHIST_SUBBITS 3
+#define LHIST_SUB (1 << LHIST_SUBBITS)
+#define LHIST_BUCKETS ((64 - LHIST_SUBBITS + 1) * LHIST_SUB)
+
+struct latency_hist {
+	int64_t count;
+	int64_t buckets[LHIST_BUCKETS];
+};
+
+typedef struct latency_hist lhist_t;
+
 void _json_check(json_t *val, json_error_t *err, const char *file, const char *func, const int line);
 #define json_check(VAL, ERR) _json_check(VAL, ERR,  __FILE__, __func__, __LINE__)
 
@@ -410,7 +441,10 @@ static inline void _json_set_object(json_t *val, const char *key, json_t *object
 }
 #define json_set_object(val, key, object) _json_set_object(val, key, object, __FILE__, __func__, __LINE__)
 
+bool add_affinity_role(const char *role, const char *cpulist);
+void set_affinity_process(const char *name);
 void rename_proc(const char *name);
+void thread_stats(json_t **val);
 void create_pthread(pthread_t *thread, void *(*start_routine)(void *), void *arg);
 void join_pthread(pthread_t thread);
 bool ck_completion_timeout(void *fn, void *fnarg, int timeout);
@@ -503,6 +537,8 @@ int _open_unix_client(const char *server_path, const char *file, const char *fun
 int wait_close(int sockd, int timeout);
 int wait_read_select(int sockd, float timeout);
 int read_length(int sockd, void *buf, int len);
+char *_recv_unix_buf(int sockd, int timeout1, int timeout2, uint32_t *len, const char *file,
+		     const char *func, const int line);
 char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line);
 #define RECV_UNIX_TIMEOUT1 30
 #define RECV_UNIX_TIMEOUT2 5
@@ -514,6 +550,9 @@ int wait_write_select(int sockd, float timeout);
 int _write_length(int sockd, const void *buf, int len, const char *file, const char *func, const int line);
 bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line);
 #define send_unix_msg(sockd, buf) _send_unix_msg(sockd, buf, UNIX_WRITE_TIMEOUT, __FILE__, __func__, __LINE__)
+bool _send_unix_buf(int sockd, const void *buf, uint32_t len, int timeout, const char *file,
+		    const char *func, const int line);
+#define send_unix_buf(sockd, buf, len) _send_unix_buf(sockd, buf, len, UNIX_WRITE_TIMEOUT, __FILE__, __func__, __LINE__)
 bool _send_unix_data(int sockd, const struct msghdr *msg, const char *file, const char *func, const int line);
 #define send_unix_data(sockd, msg) _send_unix_data(sockd, msg, __FILE__, __func__, __LINE__)
 bool _recv_unix_data(int sockd, struct msghdr *msg, const char *file, const char *func, const int line);
@@ -537,6 +576,17 @@ void *_ckalloc(size_t len, const char *file, const char *func, const int line);
 void *json_ckalloc(size_t size);
 void *_ckzalloc(size_t len, const char *file, const char *func, const int line);
 size_t round_up_page(size_t len);
+slab_cache_t *create_slab_cache(const char *name, size_t size);
+void *slab_alloc(slab_cache_t *sc);
+void *slab_zalloc(slab_cache_t *sc);
+void slab_free(slab_cache_t *sc, void *ptr);
+void slab_stats(json_t **val);
+void *json_slab_alloc(size_t size);
+void json_slab_free(void *ptr);
+void json_slab_init(void);
+int64_t monotonic_ns(void);
+void lhist_add(lhist_t *hist, int64_t ns);
+void lhist_stats(lhist_t *hist, json_t **val);
 
 extern const int hex2bin_tbl[];
 void __bin2hex(void *vs, const void *vp, size_t len);
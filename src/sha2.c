@@ -34,6 +34,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -85,33 +86,11 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-#ifdef USE_AVX2
-extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
+/* All the transform kernels take the message, state and number of blocks,
+ * the best one the running CPU supports being selected on first use. */
+typedef void (*sha256_kernel_t)(const unsigned char *, uint32_t[8], uint64_t);
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_rorx(message, ctx->h, block_nb);
-}
-#elif defined(USE_AVX1)
-extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_avx(message, ctx->h, block_nb);
-}
-#elif defined(USE_SSE4)
-extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_sse4(message, ctx->h, block_nb);
-}
-#else
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_generic(const unsigned char *message, uint32_t h[8], uint64_t block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -133,7 +112,7 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            wv[j] = ctx->h[j];
+            wv[j] = h[j];
         }
 
         for (j = 0; j < 64; j++) {
@@ -151,11 +130,341 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            ctx->h[j] += wv[j];
+            h[j] += wv[j];
         }
     }
 }
+
+#ifdef USE_YASM
+extern void sha256_rorx(const unsigned char *, uint32_t[8], uint64_t);
+extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
+extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
+#endif
+
+#ifdef HAVE_SHANI
+#include <immintrin.h>
+
+/* SHA extensions kernel, 4 rounds per group with the message schedule for
+ * later groups computed in the same pass. */
+__attribute__((target("sha,sse4.1")))
+static void sha256_shani(const unsigned char *message, uint32_t h[8], uint64_t block_nb)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, msg, tmp, abef_save, cdgh_save, w[4];
+	uint64_t i;
+	int g;
+
+	tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);		/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+	for (i = 0; i < block_nb; i++, message += 64) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		for (g = 0; g < 4; g++) {
+			tmp = _mm_loadu_si128((const __m128i *)(message + g * 16));
+			w[g] = _mm_shuffle_epi8(tmp, mask);
+		}
+		for (g = 0; g < 16; g++) {
+			msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i *)&sha256_k[g * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if (g >= 3 && g <= 14) {
+				tmp = _mm_alignr_epi8(w[g & 3], w[(g - 1) & 3], 4);
+				w[(g + 1) & 3] = _mm_add_epi32(w[(g + 1) & 3], tmp);
+				w[(g + 1) & 3] = _mm_sha256msg2_epu32(w[(g + 1) & 3], w[g & 3]);
+			}
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+			if (g >= 1 && g <= 12)
+				w[(g - 1) & 3] = _mm_sha256msg1_epu32(w[(g - 1) & 3], w[g & 3]);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);		/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+	_mm_storeu_si128((__m128i *)&h[0], state0);
+	_mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif
+
+#ifdef HAVE_AVX2_INTRIN
+#include <immintrin.h>
+
+#define MROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define MSHA256_F1(x) _mm256_xor_si256(_mm256_xor_si256(MROTR(x, 2), MROTR(x, 13)), MROTR(x, 22))
+#define MSHA256_F2(x) _mm256_xor_si256(_mm256_xor_si256(MROTR(x, 6), MROTR(x, 11)), MROTR(x, 25))
+#define MSHA256_F3(x) _mm256_xor_si256(_mm256_xor_si256(MROTR(x, 7), MROTR(x, 18)), _mm256_srli_epi32(x, 3))
+#define MSHA256_F4(x) _mm256_xor_si256(_mm256_xor_si256(MROTR(x, 17), MROTR(x, 19)), _mm256_srli_epi32(x, 10))
+#define MCH(x, y, z) _mm256_xor_si256(_mm256_and_si256(x, y), _mm256_andnot_si256(x, z))
+#define MMAJ(x, y, z) _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y)))
+
+/* Multi-buffer kernel transforming one block in each of up to 8 states with
+ * one 32 bit lane of the ymm registers per buffer. Unused lanes duplicate
+ * the first buffer and their results are discarded. */
+__attribute__((target("avx2")))
+static void sha256_multi_avx2(uint32_t *h[], const unsigned char *blocks[], int n)
+{
+	uint32_t tmp[SHA256_LANES] __attribute__((aligned(32)));
+	__m256i w[64], wv[8], t1, t2;
+	int i, j;
+
+	for (i = 0; i < 16; i++) {
+		for (j = 0; j < SHA256_LANES; j++)
+			PACK32(blocks[j < n ? j : 0] + (i << 2), &tmp[j]);
+		w[i] = _mm256_load_si256((__m256i *)tmp);
+	}
+	for (i = 16; i < 64; i++) {
+		w[i] = _mm256_add_epi32(_mm256_add_epi32(MSHA256_F4(w[i - 2]), w[i - 7]),
+					_mm256_add_epi32(MSHA256_F3(w[i - 15]), w[i - 16]));
+	}
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < SHA256_LANES; j++)
+			tmp[j] = h[j < n ? j : 0][i];
+		wv[i] = _mm256_load_si256((__m256i *)tmp);
+	}
+
+	for (i = 0; i < 64; i++) {
+		t1 = _mm256_add_epi32(_mm256_add_epi32(wv[7], MSHA256_F2(wv[4])),
+				      _mm256_add_epi32(MCH(wv[4], wv[5], wv[6]),
+						       _mm256_add_epi32(_mm256_set1_epi32(sha256_k[i]), w[i])));
+		t2 = _mm256_add_epi32(MSHA256_F1(wv[0]), MMAJ(wv[0], wv[1], wv[2]));
+		wv[7] = wv[6];
+		wv[6] = wv[5];
+		wv[5] = wv[4];
+		wv[4] = _mm256_add_epi32(wv[3], t1);
+		wv[3] = wv[2];
+		wv[2] = wv[1];
+		wv[1] = wv[0];
+		wv[0] = _mm256_add_epi32(t1, t2);
+	}
+
+	for (i = 0; i < 8; i++) {
+		_mm256_store_si256((__m256i *)tmp, wv[i]);
+		for (j = 0; j < n; j++)
+			h[j][i] += tmp[j];
+	}
+}
+#endif
+
+typedef void (*sha256_multi_kernel_t)(uint32_t *[], const unsigned char *[], int);
+
+static sha256_kernel_t sha256_kernel;
+static const char *sha256_kernel_name = "generic";
+
+/* NULL when there is no multi-buffer kernel faster than hashing each buffer
+ * in turn with sha256_kernel */
+static sha256_multi_kernel_t sha256_multi_kernel;
+
+#if defined(__x86_64__) && (defined(USE_YASM) || defined(HAVE_SHANI) || defined(HAVE_AVX2_INTRIN))
+#include <cpuid.h>
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
 #endif
+
+/* What the CPU supports, for sha256_set_impl to check against */
+static bool cpu_sse4, cpu_avx, cpu_avx2, cpu_shani;
+
+/* Check the OS saves the xmm and ymm registers before using avx */
+static int sha256_os_avx(void)
+{
+	uint32_t eax, edx;
+
+	__asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return (eax & 6) == 6;
+}
+
+/* Choose the fastest kernel the CPU we're running on supports rather than
+ * what the build host supported. */
+static void sha256_select_kernel(void)
+{
+	unsigned int eax, ebx, ecx = 0, edx, ebx7 = 0, ecx7, edx7;
+	bool avx, shani;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && __get_cpuid_max(0, NULL) >= 7)
+		__cpuid_count(7, 0, eax, ebx7, ecx7, edx7);
+	avx = (ecx & bit_AVX) && (ecx & bit_OSXSAVE) && sha256_os_avx();
+	shani = (ebx7 & bit_SHA) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+	cpu_sse4 = (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+	cpu_avx = avx;
+	cpu_avx2 = avx && (ebx7 & bit_AVX2) && (ebx7 & bit_BMI2);
+	cpu_shani = shani;
+
+	if (0) {
+#ifdef HAVE_SHANI
+	} else if (shani) {
+		sha256_kernel = sha256_shani;
+		sha256_kernel_name = "shani";
+#endif
+#ifdef USE_YASM
+	} else if (avx && (ebx7 & bit_AVX2) && (ebx7 & bit_BMI2)) {
+		sha256_kernel = sha256_rorx;
+		sha256_kernel_name = "avx2";
+	} else if (avx) {
+		sha256_kernel = sha256_avx;
+		sha256_kernel_name = "avx1";
+	} else if ((ecx & bit_SSE4_1) && (ecx & bit_SSSE3)) {
+		sha256_kernel = sha256_sse4;
+		sha256_kernel_name = "sse4";
+#endif
+	} else
+		sha256_kernel = sha256_generic;
+
+	/* Interleaving 8 buffers only beats doing them one at a time when we
+	 * don't have the sha extensions */
+#ifdef HAVE_AVX2_INTRIN
+	if (!shani && avx && (ebx7 & bit_AVX2))
+		sha256_multi_kernel = sha256_multi_avx2;
+#endif
+	(void)avx;
+	(void)shani;
+}
+#else
+static void sha256_select_kernel(void)
+{
+	sha256_kernel = sha256_generic;
+}
+#endif
+
+/* Returns the name of the transform kernel in use */
+const char *sha256_impl(void)
+{
+	if (!sha256_kernel)
+		sha256_select_kernel();
+	return sha256_kernel_name;
+}
+
+/* Force the transform kernel by name so they can be benchmarked against each
+ * other, returning false if it isn't built in or the CPU doesn't support it */
+bool sha256_set_impl(const char *name)
+{
+	if (!sha256_kernel)
+		sha256_select_kernel();
+	if (!strcmp(name, "generic")) {
+		sha256_kernel = sha256_generic;
+		sha256_kernel_name = "generic";
+		return true;
+	}
+#ifdef HAVE_SHANI
+	if (!strcmp(name, "shani") && cpu_shani) {
+		sha256_kernel = sha256_shani;
+		sha256_kernel_name = "shani";
+		return true;
+	}
+#endif
+#ifdef USE_YASM
+	if (!strcmp(name, "avx2") && cpu_avx2) {
+		sha256_kernel = sha256_rorx;
+		sha256_kernel_name = "avx2";
+		return true;
+	}
+	if (!strcmp(name, "avx1") && cpu_avx) {
+		sha256_kernel = sha256_avx;
+		sha256_kernel_name = "avx1";
+		return true;
+	}
+	if (!strcmp(name, "sse4") && cpu_sse4) {
+		sha256_kernel = sha256_sse4;
+		sha256_kernel_name = "sse4";
+		return true;
+	}
+#endif
+	return false;
+}
+
+/* Returns the name of the multi-buffer kernel in use */
+const char *sha256_multi_impl(void)
+{
+	if (!sha256_kernel)
+		sha256_select_kernel();
+	return sha256_multi_kernel ? "avx2x8" : "serial";
+}
+
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+	if (__builtin_expect(!sha256_kernel, 0))
+		sha256_select_kernel();
+	sha256_kernel(message, ctx->h, block_nb);
+}
+
+#define SHA256_MULTI_MAX 1024
+
+/* Continue each of n contexts with its own message of len bytes and finalise
+ * them into their digests, consuming the contexts. The contexts must all have
+ * the same amount of data buffered, as they do when they're copies of the one
+ * midstate or were all just initialised. Up to SHA256_LANES buffers are
+ * hashed side by side with the multi-buffer kernel when there is one. */
+void sha256_multi(sha256_ctx *ctx[], const unsigned char *message[], unsigned int len,
+                  unsigned char *digest[], int n)
+{
+	unsigned char buf[SHA256_LANES][SHA256_MULTI_MAX];
+	const unsigned char *blocks[SHA256_LANES];
+	uint32_t *h[SHA256_LANES];
+	unsigned int padlen, block_nb, b;
+	int i, j, lanes;
+
+	if (__builtin_expect(!sha256_kernel, 0))
+		sha256_select_kernel();
+
+	for (i = 0; i < n; i += lanes) {
+		lanes = n - i < SHA256_LANES ? n - i : SHA256_LANES;
+		padlen = ctx[i]->len + len + 9;
+		block_nb = (padlen + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE;
+		for (j = 1; j < lanes; j++) {
+			if (ctx[i + j]->len != ctx[i]->len)
+				break;
+		}
+		if (j < lanes || (block_nb << 6) > SHA256_MULTI_MAX) {
+			/* Can't line these up so do them the slow way */
+			for (j = 0; j < lanes; j++) {
+				sha256_update(ctx[i + j], message[i + j], len);
+				sha256_final(ctx[i + j], digest[i + j]);
+			}
+			continue;
+		}
+
+		/* Lay out each buffer as sha256_final would pad it */
+		for (j = 0; j < lanes; j++) {
+			sha256_ctx *c = ctx[i + j];
+			unsigned char *p = buf[j];
+			unsigned int len_b = (c->tot_len + c->len + len) << 3;
+
+			memcpy(p, c->block, c->len);
+			memcpy(p + c->len, message[i + j], len);
+			memset(p + c->len + len, 0, (block_nb << 6) - c->len - len);
+			p[c->len + len] = 0x80;
+			UNPACK32(len_b, p + (block_nb << 6) - 4);
+			h[j] = c->h;
+		}
+
+		if (sha256_multi_kernel && lanes > 1) {
+			for (b = 0; b < block_nb; b++) {
+				for (j = 0; j < lanes; j++)
+					blocks[j] = buf[j] + (b << 6);
+				sha256_multi_kernel(h, blocks, lanes);
+			}
+		} else {
+			for (j = 0; j < lanes; j++)
+				sha256_kernel(buf[j], h[j], block_nb);
+		}
+
+		for (j = 0; j < lanes; j++) {
+			for (b = 0; b < 8; b++)
+				UNPACK32(h[j][b], &digest[i + j][b << 2]);
+		}
+	}
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -34,11 +34,14 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+
 #ifndef SHA2_H
 #define SHA2_H
 
 #define SHA256_DIGEST_SIZE ( 256 / 8)
 #define SHA256_BLOCK_SIZE  ( 512 / 8)
+#define SHA256_LANES 8
 
 #define SHFR(x, n)    (x >> n)
 #define ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))
@@ -65,5 +68,10 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+const char *sha256_impl(void);
+bool sha256_set_impl(const char *name);
+void sha256_multi(sha256_ctx *ctx[], const unsigned char *message[], unsigned int len,
+                  unsigned char *digest[], int n);
+const char *sha256_multi_impl(void);
 
 #endif /* !SHA2_H */
@@ -10,6 +10,7 @@
 #include "config.h"
 
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -36,6 +37,11 @@
 #define DAY	86400
 #define WEEK	604800
 
+/* Shortest interval in seconds that share diff is accumulated over before
+ * being folded into the decaying hashrate averages, matching the interval
+ * statsupdate accounts the pool shares at */
+#define DECAY_QUANTUM	1.875
+
 /* Consistent across all pool instances */
 static const char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 static const char *scriptsig_header = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff";
@@ -107,7 +113,8 @@ struct workbase {
 	int height;
 	char *flags;
 	int transactions;
-	char *txn_data;
+	uchar *txn_bin; // Binary transactions, only hex encoded when needed
+	int txn_binlen;
 	char *txn_hashes;
 	int merkles;
 	char merklehash[16][68];
@@ -130,9 +137,17 @@ struct workbase {
 	uchar *coinb2bin;
 	int coinb2len; // length of above
 
+	/* SHA256 state after hashing coinb1 and the constant enonce1 which are
+	 * the same for every share on this workbase */
+	sha256_ctx coinb1ctx;
+
 	/* Cached header binary */
 	char headerbin[112];
 
+	/* mining.notify lines rendered once in add_base, indexed by clean */
+	char *notify[2];
+	int notifylen[2];
+
 	char *logdir;
 
 	ckpool_t *ckp;
@@ -141,23 +156,94 @@ struct workbase {
 
 typedef struct workbase workbase_t;
 
+/* A mining.submit scanned straight from the client's line without building any
+ * json, with the fields of its params array in order */
+struct submit_params {
+	char workername[128];
+	char job_id[32];
+	char nonce2[40];
+	char ntime[16];
+	char nonce[16];
+
+	/* The id as it appeared, of type JSON_INTEGER, JSON_STRING or JSON_NULL */
+	char id[24];
+	json_type idtype;
+};
+
+typedef struct submit_params submit_params_t;
+
 struct json_params {
 	json_t *method;
 	json_t *params;
 	json_t *id_val;
 	int64_t client_id;
+
+	/* Share submissions scanned in place have no method or params */
+	bool scanned;
+	submit_params_t submit;
+
+	/* monotonic_ns when the connector read it and it was queued here, only
+	 * set for share submissions */
+	int64_t received;
+	int64_t queued;
 };
 
 typedef struct json_params json_params_t;
 
+/* Maximum number of queued share submissions hashed side by side */
+#define SHARE_BATCH SHA256_LANES
+
+/* Share submission hashed ahead of being processed by the batched share
+ * processor, valid only for the workbase it was hashed on */
+struct share_hash {
+	const workbase_t *wb;
+	int64_t id;
+	ts_t gentime;
+	bool hashed;
+
+	uint32_t ntime32;
+	const char *nonce;
+
+	char *coinbase;
+	int cblen;
+	uchar swap[80];
+	uchar hash[32];
+	double sdiff;
+};
+
+typedef struct share_hash share_hash_t;
+
 /* Stratum json messages with their associated client id */
 struct smsg {
 	json_t *json_msg;
 	int64_t client_id;
+
+	/* Message already serialised instead of json_msg, only for sends to
+	 * client_ids */
+	char *line;
+	int len;
+
+	/* For broadcasts, the array of client ids the one message goes to */
+	int64_t *client_ids;
+	int clients;
+
+	/* monotonic_ns when the connector read the originating line if known,
+	 * and when this was queued and dequeued */
+	int64_t received;
+	int64_t queued;
+	int64_t dequeued;
+
+	/* A client's share submission scanned instead of json_msg */
+	const submit_params_t *submit;
 };
 
 typedef struct smsg smsg_t;
 
+/* Caches for the message objects allocated and freed for every share and
+ * every send */
+static slab_cache_t *smsg_slab;
+static slab_cache_t *jp_slab;
+
 struct user_instance;
 struct worker_instance;
 struct stratum_instance;
@@ -190,9 +276,12 @@ struct user_instance {
 	double dsps60;/* etc */
 	double dsps1440;
 	double dsps10080;
+	double pending_diff; /* Diff not yet folded into the above */
 	tv_t last_share;
 	tv_t last_decay;
 	tv_t last_update;
+	int64_t stored_shares; /* Shares and workers when last written to the */
+	int stored_workers; /* stats store, to only write them when changed */
 
 	bool authorised; /* Has this username ever been authorised? */
 	time_t auth_time;
@@ -218,9 +307,11 @@ struct worker_instance {
 	double dsps60;
 	double dsps1440;
 	double dsps10080;
+	double pending_diff;
 	tv_t last_share;
 	tv_t last_decay;
 	tv_t last_update;
+	int64_t stored_shares; /* Shares when last written to the stats store */
 	time_t start_time;
 
 	double best_diff; /* Best share found by this worker */
@@ -242,6 +333,14 @@ struct stratum_instance {
 	stratum_instance_t *next;
 	stratum_instance_t *prev;
 
+	/* Links on the subscriber list of the ckp sdata and, in proxy mode, of
+	 * the sdata of the proxy it was bound to when it authorised */
+	stratum_instance_t *sub_next;
+	stratum_instance_t *sub_prev;
+	stratum_instance_t *psub_next;
+	stratum_instance_t *psub_prev;
+	sdata_t *sub_sdata;
+
 	/* Reference count for when this instance is used outside of the
 	 * instance_lock */
 	int ref;
@@ -260,6 +359,7 @@ struct stratum_instance {
 	double dsps60;/* etc */
 	double dsps1440;
 	double dsps10080;
+	double pending_diff; /* Diff not yet folded into the dsps averages */
 	tv_t ldc; /* Last diff change */
 	int ssdc; /* Shares since diff change */
 	tv_t first_share;
@@ -274,6 +374,7 @@ struct stratum_instance {
 	bool subscribed;
 	bool authorising; /* In progress, protected by instance_lock */
 	bool authorised;
+	bool listening; /* On the subscriber lists, protected by instance_lock */
 	bool dropped;
 	bool idle;
 	int reject;	/* Indicator that this client is having a run of rejects
@@ -314,11 +415,45 @@ struct stratum_instance {
 struct share {
 	UT_hash_handle hh;
 	uchar hash[32];
-	int64_t workbase_id;
 };
 
 typedef struct share share_t;
 
+/* Shares are allocated from slabs that are only ever freed along with the
+ * whole table of shares for a workbase */
+#define SHARE_SLAB 64
+
+typedef struct share_slab share_slab_t;
+
+struct share_slab {
+	share_slab_t *next;
+	share_t shares[SHARE_SLAB];
+};
+
+/* The shares of each workbase are split by hash across this many
+ * independently locked hashtables */
+#define SHARE_SHARDS 16
+
+struct share_shard {
+	mutex_t lock;
+	share_t *shares;
+	share_slab_t *slabs;
+	int slabused; /* Shares used in the head of slabs */
+	int count;
+};
+
+typedef struct share_shard share_shard_t;
+
+typedef struct share_table share_table_t;
+
+/* Table of the shares submitted on one workbase */
+struct share_table {
+	UT_hash_handle hh;
+	int64_t workbase_id;
+	share_table_t *next; /* For purging outside of share_lock */
+	share_shard_t shards[SHARE_SHARDS];
+};
+
 struct proxy_base {
 	UT_hash_handle hh;
 	UT_hash_handle sh; /* For subproxy hashlist */
@@ -414,6 +549,110 @@ static const char *ckdb_seq_names[] = {
 
 #define ID_COUNT (sizeof(ckdb_ids)/sizeof(char *))
 
+#define CKDB_BATCH 64 /* Most queued messages sent to ckdb in one batch */
+
+#define STATS_SLOT 512 /* Bytes per record slot in a stats store */
+#define STATS_GROW 1024 /* Slots added each time a stats store is grown */
+
+/* The decoded stats for one entity, kept alongside its index entry */
+struct stats_record {
+	double dsps1;
+	double dsps5;
+	double dsps60;
+	double dsps1440;
+	double dsps10080;
+	double best_diff;
+	int64_t lastupdate;
+	int64_t shares;
+};
+
+typedef struct stats_record stats_record_t;
+
+/* Where the record for one entity lives in a stats store */
+struct stats_index {
+	UT_hash_handle hh;
+	char *name;
+	int64_t slot;
+	int64_t nslots; /* Consecutive slots the record spans */
+	stats_record_t rec;
+};
+
+typedef struct stats_index stats_index_t;
+
+/* User and worker stats are each kept in a single file mapped into memory as
+ * one fixed size line of json per entity, indexed by name. A record too long
+ * for one slot spills over into as many consecutive slots as it needs, still
+ * as one line. Records are only
+ * rewritten in place when the entity's stats have changed, so unchanged
+ * entities cost nothing. Every record is decoded once when the store is
+ * opened so looking up an entity's stats never parses or reads anything. */
+struct stats_store {
+	mutex_t lock;
+	char *fname;
+	int fd;
+	char *map;
+	int64_t slots; /* Slots currently mapped */
+	int64_t used; /* Slots handed out to entities */
+	stats_index_t *index;
+};
+
+typedef struct stats_store stats_store_t;
+
+/* Most bytes of entries put in one batch message to the upstream pool */
+#define REMOTE_BATCH_BYTES 65536
+
+/* Accepted shares for one worker on a trusted remote node that are yet to be
+ * sent upstream, summed over each remote interval */
+struct remote_share {
+	UT_hash_handle hh;
+	char *workername;
+	int64_t diff;
+	double sdiff; /* Best share diff */
+};
+
+typedef struct remote_share remote_share_t;
+
+/* Stages of a template update from being requested to being broadcast */
+enum update_stage {
+	UPDATE_QUEUED,
+	UPDATE_GETBASE,
+	UPDATE_DECODE,
+	UPDATE_COINBASE,
+	UPDATE_ADDBASE,
+	UPDATE_BROADCAST,
+	UPDATE_STAGES
+};
+
+static const char *update_stages[UPDATE_STAGES] = {
+	"queued", "getbase", "decode", "coinbase", "addbase", "broadcast"
+};
+
+/* Microseconds spent in each update stage of the last and slowest updates */
+struct update_times {
+	int64_t updates;
+	double last[UPDATE_STAGES];
+	double max[UPDATE_STAGES];
+};
+
+typedef struct update_times update_times_t;
+
+/* Stages a share submission passes through from the connector reading it to
+ * its result being handed back to the connector */
+enum share_stage {
+	SHARE_IPC,	/* Connector to the stratifier receiving it */
+	SHARE_SRECVQ,	/* Waiting on the srecvs queue */
+	SHARE_PARSE,	/* srecv_process till queued on sshareq */
+	SHARE_SSHAREQ,	/* Waiting on the sshareq queue */
+	SHARE_PROCESS,	/* sshare_process till its result is queued */
+	SHARE_SSENDQ,	/* Waiting on the ssends queue */
+	SHARE_TOTAL,	/* Connector read to the result sent to the connector */
+	SHARE_STAGES
+};
+
+static const char *share_stages[SHARE_STAGES] = {
+	"ipc", "srecvq", "parse", "sshareq", "process", "ssendq", "total"
+};
+
 struct stratifier_data {
 	ckpool_t *ckp;
 
@@ -436,6 +675,7 @@ struct stratifier_data {
 	uint64_t ckdb_seq_ids[ID_COUNT];
 
 	bool ckdb_offline;
+	bool ckdb_nobatch; /* ckdb does not accept batched messages */
 	bool verbose;
 
 	uint64_t enonce1_64;
@@ -448,8 +688,16 @@ struct stratifier_data {
 	workbase_t *current_workbase;
 	int workbases_generated;
 
-	/* Semaphore to serialise calls to add_base */
-	sem_t update_sem;
+	update_times_t update_times; /* Protected by stats_lock */
+	/* Share submission latency through each stage, updated locklessly */
+	lhist_t share_latency[SHARE_STAGES];
+
+	stats_store_t *userstore;
+	stats_store_t *workerstore;
+
+	/* Shares pending for the upstream pool in trusted remote mode */
+	mutex_t remote_lock;
+	remote_share_t *remote_shares;
 	/* Time we last sent out a stratum update */
 	time_t update_time;
 
@@ -465,7 +713,11 @@ struct stratifier_data {
 	ckmsgq_t *sshareq;	// Stratum share sends
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
+	ckmsgq_t *updateq;	// Template updates
+	int update_pending;	// Template updates queued but not started
 	ckmsg_t *postponed;	// List of messages postponed till next update
+	int postponed_count;	// Number of messages in above
+	mutex_t postponed_lock;
 
 	int user_instance_id;
 
@@ -473,6 +725,12 @@ struct stratifier_data {
 	stratum_instance_t *recycled_instances;
 	stratum_instance_t *node_instances;
 
+	/* Authorised clients that receive broadcasts, protected by the ckp sdata
+	 * instance_lock. In proxy mode the ckp sdata list holds every
+	 * subscriber and each proxy sdata holds only its own. */
+	stratum_instance_t *subscribers;
+	int subscriber_count;
+
 	int stratum_generated;
 	int disconnected_generated;
 	session_t *disconnected_sessions;
@@ -482,8 +740,10 @@ struct stratifier_data {
 	/* Protects both stratum and user instances */
 	cklock_t instance_lock;
 
-	share_t *shares;
-	mutex_t share_lock;
+	/* Hashtable of share tables by workbase id. The lock is held read only
+	 * to add shares and write only to add and remove share tables */
+	share_table_t *share_tables;
+	cklock_t share_lock;
 
 	int64_t shares_generated;
 
@@ -555,7 +815,7 @@ static void generate_coinbase(const ckpool_t *ckp, workbase_t *wb)
 {
 	uint64_t *u64, g64, d64 = 0;
 	sdata_t *sdata = ckp->data;
-	char header[228];
+	char header[272]; /* Room for the longest strings the workbase holds */
 	int len, ofs = 0;
 	ts_t now;
 
@@ -656,7 +916,7 @@ static void generate_coinbase(const ckpool_t *ckp, workbase_t *wb)
 	LOGDEBUG("Coinb2: %s", wb->coinb2);
 	/* Coinbase 2 complete */
 
-	snprintf(header, 225, "%s%s%s%s%s%s%s",
+	snprintf(header, sizeof(header), "%s%s%s%s%s%s%s",
 		 wb->bbversion, wb->prevhash,
 		 "0000000000000000000000000000000000000000000000000000000000000000",
 		 wb->ntime, wb->nbit,
@@ -667,59 +927,83 @@ static void generate_coinbase(const ckpool_t *ckp, workbase_t *wb)
 }
 
 static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool clean);
+static json_t *__stratum_notify(const workbase_t *wb, const bool clean);
 
 static void clear_workbase(workbase_t *wb)
 {
 	free(wb->flags);
-	free(wb->txn_data);
+	free(wb->txn_bin);
 	free(wb->txn_hashes);
 	free(wb->logdir);
 	free(wb->coinb1bin);
 	free(wb->coinb1);
 	free(wb->coinb2bin);
 	free(wb->coinb2);
+	free(wb->notify[0]);
+	free(wb->notify[1]);
 	json_decref(wb->merkle_array);
 	free(wb);
 }
 
-/* Remove all shares with a workbase id less than wb_id for block changes */
+static void free_share_table(share_table_t *table)
+{
+	share_slab_t *slab, *tmp;
+	int i;
+
+	for (i = 0; i < SHARE_SHARDS; i++) {
+		share_shard_t *shard = &table->shards[i];
+
+		HASH_CLEAR(hh, shard->shares);
+		LL_FOREACH_SAFE(shard->slabs, slab, tmp)
+			free(slab);
+		mutex_destroy(&shard->lock);
+	}
+	free(table);
+}
+
+/* Remove the share tables of all workbases with an id less than wb_id for
+ * block changes */
 static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	share_table_t *table, *tmp, *purged = NULL;
+	int tables = 0;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
+	ck_wlock(&sdata->share_lock);
+	HASH_ITER(hh, sdata->share_tables, table, tmp) {
+		if (table->workbase_id < wb_id) {
+			HASH_DEL(sdata->share_tables, table);
+			table->next = purged;
+			purged = table;
 		}
 	}
-	mutex_unlock(&sdata->share_lock);
+	ck_wunlock(&sdata->share_lock);
+
+	while (purged) {
+		table = purged;
+		purged = table->next;
+		free_share_table(table);
+		tables++;
+	}
 
-	if (purged)
-		LOGINFO("Cleared %d shares from share hashtable", purged);
+	if (tables)
+		LOGINFO("Cleared %d workbase share tables", tables);
 }
 
-/* Remove all shares with a workbase id == wb_id being discarded */
+/* Remove the share table of workbase wb_id being discarded */
 static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
-	int aged = 0;
+	share_table_t *table;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
-		}
-	}
-	mutex_unlock(&sdata->share_lock);
+	ck_wlock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+	if (table)
+		HASH_DEL(sdata->share_tables, table);
+	ck_wunlock(&sdata->share_lock);
 
-	if (aged)
-		LOGINFO("Aged %d shares from share hashtable", aged);
+	if (table) {
+		LOGINFO("Aged share table of workbase %"PRId64, wb_id);
+		free_share_table(table);
+	}
 }
 
 static char *status_chars = "|/-\\";
@@ -800,55 +1084,41 @@ static void _ckdbq_add(ckpool_t *ckp, const int idtype, json_t *val, const char
 /* Append a bulk list already created to the ssends list */
 static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-
-	mutex_lock(ssends->lock);
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, bulk_send);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	ckmsgq_add_bulk(sdata->ssends, bulk_send, messages, false);
 }
 
-/* As ssend_bulk_append but for high priority messages to be put at the front
- * of the list. */
+/* As ssend_bulk_append but for high priority messages to be sent before
+ * anything already queued. */
 static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-	ckmsg_t *tmp;
-
-	mutex_lock(ssends->lock);
-	tmp = ssends->msgs;
-	ssends->msgs = bulk_send;
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, tmp);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	ckmsgq_add_bulk(sdata->ssends, bulk_send, messages, true);
 }
 
 /* List of messages we intentionally want to postpone till after the next bulk
  * update - eg. workinfo which is large and we don't want to delay updates */
 static void ssend_bulk_postpone(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-
-	mutex_lock(ssends->lock);
+	mutex_lock(&sdata->postponed_lock);
 	DL_CONCAT(sdata->postponed, bulk_send);
-	ssends->messages += messages;
-	mutex_unlock(ssends->lock);
+	sdata->postponed_count += messages;
+	mutex_unlock(&sdata->postponed_lock);
 }
 
 /* Send any postponed bulk messages */
 static void send_postponed(sdata_t *sdata)
 {
-	ckmsgq_t *ssends = sdata->ssends;
+	ckmsg_t *postponed;
+	int messages;
 
-	mutex_lock(ssends->lock);
-	if (sdata->postponed) {
-		DL_CONCAT(ssends->msgs, sdata->postponed);
-		sdata->postponed = NULL;
-		pthread_cond_signal(ssends->cond);
-	}
-	mutex_unlock(ssends->lock);
+	mutex_lock(&sdata->postponed_lock);
+	postponed = sdata->postponed;
+	messages = sdata->postponed_count;
+	sdata->postponed = NULL;
+	sdata->postponed_count = 0;
+	mutex_unlock(&sdata->postponed_lock);
+
+	if (postponed)
+		ssend_bulk_append(sdata, postponed, messages);
 }
 
 static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
@@ -877,8 +1147,13 @@ static void send_node_workinfo(sdata_t *sdata, const workbase_t *wb)
 		json_set_int(wb_val, "height", wb->height);
 		json_set_string(wb_val, "flags", wb->flags);
 		json_set_int(wb_val, "transactions", wb->transactions);
-		if (likely(wb->transactions))
-			json_set_string(wb_val, "txn_data", wb->txn_data);
+		if (likely(wb->transactions)) {
+			char *txn_data = ckalloc(wb->txn_binlen * 2 + 1);
+
+			__bin2hex(txn_data, wb->txn_bin, wb->txn_binlen);
+			json_object_set_new_nocheck(wb_val, "txn_data", json_string_nocheck(txn_data));
+			free(txn_data);
+		}
 		/* We don't need txn_hashes */
 		json_set_int(wb_val, "merkles", wb->merkles);
 		json_object_set_new_nocheck(wb_val, "merklehash", json_deep_copy(wb->merkle_array));
@@ -895,8 +1170,8 @@ static void send_node_workinfo(sdata_t *sdata, const workbase_t *wb)
 			json_t *json_msg = json_deep_copy(wb_val);
 
 			json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-			client_msg = ckalloc(sizeof(ckmsg_t));
-			msg = ckzalloc(sizeof(smsg_t));
+			client_msg = ckmsg_alloc();
+			msg = slab_zalloc(smsg_slab);
 			msg->json_msg = json_msg;
 			msg->client_id = client->id;
 			client_msg->data = msg;
@@ -976,6 +1251,10 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	ts_realtime(&wb->gentime);
 	wb->network_diff = diff_from_nbits(wb->headerbin + 72);
 
+	sha256_init(&wb->coinb1ctx);
+	sha256_update(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
+	sha256_update(&wb->coinb1ctx, wb->enonce1constbin, wb->enonce1constlen);
+
 	len = strlen(ckp->logdir) + 8 + 1 + 16 + 1;
 	wb->logdir = ckzalloc(len);
 
@@ -1005,6 +1284,15 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 			LOGERR("Failed to create log directory %s", wb->logdir);
 	}
 	sprintf(wb->idstring, "%016lx", wb->id);
+	/* Render the notify lines every client will be sent now that we have
+	 * the job id */
+	for (ret = 0; ret < 2; ret++) {
+		json_t *val = __stratum_notify(wb, ret);
+
+		wb->notify[ret] = json_dumps(val, JSON_EOL | JSON_COMPACT);
+		wb->notifylen[ret] = strlen(wb->notify[ret]);
+		json_decref(val);
+	}
 	if (ckp->logshares)
 		sprintf(wb->logdir, "%s%08x/%s", ckp->logdir, wb->height, wb->idstring);
 
@@ -1047,7 +1335,7 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 /* Mandatory send_recv to the generator which sets the message priority if this
  * message is higher priority. Races galore on gen_priority mean this might
  * read the wrong priority but occasional wrong values are harmless. */
-static char *__send_recv_generator(ckpool_t *ckp, const char *msg, const int prio)
+static char *__send_recv_generator(ckpool_t *ckp, const char *msg, const int prio, uint32_t *len)
 {
 	sdata_t *sdata = ckp->data;
 	char *buf = NULL;
@@ -1058,9 +1346,13 @@ static char *__send_recv_generator(ckpool_t *ckp, const char *msg, const int pri
 		set = true;
 	} else
 		set = false;
-	buf = _send_recv_proc(ckp->generator, msg, UNIX_WRITE_TIMEOUT, RPC_TIMEOUT, __FILE__, __func__, __LINE__);
-	if (unlikely(!buf))
+	buf = _send_recv_proc_buf(ckp->generator, msg, UNIX_WRITE_TIMEOUT, RPC_TIMEOUT, len,
+				  __FILE__, __func__, __LINE__);
+	if (unlikely(!buf)) {
 		buf = strdup("failed");
+		if (len)
+			*len = strlen(buf);
+	}
 	if (set)
 		sdata->gen_priority = 0;
 
@@ -1070,13 +1362,13 @@ static char *__send_recv_generator(ckpool_t *ckp, const char *msg, const int pri
 /* Conditionally send_recv a message only if it's equal or higher priority than
  * any currently being serviced. NULL is returned if the request is not
  * processed for priority reasons, "failed" for an actual failure. */
-static char *send_recv_generator(ckpool_t *ckp, const char *msg, const int prio)
+static char *send_recv_generator(ckpool_t *ckp, const char *msg, const int prio, uint32_t *len)
 {
 	sdata_t *sdata = ckp->data;
 	char *buf = NULL;
 
 	if (prio >= sdata->gen_priority)
-		buf = __send_recv_generator(ckp, msg, prio);
+		buf = __send_recv_generator(ckp, msg, prio, len);
 	return buf;
 }
 
@@ -1096,36 +1388,120 @@ static void send_generator(const ckpool_t *ckp, const char *msg, const int prio)
 }
 
 struct update_req {
-	pthread_t *pth;
-	ckpool_t *ckp;
 	int prio;
+	tv_t queued;
 };
 
 static void broadcast_ping(sdata_t *sdata);
 
-/* This function assumes it will only receive a valid json gbt base template
- * since checking should have been done earlier, and creates the base template
- * for generating work templates. */
-static void *do_update(void *arg)
+/* Map the gbtbin_t image the generator sends for getbinbase into a new
+ * workbase without any intermediate parsing. */
+static workbase_t *decode_base(ckpool_t *ckp, const char *buf, const uint32_t len)
+{
+	const gbtbin_t *bin = (const gbtbin_t *)buf;
+	const char *ofs;
+	workbase_t *wb;
+	int i;
+
+	if (unlikely(len < sizeof(gbtbin_t) || bin->len != len)) {
+		LOGERR("Invalid %u byte binary base received from generator", len);
+		return NULL;
+	}
+	if (unlikely(bin->magic != GBTBIN_MAGIC || bin->merkles < 0 || bin->merkles > 16 ||
+		     bin->len != sizeof(gbtbin_t) + bin->flagslen + bin->txn_binlen + bin->txn_hasheslen ||
+		     !bin->flagslen || (bin->transactions && (!bin->txn_binlen || !bin->txn_hasheslen)))) {
+		LOGERR("Invalid binary base received from generator");
+		return NULL;
+	}
+
+	wb = ckzalloc(sizeof(workbase_t));
+	wb->ckp = ckp;
+	memcpy(wb->target, bin->target, sizeof(wb->target));
+	wb->diff = bin->diff;
+	wb->version = bin->version;
+	wb->curtime = bin->curtime;
+	memcpy(wb->prevhash, bin->prevhash, sizeof(wb->prevhash));
+	memcpy(wb->ntime, bin->ntime, sizeof(wb->ntime));
+	wb->ntime32 = bin->curtime;
+	memcpy(wb->bbversion, bin->bbversion, sizeof(wb->bbversion));
+	memcpy(wb->nbit, bin->nbit, sizeof(wb->nbit));
+	wb->coinbasevalue = bin->coinbasevalue;
+	wb->height = bin->height;
+
+	ofs = buf + sizeof(gbtbin_t);
+	wb->flags = ckalloc(bin->flagslen);
+	memcpy(wb->flags, ofs, bin->flagslen);
+	ofs += bin->flagslen;
+	wb->transactions = bin->transactions;
+	if (wb->transactions) {
+		wb->txn_binlen = bin->txn_binlen;
+		wb->txn_bin = ckalloc(wb->txn_binlen);
+		memcpy(wb->txn_bin, ofs, wb->txn_binlen);
+		ofs += wb->txn_binlen;
+		wb->txn_hashes = ckalloc(bin->txn_hasheslen);
+		memcpy(wb->txn_hashes, ofs, bin->txn_hasheslen);
+	} else
+		wb->txn_hashes = ckzalloc(1);
+
+	wb->merkles = bin->merkles;
+	memcpy(wb->merklehash, bin->merklehash, 68 * wb->merkles);
+	memcpy(wb->merklebin, bin->merklebin, 32 * wb->merkles);
+	wb->merkle_array = json_array();
+	for (i = 0; i < wb->merkles; i++)
+		json_array_append_new(wb->merkle_array, json_string_nocheck(&wb->merklehash[i][0]));
+	return wb;
+}
+
+/* Record how long each stage of an update took, timed by the array of
+ * UPDATE_STAGES + 1 timestamps, and log them if they're of interest. */
+static void update_timing(sdata_t *sdata, tv_t *tv, const bool new_block)
+{
+	update_times_t *times = &sdata->update_times;
+	char stages[256];
+	int i, ofs = 0;
+	double total;
+
+	mutex_lock(&sdata->stats_lock);
+	times->updates++;
+	for (i = 0; i < UPDATE_STAGES; i++) {
+		times->last[i] = us_tvdiff(&tv[i + 1], &tv[i]);
+		if (times->last[i] > times->max[i])
+			times->max[i] = times->last[i];
+		ofs += snprintf(stages + ofs, sizeof(stages) - ofs, " %s %.3f", update_stages[i],
+				times->last[i] / 1000);
+	}
+	mutex_unlock(&sdata->stats_lock);
+
+	total = us_tvdiff(&tv[UPDATE_STAGES], &tv[0]) / 1000;
+	if (new_block)
+		LOGNOTICE("Block change update took %.3fms:%s", total, stages);
+	else
+		LOGINFO("Update took %.3fms:%s", total, stages);
+}
+
+/* Serviced by the single updater thread so access to getbase is serialised
+ * to avoid out of order new block notifies. This function assumes it will
+ * only receive a valid gbt base template since checking should have been
+ * done earlier, and creates the base template for generating work
+ * templates. */
+static void do_update(ckpool_t *ckp, struct update_req *ur)
 {
-	struct update_req *ur = (struct update_req *)arg;
 	int prio = ur->prio, retries = 0;
-	ckpool_t *ckp = ur->ckp;
+	tv_t tv[UPDATE_STAGES + 1];
 	sdata_t *sdata = ckp->data;
 	bool new_block = false;
 	bool ret = false;
 	workbase_t *wb;
+	uint32_t len;
 	time_t now_t;
-	json_t *val;
 	char *buf;
 
-	pthread_detach(pthread_self());
-	rename_proc("updater");
-
-	/* Serialise access to getbase to avoid out of order new block notifies */
-	cksem_wait(&sdata->update_sem);
+	tv[UPDATE_QUEUED] = ur->queued;
+	free(ur);
+	__atomic_sub_fetch(&sdata->update_pending, 1, __ATOMIC_RELEASE);
+	tv_time(&tv[UPDATE_GETBASE]);
 retry:
-	buf = send_recv_generator(ckp, "getbase", prio);
+	buf = send_recv_generator(ckp, "getbinbase", prio, &len);
 	if (unlikely(!buf)) {
 		LOGNOTICE("Get base in update_base delayed due to higher priority request");
 		goto out;
@@ -1133,6 +1509,7 @@ retry:
 	if (unlikely(cmdmatch(buf, "failed"))) {
 		if (retries++ < 5 || prio == GEN_PRIORITY) {
 			LOGWARNING("Generator returned failure in update_base, retry #%d", retries);
+			dealloc(buf);
 			goto retry;
 		}
 		LOGWARNING("Generator failed in update_base after retrying");
@@ -1141,44 +1518,15 @@ retry:
 	if (unlikely(retries))
 		LOGWARNING("Generator succeeded in update_base after retrying");
 
-	wb = ckzalloc(sizeof(workbase_t));
-	wb->ckp = ckp;
-	val = json_loads(buf, 0, NULL);
-
-	json_strcpy(wb->target, val, "target");
-	json_dblcpy(&wb->diff, val, "diff");
-	json_uintcpy(&wb->version, val, "version");
-	json_uintcpy(&wb->curtime, val, "curtime");
-	json_strcpy(wb->prevhash, val, "prevhash");
-	json_strcpy(wb->ntime, val, "ntime");
-	sscanf(wb->ntime, "%x", &wb->ntime32);
-	json_strcpy(wb->bbversion, val, "bbversion");
-	json_strcpy(wb->nbit, val, "nbit");
-	json_uint64cpy(&wb->coinbasevalue, val, "coinbasevalue");
-	json_intcpy(&wb->height, val, "height");
-	json_strdup(&wb->flags, val, "flags");
-	json_intcpy(&wb->transactions, val, "transactions");
-	if (wb->transactions) {
-		json_strdup(&wb->txn_data, val, "txn_data");
-		json_strdup(&wb->txn_hashes, val, "txn_hashes");
-	} else
-		wb->txn_hashes = ckzalloc(1);
-	json_intcpy(&wb->merkles, val, "merkles");
-	wb->merkle_array = json_array();
-	if (wb->merkles) {
-		json_t *arr;
-		int i;
+	tv_time(&tv[UPDATE_DECODE]);
+	wb = decode_base(ckp, buf, len);
+	if (unlikely(!wb))
+		goto out;
 
-		arr = json_object_get(val, "merklehash");
-		for (i = 0; i < wb->merkles; i++) {
-			strcpy(&wb->merklehash[i][0], json_string_value(json_array_get(arr, i)));
-			hex2bin(&wb->merklebin[i][0], &wb->merklehash[i][0], 32);
-			json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[i][0]));
-		}
-	}
-	json_decref(val);
+	tv_time(&tv[UPDATE_COINBASE]);
 	generate_coinbase(ckp, wb);
 
+	tv_time(&tv[UPDATE_ADDBASE]);
 	add_base(ckp, sdata, wb, &new_block);
 	/* Reset the update time to avoid stacked low priority notifies. Bring
 	 * forward the next notify in case of a new block. */
@@ -1189,12 +1537,13 @@ retry:
 
 	if (new_block)
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
+	tv_time(&tv[UPDATE_BROADCAST]);
 	stratum_broadcast_update(sdata, wb, new_block);
+	tv_time(&tv[UPDATE_STAGES]);
 	ret = true;
 	LOGINFO("Broadcast updated stratum base");
+	update_timing(sdata, tv, new_block);
 out:
-	cksem_post(&sdata->update_sem);
-
 	/* Send a ping to miners if we fail to get a base to keep them
 	 * connected while bitcoind recovers(?) */
 	if (unlikely(!ret)) {
@@ -1202,9 +1551,6 @@ out:
 		broadcast_ping(sdata);
 	}
 	dealloc(buf);
-	free(ur->pth);
-	free(ur);
-	return NULL;
 }
 
 static void add_node_base(ckpool_t *ckp, json_t *val)
@@ -1230,8 +1576,18 @@ static void add_node_base(ckpool_t *ckp, json_t *val)
 	json_intcpy(&wb->height, val, "height");
 	json_strdup(&wb->flags, val, "flags");
 	json_intcpy(&wb->transactions, val, "transactions");
-	if (wb->transactions)
-		json_strdup(&wb->txn_data, val, "txn_data");
+	if (wb->transactions) {
+		const char *txn_data = json_string_value(json_object_get(val, "txn_data"));
+
+		wb->txn_binlen = txn_data ? strlen(txn_data) / 2 : 0;
+		if (unlikely(!wb->txn_binlen)) {
+			LOGWARNING("Missing txn_data in node workinfo");
+			wb->transactions = 0;
+		} else {
+			wb->txn_bin = ckalloc(wb->txn_binlen);
+			hex2bin(wb->txn_bin, txn_data, wb->txn_binlen);
+		}
+	}
 	json_intcpy(&wb->merkles, val, "merkles");
 	wb->merkle_array = json_object_dup(val, "merklehash");
 	for (i = 0; i < wb->merkles; i++) {
@@ -1264,33 +1620,42 @@ static void add_node_base(ckpool_t *ckp, json_t *val)
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
 }
 
-/* Calculate share diff and fill in hash and swap */
-static double
-share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
-	   const uint32_t ntime32, const char *nonce, uchar *hash, uchar *swap, int *cblen)
+/* Assemble the coinbase for a share and return its length */
+static int share_coinbase(char *coinbase, const uchar *enonce1bin, const workbase_t *wb,
+			  const char *nonce2)
+{
+	int cblen;
+
+	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
+	cblen = wb->coinb1len;
+	memcpy(coinbase + cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
+	cblen += wb->enonce1constlen + wb->enonce1varlen;
+	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
+	cblen += wb->enonce2varlen;
+	memcpy(coinbase + cblen, wb->coinb2bin, wb->coinb2len);
+	cblen += wb->coinb2len;
+
+	return cblen;
+}
+
+/* We can continue from the cached coinb1 midstate and only hash the part of
+ * the coinbase unique to a share unless the client's enonce1 predates this
+ * workbase's constant enonce1. */
+static inline bool coinb1_midstate(const uchar *enonce1bin, const workbase_t *wb)
+{
+	return likely(!memcmp(enonce1bin, wb->enonce1constbin, wb->enonce1constlen));
+}
+
+/* Build the block header from the cached header binary with the merkle root,
+ * which is in the first 32 bytes of merkle_sha, ntime and nonce inserted and
+ * byte swap it into swap ready for hashing. */
+static void share_header(const workbase_t *wb, uchar *merkle_sha, const uint32_t ntime32,
+			 const char *nonce, uchar *swap)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
 	uint32_t *data32, *swap32, benonce32;
-	uchar hash1[32];
+	unsigned char merkle_root[32];
 	char data[80];
-	int i;
 
-	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-	*cblen = wb->coinb1len;
-	memcpy(coinbase + *cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
-	*cblen += wb->enonce1constlen + wb->enonce1varlen;
-	hex2bin(coinbase + *cblen, nonce2, wb->enonce2varlen);
-	*cblen += wb->enonce2varlen;
-	memcpy(coinbase + *cblen, wb->coinb2bin, wb->coinb2len);
-	*cblen += wb->coinb2len;
-
-	gen_hash((uchar *)coinbase, merkle_root, *cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
 	data32 = (uint32_t *)merkle_sha;
 	swap32 = (uint32_t *)merkle_root;
 	flip_32(swap32, data32);
@@ -1308,10 +1673,40 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	data32 = (uint32_t *)(data + 68);
 	*data32 = htobe32(ntime32);
 
-	/* Hash the share */
 	data32 = (uint32_t *)data;
 	swap32 = (uint32_t *)swap;
 	flip_80(swap32, data32);
+}
+
+/* Calculate share diff and fill in hash and swap */
+static double
+share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
+	   const uint32_t ntime32, const char *nonce, uchar *hash, uchar *swap, int *cblen)
+{
+	unsigned char merkle_root[32], merkle_sha[64];
+	uchar hash1[32];
+	sha256_ctx ctx;
+	int i, ofs;
+
+	*cblen = share_coinbase(coinbase, enonce1bin, wb, nonce2);
+
+	if (coinb1_midstate(enonce1bin, wb)) {
+		ofs = wb->coinb1len + wb->enonce1constlen;
+		memcpy(&ctx, &wb->coinb1ctx, sizeof(ctx));
+		sha256_update(&ctx, (uchar *)coinbase + ofs, *cblen - ofs);
+		sha256_final(&ctx, hash1);
+		sha256(hash1, 32, merkle_root);
+	} else
+		gen_hash((uchar *)coinbase, merkle_root, *cblen);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < wb->merkles; i++) {
+		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+
+	/* Hash the share */
+	share_header(wb, merkle_sha, ntime32, nonce, swap);
 	sha256(swap, 80, hash1);
 	sha256(hash1, 32, hash);
 
@@ -1319,6 +1714,64 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	return diff_from_target(hash);
 }
 
+/* Double sha256 n equal length buffers side by side, continuing the first
+ * pass from the contexts passed in. */
+static void gen_hash_multi(sha256_ctx *ctx[], const uchar *data[], const int len,
+			   uchar *hash[], const int n)
+{
+	uchar hash1[SHARE_BATCH][32], *hash1p[SHARE_BATCH];
+	int i;
+
+	for (i = 0; i < n; i++)
+		hash1p[i] = hash1[i];
+	sha256_multi(ctx, data, len, hash1p, n);
+	for (i = 0; i < n; i++)
+		sha256_init(ctx[i]);
+	sha256_multi(ctx, (const uchar **)hash1p, 32, hash, n);
+}
+
+/* As share_diff for up to SHARE_BATCH shares with their coinbases already
+ * assembled, all on the one workbase and able to use its coinb1 midstate. */
+static void share_diff_multi(share_hash_t *sh[], const workbase_t *wb, const int n)
+{
+	sha256_ctx ctxs[SHARE_BATCH], *ctx[SHARE_BATCH];
+	uchar merkle_sha[SHARE_BATCH][64];
+	const uchar *data[SHARE_BATCH];
+	uchar *root[SHARE_BATCH];
+	int i, j, ofs;
+
+	ofs = wb->coinb1len + wb->enonce1constlen;
+	for (i = 0; i < n; i++) {
+		memcpy(&ctxs[i], &wb->coinb1ctx, sizeof(sha256_ctx));
+		ctx[i] = &ctxs[i];
+		data[i] = (uchar *)sh[i]->coinbase + ofs;
+		root[i] = merkle_sha[i];
+	}
+	gen_hash_multi(ctx, data, sh[0]->cblen - ofs, root, n);
+
+	for (j = 0; j < wb->merkles; j++) {
+		for (i = 0; i < n; i++) {
+			memcpy(merkle_sha[i] + 32, &wb->merklebin[j], 32);
+			sha256_init(ctx[i]);
+			data[i] = merkle_sha[i];
+		}
+		gen_hash_multi(ctx, data, 64, root, n);
+	}
+
+	for (i = 0; i < n; i++) {
+		share_header(wb, merkle_sha[i], sh[i]->ntime32, sh[i]->nonce, sh[i]->swap);
+		sha256_init(ctx[i]);
+		data[i] = sh[i]->swap;
+		root[i] = sh[i]->hash;
+	}
+	gen_hash_multi(ctx, data, 80, root, n);
+
+	for (i = 0; i < n; i++) {
+		sh[i]->sdiff = diff_from_target(sh[i]->hash);
+		sh[i]->hashed = true;
+	}
+}
+
 /* passthrough subclients have client_ids in the high bits */
 static inline bool passthrough_subclient(const int64_t client_id)
 {
@@ -1360,8 +1813,8 @@ static void send_node_block(sdata_t *sdata, const char *enonce1, const char *non
 			if (client->id == skip)
 				continue;
 			json_msg = json_deep_copy(val);
-			client_msg = ckalloc(sizeof(ckmsg_t));
-			msg = ckzalloc(sizeof(smsg_t));
+			client_msg = ckmsg_alloc();
+			msg = slab_zalloc(smsg_slab);
 			msg->json_msg = json_msg;
 			msg->client_id = client->id;
 			client_msg->data = msg;
@@ -1386,7 +1839,8 @@ process_block(ckpool_t *ckp, const workbase_t *wb, const char *coinbase, const i
 	char *gbt_block, varint[12];
 	char hexcoinbase[1024];
 
-	gbt_block = ckalloc(1024);
+	/* Transactions are only hex encoded here, when there's a block */
+	gbt_block = ckalloc(256 + cblen * 2 + wb->txn_binlen * 2);
 	flip_32(swap32, hash);
 	__bin2hex(blockhash, swap32, 32);
 
@@ -1412,7 +1866,7 @@ process_block(ckpool_t *ckp, const workbase_t *wb, const char *coinbase, const i
 	__bin2hex(hexcoinbase, coinbase, cblen);
 	strcat(gbt_block, hexcoinbase);
 	if (wb->transactions)
-		realloc_strcat(&gbt_block, wb->txn_data);
+		__bin2hex(gbt_block + strlen(gbt_block), wb->txn_bin, wb->txn_binlen);
 	send_generator(ckp, gbt_block, GEN_PRIORITY);
 	free(gbt_block);
 
@@ -1516,13 +1970,18 @@ out:
 
 static void update_base(ckpool_t *ckp, const int prio)
 {
-	struct update_req *ur = ckalloc(sizeof(struct update_req));
-	pthread_t *pth = ckalloc(sizeof(pthread_t));
+	sdata_t *sdata = ckp->data;
+	struct update_req *ur;
 
-	ur->pth = pth;
-	ur->ckp = ckp;
+	/* Any update already queued will fetch the latest template so don't
+	 * stack normal priority ones up behind it */
+	if (prio == GEN_NORMAL && __atomic_load_n(&sdata->update_pending, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_add_fetch(&sdata->update_pending, 1, __ATOMIC_RELEASE);
+	ur = ckalloc(sizeof(struct update_req));
 	ur->prio = prio;
-	create_pthread(pth, do_update, ur);
+	tv_time(&ur->queued);
+	ckmsgq_add(sdata->updateq, ur);
 }
 
 /* Instead of removing the client instance, we add it to a list of recycled
@@ -1589,12 +2048,56 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 	sdata->disconnected_generated++;
 }
 
+/* Put an authorised client on the subscriber lists broadcasts are sent to.
+ * Enter with the ckp sdata instance_lock held write. */
+static void __add_subscriber(sdata_t *ckp_sdata, stratum_instance_t *client)
+{
+	sdata_t *sdata = client->sdata;
+
+	if (client->listening || client->node || client->remote)
+		return;
+	client->listening = true;
+	client->sub_sdata = sdata;
+	DL_APPEND2(ckp_sdata->subscribers, client, sub_prev, sub_next);
+	ckp_sdata->subscriber_count++;
+	if (sdata != ckp_sdata) {
+		DL_APPEND2(sdata->subscribers, client, psub_prev, psub_next);
+		sdata->subscriber_count++;
+	}
+}
+
+/* Enter with the ckp sdata instance_lock held write. */
+static void __del_subscriber(sdata_t *ckp_sdata, stratum_instance_t *client)
+{
+	sdata_t *sdata = client->sub_sdata;
+
+	if (!client->listening)
+		return;
+	client->listening = false;
+	DL_DELETE2(ckp_sdata->subscribers, client, sub_prev, sub_next);
+	ckp_sdata->subscriber_count--;
+	if (sdata != ckp_sdata) {
+		DL_DELETE2(sdata->subscribers, client, psub_prev, psub_next);
+		sdata->subscriber_count--;
+	}
+	client->sub_sdata = NULL;
+}
+
+static void add_subscriber(sdata_t *ckp_sdata, stratum_instance_t *client)
+{
+	ck_wlock(&ckp_sdata->instance_lock);
+	if (!client->dropped)
+		__add_subscriber(ckp_sdata, client);
+	ck_wunlock(&ckp_sdata->instance_lock);
+}
+
 /* Removes a client instance we know is on the stratum_instances list and from
  * the user client list if it's been placed on it */
 static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 {
 	user_instance_t *user = client->user_instance;
 
+	__del_subscriber(client->ckp->data, client);
 	HASH_DEL(sdata->stratum_instances, client);
 	if (user) {
 		DL_DELETE(user->clients, client);
@@ -1611,10 +2114,19 @@ static void connector_drop_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->connector, buf);
 }
 
-static void drop_allclients(ckpool_t *ckp)
+/* Have the connector tell a client its message wasn't json and drop it */
+static void connector_invalid_json(ckpool_t *ckp, const int64_t id)
 {
-	stratum_instance_t *client, *tmp;
-	sdata_t *sdata = ckp->data;
+	char buf[256];
+
+	snprintf(buf, 255, "invalidjson=%"PRId64, id);
+	send_proc(ckp->connector, buf);
+}
+
+static void drop_allclients(ckpool_t *ckp)
+{
+	stratum_instance_t *client, *tmp;
+	sdata_t *sdata = ckp->data;
 	int kills = 0;
 
 	ck_wlock(&sdata->instance_lock);
@@ -1657,8 +2169,8 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 
 	/* Give the sbuproxy its own workbase list and lock */
 	cklock_init(&dsdata->workbase_lock);
-	cksem_init(&dsdata->update_sem);
-	cksem_post(&dsdata->update_sem);
+	cklock_init(&dsdata->share_lock);
+	mutex_init(&dsdata->postponed_lock);
 	return dsdata;
 }
 
@@ -2585,76 +3097,91 @@ static void connector_test_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->connector, buf);
 }
 
-/* For creating a list of sends without locking that can then be concatenated
- * to the stratum_sends list. Minimises locking and avoids taking recursive
- * locks. Sends only to sdata bound clients (everyone in ckpool) */
-static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
+/* Broadcast either json val or a message already serialised into line of
+ * len bytes, taking ownership of whichever is passed. */
+static void __stratum_broadcast(sdata_t *sdata, json_t *val, char *line, const int len,
+				const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	sdata_t *ckp_sdata = ckp->data;
-	stratum_instance_t *client, *tmp;
 	ckmsg_t *bulk_send = NULL;
-	time_t now_t = time(NULL);
-	int messages = 0;
+	stratum_instance_t *client;
+	int messages = 0, clients = 0;
+	int64_t *client_ids;
 
-	if (unlikely(!val)) {
+	if (unlikely(!val && !line)) {
 		LOGERR("Sent null json to stratum_broadcast");
 		return;
 	}
 
 	if (ckp->node) {
 		json_decref(val);
+		free(line);
 		return;
 	}
 
-	/* Use this locking as an opportunity to test other clients. */
+	/* Only walk the authorised subscribers of this sdata, leaving the
+	 * housekeeping of the rest of the clients to the client reaper. */
 	ck_rlock(&ckp_sdata->instance_lock);
-	HASH_ITER(hh, ckp_sdata->stratum_instances, client, tmp) {
+	client_ids = ckalloc(sizeof(int64_t) * (sdata->subscriber_count + 1));
+	client = sdata->subscribers;
+	while (client) {
+		stratum_instance_t *next;
 		ckmsg_t *client_msg;
 		smsg_t *msg;
 
-		if (sdata != ckp_sdata && client->sdata != sdata)
-			continue;
-
-		/* Look for clients that may have been dropped which the stratifer has
-		* not been informed about and ask the connector of they still exist */
-		if (client->dropped) {
-			connector_test_client(ckp, client->id);
-			continue;
-		}
-
-		if (client->node || client->remote)
-			continue;
-
-		/* Test for clients that haven't authed in over a minute and drop them */
-		if (!client->authorised) {
-			if (now_t > client->start_time + 60) {
-				client->dropped = true;
-				connector_drop_client(ckp, client->id);
-			}
-			continue;
-		}
+		if (sdata == ckp_sdata)
+			next = client->sub_next;
+		else
+			next = client->psub_next;
 
 		if (!client_active(client))
-			continue;
+			goto next;
 
 		/* Only send messages to whitelisted clients */
 		if (msg_type == SM_MSG && !client->messages)
-			continue;
+			goto next;
+
+		/* Regular clients all receive the same message so they're
+		 * sent as a single broadcast the connector fans out. */
+		if (likely(!passthrough_subclient(client->id))) {
+			client_ids[clients++] = client->id;
+			goto next;
+		}
 
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
-		if (passthrough_subclient(client->id))
-			json_set_string(val, "node.method", stratum_msgs[msg_type]);
-		msg->json_msg = json_deep_copy(val);
+		client_msg = ckmsg_alloc();
+		msg = slab_zalloc(smsg_slab);
+		if (val)
+			msg->json_msg = json_deep_copy(val);
+		else
+			msg->json_msg = json_loads(line, 0, NULL);
+		json_set_string(msg->json_msg, "node.method", stratum_msgs[msg_type]);
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
 		messages++;
+next:
+		client = next;
 	}
 	ck_runlock(&ckp_sdata->instance_lock);
 
-	json_decref(val);
+	if (likely(clients)) {
+		ckmsg_t *client_msg = ckmsg_alloc();
+		smsg_t *msg = slab_zalloc(smsg_slab);
+
+		msg->json_msg = val;
+		msg->line = line;
+		msg->len = len;
+		msg->client_ids = client_ids;
+		msg->clients = clients;
+		client_msg->data = msg;
+		DL_PREPEND(bulk_send, client_msg);
+		messages++;
+	} else {
+		free(client_ids);
+		json_decref(val);
+		free(line);
+	}
 
 	if (likely(bulk_send))
 		ssend_bulk_append(sdata, bulk_send, messages);
@@ -2662,8 +3189,15 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		send_postponed(sdata);
 }
 
-static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
-			     const int msg_type)
+static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
+{
+	__stratum_broadcast(sdata, val, NULL, 0, msg_type);
+}
+
+/* Queue a message to a client, with received being the monotonic_ns the
+ * connector read the message it answers where its latency is tracked */
+static void stratum_add_timed_send(sdata_t *sdata, json_t *val, const int64_t client_id,
+				   const int msg_type, const int64_t received)
 {
 	smsg_t *msg;
 	ckpool_t *ckp = sdata->ckp;
@@ -2678,9 +3212,42 @@ static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_i
 	if (passthrough_subclient(client_id))
 		json_set_string(val, "node.method", stratum_msgs[msg_type]);
 	LOGDEBUG("Sending stratum message %s", stratum_msgs[msg_type]);
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = slab_zalloc(smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client_id;
+	if (received) {
+		msg->received = received;
+		msg->queued = monotonic_ns();
+	}
+	ckmsgq_add(sdata->ssends, msg);
+}
+
+static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
+			     const int msg_type)
+{
+	stratum_add_timed_send(sdata, val, client_id, msg_type, 0);
+}
+
+/* As stratum_add_send but for a message already serialised into line of len
+ * bytes, taking ownership of it. It is sent as a broadcast to one client so
+ * the connector passes the bytes through untouched. */
+static void stratum_add_send_line(sdata_t *sdata, char *line, const int len,
+				  const int64_t client_id)
+{
+	ckpool_t *ckp = sdata->ckp;
+	smsg_t *msg;
+
+	if (ckp->node) {
+		free(line);
+		return;
+	}
+
+	msg = slab_zalloc(smsg_slab);
+	msg->line = line;
+	msg->len = len;
+	msg->client_ids = ckalloc(sizeof(int64_t));
+	msg->client_ids[0] = client_id;
+	msg->clients = 1;
 	ckmsgq_add(sdata->ssends, msg);
 }
 
@@ -2784,25 +3351,48 @@ static user_instance_t *user_by_workername(sdata_t *sdata, const char *workernam
 
 static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername);
 
+/* A rolling average with the diff still pending folded in as of the last
+ * share, as it would read had that share been decayed, for reporting without
+ * modifying the average */
+static double fold_dsps(const double dsps, const double pending, const tv_t *last_share,
+			const tv_t *last_decay, const double interval)
+{
+	tv_t end, start;
+	double ret = dsps, tdiff;
+
+	if (!pending)
+		return ret;
+	copy_tv(&end, last_share);
+	copy_tv(&start, last_decay);
+	tdiff = tvdiff(&end, &start);
+	if (tdiff < 0.001)
+		tdiff = 0.001;
+	decay_time(&ret, pending, tdiff, interval);
+	return ret;
+}
+
+#define FOLD_DSPS(INST, DSPS, INTERVAL) fold_dsps((INST)->DSPS, (INST)->pending_diff, \
+	&(INST)->last_share, &(INST)->last_decay, INTERVAL)
+
 static json_t *worker_stats(const worker_instance_t *worker)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
 	json_t *val;
 	double ghs;
 
-	ghs = worker->dsps1 * nonces;
+	ghs = FOLD_DSPS(worker, dsps1, MIN1) * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
 
-	ghs = worker->dsps5 * nonces;
+	ghs = FOLD_DSPS(worker, dsps5, MIN5) * nonces;
 	suffix_string(ghs, suffix5, 16, 0);
 
-	ghs = worker->dsps60 * nonces;
+	ghs = FOLD_DSPS(worker, dsps60, HOUR) * nonces;
 	suffix_string(ghs, suffix60, 16, 0);
 
-	ghs = worker->dsps1440 * nonces;
+	ghs = FOLD_DSPS(worker, dsps1440, DAY) * nonces;
 	suffix_string(ghs, suffix1440, 16, 0);
 
-	ghs = worker->dsps10080 * nonces;
+	ghs = FOLD_DSPS(worker, dsps10080, WEEK) * nonces;
 	suffix_string(ghs, suffix10080, 16, 0);
 
 	JSON_CPACK(val, "{ss,ss,ss,ss,ss}",
@@ -2820,19 +3410,19 @@ static json_t *user_stats(const user_instance_t *user)
 	json_t *val;
 	double ghs;
 
-	ghs = user->dsps1 * nonces;
+	ghs = FOLD_DSPS(user, dsps1, MIN1) * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
 
-	ghs = user->dsps5 * nonces;
+	ghs = FOLD_DSPS(user, dsps5, MIN5) * nonces;
 	suffix_string(ghs, suffix5, 16, 0);
 
-	ghs = user->dsps60 * nonces;
+	ghs = FOLD_DSPS(user, dsps60, HOUR) * nonces;
 	suffix_string(ghs, suffix60, 16, 0);
 
-	ghs = user->dsps1440 * nonces;
+	ghs = FOLD_DSPS(user, dsps1440, DAY) * nonces;
 	suffix_string(ghs, suffix1440, 16, 0);
 
-	ghs = user->dsps10080 * nonces;
+	ghs = FOLD_DSPS(user, dsps10080, WEEK) * nonces;
 	suffix_string(ghs, suffix10080, 16, 0);
 
 	JSON_CPACK(val, "{ss,ss,ss,ss,ss}",
@@ -3000,23 +3590,25 @@ static void broadcast_ping(sdata_t *sdata)
 
 static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
 {
-	int objects, generated;
+	ckmsgq_counters_t counters;
 	int64_t memsize;
-	ckmsg_t *msg;
 
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
-
-	memsize = (sizeof(ckmsg_t) + size) * objects;
-	JSON_CPACK(*val, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
+	ckmsgq_counters(ckmsgq, &counters);
+	memsize = (sizeof(ckmsg_t) + size) * counters.pending;
+	/* Latencies are in microseconds since the last stats */
+	JSON_CPACK(*val, "{si,si,sI,si,sI,sI}", "count", counters.pending, "memory", memsize,
+		   "generated", counters.messages, "maxcount", counters.maxpending,
+		   "latency", counters.avglatency / 1000, "maxlatency", counters.maxlatency / 1000);
+	if (ckmsgq->steal)
+		json_set_int64(*val, "stolen", counters.stolen);
 }
 
 static char *stratifier_stats(ckpool_t *ckp, sdata_t *sdata)
 {
 	json_t *val = json_object(), *subval;
-	int objects, generated;
+	logger_counters_t logc;
+	share_table_t *table, *tmptable;
+	int objects, generated, i;
 	int64_t memsize;
 	char *buf;
 
@@ -3049,11 +3641,25 @@ static char *stratifier_stats(ckpool_t *ckp, sdata_t *sdata)
 	json_set_object(val, "disconnected", subval);
 	ck_runlock(&sdata->instance_lock);
 
-	mutex_lock(&sdata->share_lock);
-	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
-	mutex_unlock(&sdata->share_lock);
+	generated = __atomic_load_n(&sdata->shares_generated, __ATOMIC_RELAXED);
+	objects = memsize = 0;
+	ck_rlock(&sdata->share_lock);
+	HASH_ITER(hh, sdata->share_tables, table, tmptable) {
+		memsize += sizeof(share_table_t);
+		for (i = 0; i < SHARE_SHARDS; i++) {
+			share_shard_t *shard = &table->shards[i];
+			share_slab_t *slab;
+
+			mutex_lock(&shard->lock);
+			objects += shard->count;
+			memsize += SAFE_HASH_OVERHEAD(shard->shares);
+			LL_FOREACH(shard->slabs, slab)
+				memsize += sizeof(share_slab_t);
+			mutex_unlock(&shard->lock);
+		}
+	}
+	memsize += SAFE_HASH_OVERHEAD(sdata->share_tables);
+	ck_runlock(&sdata->share_lock);
 
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "shares", subval);
@@ -3063,6 +3669,8 @@ static char *stratifier_stats(ckpool_t *ckp, sdata_t *sdata)
 	/* Don't know exactly how big the string is so just count the pointer for now */
 	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
 	json_set_object(val, "srecvs", subval);
+	ckmsgq_stats(sdata->sshareq, sizeof(json_params_t), &subval);
+	json_set_object(val, "sshareq", subval);
 	if (!CKP_STANDALONE(ckp)) {
 		ckmsgq_stats(sdata->ckdbq, sizeof(char *), &subval);
 		json_set_object(val, "ckdbq", subval);
@@ -3070,6 +3678,43 @@ static char *stratifier_stats(ckpool_t *ckp, sdata_t *sdata)
 	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
 	json_set_object(val, "stxnq", subval);
 
+	logger_counters(&logc);
+	JSON_CPACK(subval, "{sI,sI,sI,sI,sI,sI,si}", "pending", logc.pending, "memory", logc.memory,
+		   "written", logc.written, "dropped", logc.dropped, "truncated", logc.truncated,
+		   "overflowed", logc.overflowed, "rings", logc.rings);
+	json_set_object(val, "logger", subval);
+
+	mutex_lock(&sdata->stats_lock);
+	subval = json_object();
+	json_set_int64(subval, "updates", sdata->update_times.updates);
+	for (i = 0; i < UPDATE_STAGES; i++) {
+		json_t *stage;
+
+		JSON_CPACK(stage, "{sf,sf}", "last", sdata->update_times.last[i] / 1000,
+			   "max", sdata->update_times.max[i] / 1000);
+		json_set_object(subval, update_stages[i], stage);
+	}
+	mutex_unlock(&sdata->stats_lock);
+	json_set_object(val, "update", subval);
+
+	subval = json_object();
+	for (i = 0; i < SHARE_STAGES; i++) {
+		json_t *stage;
+
+		lhist_stats(&sdata->share_latency[i], &stage);
+		json_set_object(subval, share_stages[i], stage);
+	}
+	json_set_object(val, "latency", subval);
+
+	slab_stats(&subval);
+	json_set_object(val, "slabs", subval);
+
+	thread_stats(&subval);
+	json_set_object(val, "threads", subval);
+
+	json_set_string(val, "sha256", sha256_impl());
+	json_set_string(val, "sha256multi", sha256_multi_impl());
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	LOGNOTICE("Stratifier stats: %s", buf);
@@ -3125,8 +3770,9 @@ static json_t *userinfo(const user_instance_t *user)
 
 	JSON_CPACK(val, "{ss,si,si,sf,sf,sf,sf,sf,sf,si}",
 		   "user", user->username, "id", user->id, "workers", user->workers,
-	    "bestdiff", user->best_diff, "dsps1", user->dsps1, "dsps5", user->dsps5,
-	    "dsps60", user->dsps60, "dsps1440", user->dsps1440, "dsps10080", user->dsps10080,
+	    "bestdiff", user->best_diff, "dsps1", FOLD_DSPS(user, dsps1, MIN1),
+	    "dsps5", FOLD_DSPS(user, dsps5, MIN5), "dsps60", FOLD_DSPS(user, dsps60, HOUR),
+	    "dsps1440", FOLD_DSPS(user, dsps1440, DAY), "dsps10080", FOLD_DSPS(user, dsps10080, WEEK),
 	    "lastshare", user->last_share.tv_sec);
 	return val;
 }
@@ -3243,8 +3889,9 @@ static json_t *workerinfo(const user_instance_t *user, const worker_instance_t *
 
 	JSON_CPACK(val, "{ss,ss,si,sf,sf,sf,sf,si,sf,si,sb}",
 		   "user", user->username, "worker", worker->workername, "id", user->id,
-	    "dsps1", worker->dsps1, "dsps5", worker->dsps5, "dsps60", worker->dsps60,
-	    "dsps1440", worker->dsps1440, "lastshare", worker->last_share.tv_sec,
+	    "dsps1", FOLD_DSPS(worker, dsps1, MIN1), "dsps5", FOLD_DSPS(worker, dsps5, MIN5),
+	    "dsps60", FOLD_DSPS(worker, dsps60, HOUR), "dsps1440", FOLD_DSPS(worker, dsps1440, DAY),
+	    "lastshare", worker->last_share.tv_sec,
 	    "bestdiff", worker->best_diff, "mindiff", worker->mindiff, "idle", worker->idle);
 	return val;
 }
@@ -3330,11 +3977,11 @@ static json_t *clientinfo(const stratum_instance_t *client)
 	json_set_string(val, "enonce1var", client->enonce1var);
 	json_set_int(val, "enonce1_64", client->enonce1_64);
 	json_set_double(val, "diff", client->diff);
-	json_set_double(val, "dsps1", client->dsps1);
-	json_set_double(val, "dsps5", client->dsps5);
-	json_set_double(val, "dsps60", client->dsps60);
-	json_set_double(val, "dsps1440", client->dsps1440);
-	json_set_double(val, "dsps10080", client->dsps10080);
+	json_set_double(val, "dsps1", FOLD_DSPS(client, dsps1, MIN1));
+	json_set_double(val, "dsps5", FOLD_DSPS(client, dsps5, MIN5));
+	json_set_double(val, "dsps60", FOLD_DSPS(client, dsps60, HOUR));
+	json_set_double(val, "dsps1440", FOLD_DSPS(client, dsps1440, DAY));
+	json_set_double(val, "dsps10080", FOLD_DSPS(client, dsps10080, WEEK));
 	json_set_int(val, "lastshare", client->last_share.tv_sec);
 	json_set_int(val, "starttime", client->start_time);
 	json_set_string(val, "address", client->address);
@@ -3655,12 +4302,21 @@ retry:
 	} while (!umsg);
 
 	buf = umsg->buf;
-	if (likely(buf[0] == '{')) {
+	if (likely(buf[0] == CLIENT_ENVELOPE || buf[0] == '{')) {
 		/* The bulk of the messages will be received json from the
 		 * connector so look for this first. The srecv_process frees
 		 * the buf heap ram */
+		int64_t client_id = 0;
+
+		/* Keep each client's messages in order on the one queue */
+		if (buf[0] == CLIENT_ENVELOPE) {
+			client_envelope_t *env = (client_envelope_t *)buf;
+
+			memcpy(&client_id, buf + offsetof(client_envelope_t, client_id), sizeof(client_id));
+			env->queued = monotonic_ns();
+		}
 		Close(umsg->sockd);
-		ckmsgq_add(sdata->srecvs, umsg->buf);
+		ckmsgq_add_id(sdata->srecvs, umsg->buf, client_id);
 		umsg->buf = NULL;
 		goto retry;
 	}
@@ -3805,7 +4461,7 @@ static void *blockupdate(void *arg)
 
 	while (42) {
 		dealloc(buf);
-		buf = send_recv_generator(ckp, request, GEN_LAX);
+		buf = send_recv_generator(ckp, request, GEN_LAX, NULL);
 		if (buf && cmdmatch(buf, "notify"))
 			cksleep_ms(5000);
 		else if (buf && strcmp(buf, sdata->lastswaphash) && !cmdmatch(buf, "failed"))
@@ -4096,6 +4752,14 @@ static json_t *parse_subscribe(stratum_instance_t *client, const int64_t client_
 	}
 
 	client->sdata = sdata;
+	/* A client resubscribing after authorising moves onto the subscriber
+	 * list of the proxy it is now bound to */
+	if (unlikely(client->listening)) {
+		ck_wlock(&ckp_sdata->instance_lock);
+		__del_subscriber(ckp_sdata, client);
+		__add_subscriber(ckp_sdata, client);
+		ck_wunlock(&ckp_sdata->instance_lock);
+	}
 	if (ckp->proxy) {
 		LOGINFO("Current %d, selecting proxy %d:%d for client %"PRId64, ckp_sdata->proxy->id,
 			sdata->subproxy->id, sdata->subproxy->subid, client->id);
@@ -4135,7 +4799,7 @@ static bool test_address(ckpool_t *ckp, const char *address)
 
 	ASPRINTF(&msg, "checkaddr:%s", address);
 	/* Must wait for a response here */
-	buf = __send_recv_generator(ckp, msg, GEN_LAX);
+	buf = __send_recv_generator(ckp, msg, GEN_LAX, NULL);
 	dealloc(msg);
 	if (!buf)
 		return ret;
@@ -4185,10 +4849,14 @@ static double sane_tdiff(tv_t *end, tv_t *start)
 	return tdiff;
 }
 
+/* The decay functions fold any diff accumulated since the last decay along
+ * with diff into the decaying averages. */
 static void decay_client(stratum_instance_t *client, double diff, tv_t *now_t)
 {
 	double tdiff = sane_tdiff(now_t, &client->last_decay);
 
+	diff += client->pending_diff;
+	client->pending_diff = 0;
 	decay_time(&client->dsps1, diff, tdiff, MIN1);
 	decay_time(&client->dsps5, diff, tdiff, MIN5);
 	decay_time(&client->dsps60, diff, tdiff, HOUR);
@@ -4201,6 +4869,8 @@ static void decay_worker(worker_instance_t *worker, double diff, tv_t *now_t)
 {
 	double tdiff = sane_tdiff(now_t, &worker->last_decay);
 
+	diff += worker->pending_diff;
+	worker->pending_diff = 0;
 	decay_time(&worker->dsps1, diff, tdiff, MIN1);
 	decay_time(&worker->dsps5, diff, tdiff, MIN5);
 	decay_time(&worker->dsps60, diff, tdiff, HOUR);
@@ -4213,6 +4883,8 @@ static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
 {
 	double tdiff = sane_tdiff(now_t, &user->last_decay);
 
+	diff += user->pending_diff;
+	user->pending_diff = 0;
 	decay_time(&user->dsps1, diff, tdiff, MIN1);
 	decay_time(&user->dsps5, diff, tdiff, MIN5);
 	decay_time(&user->dsps60, diff, tdiff, HOUR);
@@ -4221,49 +4893,274 @@ static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
 	copy_tv(&user->last_decay, now_t);
 }
 
-/* Enter holding a reference count */
-static void read_userstats(ckpool_t *ckp, user_instance_t *user)
+/* On the share path only accumulate diff, running the exp() heavy decay no
+ * more than once every DECAY_QUANTUM per entity. Crediting the shares of one
+ * quantum together keeps the averages within ~0.02% of decaying them one at
+ * a time, well below the precision they're reported with. */
+static void add_client_diff(stratum_instance_t *client, const double diff, tv_t *now_t)
 {
-	int tvsec_diff = 0, ret;
-	char s[512];
-	json_t *val;
-	FILE *fp;
-	tv_t now;
+	client->pending_diff += diff;
+	if (tvdiff(now_t, &client->last_decay) >= DECAY_QUANTUM)
+		decay_client(client, 0, now_t);
+}
 
-	snprintf(s, 511, "%s/users/%s", ckp->logdir, user->username);
-	fp = fopen(s, "re");
-	if (!fp) {
-		LOGINFO("User %s does not have a logfile to read", user->username);
-		return;
+static void add_worker_diff(worker_instance_t *worker, const double diff, tv_t *now_t)
+{
+	worker->pending_diff += diff;
+	if (tvdiff(now_t, &worker->last_decay) >= DECAY_QUANTUM)
+		decay_worker(worker, 0, now_t);
+}
+
+static void add_user_diff(user_instance_t *user, const double diff, tv_t *now_t)
+{
+	user->pending_diff += diff;
+	if (tvdiff(now_t, &user->last_decay) >= DECAY_QUANTUM)
+		decay_user(user, 0, now_t);
+}
+
+/* Enter with store lock held */
+static bool __grow_stats_store(stats_store_t *store, const int64_t slots)
+{
+	size_t len = slots * STATS_SLOT;
+	char *map;
+
+	if (unlikely(ftruncate(store->fd, len))) {
+		LOGERR("Failed to grow stats store %s to %"PRId64" slots", store->fname, slots);
+		return false;
 	}
-	memset(s, 0, 512);
-	ret = fread(s, 1, 511, fp);
-	fclose(fp);
-	if (ret < 1) {
-		LOGINFO("Failed to read user %s logfile", user->username);
+	if (store->map)
+		map = mremap(store->map, store->slots * STATS_SLOT, len, MREMAP_MAYMOVE);
+	else
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+	if (unlikely(map == MAP_FAILED)) {
+		LOGERR("Failed to map stats store %s", store->fname);
+		return false;
+	}
+	store->map = map;
+	store->slots = slots;
+	return true;
+}
+
+static void decode_stats_record(stats_record_t *rec, json_t *val)
+{
+	rec->dsps1 = dsps_from_key(val, "hashrate1m");
+	rec->dsps5 = dsps_from_key(val, "hashrate5m");
+	rec->dsps60 = dsps_from_key(val, "hashrate1hr");
+	rec->dsps1440 = dsps_from_key(val, "hashrate1d");
+	rec->dsps10080 = dsps_from_key(val, "hashrate7d");
+	json_get_double(&rec->best_diff, val, "bestshare");
+	json_get_int64(&rec->lastupdate, val, "lastupdate");
+	json_get_int64(&rec->shares, val, "shares");
+}
+
+static stats_index_t *__index_stats_slot(stats_store_t *store, const char *name, const int64_t slot,
+					 const int64_t nslots)
+{
+	stats_index_t *index = ckzalloc(sizeof(stats_index_t));
+
+	index->name = strdup(name);
+	index->slot = slot;
+	index->nslots = nslots;
+	HASH_ADD_KEYPTR(hh, store->index, index->name, strlen(index->name), index);
+	return index;
+}
+
+/* Fill nslots slots from slot with a record s of len bytes padded with spaces
+ * to end in a newline, so each record is one line. */
+static void __fill_stats_slots(stats_store_t *store, const int64_t slot, const int64_t nslots,
+			       const char *s, const int len)
+{
+	char *start = store->map + slot * STATS_SLOT;
+	size_t size = nslots * STATS_SLOT;
+
+	memcpy(start, s, len);
+	memset(start + len, ' ', size - 1 - len);
+	start[size - 1] = '\n';
+}
+
+/* Write val as the record for name, adding the name to val. A record that
+ * has outgrown its slots is moved to the end of the store, blanking the
+ * slots it used to have. */
+static void write_stats_record(stats_store_t *store, const char *name, json_t *val)
+{
+	static time_t last_warned;
+	stats_index_t *index;
+	int64_t nslots;
+	char *s;
+	int len;
+
+	json_set_string(val, "name", name);
+	s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+	len = strlen(s);
+	/* Room for the record and its newline */
+	nslots = len / STATS_SLOT + 1;
+
+	mutex_lock(&store->lock);
+	if (unlikely(!store->map))
+		goto out_unlock;
+	if (unlikely(nslots > 1)) {
+		time_t now_t = time(NULL);
+
+		if (now_t - last_warned >= 60) {
+			last_warned = now_t;
+			LOGWARNING("Stats for %s too long at %d bytes for one slot in %s, spilling over %"PRId64" slots",
+				   name, len, store->fname, nslots);
+		}
+	}
+	HASH_FIND_STR(store->index, name, index);
+	if (!index || index->nslots < nslots) {
+		int64_t slots = store->used + nslots;
+
+		if (slots > store->slots &&
+		    !__grow_stats_store(store, (slots + STATS_GROW - 1) / STATS_GROW * STATS_GROW))
+			goto out_unlock;
+		if (index) {
+			__fill_stats_slots(store, index->slot, index->nslots, "", 0);
+			index->slot = store->used;
+			index->nslots = nslots;
+		} else
+			index = __index_stats_slot(store, name, store->used, nslots);
+		store->used += nslots;
+	}
+	decode_stats_record(&index->rec, val);
+	__fill_stats_slots(store, index->slot, index->nslots, s, len);
+out_unlock:
+	mutex_unlock(&store->lock);
+	free(s);
+}
+
+/* Move any legacy per entity files in the logdir directory dir that aren't
+ * in the store yet into it. Once imported only the directory listing is
+ * read on subsequent startups. */
+static void import_legacy_stats(const ckpool_t *ckp, stats_store_t *store, const char *dir)
+{
+	stats_index_t *index;
+	char path[512];
+	struct dirent *ent;
+	int imported = 0;
+	DIR *dp;
+
+	snprintf(path, 511, "%s/%s", ckp->logdir, dir);
+	dp = opendir(path);
+	if (!dp)
 		return;
+	while ((ent = readdir(dp))) {
+		json_t *val;
+
+		if (ent->d_name[0] == '.')
+			continue;
+		HASH_FIND_STR(store->index, ent->d_name, index);
+		if (index)
+			continue;
+		snprintf(path, 511, "%s/%s/%s", ckp->logdir, dir, ent->d_name);
+		val = json_load_file(path, 0, NULL);
+		if (unlikely(!json_is_object(val))) {
+			LOGWARNING("Invalid legacy stats file %s", path);
+			json_decref(val);
+			continue;
+		}
+		write_stats_record(store, ent->d_name, val);
+		json_decref(val);
+		imported++;
 	}
-	val = json_loads(s, 0, NULL);
-	if (!val) {
-		LOGINFO("Failed to json decode user %s logfile: %s", user->username, s);
+	closedir(dp);
+	if (imported)
+		LOGNOTICE("Imported %d legacy stats files from %s/%s into %s", imported,
+			  ckp->logdir, dir, store->fname);
+}
+
+/* Open or create the stats store fname in the logdir, bulk decoding every
+ * existing record into the index and importing any legacy per entity files
+ * from the logdir directory dir. */
+static stats_store_t *open_stats_store(const ckpool_t *ckp, const char *fname, const char *dir)
+{
+	stats_store_t *store = ckzalloc(sizeof(stats_store_t));
+	int64_t slots, i;
+	struct stat st;
+
+	mutex_init(&store->lock);
+	ASPRINTF(&store->fname, "%s/%s", ckp->logdir, fname);
+	store->fd = open(store->fname, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (unlikely(store->fd < 0 || fstat(store->fd, &st))) {
+		LOGERR("Failed to open stats store %s", store->fname);
+		goto out;
+	}
+	slots = (st.st_size + STATS_SLOT - 1) / STATS_SLOT;
+	slots = MAX(STATS_GROW, (slots + STATS_GROW - 1) / STATS_GROW * STATS_GROW);
+	if (unlikely(!__grow_stats_store(store, slots)))
+		goto out;
+
+	for (i = 0; i < store->slots; i++) {
+		char *start = store->map + i * STATS_SLOT, *end;
+		int64_t nslots = 1;
+		stats_index_t *index;
+		const char *name;
+		json_t *val;
+
+		if (*start != '{')
+			continue;
+		end = memchr(start, '\n', (store->slots - i) * STATS_SLOT);
+		if (likely(end))
+			nslots = (end - start) / STATS_SLOT + 1;
+		val = json_loadb(start, end ? end - start : STATS_SLOT, 0, NULL);
+		name = json_string_value(json_object_get(val, "name"));
+		if (likely(name)) {
+			index = __index_stats_slot(store, name, i, nslots);
+			decode_stats_record(&index->rec, val);
+			store->used = i + nslots;
+		} else
+			LOGWARNING("Invalid record %"PRId64" in stats store %s", i, store->fname);
+		json_decref(val);
+		/* Skip over any slots the record spilled into */
+		i += nslots - 1;
+	}
+	LOGINFO("Loaded %d records from stats store %s", HASH_COUNT(store->index), store->fname);
+	import_legacy_stats(ckp, store, dir);
+out:
+	return store;
+}
+
+/* Copy the decoded stats for name into rec, returning whether it has any */
+static bool read_stats_record(stats_store_t *store, const char *name, stats_record_t *rec)
+{
+	stats_index_t *index;
+
+	mutex_lock(&store->lock);
+	HASH_FIND_STR(store->index, name, index);
+	if (index)
+		memcpy(rec, &index->rec, sizeof(stats_record_t));
+	mutex_unlock(&store->lock);
+	return index != NULL;
+}
+
+/* Enter holding a reference count */
+static void read_userstats(ckpool_t *ckp, user_instance_t *user)
+{
+	sdata_t *sdata = ckp->data;
+	int tvsec_diff = 0;
+	stats_record_t rec;
+	tv_t now;
+
+	if (!read_stats_record(sdata->userstore, user->username, &rec)) {
+		LOGINFO("User %s does not have stats to read", user->username);
 		return;
 	}
 
 	tv_time(&now);
 	copy_tv(&user->last_share, &now);
 	copy_tv(&user->last_decay, &now);
-	user->dsps1 = dsps_from_key(val, "hashrate1m");
-	user->dsps5 = dsps_from_key(val, "hashrate5m");
-	user->dsps60 = dsps_from_key(val, "hashrate1hr");
-	user->dsps1440 = dsps_from_key(val, "hashrate1d");
-	user->dsps10080 = dsps_from_key(val, "hashrate7d");
-	json_get_int64(&user->last_update.tv_sec, val, "lastupdate");
-	json_get_int64(&user->shares, val, "shares");
-	json_get_double(&user->best_diff, val, "bestshare");
+	user->dsps1 = rec.dsps1;
+	user->dsps5 = rec.dsps5;
+	user->dsps60 = rec.dsps60;
+	user->dsps1440 = rec.dsps1440;
+	user->dsps10080 = rec.dsps10080;
+	user->last_update.tv_sec = rec.lastupdate;
+	user->shares = rec.shares;
+	user->stored_shares = user->shares;
+	user->best_diff = rec.best_diff;
 	LOGINFO("Successfully read user %s stats %f %f %f %f %f %f", user->username,
 		user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
 		user->dsps10080, user->best_diff);
-	json_decref(val);
 	if (user->last_update.tv_sec)
 		tvsec_diff = now.tv_sec - user->last_update.tv_sec - 60;
 	if (tvsec_diff > 60) {
@@ -4276,45 +5173,30 @@ static void read_userstats(ckpool_t *ckp, user_instance_t *user)
 /* Enter holding a reference count */
 static void read_workerstats(ckpool_t *ckp, worker_instance_t *worker)
 {
-	int tvsec_diff = 0, ret;
-	char s[512];
-	json_t *val;
-	FILE *fp;
+	sdata_t *sdata = ckp->data;
+	int tvsec_diff = 0;
+	stats_record_t rec;
 	tv_t now;
 
-	snprintf(s, 511, "%s/workers/%s", ckp->logdir, worker->workername);
-	fp = fopen(s, "re");
-	if (!fp) {
-		LOGINFO("Worker %s does not have a logfile to read", worker->workername);
-		return;
-	}
-	memset(s, 0, 512);
-	ret = fread(s, 1, 511, fp);
-	fclose(fp);
-	if (ret < 1) {
-		LOGINFO("Failed to read worker %s logfile", worker->workername);
-		return;
-	}
-	val = json_loads(s, 0, NULL);
-	if (!val) {
-		LOGINFO("Failed to json decode worker %s logfile: %s", worker->workername, s);
+	if (!read_stats_record(sdata->workerstore, worker->workername, &rec)) {
+		LOGINFO("Worker %s does not have stats to read", worker->workername);
 		return;
 	}
 
 	tv_time(&now);
 	copy_tv(&worker->last_share, &now);
 	copy_tv(&worker->last_decay, &now);
-	worker->dsps1 = dsps_from_key(val, "hashrate1m");
-	worker->dsps5 = dsps_from_key(val, "hashrate5m");
-	worker->dsps60 = dsps_from_key(val, "hashrate1hr");
-	worker->dsps1440 = dsps_from_key(val, "hashrate1d");
-	worker->dsps10080 = dsps_from_key(val, "hashrate7d");
-	json_get_double(&worker->best_diff, val, "bestshare");
-	json_get_int64(&worker->last_update.tv_sec, val, "lastupdate");
-	json_get_int64(&worker->shares, val, "shares");
+	worker->dsps1 = rec.dsps1;
+	worker->dsps5 = rec.dsps5;
+	worker->dsps60 = rec.dsps60;
+	worker->dsps1440 = rec.dsps1440;
+	worker->dsps10080 = rec.dsps10080;
+	worker->best_diff = rec.best_diff;
+	worker->last_update.tv_sec = rec.lastupdate;
+	worker->shares = rec.shares;
+	worker->stored_shares = worker->shares;
 	LOGINFO("Successfully read worker %s stats %f %f %f %f %f", worker->workername,
 		worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff);
-	json_decref(val);
 	if (worker->last_update.tv_sec)
 		tvsec_diff = now.tv_sec - worker->last_update.tv_sec - 60;
 	if (tvsec_diff > 60) {
@@ -4730,6 +5612,7 @@ static json_t *parse_authorise(stratum_instance_t *client, const json_t *params_
 	if (ret) {
 		client->authorised = ret;
 		user->authorised = ret;
+		add_subscriber(ckp->data, client);
 		if (ckp->proxy) {
 			LOGNOTICE("Authorised client %"PRId64" to proxy %d:%d, worker %s as user %s",
 				  client->id, client->proxyid, client->subproxyid, buf, user->username);
@@ -4789,14 +5672,89 @@ static double time_bias(const double tdiff, const double period)
 	return 1.0 - 1.0 / exp(dexp);
 }
 
-static void upstream_shares(ckpool_t *ckp, const char *workername, const int64_t diff,
+/* Shares are summed per worker and sent upstream in batches by remoteflush */
+static void upstream_shares(sdata_t *sdata, const char *workername, const int64_t diff,
 			    const double sdiff)
 {
-	char buf[512];
+	remote_share_t *share;
+
+	mutex_lock(&sdata->remote_lock);
+	HASH_FIND_STR(sdata->remote_shares, workername, share);
+	if (!share) {
+		share = ckzalloc(sizeof(remote_share_t));
+		share->workername = strdup(workername);
+		HASH_ADD_KEYPTR(hh, sdata->remote_shares, share->workername,
+				strlen(share->workername), share);
+	}
+	share->diff += diff;
+	if (sdiff > share->sdiff)
+		share->sdiff = sdiff;
+	mutex_unlock(&sdata->remote_lock);
+}
+
+/* Send a batch message with the array entries in arr named key upstream */
+static void upstream_batch(ckpool_t *ckp, const char *key, json_t *arr)
+{
+	char *s, *buf;
 
-	snprintf(buf, 511, "upstream={\"method\":\"shares\",\"workername\":\"%s\",\"diff\":%"PRId64",\"sdiff\":%lf}\n",
-		workername, diff, sdiff);
+	s = json_dumps(arr, JSON_COMPACT);
+	ASPRINTF(&buf, "upstream={\"method\":\"batch\",\"%s\":%s}\n", key, s);
+	free(s);
 	send_proc(ckp->connector, buf);
+	free(buf);
+}
+
+static void flush_remote_shares(ckpool_t *ckp, sdata_t *sdata)
+{
+	remote_share_t *shares, *share, *tmp;
+	json_t *arr = NULL;
+	int len = 0;
+
+	mutex_lock(&sdata->remote_lock);
+	shares = sdata->remote_shares;
+	sdata->remote_shares = NULL;
+	mutex_unlock(&sdata->remote_lock);
+
+	HASH_ITER(hh, shares, share, tmp) {
+		if (!arr)
+			arr = json_array();
+		json_array_append_new(arr, json_pack("[sIf]", share->workername, share->diff,
+						     share->sdiff));
+		len += strlen(share->workername) + 32;
+		if (len > REMOTE_BATCH_BYTES) {
+			upstream_batch(ckp, "shares", arr);
+			json_decref(arr);
+			arr = NULL;
+			len = 0;
+		}
+		HASH_DEL(shares, share);
+		free(share->workername);
+		free(share);
+	}
+	if (arr) {
+		upstream_batch(ckp, "shares", arr);
+		json_decref(arr);
+	}
+}
+
+/* Rather than one message per share, trusted remote nodes send the shares
+ * accepted by each worker summed over every remote interval */
+static void *remoteflush(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->data;
+	ts_t ts;
+
+	pthread_detach(pthread_self());
+	rename_proc("remoteflush");
+
+	cksleep_prepare_r(&ts);
+	while (42) {
+		cksleep_ms_r(&ts, ckp->remoteinterval);
+		cksleep_prepare_r(&ts);
+		flush_remote_shares(ckp, sdata);
+	}
+	return NULL;
 }
 
 /* Needs to be entered with client holding a ref count. */
@@ -4824,7 +5782,7 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		user->shares += diff;
 		/* Send shares to the upstream pool in trusted remote node */
 		if (ckp->remote)
-			upstream_shares(ckp, worker->workername, diff, sdiff);
+			upstream_shares(ckp_sdata, worker->workername, diff, sdiff);
 	} else if (!submit)
 		return;
 
@@ -4843,14 +5801,14 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		copy_tv(&client->ldc, &now_t);
 	}
 
-	decay_client(client, diff, &now_t);
+	add_client_diff(client, diff, &now_t);
 	copy_tv(&client->last_share, &now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_worker_diff(worker, diff, &now_t);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_user_diff(user, diff, &now_t);
 	copy_tv(&user->last_share, &now_t);
 	client->idle = false;
 
@@ -4874,6 +5832,10 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		return;
 	}
 
+	/* Bring the rolling average up to date with any accumulated diff */
+	if (client->pending_diff)
+		decay_client(client, 0, &now_t);
+
 	/* Diff rate ratio */
 	dsps = client->dsps5 / bias;
 	drr = dsps / (double)client->diff;
@@ -4988,13 +5950,24 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 
 /* Needs to be entered with client holding a ref count. */
 static double submission_diff(const stratum_instance_t *client, const workbase_t *wb, const char *nonce2,
-			      const uint32_t ntime32, const char *nonce, uchar *hash)
+			      const uint32_t ntime32, const char *nonce, uchar *hash,
+			      const share_hash_t *sh)
 {
 	char *coinbase;
 	uchar swap[80];
 	double ret;
 	int cblen;
 
+	/* Use the result from the batched share processor if it was hashed on
+	 * this very workbase */
+	if (sh && sh->hashed && sh->wb == wb && sh->id == wb->id &&
+	    sh->gentime.tv_sec == wb->gentime.tv_sec && sh->gentime.tv_nsec == wb->gentime.tv_nsec) {
+		memcpy(hash, sh->hash, 32);
+		test_blocksolve(client, wb, sh->swap, hash, sh->sdiff, sh->coinbase, sh->cblen,
+				nonce2, nonce, ntime32);
+		return sh->sdiff;
+	}
+
 	coinbase = ckalloc(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len);
 
 	/* Calculate the diff of the share here */
@@ -5008,27 +5981,63 @@ static double submission_diff(const stratum_instance_t *client, const workbase_t
 	return ret;
 }
 
+/* Find the share table for wb_id, creating it if need be, returning with the
+ * share_lock held read only. */
+static share_table_t *share_table(sdata_t *sdata, const int64_t wb_id)
+{
+	share_table_t *table;
+	int i;
+
+	ck_rlock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+	if (likely(table))
+		return table;
+	ck_runlock(&sdata->share_lock);
+
+	ck_wlock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+	if (!table) {
+		table = ckzalloc(sizeof(share_table_t));
+		table->workbase_id = wb_id;
+		for (i = 0; i < SHARE_SHARDS; i++)
+			mutex_init(&table->shards[i].lock);
+		HASH_ADD_I64(sdata->share_tables, workbase_id, table);
+	}
+	ck_dwlock(&sdata->share_lock);
+	return table;
+}
+
 /* Optimised for the common case where shares are new */
 static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
-	bool ret = true;
+	share_t *share, *match = NULL;
+	share_table_t *table;
+	share_shard_t *shard;
+
+	__atomic_add_fetch(&sdata->shares_generated, 1, __ATOMIC_RELAXED);
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
+	table = share_table(sdata, wb_id);
+	/* The low bytes of the hash are as good as random */
+	shard = &table->shards[hash[0] % SHARE_SHARDS];
 
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
+	mutex_lock(&shard->lock);
+	HASH_FIND(hh, shard->shares, hash, 32, match);
+	if (likely(!match)) {
+		if (unlikely(!shard->slabs || shard->slabused == SHARE_SLAB)) {
+			share_slab_t *slab = ckalloc(sizeof(share_slab_t));
 
-	if (unlikely(match)) {
-		dealloc(share);
-		ret = false;
+			LL_PREPEND(shard->slabs, slab);
+			shard->slabused = 0;
+		}
+		share = &shard->slabs->shares[shard->slabused++];
+		memcpy(share->hash, hash, 32);
+		HASH_ADD(hh, shard->shares, hash, 32, share);
+		shard->count++;
 	}
-	return ret;
+	mutex_unlock(&shard->lock);
+	ck_runlock(&sdata->share_lock);
+
+	return !match;
 }
 
 static void update_client(const stratum_instance_t *client, const int64_t client_id);
@@ -5076,14 +6085,44 @@ static void check_best_diff(ckpool_t *ckp, sdata_t *sdata, user_instance_t *user
 #define JSON_ERR(err) json_string(SHARE_ERR(err))
 
 /* Needs to be entered with client holding a ref count. */
+/* Get the worker name, job id, nonce2, ntime and nonce strings of a share
+ * submission from wherever it was parsed to, in that order */
+static enum share_err submit_fields(const json_params_t *jp, const char *fields[5])
+{
+	static const enum share_err missing[5] = {
+		SE_NO_USERNAME, SE_NO_JOBID, SE_NO_NONCE2, SE_NO_NTIME, SE_NO_NONCE };
+	const json_t *params_val = jp->params;
+	int i;
+
+	if (jp->scanned) {
+		fields[0] = jp->submit.workername;
+		fields[1] = jp->submit.job_id;
+		fields[2] = jp->submit.nonce2;
+		fields[3] = jp->submit.ntime;
+		fields[4] = jp->submit.nonce;
+	} else {
+		if (unlikely(!json_is_array(params_val)))
+			return SE_NOT_ARRAY;
+		if (unlikely(json_array_size(params_val) != 5))
+			return SE_INVALID_SIZE;
+		for (i = 0; i < 5; i++)
+			fields[i] = json_string_value(json_array_get(params_val, i));
+	}
+	for (i = 0; i < 5; i++) {
+		if (unlikely(!fields[i] || !*fields[i]))
+			return missing[i];
+	}
+	return SE_NONE;
+}
+
 static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+			    const json_params_t *jp, json_t **err_val, const share_hash_t *sh)
 {
 	bool share = false, result = false, invalid = true, submit = false;
 	user_instance_t *user = client->user_instance;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
 	char hexhash[68] = {}, sharehash[32], cdfield[64];
-	const char *workername, *job_id, *ntime, *nonce;
+	const char *fields[5], *workername, *job_id, *ntime, *nonce;
 	char *fname = NULL, *s, *nonce2;
 	sdata_t *sdata = client->sdata;
 	enum share_err err = SE_NONE;
@@ -5103,48 +6142,18 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 	now_t = now.tv_sec;
 	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	if (unlikely(!json_is_array(params_val))) {
-		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	if (unlikely(json_array_size(params_val) != 5)) {
-		err = SE_INVALID_SIZE;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	workername = json_string_value(json_array_get(params_val, 0));
-	if (unlikely(!workername || !strlen(workername))) {
-		err = SE_NO_USERNAME;
+	err = submit_fields(jp, fields);
+	if (unlikely(err != SE_NONE)) {
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	job_id = json_string_value(json_array_get(params_val, 1));
-	if (unlikely(!job_id || !strlen(job_id))) {
-		err = SE_NO_JOBID;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
-	if (unlikely(!nonce2 || !strlen(nonce2))) {
-		err = SE_NO_NONCE2;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	ntime = json_string_value(json_array_get(params_val, 3));
-	if (unlikely(!ntime || !strlen(ntime))) {
-		err = SE_NO_NTIME;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	nonce = json_string_value(json_array_get(params_val, 4));
-	if (unlikely(!nonce || !strlen(nonce))) {
-		err = SE_NO_NONCE;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	if (safecmp(workername, client->workername)) {
-		err = SE_WORKER_MISMATCH;
+	workername = fields[0];
+	job_id = fields[1];
+	nonce2 = (char *)fields[2];
+	ntime = fields[3];
+	nonce = fields[4];
+	if (safecmp(workername, client->workername)) {
+		err = SE_WORKER_MISMATCH;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
@@ -5185,7 +6194,7 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 		memcpy(nonce2, tmp, nlen);
 		nonce2[len] = '\0';
 	}
-	sdiff = submission_diff(client, wb, nonce2, ntime32, nonce, hash);
+	sdiff = submission_diff(client, wb, nonce2, ntime32, nonce, hash, sh);
 	if (sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
@@ -5376,22 +6385,36 @@ static json_t *__stratum_notify(const workbase_t *wb, const bool clean)
 	return val;
 }
 
+/* Take a copy of the notify line rendered for this workbase. Enter with
+ * workbase_lock held. */
+static char *__notify_line(const workbase_t *wb, const bool clean, int *len)
+{
+	char *line;
+
+	*len = wb->notifylen[clean];
+	line = ckalloc(*len + 1);
+	memcpy(line, wb->notify[clean], *len + 1);
+	return line;
+}
+
 static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, const bool clean)
 {
-	json_t *json_msg;
+	char *line;
+	int len;
 
 	ck_rlock(&sdata->workbase_lock);
-	json_msg = __stratum_notify(wb, clean);
+	line = __notify_line(wb, clean, &len);
 	ck_runlock(&sdata->workbase_lock);
 
-	stratum_broadcast(sdata, json_msg, SM_UPDATE);
+	__stratum_broadcast(sdata, NULL, line, len, SM_UPDATE);
 }
 
 /* For sending a single stratum template update */
 static void stratum_send_update(sdata_t *sdata, const int64_t client_id, const bool clean)
 {
 	ckpool_t *ckp = sdata->ckp;
-	json_t *json_msg;
+	char *line;
+	int len;
 
 	if (unlikely(!sdata->current_workbase)) {
 		if (!ckp->proxy)
@@ -5401,11 +6424,23 @@ static void stratum_send_update(sdata_t *sdata, const int64_t client_id, const b
 		return;
 	}
 
+	/* Passthrough subclients need the json to tag it for their node */
+	if (unlikely(passthrough_subclient(client_id))) {
+		json_t *json_msg;
+
+		ck_rlock(&sdata->workbase_lock);
+		json_msg = __stratum_notify(sdata->current_workbase, clean);
+		ck_runlock(&sdata->workbase_lock);
+
+		stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
+		return;
+	}
+
 	ck_rlock(&sdata->workbase_lock);
-	json_msg = __stratum_notify(sdata->current_workbase, clean);
+	line = __notify_line(sdata->current_workbase, clean, &len);
 	ck_runlock(&sdata->workbase_lock);
 
-	stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
+	stratum_add_send_line(sdata, line, len, client_id);
 }
 
 static void send_json_err(sdata_t *sdata, const int64_t client_id, json_t *id_val, const char *err_msg)
@@ -5429,12 +6464,32 @@ static json_params_t
 *create_json_params(const int64_t client_id, const json_t *method, const json_t *params,
 		    const json_t *id_val)
 {
-	json_params_t *jp = ckalloc(sizeof(json_params_t));
+	json_params_t *jp = slab_alloc(jp_slab);
 
 	jp->method = json_deep_copy(method);
 	jp->params = json_deep_copy(params);
 	jp->id_val = json_deep_copy(id_val);
 	jp->client_id = client_id;
+	jp->scanned = false;
+	jp->received = 0;
+	return jp;
+}
+
+static json_params_t *create_submit_params(const int64_t client_id, const submit_params_t *submit)
+{
+	json_params_t *jp = slab_alloc(jp_slab);
+
+	jp->method = jp->params = NULL;
+	if (submit->idtype == JSON_INTEGER)
+		jp->id_val = json_integer(strtoll(submit->id, NULL, 10));
+	else if (submit->idtype == JSON_STRING)
+		jp->id_val = json_string_nocheck(submit->id);
+	else
+		jp->id_val = json_null();
+	jp->client_id = client_id;
+	jp->scanned = true;
+	memcpy(&jp->submit, submit, sizeof(submit_params_t));
+	jp->received = 0;
 	return jp;
 }
 
@@ -5553,10 +6608,25 @@ static void add_mining_node(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *c
 }
 
 /* Enter with client holding ref count */
+/* Queue a client's share submission for the share processors, accounting for
+ * the time it took to get this far */
+static void queue_share(sdata_t *sdata, const smsg_t *msg, json_params_t *jp)
+{
+	if (likely(msg->received)) {
+		jp->received = msg->received;
+		jp->queued = monotonic_ns();
+		lhist_add(&sdata->share_latency[SHARE_IPC], msg->queued - msg->received);
+		lhist_add(&sdata->share_latency[SHARE_SRECVQ], msg->dequeued - msg->queued);
+		lhist_add(&sdata->share_latency[SHARE_PARSE], jp->queued - msg->dequeued);
+	}
+	ckmsgq_add_id(sdata->sshareq, jp, msg->client_id);
+}
+
 static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *client,
-			 const int64_t client_id, json_t *id_val, json_t *method_val,
+			 const smsg_t *msg, json_t *id_val, json_t *method_val,
 			 json_t *params_val)
 {
+	const int64_t client_id = msg->client_id;
 	const char *method;
 
 	/* Random broken clients send something not an integer as the id so we
@@ -5564,9 +6634,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	 * most common messages will be shares so look for those first */
 	method = json_string_value(method_val);
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
-		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
-
-		ckmsgq_add(sdata->sshareq, jp);
+		queue_share(sdata, msg, create_json_params(client_id, method_val, params_val, id_val));
 		return;
 	}
 
@@ -5708,7 +6776,9 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 static void free_smsg(smsg_t *msg)
 {
 	json_decref(msg->json_msg);
-	free(msg);
+	free(msg->line);
+	free(msg->client_ids);
+	slab_free(smsg_slab, msg);
 }
 
 /* Even though we check the results locally in node mode, check the upstream
@@ -5827,26 +6897,13 @@ static user_instance_t *generate_remote_user(ckpool_t *ckp, const char *workerna
 }
 
 
-static void parse_remote_shares(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+static void add_remote_shares(ckpool_t *ckp, sdata_t *sdata, const char *workername,
+			      const int64_t diff, const double sdiff)
 {
-	json_t *workername_val = json_object_get(val, "workername");
 	worker_instance_t *worker;
-	const char *workername;
 	user_instance_t *user;
-	double sdiff = 0;
-	int64_t diff;
 	tv_t now_t;
 
-	workername = json_string_value(workername_val);
-	if (unlikely(!workername_val || !workername)) {
-		LOGWARNING("Failed to get workername from remote message %s", buf);
-		return;
-	}
-	if (unlikely(!json_get_int64(&diff, val, "diff") || diff < 1)) {
-		LOGWARNING("Unable to parse valid diff from remote message %s", buf);
-		return;
-	}
-	json_get_double(&sdiff, val, "sdiff");
 	user = generate_remote_user(ckp, workername);
 	user->authorised = true;
 	worker = get_worker(sdata, user, workername);
@@ -5861,21 +6918,48 @@ static void parse_remote_shares(ckpool_t *ckp, sdata_t *sdata, json_t *val, cons
 	user->shares += diff;
 	tv_time(&now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_worker_diff(worker, diff, &now_t);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_user_diff(user, diff, &now_t);
 	copy_tv(&user->last_share, &now_t);
 
 	LOGINFO("Added %"PRId64" remote shares to worker %s", diff, workername);
 }
 
+static void parse_remote_shares(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+{
+	json_t *workername_val = json_object_get(val, "workername");
+	const char *workername;
+	double sdiff = 0;
+	int64_t diff;
+
+	workername = json_string_value(workername_val);
+	if (unlikely(!workername_val || !workername)) {
+		LOGWARNING("Failed to get workername from remote message %s", buf);
+		return;
+	}
+	if (unlikely(!json_get_int64(&diff, val, "diff") || diff < 1)) {
+		LOGWARNING("Unable to parse valid diff from remote message %s", buf);
+		return;
+	}
+	json_get_double(&sdiff, val, "sdiff");
+	add_remote_shares(ckp, sdata, workername, diff, sdiff);
+}
+
+static void add_remote_workers(sdata_t *sdata, const char *username, const int workers)
+{
+	user_instance_t *user = get_user(sdata, username);
+
+	user->remote_workers += workers;
+	LOGDEBUG("Adding %d remote workers to user %s", workers, username);
+}
+
 /* Get the remote worker count once per minute from all the remote servers */
 static void parse_remote_workers(sdata_t *sdata, json_t *val, const char *buf)
 {
 	json_t *username_val = json_object_get(val, "username");
-	user_instance_t *user;
 	const char *username;
 	int workers;
 
@@ -5884,13 +6968,44 @@ static void parse_remote_workers(sdata_t *sdata, json_t *val, const char *buf)
 		LOGWARNING("Failed to get username from remote message %s", buf);
 		return;
 	}
-	user = get_user(sdata, username);
 	if (unlikely(!json_get_int(&workers, val, "workers"))) {
 		LOGWARNING("Failed to get workers from remote message %s", buf);
 		return;
 	}
-	user->remote_workers += workers;
-	LOGDEBUG("Adding %d remote workers to user %s", workers, username);
+	add_remote_workers(sdata, username, workers);
+}
+
+/* Batches hold arrays of the summed shares per worker as
+ * [workername, diff, sdiff] and of worker counts per user as
+ * [username, workers] */
+static void parse_remote_batch(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+{
+	json_t *arr_val, *entry;
+	size_t index;
+
+	arr_val = json_object_get(val, "shares");
+	json_array_foreach(arr_val, index, entry) {
+		const char *workername = json_string_value(json_array_get(entry, 0));
+		int64_t diff = json_integer_value(json_array_get(entry, 1));
+		double sdiff = json_number_value(json_array_get(entry, 2));
+
+		if (unlikely(!workername || diff < 1)) {
+			LOGWARNING("Invalid shares entry %d in remote batch %s", (int)index, buf);
+			continue;
+		}
+		add_remote_shares(ckp, sdata, workername, diff, sdiff);
+	}
+	arr_val = json_object_get(val, "workers");
+	json_array_foreach(arr_val, index, entry) {
+		const char *username = json_string_value(json_array_get(entry, 0));
+		json_t *workers_val = json_array_get(entry, 1);
+
+		if (unlikely(!username || !json_is_integer(workers_val))) {
+			LOGWARNING("Invalid workers entry %d in remote batch %s", (int)index, buf);
+			continue;
+		}
+		add_remote_workers(sdata, username, json_integer_value(workers_val));
+	}
 }
 
 static void parse_remote_block(sdata_t *sdata, json_t *val, const char *buf)
@@ -5934,7 +7049,9 @@ static void parse_trusted_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		LOGWARNING("Failed to get method from remote message %s", buf);
 		return;
 	}
-	if (likely(!safecmp(method, "shares")))
+	if (likely(!safecmp(method, "batch")))
+		parse_remote_batch(ckp, sdata, val, buf);
+	else if (!safecmp(method, "shares"))
 		parse_remote_shares(ckp, sdata, val, buf);
 	else if (!safecmp(method, "workers"))
 		parse_remote_workers(sdata, val, buf);
@@ -5965,7 +7082,7 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, const char *buf, stratum
 	switch (msg_type) {
 		case SM_SHARE:
 			jp = create_json_params(client->id, method, params, id_val);
-			ckmsgq_add(sdata->sshareq, jp);
+			ckmsgq_add_id(sdata->sshareq, jp, client->id);
 			break;
 		case SM_SHARERESULT:
 			parse_share_result(ckp, client, res_val);
@@ -6025,6 +7142,21 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 		return;
 	}
 
+	/* Handle scanned share submissions as parse_method would */
+	if (likely(msg->submit)) {
+		if (likely(client->authorised))
+			queue_share(sdata, msg, create_submit_params(client_id, msg->submit));
+		else if (!client->subscribed) {
+			LOGINFO("Dropping mining.submit from unsubscribed client %"PRId64" %s",
+				client_id, client->address);
+			connector_drop_client(ckp, client_id);
+		} else {
+			LOGINFO("Dropping mining.submit from unauthorised client %"PRId64" %s",
+				client_id, client->address);
+		}
+		return;
+	}
+
 	/* Return back the same id_val even if it's null or not existent. */
 	id_val = json_object_get(val, "id");
 
@@ -6063,25 +7195,200 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 		if (!(++delays % 50))
 			LOGWARNING("%d Second delay waiting for bitcoind at startup", delays / 10);
 	}
-	parse_method(ckp, sdata, client, client_id, id_val, method, params);
+	parse_method(ckp, sdata, client, msg, id_val, method, params);
+}
+
+static inline void skip_space(const char **p)
+{
+	while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+		(*p)++;
+}
+
+/* Scan the json string at *p into buf of size len, or just skip over it if
+ * buf is NULL. Only printable ascii without escapes is accepted, leaving
+ * anything else to jansson. */
+static bool scan_string(const char **p, char *buf, const int len)
+{
+	const uchar *s = (const uchar *)*p;
+	int i = 0;
+
+	if (*s++ != '"')
+		return false;
+	while (*s != '"') {
+		if (unlikely(*s < 0x20 || *s > 0x7e || *s == '\\'))
+			return false;
+		if (buf) {
+			if (unlikely(i >= len - 1))
+				return false;
+			buf[i++] = *s;
+		}
+		s++;
+	}
+	if (buf)
+		buf[i] = '\0';
+	*p = (const char *)s + 1;
+	return true;
+}
+
+/* Scan a plain json integer of up to 18 digits into buf */
+static bool scan_integer(const char **p, char *buf)
+{
+	const char *s = *p;
+	int digits;
+
+	if (*s == '-')
+		s++;
+	for (digits = 0; s[digits] >= '0' && s[digits] <= '9'; digits++);
+	if (unlikely(!digits || digits > 18 || (digits > 1 && *s == '0')))
+		return false;
+	s += digits;
+	if (unlikely(*s == '.' || *s == 'e' || *s == 'E'))
+		return false;
+	memcpy(buf, *p, s - *p);
+	buf[s - *p] = '\0';
+	*p = s;
+	return true;
+}
+
+/* Skip the simple value of a member we don't use */
+static bool skip_value(const char **p)
+{
+	char num[24];
+
+	if (**p == '"')
+		return scan_string(p, NULL, 0);
+	if (!strncmp(*p, "true", 4) || !strncmp(*p, "null", 4)) {
+		*p += 4;
+		return true;
+	}
+	if (!strncmp(*p, "false", 5)) {
+		*p += 5;
+		return true;
+	}
+	return scan_integer(p, num);
+}
+
+/* Scan a client's line for a mining.submit the way nearly all miners send it,
+ * with a params array of 5 strings, an integer, string or null id, and no
+ * nesting or escapes, straight into submit without allocating anything.
+ * Returns false for anything else so it can be parsed by jansson as usual. */
+static bool scan_submit(const char *p, submit_params_t *submit)
+{
+	char *fields[5] = { submit->workername, submit->job_id, submit->nonce2,
+			    submit->ntime, submit->nonce };
+	const int lens[5] = { sizeof(submit->workername), sizeof(submit->job_id),
+			      sizeof(submit->nonce2), sizeof(submit->ntime),
+			      sizeof(submit->nonce) };
+	bool method = false, params = false, id = false;
+	char key[16], val[16];
+	int i;
+
+	skip_space(&p);
+	if (*p++ != '{')
+		return false;
+	do {
+		skip_space(&p);
+		if (!scan_string(&p, key, sizeof(key)))
+			return false;
+		skip_space(&p);
+		if (*p++ != ':')
+			return false;
+		skip_space(&p);
+		if (!strcmp(key, "method")) {
+			if (method || !scan_string(&p, val, sizeof(val)) || strcmp(val, "mining.submit"))
+				return false;
+			method = true;
+		} else if (!strcmp(key, "params")) {
+			if (params || *p++ != '[')
+				return false;
+			for (i = 0; i < 5; i++) {
+				skip_space(&p);
+				if (i && *p++ != ',')
+					return false;
+				skip_space(&p);
+				if (!scan_string(&p, fields[i], lens[i]))
+					return false;
+			}
+			skip_space(&p);
+			if (*p++ != ']')
+				return false;
+			params = true;
+		} else if (!strcmp(key, "id")) {
+			if (id)
+				return false;
+			if (*p == '"') {
+				if (!scan_string(&p, submit->id, sizeof(submit->id)))
+					return false;
+				submit->idtype = JSON_STRING;
+			} else if (!strncmp(p, "null", 4)) {
+				p += 4;
+				submit->idtype = JSON_NULL;
+			} else {
+				if (!scan_integer(&p, submit->id))
+					return false;
+				submit->idtype = JSON_INTEGER;
+			}
+			id = true;
+		} else if (!skip_value(&p))
+			return false;
+		skip_space(&p);
+	} while (*p++ == ',');
+	if (p[-1] != '}')
+		return false;
+	skip_space(&p);
+	return method && params && id && !*p;
 }
 
 static void srecv_process(ckpool_t *ckp, char *buf)
 {
 	bool noid = false, dropped = false;
 	char address[INET6_ADDRSTRLEN];
+	int64_t dequeued = monotonic_ns();
 	sdata_t *sdata = ckp->data;
 	stratum_instance_t *client;
+	submit_params_t submit;
+	char *line = buf;
 	smsg_t *msg;
 	json_t *val;
 	int server;
 
+	/* Client messages from the connector in pool mode arrive as the raw
+	 * stratum line behind a binary envelope so this is the only place
+	 * they get parsed. Share submissions, which are nearly all of them,
+	 * are scanned into submit without building any json. */
+	if (likely(buf[0] == CLIENT_ENVELOPE)) {
+		const client_envelope_t *env = (const client_envelope_t *)buf;
+
+		line = buf + sizeof(client_envelope_t);
+		msg = slab_zalloc(smsg_slab);
+		if (likely(scan_submit(line, &submit)))
+			msg->submit = &submit;
+		else {
+			val = json_loads(line, 0, NULL);
+			if (unlikely(!val)) {
+				LOGINFO("Client id %"PRId64" sent invalid json message %s",
+					env->client_id, line);
+				connector_invalid_json(ckp, env->client_id);
+				slab_free(smsg_slab, msg);
+				goto out;
+			}
+			msg->json_msg = val;
+		}
+		msg->client_id = env->client_id;
+		msg->received = env->received;
+		msg->queued = env->queued;
+		msg->dequeued = dequeued;
+		strcpy(address, env->address);
+		server = env->server;
+		goto add_instance;
+	}
+
 	val = json_loads(buf, 0, NULL);
 	if (unlikely(!val)) {
 		LOGWARNING("Received unrecognised non-json message: %s", buf);
 		goto out;
 	}
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = slab_zalloc(smsg_slab);
 	msg->json_msg = val;
 	val = json_object_get(msg->json_msg, "client_id");
 	if (unlikely(!val)) {
@@ -6111,6 +7418,7 @@ static void srecv_process(ckpool_t *ckp, char *buf)
 	server = json_integer_value(val);
 	json_object_clear(val);
 
+add_instance:
 	/* Parse the message here */
 	ck_wlock(&sdata->instance_lock);
 	client = __instance_by_id(sdata, msg->client_id);
@@ -6134,10 +7442,15 @@ static void srecv_process(ckpool_t *ckp, char *buf)
 	if (unlikely(noid))
 		LOGINFO("Stratifier added instance %"PRId64" server %d", client->id, server);
 
+	/* Remote and node clients' messages are handled as json */
+	if (unlikely(msg->submit && (client->remote || ckp->node))) {
+		msg->json_msg = json_loads(line, 0, NULL);
+		msg->submit = NULL;
+	}
 	if (client->remote)
-		parse_trusted_msg(ckp, sdata, msg->json_msg, buf);
+		parse_trusted_msg(ckp, sdata, msg->json_msg, line);
 	else if (ckp->node)
-		node_client_msg(ckp, msg->json_msg, buf, client);
+		node_client_msg(ckp, msg->json_msg, line, client);
 	else
 		parse_instance_msg(ckp, sdata, msg, client);
 	dec_instance_ref(sdata, client);
@@ -6147,13 +7460,50 @@ out:
 	free(buf);
 }
 
+/* Serialise a broadcast message once and send it to the connector with the
+ * list of client ids to fan it out to in the form broadcast=id,id,...:msg
+ * where msg is already terminated with the EOL the clients expect. */
+static void ssend_broadcast(ckpool_t *ckp, smsg_t *msg)
+{
+	char *s, *buf, *p;
+	int i, len;
+
+	if (msg->line) {
+		s = msg->line;
+		len = msg->len;
+		msg->line = NULL;
+	} else {
+		s = json_dumps(msg->json_msg, JSON_EOL | JSON_COMPACT);
+		len = strlen(s);
+	}
+	p = buf = ckalloc(10 + msg->clients * 21 + len + 1);
+	p += sprintf(p, "broadcast=");
+	for (i = 0; i < msg->clients; i++)
+		p += sprintf(p, i ? ",%"PRId64 : "%"PRId64, msg->client_ids[i]);
+	*p++ = ':';
+	memcpy(p, s, len + 1);
+	free(s);
+
+	LOGDEBUG("Broadcasting stratum message to %d clients", msg->clients);
+	send_proc(ckp->connector, buf);
+	free(buf);
+	free_smsg(msg);
+}
+
 static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 {
 	char *s;
 
-	if (unlikely(!msg->json_msg)) {
+	if (msg->received)
+		msg->dequeued = monotonic_ns();
+	if (unlikely(!msg->json_msg && !msg->line)) {
 		LOGERR("Sent null json msg to stratum_sender");
-		free(msg);
+		slab_free(smsg_slab, msg);
+		return;
+	}
+
+	if (msg->client_ids) {
+		ssend_broadcast(ckp, msg);
 		return;
 	}
 
@@ -6163,6 +7513,12 @@ static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 	s = json_dumps(msg->json_msg, JSON_COMPACT);
 	send_proc(ckp->connector, s);
 	free(s);
+	if (msg->received) {
+		sdata_t *sdata = ckp->data;
+
+		lhist_add(&sdata->share_latency[SHARE_SSENDQ], msg->dequeued - msg->queued);
+		lhist_add(&sdata->share_latency[SHARE_TOTAL], monotonic_ns() - msg->received);
+	}
 	free_smsg(msg);
 }
 
@@ -6172,7 +7528,7 @@ static void discard_json_params(json_params_t *jp)
 	json_decref(jp->params);
 	if (jp->id_val)
 		json_decref(jp->id_val);
-	free(jp);
+	slab_free(jp_slab, jp);
 }
 
 static void steal_json_id(json_t *val, json_params_t *jp)
@@ -6182,36 +7538,155 @@ static void steal_json_id(json_t *val, json_params_t *jp)
 	jp->id_val = NULL;
 }
 
-static void sshare_process(ckpool_t *ckp, json_params_t *jp)
+/* Needs to be entered with client holding a ref count. */
+static void client_share(sdata_t *sdata, stratum_instance_t *client, json_params_t *jp,
+			 const share_hash_t *sh)
 {
 	json_t *result_val, *json_msg, *err_val = NULL;
-	stratum_instance_t *client;
-	sdata_t *sdata = ckp->data;
-	int64_t client_id;
 
-	client_id = jp->client_id;
+	json_msg = json_object();
+	result_val = parse_submit(client, json_msg, jp, &err_val, sh);
+	json_object_set_new_nocheck(json_msg, "result", result_val);
+	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
+	steal_json_id(json_msg, jp);
+	stratum_add_timed_send(sdata, json_msg, client->id, SM_SHARERESULT, jp->received);
+}
+
+/* Returns a ref counted client only if it's still authorised to submit */
+static stratum_instance_t *ref_share_client(sdata_t *sdata, const int64_t client_id)
+{
+	stratum_instance_t *client;
 
 	client = ref_instance_by_id(sdata, client_id);
 	if (unlikely(!client)) {
 		LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
-		goto out;
+		return NULL;
 	}
 	if (unlikely(!client->authorised)) {
 		LOGDEBUG("Client %"PRId64" no longer authorised to submit shares", client_id);
-		goto out_decref;
+		dec_instance_ref(sdata, client);
+		return NULL;
 	}
-	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
-	json_object_set_new_nocheck(json_msg, "result", result_val);
-	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
-	steal_json_id(json_msg, jp);
-	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
-out_decref:
-	dec_instance_ref(sdata, client);
-out:
+	return client;
+}
+
+/* Account for the time a share spent waiting on sshareq and being processed
+ * from start */
+static void share_process_latency(sdata_t *sdata, const json_params_t *jp, const int64_t start)
+{
+	if (likely(jp->received)) {
+		lhist_add(&sdata->share_latency[SHARE_SSHAREQ], start - jp->queued);
+		lhist_add(&sdata->share_latency[SHARE_PROCESS], monotonic_ns() - start);
+	}
+}
+
+static void sshare_process(ckpool_t *ckp, json_params_t *jp)
+{
+	int64_t start = monotonic_ns();
+	stratum_instance_t *client;
+	sdata_t *sdata = ckp->data;
+
+	client = ref_share_client(sdata, jp->client_id);
+	if (likely(client)) {
+		client_share(sdata, client, jp, NULL);
+		dec_instance_ref(sdata, client);
+	}
+	share_process_latency(sdata, jp, start);
 	discard_json_params(jp);
 }
 
+/* Hash as many of a batch of share submissions as we can side by side with
+ * the multi-buffer sha256, grouped by workbase, before they're processed one
+ * at a time. Anything that doesn't look like a valid submission is left for
+ * parse_submit to hash and reject as usual. */
+static void prehash_shares(sdata_t *sdata, stratum_instance_t **clients, json_params_t **jps,
+			   share_hash_t *shs, const int count)
+{
+	share_hash_t *group[SHARE_BATCH];
+	int i, j, n;
+
+	ck_rlock(&sdata->workbase_lock);
+	for (i = 0; i < count; i++) {
+		const char *fields[5], *job_id, *nonce2, *ntime, *nonce;
+		share_hash_t *sh = &shs[i];
+		char fixnonce2[17];
+		workbase_t *wb;
+		int len, nlen;
+		int64_t id;
+
+		if (!clients[i] || submit_fields(jps[i], fields) != SE_NONE)
+			continue;
+		job_id = fields[1];
+		nonce2 = fields[2];
+		ntime = fields[3];
+		nonce = fields[4];
+		sscanf(job_id, "%lx", &id);
+		HASH_FIND_I64(sdata->workbases, &id, wb);
+		if (!wb || !coinb1_midstate(clients[i]->enonce1bin, wb))
+			continue;
+		/* Pad or truncate nonce2 the same way parse_submit does */
+		len = wb->enonce2varlen * 2;
+		if (unlikely(len >= (int)sizeof(fixnonce2)))
+			continue;
+		nlen = strlen(nonce2);
+		memset(fixnonce2, '0', len);
+		memcpy(fixnonce2, nonce2, nlen < len ? nlen : len);
+		fixnonce2[len] = '\0';
+
+		sh->wb = wb;
+		sh->id = wb->id;
+		sh->gentime = wb->gentime;
+		sscanf(ntime, "%x", &sh->ntime32);
+		sh->nonce = nonce;
+		sh->coinbase = ckalloc(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen +
+				       wb->enonce2varlen + wb->coinb2len);
+		sh->cblen = share_coinbase(sh->coinbase, clients[i]->enonce1bin, wb, fixnonce2);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!shs[i].wb || shs[i].hashed)
+			continue;
+		for (n = 0, j = i; j < count; j++) {
+			if (shs[j].wb == shs[i].wb && !shs[j].hashed)
+				group[n++] = &shs[j];
+		}
+		share_diff_multi(group, shs[i].wb, n);
+	}
+	ck_runlock(&sdata->workbase_lock);
+}
+
+/* Batched share processor, taking all the submissions queued at once up to
+ * SHARE_BATCH */
+static void sshare_process_batch(ckpool_t *ckp, json_params_t **jps, const int count)
+{
+	stratum_instance_t *clients[SHARE_BATCH];
+	share_hash_t shs[SHARE_BATCH];
+	sdata_t *sdata = ckp->data;
+	int64_t start;
+	int i;
+
+	if (count == 1) {
+		sshare_process(ckp, jps[0]);
+		return;
+	}
+
+	start = monotonic_ns();
+	memset(shs, 0, sizeof(share_hash_t) * count);
+	for (i = 0; i < count; i++)
+		clients[i] = ref_share_client(sdata, jps[i]->client_id);
+	prehash_shares(sdata, clients, jps, shs, count);
+
+	for (i = 0; i < count; i++) {
+		if (likely(clients[i])) {
+			client_share(sdata, clients[i], jps[i], &shs[i]);
+			dec_instance_ref(sdata, clients[i]);
+		}
+		free(shs[i].coinbase);
+		share_process_latency(sdata, jps[i], start);
+		discard_json_params(jps[i]);
+	}
+}
+
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
  * and sets the authorising flag */
 static stratum_instance_t *preauth_ref_instance_by_id(sdata_t *sdata, const int64_t id)
@@ -6337,10 +7812,9 @@ static bool test_and_clear(bool *val, mutex_t *lock)
 	return ret;
 }
 
-static void ckdbq_process(ckpool_t *ckp, char *msg)
+/* Send msg to ckdb, retrying till it succeeds */
+static char *ckdb_call_retry(ckpool_t *ckp, sdata_t *sdata, const char *msg)
 {
-	sdata_t *sdata = ckp->data;
-	size_t responselen = 0;
 	char *buf = NULL;
 
 	while (!buf) {
@@ -6354,14 +7828,17 @@ static void ckdbq_process(ckpool_t *ckp, char *msg)
 			sleep(5);
 		}
 	}
-	free(msg);
 	if (test_and_clear(&sdata->ckdb_offline, &sdata->ckdb_lock))
 		LOGWARNING("Successfully resumed talking to ckdb");
+	return buf;
+}
+
+/* Process any requests from ckdb that are heartbeat responses with
+ * specific requests. */
+static void parse_ckdb_response(ckpool_t *ckp, const char *buf)
+{
+	size_t responselen = strlen(buf);
 
-	/* Process any requests from ckdb that are heartbeat responses with
-	 * specific requests. */
-	if (likely(buf))
-		responselen = strlen(buf);
 	if (likely(responselen > 0)) {
 		char *response = alloca(responselen);
 		int offset = 0;
@@ -6383,7 +7860,77 @@ static void ckdbq_process(ckpool_t *ckp, char *msg)
 				LOGWARNING("Got ckdb failure response: %s", buf);
 		} else
 			LOGWARNING("Got bad ckdb response: %s", buf);
+	}
+}
+
+static void ckdbq_process(ckpool_t *ckp, char *msg)
+{
+	sdata_t *sdata = ckp->data;
+	char *buf;
+
+	buf = ckdb_call_retry(ckp, sdata, msg);
+	free(msg);
+	parse_ckdb_response(ckp, buf);
+	free(buf);
+}
+
+/* Send everything queued for ckdb, up to CKDB_BATCH messages, as one batch
+ * message of the header batch.count. followed by one message per line, to
+ * avoid a round trip per message. ckdb processes and replies to each message
+ * in order, so the sequence numbers are unchanged, with one reply per line */
+static void ckdbq_process_batch(ckpool_t *ckp, char **msgs, const int count)
+{
+	sdata_t *sdata = ckp->data;
+	int i, lines, id, idlen = 0;
+	char *batch, *buf, *line, *next;
+	size_t len, ofs;
+
+	if (count == 1 || sdata->ckdb_nobatch) {
+		for (i = 0; i < count; i++)
+			ckdbq_process(ckp, msgs[i]);
+		return;
+	}
+
+	len = 32;
+	for (i = 0; i < count; i++)
+		len += strlen(msgs[i]) + 1;
+	batch = ckalloc(len);
+	ofs = sprintf(batch, "batch.%d.", count);
+	for (i = 0; i < count; i++) {
+		batch[ofs++] = '\n';
+		ofs += strlen(strcpy(batch + ofs, msgs[i]));
+	}
+
+	buf = ckdb_call_retry(ckp, sdata, batch);
+	free(batch);
+	/* A ckdb that doesn't know batches rejects the whole batch as the
+	 * unknown command batch with id count, replying id.time.?. on one line
+	 * without processing any of it */
+	if (unlikely(!strchr(buf, '\n') && sscanf(buf, "%d.%*d.%n", &id, &idlen) == 1 &&
+		     idlen && id == count && !strcmp(buf + idlen, "?."))) {
+		LOGWARNING("ckdb does not accept batches, sending messages individually: %s", buf);
 		free(buf);
+		sdata->ckdb_nobatch = true;
+		for (i = 0; i < count; i++)
+			ckdbq_process(ckp, msgs[i]);
+		return;
+	}
+	/* Otherwise each reply line answers the next message in order */
+	lines = 0;
+	for (line = buf; line && lines < count; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*(next++) = '\0';
+		parse_ckdb_response(ckp, line);
+		free(msgs[lines++]);
+	}
+	free(buf);
+	/* Only messages that got no reply still need sending */
+	if (unlikely(lines < count)) {
+		LOGWARNING("ckdb replied to %d of %d batched messages, resending the rest individually",
+			   lines, count);
+		for (i = lines; i < count; i++)
+			ckdbq_process(ckp, msgs[i]);
 	}
 }
 
@@ -6536,10 +8083,10 @@ static void update_workerstats(ckpool_t *ckp, sdata_t *sdata)
 			if (worker->idle && worker->notified_idle)
 				continue;
 			elapsed = now_t - worker->start_time;
-			ghs1 = worker->dsps1 * nonces;
-			ghs5 = worker->dsps5 * nonces;
-			ghs60 = worker->dsps60 * nonces;
-			ghs1440 = worker->dsps1440 * nonces;
+			ghs1 = FOLD_DSPS(worker, dsps1, MIN1) * nonces;
+			ghs5 = FOLD_DSPS(worker, dsps5, MIN5) * nonces;
+			ghs60 = FOLD_DSPS(worker, dsps60, HOUR) * nonces;
+			ghs1440 = FOLD_DSPS(worker, dsps1440, DAY) * nonces;
 			JSON_CPACK(val, "{ss,si,ss,ss,si,sf,sf,sf,sf,sb,ss,ss,ss,ss}",
 					"poolinstance", ckp->name,
 					"elapsed", elapsed,
@@ -6571,43 +8118,62 @@ static void update_workerstats(ckpool_t *ckp, sdata_t *sdata)
 	}
 }
 
-static void add_log_entry(log_entry_t **entries, char **fname, char **buf)
+/* Add the user's worker count to the batch in *arr, sending it upstream once
+ * it is large enough, or any remaining batch if user is NULL */
+static void upstream_workers(ckpool_t *ckp, user_instance_t *user, json_t **arr, int *len)
 {
-	log_entry_t *entry = ckalloc(sizeof(log_entry_t));
-
-	entry->fname = *fname;
-	*fname = NULL;
-	entry->buf = *buf;
-	*buf = NULL;
-	DL_APPEND(*entries, entry);
+	if (user) {
+		if (!*arr)
+			*arr = json_array();
+		json_array_append_new(*arr, json_pack("[si]", user->username, user->workers));
+		*len += strlen(user->username) + 16;
+		if (*len <= REMOTE_BATCH_BYTES)
+			return;
+	}
+	if (*arr) {
+		upstream_batch(ckp, "workers", *arr);
+		json_decref(*arr);
+		*arr = NULL;
+	}
+	*len = 0;
 }
 
-static void dump_log_entries(log_entry_t **entries)
+/* Housekeeping of clients no longer done on every broadcast. Look for
+ * clients that may have been dropped which the stratifier has not been
+ * informed about and ask the connector if they still exist, and drop clients
+ * that haven't authed in over a minute. */
+static void *clientreaper(void *arg)
 {
-	log_entry_t *entry, *tmpentry;
-	FILE *fp;
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->data;
 
-	DL_FOREACH_SAFE(*entries, entry, tmpentry) {
-		DL_DELETE(*entries, entry);
-		fp = fopen(entry->fname, "we");
-		if (likely(fp)) {
-			fprintf(fp, "%s", entry->buf);
-			fclose(fp);
-		} else
-			LOGERR("Failed to fopen %s in dump_log_entries", entry->fname);
-		free(entry->fname);
-		free(entry->buf);
-		free(entry);
-	}
-}
+	pthread_detach(pthread_self());
+	rename_proc("clientreaper");
 
-static void upstream_workers(ckpool_t *ckp, user_instance_t *user)
-{
-	char buf[256];
+	while (42) {
+		stratum_instance_t *client, *tmp;
+		time_t now_t;
 
-	snprintf(buf, 255, "upstream={\"method\":\"workers\",\"username\":\"%s\",\"workers\":%d}\n",
-		user->username, user->workers);
-	send_proc(ckp->connector, buf);
+		cksleep_ms(15000);
+		now_t = time(NULL);
+
+		ck_rlock(&sdata->instance_lock);
+		HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+			if (client->dropped) {
+				connector_test_client(ckp, client->id);
+				continue;
+			}
+			if (client->node || client->remote || client->authorised)
+				continue;
+			if (now_t > client->start_time + 60) {
+				client->dropped = true;
+				connector_drop_client(ckp, client->id);
+			}
+		}
+		ck_runlock(&sdata->instance_lock);
+	}
+
+	return NULL;
 }
 
 static void *statsupdate(void *arg)
@@ -6628,14 +8194,13 @@ static void *statsupdate(void *arg)
 		char suffix1[16], suffix5[16], suffix15[16], suffix60[16], cdfield[64];
 		char suffix360[16], suffix1440[16], suffix10080[16];
 		stratum_instance_t *client, *tmp;
-		log_entry_t *log_entries = NULL;
 		user_instance_t *user, *tmpuser;
 		char_entry_t *char_list = NULL;
-		int idle_workers = 0;
+		json_t *val, *remote_workers = NULL;
+		int idle_workers = 0, remote_len = 0;
 		char *fname, *s, *sp;
 		tv_t now, diff;
 		ts_t ts_now;
-		json_t *val;
 		FILE *fp;
 		int i;
 
@@ -6657,11 +8222,15 @@ static void *statsupdate(void *arg)
 					client->idle = true;
 				continue;
 			}
+			/* Fold in any diff still accumulating */
+			if (client->pending_diff)
+				decay_client(client, 0, &now);
 		}
 
 		HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
 			worker_instance_t *worker;
 			bool idle = false;
+			int workers;
 
 			if (!user->authorised)
 				continue;
@@ -6672,7 +8241,13 @@ static void *statsupdate(void *arg)
 				if (per_tdiff > 60) {
 					decay_worker(worker, 0, &now);
 					worker->idle = true;
-				}
+				} else if (worker->pending_diff)
+					decay_worker(worker, 0, &now);
+				/* Only store workers whose stats have changed */
+				if (worker->shares == worker->stored_shares)
+					continue;
+				worker->stored_shares = worker->shares;
+
 				ghs = worker->dsps1 * nonces;
 				suffix_string(ghs, suffix1, 16, 0);
 
@@ -6700,9 +8275,7 @@ static void *statsupdate(void *arg)
 						"shares", worker->shares,
 						"bestshare", worker->best_diff);
 
-				ASPRINTF(&fname, "%s/workers/%s", ckp->logdir, worker->workername);
-				s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL);
-				add_log_entry(&log_entries, &fname, &s);
+				write_stats_record(sdata->workerstore, worker->workername, val);
 				json_decref(val);
 			}
 
@@ -6711,7 +8284,20 @@ static void *statsupdate(void *arg)
 			if (per_tdiff > 60) {
 				decay_user(user, 0, &now);
 				idle = true;
-			}
+			} else if (user->pending_diff)
+				decay_user(user, 0, &now);
+			workers = user->workers + user->remote_workers;
+			/* Reset the remote_workers count once per minute */
+			user->remote_workers = 0;
+			if (ckp->remote)
+				upstream_workers(ckp, user, &remote_workers, &remote_len);
+
+			/* Only store users whose stats have changed */
+			if (user->shares == user->stored_shares && workers == user->stored_workers)
+				continue;
+			user->stored_shares = user->shares;
+			user->stored_workers = workers;
+
 			ghs = user->dsps1 * nonces;
 			suffix_string(ghs, suffix1, 16, 0);
 
@@ -6736,30 +8322,23 @@ static void *statsupdate(void *arg)
 					"hashrate1d", suffix1440,
 					"hashrate7d", suffix10080,
 					"lastupdate", now.tv_sec,
-					"workers", user->workers + user->remote_workers,
+					"workers", workers,
 					"shares", user->shares,
 					"bestshare", user->best_diff);
 
-			/* Reset the remote_workers count once per minute */
-			user->remote_workers = 0;
-
-			ASPRINTF(&fname, "%s/users/%s", ckp->logdir, user->username);
-			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL);
-			add_log_entry(&log_entries, &fname, &s);
 			if (!idle) {
 				s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 				ASPRINTF(&sp, "User %s:%s", user->username, s);
 				dealloc(s);
 				add_msg_entry(&char_list, &sp);
 			}
+			write_stats_record(sdata->userstore, user->username, val);
 			json_decref(val);
-			if (ckp->remote)
-				upstream_workers(ckp, user);
 		}
 		ck_runlock(&sdata->instance_lock);
+		if (ckp->remote)
+			upstream_workers(ckp, NULL, &remote_workers, &remote_len);
 
-		/* Dump log entries out of instance_lock */
-		dump_log_entries(&log_entries);
 		notice_msg_entries(&char_list);
 
 		ghs1 = stats->dsps1 * nonces;
@@ -7058,7 +8637,7 @@ static bool script_address(const char *btcaddress)
 
 int stratifier(proc_instance_t *pi)
 {
-	pthread_t pth_blockupdate, pth_statsupdate, pth_heartbeat;
+	pthread_t pth_blockupdate, pth_statsupdate, pth_heartbeat, pth_clientreaper, pth_remoteflush;
 	ckpool_t *ckp = pi->ckp;
 	int ret = 1, threads;
 	int64_t randomiser;
@@ -7070,6 +8649,8 @@ int stratifier(proc_instance_t *pi)
 	ckp->data = sdata;
 	sdata->ckp = ckp;
 	sdata->verbose = true;
+	smsg_slab = create_slab_cache("smsg", sizeof(smsg_t));
+	jp_slab = create_slab_cache("json_params", sizeof(json_params_t));
 
 	/* Wait for the generator to have something for us */
 	do {
@@ -7124,21 +8705,22 @@ int stratifier(proc_instance_t *pi)
 		ckp->serverurls = 1;
 	}
 	cklock_init(&sdata->instance_lock);
-	cksem_init(&sdata->update_sem);
-	cksem_post(&sdata->update_sem);
 
 	mutex_init(&sdata->ckdb_lock);
 	mutex_init(&sdata->ckdb_msg_lock);
-	/* Create half as many share processing and receiving threads as there
-	 * are CPUs */
-	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
+	/* Shares from each client are queued on the same share processor and
+	 * idle ones steal from the backlog of others */
+	threads = ckp->threads;
+	sdata->sshareq = create_ckmsgqs_batch(ckp, "sprocessor", &sshare_process, &sshare_process_batch,
+					      threads, SHARE_BATCH, true);
 	sdata->ssends = create_ckmsgq(ckp, "ssender", &ssend_process);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
+	sdata->updateq = create_ckmsgq(ckp, "updater", &do_update);
 	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
 	if (!CKP_STANDALONE(ckp)) {
-		sdata->ckdbq = create_ckmsgq(ckp, "ckdbqueue", &ckdbq_process);
+		sdata->ckdbq = create_ckmsgqs_batch(ckp, "ckdbqueue", &ckdbq_process, &ckdbq_process_batch,
+						    1, CKDB_BATCH, false);
 		create_pthread(&pth_heartbeat, ckdb_heartbeat, ckp);
 	}
 	read_poolstats(ckp);
@@ -7151,11 +8733,20 @@ int stratifier(proc_instance_t *pi)
 	}
 
 	mutex_init(&sdata->stats_lock);
+	if (ckp->remote) {
+		mutex_init(&sdata->remote_lock);
+		create_pthread(&pth_remoteflush, remoteflush, ckp);
+	}
+	sdata->userstore = open_stats_store(ckp, "users.dat", "users");
+	sdata->workerstore = open_stats_store(ckp, "workers.dat", "workers");
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
+	if (!ckp->node)
+		create_pthread(&pth_clientreaper, clientreaper, ckp);
 
-	mutex_init(&sdata->share_lock);
+	cklock_init(&sdata->share_lock);
 	mutex_init(&sdata->block_lock);
+	mutex_init(&sdata->postponed_lock);
 
 	create_unix_receiver(pi);
 
@@ -7176,3 +8767,57 @@ out:
 	dealloc(ckp->data);
 	return process_exit(ckp, pi, ret);
 }
+
+#ifdef CKBENCH
+/* Set up just enough of a stratifier on ckp for ckbench to time share hashing
+ * and duplicate checking against a workbase with the given number of merkle
+ * branches, returning the workbase. */
+void *bench_workbase(ckpool_t *ckp, const int merkles)
+{
+	sdata_t *sdata = ckzalloc(sizeof(sdata_t));
+	workbase_t *wb = ckzalloc(sizeof(workbase_t));
+	int i, j;
+
+	ckp->data = sdata;
+	sdata->ckp = ckp;
+	cklock_init(&sdata->share_lock);
+	address_to_pubkeytxn(sdata->pubkeytxnbin, ckp->btcaddress);
+	sdata->pubkeytxnlen = 25;
+
+	wb->ckp = ckp;
+	wb->id = 1;
+	wb->height = 500000;
+	wb->coinbasevalue = 1250000000;
+	wb->flags = strdup("");
+	strcpy(wb->bbversion, "20000000");
+	strcpy(wb->prevhash, "0000000000000000000000000000000000000000000000000000000000000000");
+	strcpy(wb->ntime, "5a000000");
+	strcpy(wb->nbit, "1d00ffff");
+	wb->ntime32 = 0x5a000000;
+	wb->merkles = merkles;
+	for (i = 0; i < merkles; i++) {
+		for (j = 0; j < 32; j++)
+			wb->merklebin[i][j] = random();
+	}
+	generate_coinbase(ckp, wb);
+	sha256_init(&wb->coinb1ctx);
+	sha256_update(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
+	return wb;
+}
+
+double bench_share_diff(void *vwb, const uchar *enonce1bin, const char *nonce2,
+			const char *nonce, uchar *hash)
+{
+	workbase_t *wb = vwb;
+	char coinbase[1024];
+	uchar swap[80];
+	int cblen;
+
+	return share_diff(coinbase, enonce1bin, wb, nonce2, wb->ntime32, nonce, hash, swap, &cblen);
+}
+
+bool bench_new_share(ckpool_t *ckp, const uchar *hash, const int64_t wb_id)
+{
+	return new_share(ckp->data, hash, wb_id);
+}
+#endif
@@ -12,4 +12,11 @@
 
 int stratifier(proc_instance_t *pi);
 
+#ifdef CKBENCH
+void *bench_workbase(ckpool_t *ckp, const int merkles);
+double bench_share_diff(void *vwb, const uchar *enonce1bin, const char *nonce2,
+			const char *nonce, uchar *hash);
+bool bench_new_share(ckpool_t *ckp, const uchar *hash, const int64_t wb_id);
+#endif
+
 #endif /* STRATIFIER_H */